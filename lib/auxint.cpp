@@ -0,0 +1,135 @@
+#include "auxint.h"
+
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include "dlib/logging_util.h"
+#include "htslib/kstring.h" /// for kroundup32
+
+namespace bmf {
+
+static const unsigned AUX_SET_MAX = 16;
+
+static inline int aux_type_size(uint8_t type)
+{
+    switch(type) {
+    case 'A': case 'c': case 'C': return 1;
+    case 's': case 'S': return 2;
+    case 'i': case 'I': case 'f': return 4;
+    case 'd': return 8;
+    default: return 0;
+    }
+}
+
+/*
+ * :param: s [const uint8_t *] Start of an aux entry (its tag).
+ * :returns: [const uint8_t *] Start of the next entry, or end if this one is cut short or of unknown type.
+ */
+static const uint8_t *aux_next(const uint8_t *s, const uint8_t *end)
+{
+    if(end - s < 3) return end;
+    const uint8_t *v(s + 3);
+    switch(s[2]) {
+    case 'Z': case 'H':
+        while(v < end && *v++);
+        return v;
+    case 'B': {
+        if(end - v < 5) return end;
+        uint32_t count;
+        std::memcpy(&count, v + 1, sizeof(count));
+        const uint64_t len(5 + (uint64_t)count * aux_type_size(*v));
+        return len <= (uint64_t)(end - v) ? v + len: end;
+    }
+    default: {
+        const int len(aux_type_size(s[2]));
+        return len && len <= end - v ? v + len: end;
+    }
+    }
+}
+
+/*
+ * :returns: [int] Whether val can be stored in place in an aux value of this type.
+ */
+static inline int fits(uint8_t type, int64_t val)
+{
+    switch(type) {
+    case 'c': return val >= INT8_MIN && val <= INT8_MAX;
+    case 'C': return val >= 0 && val <= UINT8_MAX;
+    case 's': return val >= INT16_MIN && val <= INT16_MAX;
+    case 'S': return val >= 0 && val <= UINT16_MAX;
+    case 'i': return val >= INT32_MIN && val <= INT32_MAX;
+    case 'I': return val >= 0 && val <= UINT32_MAX;
+    default: return 0; // Not an integer tag: replaced.
+    }
+}
+
+static inline void write_int(uint8_t *v, uint8_t type, int64_t val)
+{
+    switch(aux_type_size(type)) {
+    case 1: {const uint8_t x(val); std::memcpy(v, &x, sizeof(x)); break;}
+    case 2: {const uint16_t x(val); std::memcpy(v, &x, sizeof(x)); break;}
+    default: {const uint32_t x(val); std::memcpy(v, &x, sizeof(x));}
+    }
+}
+
+static inline uint8_t *append_int(uint8_t *s, const char *tag, int64_t val)
+{
+    s[0] = tag[0], s[1] = tag[1], s[2] = 'i';
+    write_int(s + 3, 'i', val);
+    return s + 3 + sizeof(int32_t);
+}
+
+int bam_aux_set_ints(bam1_t *b, const aux_int_t *vals, unsigned n)
+{
+    assert(n <= AUX_SET_MAX);
+    uint8_t *const aux(bam_get_aux(b)), *const end(b->data + b->l_data);
+    uint8_t *found[AUX_SET_MAX] {};
+    for(uint8_t *s(aux), *next; s < end; s = next) {
+        next = const_cast<uint8_t *>(aux_next(s, end));
+        if(next - s < 3 + aux_type_size(s[2])) break; // Cut short: leave it be.
+        for(unsigned i(0); i < n; ++i)
+            if(!found[i] && s[0] == vals[i].tag[0] && s[1] == vals[i].tag[1])
+                found[i] = s;
+    }
+    // Size change from rebuilding, if anything does not fit in place.
+    int64_t grow(0);
+    int rebuild(0);
+    for(unsigned i(0); i < n; ++i) {
+        if(!found[i]) grow += 3 + sizeof(int32_t), rebuild = 1;
+        else if(!fits(found[i][2], vals[i].val)) {
+            grow += 3 + (int64_t)sizeof(int32_t) - (aux_next(found[i], end) - found[i]);
+            rebuild = 1;
+        }
+    }
+    if(!rebuild) {
+        for(unsigned i(0); i < n; ++i) write_int(found[i] + 3, found[i][2], vals[i].val);
+        return 0;
+    }
+    uint32_t m(b->l_data + grow);
+    kroundup32(m);
+    uint8_t *data((uint8_t *)malloc(m));
+    if(!data) LOG_EXIT("Failed to allocate %u bytes for a record's data. Abort!\n", m);
+    std::memcpy(data, b->data, aux - b->data);
+    uint8_t *out(data + (aux - b->data));
+    for(uint8_t *s(aux), *next; s < end; s = next) {
+        next = const_cast<uint8_t *>(aux_next(s, end));
+        unsigned i(0);
+        while(i < n && found[i] != s) ++i;
+        if(i == n) {
+            std::memcpy(out, s, next - s), out += next - s;
+        } else if(fits(s[2], vals[i].val)) {
+            std::memcpy(out, s, next - s);
+            write_int(out + 3, s[2], vals[i].val);
+            out += next - s;
+        } else out = append_int(out, vals[i].tag, vals[i].val);
+    }
+    for(unsigned i(0); i < n; ++i) if(!found[i]) out = append_int(out, vals[i].tag, vals[i].val);
+    assert(out - data == b->l_data + grow);
+    free(b->data);
+    b->data = data;
+    b->l_data = out - data;
+    b->m_data = m;
+    return 1;
+}
+
+} /* namespace bmf */
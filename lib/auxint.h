@@ -0,0 +1,33 @@
+#ifndef AUXINT_H
+#define AUXINT_H
+#include <cstdint>
+#include "htslib/sam.h"
+
+namespace bmf {
+
+/*
+ * Integer aux tag and the value to set it to.
+ */
+struct aux_int_t {
+    const char *tag;
+    int64_t val;
+};
+
+/*
+ * @func bam_aux_set_ints
+ * Sets several integer aux tags in one pass over the aux block.
+ * A tag whose current type can hold its new value is overwritten in place.
+ * If any tag needs a wider type, or is missing, the record's data is rebuilt once:
+ * widened tags stay where they were as 'i' and missing tags are appended as 'i',
+ * so later updates of the same tags fit in place.
+ * Unlike bam_aux_del followed by bam_aux_append, this keeps the order of the record's tags.
+ * :param: b [bam1_t *] Record to update.
+ * :param: vals [const aux_int_t *] Tags to set. Values must fit in an int32_t.
+ * :param: n [unsigned] Number of tags. At most 16.
+ * :returns: [int] 0 if every tag was updated in place, 1 if the data was rebuilt.
+ */
+int bam_aux_set_ints(bam1_t *b, const aux_int_t *vals, unsigned n);
+
+} /* namespace bmf */
+
+#endif /* AUXINT_H */
@@ -0,0 +1,96 @@
+#include "bcluster.h"
+
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+#include "lib/famtable.h"
+
+namespace bmf {
+
+/*
+ * Entry in a pigeonhole segment table: the packed bases of one segment of a barcode.
+ */
+struct bc_seg_t {
+    uint64_t key;
+    uint32_t len; // Barcode length
+    uint32_t idx; // Family
+    bool operator<(const bc_seg_t &o) const {
+        return len != o.len ? len < o.len: key != o.key ? key < o.key: idx < o.idx;
+    }
+};
+
+/*
+ * @func seg_start
+ * :returns: [int] Offset of segment s of n_segs in a barcode of length len.
+ */
+CONST static inline int seg_start(int s, int n_segs, int len)
+{
+    return s * len / n_segs;
+}
+
+static inline uint64_t pack_segment(const char *bs, int len)
+{
+    uint64_t ret(0);
+    for(int i(0); i < len; ++i) ret = (ret << 2) | nuc2num(bs[i]);
+    return ret;
+}
+
+std::vector<uint32_t> cluster_barcodes(const std::vector<const char *> &barcodes, const std::vector<uint32_t> &counts,
+                                       int max_dist)
+{
+    const size_t n(barcodes.size());
+    std::vector<uint32_t> parent(n);
+    std::iota(parent.begin(), parent.end(), 0u);
+    if(max_dist <= 0 || n < 2) return parent;
+    const int n_segs(max_dist + 1);
+    // Pack every clusterable barcode and index its segments.
+    std::vector<uint64_t> keys(2 * n);
+    std::vector<uint32_t> lens(n, 0), order;
+    std::vector<std::vector<bc_seg_t>> index(n_segs);
+    for(size_t i(0); i < n; ++i) {
+        if(!barcodes[i]) continue;
+        const int len(std::strlen(barcodes[i]));
+        // Barcodes too short to split into segments, or which cannot be packed, are left alone.
+        if(len < n_segs || pack_barcode(barcodes[i], len, &keys[2 * i])) continue;
+        lens[i] = len;
+        order.push_back(i);
+        for(int s(0); s < n_segs; ++s) {
+            const int start(seg_start(s, n_segs, len));
+            index[s].push_back(bc_seg_t{pack_segment(barcodes[i] + start, seg_start(s + 1, n_segs, len) - start),
+                                        (uint32_t)len, (uint32_t)i});
+        }
+    }
+    for(auto &table: index) std::sort(table.begin(), table.end());
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {return counts[a] > counts[b];});
+    std::vector<uint8_t> assigned(n, 0);
+    std::vector<uint32_t> seen(n, UINT32_MAX), queue;
+    for(const uint32_t root: order) {
+        if(assigned[root]) continue;
+        assigned[root] = 1;
+        queue.assign(1, root);
+        for(size_t qi(0); qi < queue.size(); ++qi) {
+            const uint32_t u(queue[qi]);
+            const int len(lens[u]);
+            for(int s(0); s < n_segs; ++s) {
+                const int start(seg_start(s, n_segs, len));
+                const bc_seg_t query{pack_segment(barcodes[u] + start, seg_start(s + 1, n_segs, len) - start),
+                                     (uint32_t)len, 0};
+                for(auto it(std::lower_bound(index[s].begin(), index[s].end(), query));
+                    it != index[s].end() && it->key == query.key && it->len == query.len; ++it) {
+                    const uint32_t v(it->idx);
+                    if(assigned[v] || seen[v] == u) continue;
+                    seen[v] = u;
+                    if((uint64_t)counts[u] + 1 >= 2 * (uint64_t)counts[v] &&
+                       packed_hamming(&keys[2 * u], &keys[2 * v]) <= max_dist) {
+                        assigned[v] = 1;
+                        parent[v] = root;
+                        queue.push_back(v);
+                    }
+                }
+            }
+        }
+    }
+    return parent;
+}
+
+} /* namespace bmf */
@@ -0,0 +1,46 @@
+#ifndef BCLUSTER_H
+#define BCLUSTER_H
+#include <cstdint>
+#include <vector>
+#include "dlib/compiler_util.h"
+
+#define BC_CLUSTER_MAX_DIST 8 // Largest Hamming distance accepted for barcode clustering.
+
+namespace bmf {
+
+/*
+ * @func packed_hamming
+ * :param: a [const uint64_t *] Barcode packed by pack_barcode (lib/famtable.h).
+ * :param: b [const uint64_t *] Barcode of the same length packed by pack_barcode.
+ * :returns: [int] Number of bases at which a and b differ.
+ */
+CONST static inline int packed_hamming(const uint64_t *a, const uint64_t *b)
+{
+    const uint64_t x0(a[0] ^ b[0]), x1(a[1] ^ b[1]);
+    return __builtin_popcountll((x0 | (x0 >> 1)) & 0x5555555555555555uLL) +
+           __builtin_popcountll((x1 | (x1 >> 1)) & 0x5555555555555555uLL);
+}
+
+/*
+ * @func cluster_barcodes
+ * Groups barcodes which likely differ only by sequencing errors, by directional adjacency:
+ * family u absorbs family v if their barcodes are within max_dist mismatches and
+ * count[u] >= 2 * count[v] - 1, and v absorbs its own neighbours in turn.
+ * Clusters are grown from the largest remaining family (ties to the lower index),
+ * so the result depends only on the barcodes and counts, not on memory layout.
+ * Candidates are found with a pigeonhole index: barcodes within max_dist mismatches
+ * share at least one of max_dist + 1 segments exactly, so each segment is looked up
+ * in a sorted table instead of comparing all pairs.
+ * :param: barcodes [const std::vector<const char *> &] Null-terminated barcode of each family,
+ *                                                      or null to leave the family unclustered.
+ *                                                      Only barcodes of equal length are compared.
+ * :param: counts [const std::vector<uint32_t> &] Number of reads in each family.
+ * :param: max_dist [int] Maximum Hamming distance between neighbouring barcodes.
+ * :returns: [std::vector<uint32_t>] For each family, the index of the family it merges into (its own if none).
+ */
+std::vector<uint32_t> cluster_barcodes(const std::vector<const char *> &barcodes, const std::vector<uint32_t> &counts,
+                                       int max_dist);
+
+} /* namespace bmf */
+
+#endif /* BCLUSTER_H */
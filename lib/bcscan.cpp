@@ -0,0 +1,214 @@
+#include "bcscan.h"
+
+#include <algorithm>
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__)
+#    include <immintrin.h>
+#    define BC_X86 1
+#endif
+
+namespace bmf {
+
+/*
+ * Appends k (at most 16) packed bases to bc->key, first base in the highest bits.
+ */
+static inline void push_bits(bc_scan_t *bc, uint64_t bits, int k)
+{
+    const int pos(bc->len);
+    if(bc->unpackable) return;
+    if(pos + k > 64) {
+        bc->unpackable = 1;
+        return;
+    }
+    const int w(pos >> 5), room(32 - (pos & 31));
+    if(k <= room) {
+        bc->key[w] = (bc->key[w] << (2 * k)) | bits;
+    } else {
+        const int rest(k - room);
+        bc->key[w] = (bc->key[w] << (2 * room)) | (bits >> (2 * rest));
+        bc->key[w + 1] = bits & ((UINT64_C(1) << (2 * rest)) - 1);
+    }
+}
+
+/*
+ * 0-3 for A, C, G and T, 4 for N and 5 for anything else. A table rather than a switch, since barcode bases
+ * are random and every mispredicted branch costs more than the lookup.
+ */
+static const uint8_t BASE_CODES[256] {
+    5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+    5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+    5, 0, 5, 1, 5, 5, 5, 2, 5, 5, 5, 5, 5, 5, 4, 5, 5, 5, 5, 5, 3, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+    5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+    5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+    5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+    5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+    5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5
+};
+
+/*
+ * Scalar kernels. The vector kernel uses these for whatever lies too close to the end of the read for a full vector.
+ */
+static inline void scan_bases(bc_scan_t *bc, const char *seq, int start, int end)
+{
+    while(start < end) {
+        const int stop(std::min(start + 16, end)); // push_bits takes up to 16 bases at a time.
+        uint64_t bits(0);
+        for(int i(start); i < stop; ++i) {
+            const char c(seq[i]);
+            const int code(BASE_CODES[(uint8_t)c]);
+            bc->unpackable |= code >> 2, bc->n_count += code == 4;
+            bits = (bits << 2) | (code & 3);
+            bc->tail_run = bc->len + i - start && c == bc->last ? bc->tail_run + 1: 1;
+            bc->max_run = std::max(bc->max_run, bc->tail_run);
+            bc->last = c;
+        }
+        push_bits(bc, bits, stop - start);
+        bc->len += stop - start;
+        start = stop;
+    }
+}
+
+static inline int find_homing(const char *seq, int l, const char *homing, int hlen, int start, int end)
+{
+    for(int i(start); i <= end && i + hlen <= l; ++i)
+        if(memcmp(seq + i, homing, hlen) == 0) return i;
+    return -1;
+}
+
+/*
+ * Kernels scan into a local copy of bc: seq is a char *, which may alias *bc, so the compiler would otherwise
+ * store every field back to memory for every base.
+ */
+static int scan_read_scalar(bc_scan_t *bc, const char *seq, int l, int bc_start, int bc_end,
+                            const char *homing, int hlen, int search_start, int search_end)
+{
+    const int found(hlen > 0 ? find_homing(seq, l, homing, hlen, search_start, search_end): -1);
+    if(found >= 0 && found < bc_end) bc_end = found;
+    bc_scan_t s(*bc);
+    scan_bases(&s, seq, bc_start, std::min(bc_end, l));
+    *bc = s;
+    return found;
+}
+
+const bc_kernel_t &bc_kernel_scalar()
+{
+    static const bc_kernel_t ret{&scan_read_scalar, "scalar"};
+    return ret;
+}
+
+#if BC_X86
+
+/*
+ * SSE4.2: 16 bytes of the prefix per iteration. Each vector yields the offsets at which the homing sequence
+ * occurs (comparing one homing base at a time against all 16 offsets), then the barcode statistics of its bases.
+ */
+__attribute__((target("sse4.2")))
+static inline uint32_t pack16(__m128i v)
+{
+    // A, C, G and T are 0x41, 0x43, 0x47 and 0x54: bits 1-2, with G and T swapped by bit 2, give 0-3.
+    const __m128i codes(_mm_xor_si128(_mm_and_si128(_mm_srli_epi16(v, 1), _mm_set1_epi8(3)),
+                                      _mm_and_si128(_mm_srli_epi16(v, 2), _mm_set1_epi8(1))));
+    const __m128i pairs(_mm_maddubs_epi16(codes, _mm_set1_epi16(0x0104))); // c0 * 4 + c1
+    const __m128i quads(_mm_madd_epi16(pairs, _mm_set1_epi32(0x00010010))); // pair0 * 16 + pair1
+    const __m128i bytes(_mm_packus_epi16(_mm_packus_epi32(quads, quads), _mm_setzero_si128()));
+    return __builtin_bswap32(_mm_cvtsi128_si32(bytes)); // First base in the highest bits.
+}
+
+__attribute__((target("sse4.2")))
+static int scan_read_sse42(bc_scan_t *out, const char *seq, int l, int bc_start, int bc_end,
+                           const char *homing, int hlen, int search_start, int search_end)
+{
+    bc_scan_t s(*out), *const bc(&s);
+    int found(-1);
+    bool searching(hlen > 0 && search_start <= search_end);
+    bc_end = std::min(bc_end, l);
+    int p(searching ? std::min(bc_start, search_start): bc_start);
+    const __m128i h0(_mm_set1_epi8(hlen > 0 ? homing[0]: 0));
+    const __m128i a(_mm_set1_epi8('A')), c(_mm_set1_epi8('C')), g(_mm_set1_epi8('G')), t(_mm_set1_epi8('T')),
+                  n(_mm_set1_epi8('N'));
+    for(; p < bc_end || searching; p += 16) {
+        if(p + 16 > l || (searching && p + 16 + hlen - 1 > l)) break;
+        const __m128i v(_mm_loadu_si128((const __m128i *)(seq + p)));
+        if(searching) {
+            const int c0(std::max(search_start - p, 0)), c1(std::min(search_end + 1 - p, 16));
+            uint32_t cand(0);
+            if(c0 < c1) {
+                // Offsets at which every base so far matches, one homing base at a time.
+                cand = _mm_movemask_epi8(_mm_cmpeq_epi8(v, h0)) & (0xFFFFu << c0) & (0xFFFFu >> (16 - c1));
+                for(int j(1); cand && j < hlen; ++j)
+                    cand &= _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(seq + p + j)),
+                                                             _mm_set1_epi8(homing[j])));
+            }
+            if(cand) {
+                found = p + __builtin_ctz(cand);
+                searching = false;
+                bc_end = std::min(bc_end, found);
+            } else if(search_end < p + 16) searching = false;
+        }
+        const int j0(std::max(bc_start - p, 0)), j1(std::min(bc_end - p, 16));
+        if(j0 >= j1) continue;
+        const int k(j1 - j0);
+        const uint32_t bm((0xFFFFu << j0) & (0xFFFFu >> (16 - j1)));
+        const uint32_t ns(_mm_movemask_epi8(_mm_cmpeq_epi8(v, n)) & bm);
+        const uint32_t acgt(_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, a), _mm_cmpeq_epi8(v, c)),
+                                                           _mm_or_si128(_mm_cmpeq_epi8(v, g), _mm_cmpeq_epi8(v, t)))));
+        bc->n_count += __builtin_popcount(ns);
+        if(~acgt & bm) bc->unpackable = 1;
+        push_bits(bc, (pack16(v) >> (2 * (16 - j1))) & ((UINT64_C(1) << (2 * k)) - 1), k);
+        // Bit j is set if base j repeats the base before it. The first barcode base repeats nothing.
+        const __m128i prev(_mm_alignr_epi8(v, _mm_set1_epi8(bc->last), 15));
+        uint32_t eq(_mm_movemask_epi8(_mm_cmpeq_epi8(v, prev)) & bm);
+        if(!bc->len) eq &= ~(1u << j0);
+        eq >>= j0;
+        const int lead(__builtin_ctz(~eq)); // Bases continuing the barcode's last run.
+        if(lead >= k) {
+            bc->tail_run += k;
+        } else {
+            bc->max_run = std::max(bc->max_run, bc->tail_run + lead);
+            int longest(0);
+            for(uint32_t m(eq); m; m &= m >> 1) ++longest;
+            bc->max_run = std::max(bc->max_run, longest + 1);
+            const uint32_t breaks(~eq & ((1u << k) - 1));
+            bc->tail_run = k - (31 - __builtin_clz(breaks));
+        }
+        bc->max_run = std::max(bc->max_run, bc->tail_run);
+        bc->last = seq[p + j1 - 1];
+        bc->len += k;
+    }
+    // Whatever is left is too close to the end of the read to load a full vector.
+    if(searching) {
+        found = find_homing(seq, l, homing, hlen, std::max(search_start, p), search_end);
+        if(found >= 0) bc_end = std::min(bc_end, found);
+    }
+    scan_bases(bc, seq, std::max(bc_start, p), bc_end);
+    *out = s;
+    return found;
+}
+
+const bc_kernel_t &bc_kernel_sse42()
+{
+    static const bc_kernel_t ret{&scan_read_sse42, "sse4.2"};
+    return ret;
+}
+
+static const bc_kernel_t &select_kernel()
+{
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse4.2")) return bc_kernel_sse42();
+    return bc_kernel_scalar();
+}
+
+#else
+
+const bc_kernel_t &bc_kernel_sse42() {return bc_kernel_scalar();}
+static const bc_kernel_t &select_kernel() {return bc_kernel_scalar();}
+
+#endif /* BC_X86 */
+
+const bc_kernel_t &bc_kernel()
+{
+    static const bc_kernel_t &ret(select_kernel());
+    return ret;
+}
+
+} /* namespace bmf */
@@ -0,0 +1,97 @@
+#ifndef BCSCAN_H
+#define BCSCAN_H
+#include <cstdint>
+
+namespace bmf {
+
+/*
+ * Barcode scanning for the inline-barcode markers and inmem.
+ *
+ * A read's prefix holds its barcode, followed at some offset by the homing sequence.
+ * bc_scan_read traverses the prefix once to find the homing sequence and, for the barcode bases,
+ * count Ns, track homopolymer runs and pack the bases 2 bits each (as pack_barcode does).
+ * Barcodes taken from more than one read are scanned into the same bc_scan_t, one piece after another.
+ */
+struct bc_scan_t {
+    uint64_t key[2]; // Barcode packed as by pack_barcode (lib/famtable.h). Valid only if bc_scan_packed.
+    int len; // Barcode bases scanned.
+    int n_count; // Number of Ns.
+    int unpackable; // Set by bases other than ACGT or by barcodes longer than 64 bases.
+    int max_run; // Longest homopolymer run, in bases.
+    int tail_run; // Length of the run the barcode currently ends with.
+    char last; // Last barcode base.
+};
+
+static inline void bc_scan_init(bc_scan_t *bc)
+{
+    bc->key[0] = bc->key[1] = 0;
+    bc->len = bc->n_count = bc->unpackable = bc->max_run = bc->tail_run = 0;
+    bc->last = '\0';
+}
+
+/*
+ * @func bc_scan_pass
+ * :returns: [int] 1 if the barcode passes QC, 0 if it contains an N or a homopolymer longer than threshold bases.
+ * Thresholds of 0 or less disable the homopolymer check.
+ */
+static inline int bc_scan_pass(const bc_scan_t *bc, int threshold)
+{
+    return !bc->n_count && (threshold <= 0 || bc->max_run <= threshold);
+}
+
+/*
+ * @func bc_scan_packed
+ * :returns: [int] 1 if bc->key holds the barcode, as it does for barcodes of 1 to 64 ACGT bases.
+ */
+static inline int bc_scan_packed(const bc_scan_t *bc)
+{
+    return bc->len && !bc->unpackable;
+}
+
+struct bc_kernel_t {
+    /*
+     * Scans a read's prefix: finds the first offset i in [search_start, search_end] at which the homing sequence
+     * occurs, and appends the barcode seq[bc_start, bc_end) to bc. If the homing sequence is found before bc_end,
+     * the barcode ends there instead (for variable-length barcodes).
+     * :param: seq [const char *] Read sequence, null-terminated.
+     * :param: l [int] Length of seq.
+     * :param: homing [const char *] Homing sequence. Not searched for if hlen is 0.
+     * :param: hlen [int] Length of homing.
+     * :returns: [int] The offset of the homing sequence, or -1 if it was not found.
+     */
+    int (*scan_read)(bc_scan_t *bc, const char *seq, int l, int bc_start, int bc_end,
+                     const char *homing, int hlen, int search_start, int search_end);
+    const char *name;
+};
+
+const bc_kernel_t &bc_kernel_scalar();
+const bc_kernel_t &bc_kernel_sse42(); // Falls back to scalar if not compiled for x86.
+
+/*
+ * @func bc_kernel
+ * :returns: [const bc_kernel_t &] The fastest kernel supported by this CPU, chosen on first use.
+ */
+const bc_kernel_t &bc_kernel();
+
+/*
+ * @func bc_scan_read
+ * Scans a read's prefix with the fastest kernel. See bc_kernel_t::scan_read.
+ */
+static inline int bc_scan_read(bc_scan_t *bc, const char *seq, int l, int bc_start, int bc_end,
+                               const char *homing, int hlen, int search_start, int search_end)
+{
+    return bc_kernel().scan_read(bc, seq, l, bc_start, bc_end, homing, hlen, search_start, search_end);
+}
+
+/*
+ * @func bc_scan_append
+ * Appends barcode bases which are not followed by a homing sequence, such as index reads.
+ */
+static inline void bc_scan_append(bc_scan_t *bc, const char *seq, int l)
+{
+    bc_scan_read(bc, seq, l, 0, l, nullptr, 0, 0, -1);
+}
+
+} /* namespace bmf */
+
+#endif /* BCSCAN_H */
@@ -0,0 +1,185 @@
+#include "binfq.h"
+
+#include <algorithm>
+#include <cstring>
+#include "dlib/logging_util.h"
+#include "lib/hashdmp.h"
+
+namespace bmf {
+
+/*
+ * Sequence decoding tables: each byte of a 2-bit sequence expands to 4 bases, and each byte of
+ * a 4-bit sequence to 2.
+ */
+struct binfq_tables_t {
+    char dec2[256][4];
+    char dec4[256][2];
+    binfq_tables_t() {
+        for(int i(0); i < 256; ++i) {
+            for(int j(0); j < 4; ++j) dec2[i][j] = "ACGT"[(i >> (2 * j)) & 3];
+            for(int j(0); j < 2; ++j) dec4[i][j] = "ACGTNNNNNNNNNNNN"[(i >> (4 * j)) & 0xf];
+        }
+    }
+};
+
+static const binfq_tables_t tables;
+
+void binfq_rec(kstring_t *ks, const char *name, const char *barcode, int blen, char strand, int pass_fail,
+               const char *seq, const char *qual, unsigned l)
+{
+    const size_t name_l(std::strlen(name));
+    if(UNLIKELY(l > UINT16_MAX || blen > MAX_BARCODE_LENGTH || name_l > UINT8_MAX))
+        LOG_EXIT("Record %s is too long for a binary temporary file. Abort!\n", name);
+    uint64_t key[2];
+    int flags((strand == 'F' ? 0: strand == 'R' ? 1: 2) | (pass_fail ? BINFQ_PASS: 0));
+    if(pack_barcode(barcode, blen, key)) flags |= BINFQ_TEXT_BARCODE;
+    for(unsigned i(0); i < l; ++i) {
+        if(nuc2num(seq[i]) > 3) {
+            flags |= BINFQ_SEQ_4BIT;
+            break;
+        }
+    }
+    const size_t key_l(flags & BINFQ_TEXT_BARCODE ? blen: binfq_key_bytes(blen)),
+                 seq_l(flags & BINFQ_SEQ_4BIT ? (l + 1) >> 1: (l + 3) >> 2);
+    ks_resize(ks, ks->l + BINFQ_HDR_SIZE + name_l + key_l + seq_l + l + 1);
+    uint8_t *p((uint8_t *)ks->s + ks->l);
+    *p++ = l & 0xff, *p++ = l >> 8;
+    *p++ = blen, *p++ = flags, *p++ = name_l;
+    std::memcpy(p, name, name_l), p += name_l;
+    if(flags & BINFQ_TEXT_BARCODE) std::memcpy(p, barcode, blen);
+    else {
+        for(int i(0), n((std::min(blen, 32) + 3) >> 2); i < n; ++i) p[i] = key[0] >> (8 * i);
+        for(int i(0), n(binfq_key_bytes(blen) - 8); i < n; ++i) p[8 + i] = key[1] >> (8 * i);
+    }
+    p += key_l;
+    std::memset(p, 0, seq_l);
+    if(flags & BINFQ_SEQ_4BIT) for(unsigned i(0); i < l; ++i) p[i >> 1] |= std::min(nuc2num(seq[i]), 4) << (4 * (i & 1));
+    else for(unsigned i(0); i < l; ++i) p[i >> 2] |= nuc2num(seq[i]) << (2 * (i & 3));
+    p += seq_l;
+    std::memcpy(p, qual, l), p += l;
+    *p = '\0';
+    ks->l = (char *)p - ks->s;
+}
+
+TmpFqReader::TmpFqReader(const char *path):
+    in_(path), view_(), binary_(0), rec_(nullptr), rec_len_(0), packed_(0),
+    seqbuf_{0, 0, nullptr}, name(nullptr), name_l(0), bs(nullptr), blen(-1), pass_fail('1'),
+    seq(nullptr), qual(nullptr), l(0)
+{
+    detect();
+}
+
+TmpFqReader::~TmpFqReader()
+{
+    free(seqbuf_.s);
+}
+
+/*
+ * Reads the start of the file to choose a format, consuming the magic of binary files.
+ */
+void TmpFqReader::detect()
+{
+    const char *p(in_.peek(1));
+    binary_ = 0;
+    if(!p) return;
+    if(*p == BINFQ_MAGIC[0]) {
+        if(!(p = in_.peek(BINFQ_MAGIC_LEN)) || std::memcmp(p, BINFQ_MAGIC, BINFQ_MAGIC_LEN))
+            LOG_EXIT("Unrecognized binary temporary file version. Abort!\n");
+        in_.skip(BINFQ_MAGIC_LEN);
+        binary_ = 1;
+        return;
+    }
+    if(*p != '@') LOG_EXIT("Input is neither a marked fastq nor a binary temporary file. Abort!\n");
+}
+
+int TmpFqReader::rewind()
+{
+    if(in_.rewind()) return -1;
+    detect();
+    return 0;
+}
+
+int TmpFqReader::next_binary()
+{
+    const uint8_t *p((const uint8_t *)in_.peek(BINFQ_HDR_SIZE));
+    if(!p) {
+        if(in_.peek(1)) LOG_EXIT("Truncated binary temporary file. Abort!\n");
+        return 0;
+    }
+    l = p[0] | (p[1] << 8);
+    const int bl(p[2]), flags(p[3]);
+    name_l = p[4];
+    const size_t key_l(flags & BINFQ_TEXT_BARCODE ? bl: binfq_key_bytes(bl)),
+                 seq_l(flags & BINFQ_SEQ_4BIT ? (l + 1) >> 1: (l + 3) >> 2),
+                 size(BINFQ_HDR_SIZE + name_l + key_l + seq_l + l);
+    if(!(p = (const uint8_t *)in_.peek(size))) LOG_EXIT("Truncated binary temporary file. Abort!\n");
+    in_.skip(size);
+    rec_ = (const char *)p, rec_len_ = size;
+    p += BINFQ_HDR_SIZE;
+    name = (const char *)p, p += name_l;
+    bs_[0] = "FRZZ"[flags & BINFQ_STRAND_MASK];
+    blen = bl + 1;
+    if((packed_ = !(flags & BINFQ_TEXT_BARCODE))) {
+        const int n0(std::min(bl, 32));
+        key_[0] = key_[1] = 0;
+        for(int i(0), n((n0 + 3) >> 2); i < n; ++i) key_[0] |= (uint64_t)p[i] << (8 * i);
+        for(int i(0), n(binfq_key_bytes(bl) - 8); i < n; ++i) key_[1] |= (uint64_t)p[8 + i] << (8 * i);
+        for(int i(0); i < n0; ++i) bs_[1 + i] = "ACGT"[(key_[0] >> (2 * (n0 - 1 - i))) & 3];
+        for(int i(0); i < bl - 32; ++i) bs_[33 + i] = "ACGT"[(key_[1] >> (2 * (bl - 33 - i))) & 3];
+    } else std::memcpy(bs_ + 1, p, bl);
+    bs_[blen] = '\0';
+    bs = bs_;
+    p += key_l;
+    ks_resize(&seqbuf_, l + 4);
+    char *s(seqbuf_.s);
+    if(flags & BINFQ_SEQ_4BIT) for(size_t i(0); i < seq_l; ++i) std::memcpy(s + 2 * i, tables.dec4[p[i]], 2);
+    else for(size_t i(0); i < seq_l; ++i) std::memcpy(s + 4 * i, tables.dec2[p[i]], 4);
+    s[l] = '\0';
+    seq = s;
+    qual = (const char *)p + seq_l;
+    pass_fail = flags & BINFQ_PASS ? '1': '0';
+    return 1;
+}
+
+int TmpFqReader::next_text()
+{
+    if(!in_.next(&view_)) return 0;
+    if(UNLIKELY(blen < 0)) {
+        // The barcode length is inferred from the first record.
+        if(view_.comment_l <= HASH_DMP_OFFSET)
+            LOG_EXIT("Record %.*s is not marked with a barcode. Abort!\n", (int)view_.name_l, view_.name);
+        const char *const bstart(view_.comment + HASH_DMP_OFFSET), *const cend(view_.comment + view_.comment_l);
+        const char *bend((const char *)std::memchr(bstart, '|', cend - bstart));
+        blen = (bend ? bend: cend) - bstart;
+        if(blen < 2 || blen > MAX_BARCODE_LENGTH + 1)
+            LOG_EXIT("Record %.*s has a barcode of unsupported length. Abort!\n", (int)view_.name_l, view_.name);
+        LOG_DEBUG("Barcode length (inferred): %i.\n", blen);
+    }
+    if(UNLIKELY(view_.comment_l < HASH_DMP_OFFSET + (unsigned)blen))
+        LOG_EXIT("Record %.*s is not marked with a barcode. Abort!\n", (int)view_.name_l, view_.name);
+    // The barcode is copied out of the comment so that it is null-terminated.
+    std::memcpy(bs_, view_.comment + HASH_DMP_OFFSET, blen);
+    bs_[blen] = '\0';
+    bs = bs_;
+    name = view_.name, name_l = view_.name_l;
+    pass_fail = view_.comment[FP_OFFSET];
+    seq = view_.seq, qual = view_.qual, l = view_.l;
+    return 1;
+}
+
+void TmpFqReader::copy(TmpFqWriter *w)
+{
+    if(binary_) {
+        w->write(rec_, rec_len_);
+        return;
+    }
+    kstring_t *ks(&w->buf);
+    kputc('@', ks), kputsn(view_.name, view_.name_l, ks);
+    kputc(' ', ks), kputsn(view_.comment, view_.comment_l, ks);
+    kputc('\n', ks), kputsn(view_.seq, view_.l, ks);
+    kputsnl("\n+\n", ks), kputsn(view_.qual, view_.l, ks);
+    kputc('\n', ks);
+    w->check();
+}
+
+} /* namespace bmf */
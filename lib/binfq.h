@@ -0,0 +1,148 @@
+#ifndef BINFQ_H
+#define BINFQ_H
+#include <cstdint>
+#include <vector>
+#include <zlib.h>
+#include "htslib/kseq.h"
+#include "htslib/kstring.h"
+#include "lib/famtable.h"
+#include "lib/fqreader.h"
+#include "lib/mseq.h"
+
+#define BINFQ_MAGIC "\x89" "BF\x01" // Starts a binary temporary file. The last byte is the format version.
+#define BINFQ_MAGIC_LEN 4
+#define BINFQ_HDR_SIZE 5
+
+// Record flags
+#define BINFQ_STRAND_MASK 0x3 // Index into "FRZ"
+#define BINFQ_PASS 0x4
+#define BINFQ_TEXT_BARCODE 0x8 // Barcode is stored as text because it could not be packed.
+#define BINFQ_SEQ_4BIT 0x10 // Sequence is stored 4 bits per base because it contains a base other than ACGT.
+
+namespace bmf {
+
+/*
+ * Binary format for temporary split files, written by collapse -B.
+ *
+ * A file is BINFQ_MAGIC followed by records. Each record is a fixed header:
+ *   uint16_t l (read length, little-endian), uint8_t blen (barcode length, excluding the strand character),
+ *   uint8_t flags, uint8_t name_l (names longer than 255 bytes are rejected, not truncated)
+ * followed by the name (name_l bytes), the barcode, the sequence and the quality string (l raw bytes).
+ * Barcodes are stored as FamTable keys (see pack_barcode), each word truncated to the bytes it uses,
+ * so the dmp cores look families up without re-packing them. Sequences are 2 bits per base,
+ * or 4 bits per base (ACGTN) if they contain anything else.
+ * Barcode words are written least significant byte first, as is l.
+ */
+
+/*
+ * @func binfq_key_bytes
+ * :param: blen [int] Barcode length.
+ * :returns: [int] Bytes used by a packed barcode of this length.
+ */
+CONST static inline int binfq_key_bytes(int blen)
+{
+    return blen > 32 ? 8 + ((blen - 32 + 3) >> 2): (blen + 3) >> 2;
+}
+
+/*
+ * @func binfq_rec
+ * Appends a marked record to a kstring in the binary format.
+ * :param: ks [kstring_t *] Output buffer.
+ * :param: name [const char *] Read name.
+ * :param: barcode [const char *] Barcode, excluding the strand character.
+ * :param: blen [int] Length of barcode.
+ * :param: strand [char] Strand character: 'F', 'R' or 'Z'.
+ * :param: pass_fail [int] 1 for pass, 0 for fail.
+ * :param: seq [const char *] Read sequence.
+ * :param: qual [const char *] Read quality string.
+ * :param: l [unsigned] Read length.
+ */
+void binfq_rec(kstring_t *ks, const char *name, const char *barcode, int blen, char strand, int pass_fail,
+               const char *seq, const char *qual, unsigned l);
+
+/*
+ * @func mseq2bin_stranded
+ * Binary counterpart of mseq2ks_stranded.
+ */
+static inline void mseq2bin_stranded(kstring_t *ks, mseq_t *mvar, int pass_fail, char *barcode, char prefix)
+{
+    binfq_rec(ks, mvar->name, barcode, std::strlen(barcode), prefix, pass_fail,
+              mvar->seq, mvar->qual, std::strlen(mvar->seq));
+}
+
+static inline void binfq_write_header(TmpFqWriter *handle)
+{
+    handle->write(BINFQ_MAGIC, BINFQ_MAGIC_LEN);
+}
+
+/*
+ * Reader for temporary split files in either format, built on FqReader.
+ * Marked fastqs (starting with '@') are parsed as views; binary files (starting with BINFQ_MAGIC)
+ * are decoded at fixed offsets.
+ * After next() returns 1, the public fields describe the current record until the following call.
+ */
+class TmpFqReader {
+    FqReader in_;
+    fq_view_t view_;
+    int binary_;
+    const char *rec_; // Current binary record.
+    size_t rec_len_;
+    uint64_t key_[2];
+    int packed_; // Whether key_ holds the current barcode.
+    char bs_[MAX_BARCODE_LENGTH + 2];
+    kstring_t seqbuf_;
+    void detect();
+    int next_binary();
+    int next_text();
+public:
+    const char *name; // Not null-terminated.
+    int name_l;
+    const char *bs; // Barcode, starting with the strand character. Null-terminated.
+    int blen; // Length of bs, including the strand character.
+    char pass_fail; // '1' for pass, '0' for fail.
+    const char *seq; // Not null-terminated for fastq input.
+    const char *qual; // Not null-terminated.
+    unsigned l;
+    /*
+     * :param: path [const char *] Input path. Null or "-" for stdin.
+     */
+    TmpFqReader(const char *path);
+    ~TmpFqReader();
+    TmpFqReader(const TmpFqReader &) = delete;
+    TmpFqReader &operator=(const TmpFqReader &) = delete;
+    int binary() const {return binary_;}
+    /*
+     * Reads the next record.
+     * :returns: [int] 1 if a record was read, 0 at the end of the file.
+     */
+    int next() {return binary_ ? next_binary(): next_text();}
+    /*
+     * Rewinds to the first record.
+     * :returns: [int] 0 on success, -1 if the input cannot be rewound.
+     */
+    int rewind();
+    /*
+     * :returns: [size_t] Approximate offset in the (compressed) input of the next record.
+     */
+    size_t offset() {return in_.offset();}
+    /*
+     * Finds the current record's family, adding it if absent.
+     * The strand character is excluded from the key, so both strands share a family.
+     */
+    template<typename T>
+    uint32_t lookup(FamTable<T> &table, int *is_new) {
+        return packed_ ? table.get_packed(key_, blen - 1, is_new): table.get(bs + 1, blen - 1, is_new);
+    }
+    /*
+     * Writes a header to w for files in this input's format. Call before copy().
+     */
+    void start(TmpFqWriter *w) {if(binary_) binfq_write_header(w);}
+    /*
+     * Appends the current record to w in this input's format.
+     */
+    void copy(TmpFqWriter *w);
+};
+
+} /* namespace bmf */
+
+#endif /* BINFQ_H */
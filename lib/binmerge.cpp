@@ -0,0 +1,251 @@
+#include "binmerge.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "dlib/logging_util.h"
+#include "lib/mseq.h"
+#include "lib/ubam.h"
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#define BINMERGE_SENDFILE 1
+#if __GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27)
+#define BINMERGE_COPY_FILE_RANGE 1
+#endif
+#endif
+
+#define BINMERGE_BUF_SIZE (1 << 20)
+
+namespace bmf {
+
+enum copy_method {
+    COPY_FILE_RANGE,
+    SENDFILE,
+    READ_WRITE
+};
+
+static ssize_t copy_rw(int in, int out, size_t len)
+{
+    static thread_local char buf[BINMERGE_BUF_SIZE];
+    const ssize_t ret(read(in, buf, len < sizeof(buf) ? len: sizeof(buf)));
+    if(ret <= 0) return ret;
+    for(ssize_t written(0), w; written < ret; written += w)
+        if((w = write(out, buf + written, ret - written)) < 0) {
+            if(errno != EINTR) return -1;
+            w = 0;
+        }
+    return ret;
+}
+
+/*
+ * @func append_file
+ * Appends the contents of the file at path to the file descriptor out.
+ * :param: out [int] Output file descriptor.
+ * :param: path [const char *] Path to the file to append.
+ */
+static void append_file(int out, const char *path)
+{
+    const int in(open(path, O_RDONLY));
+    if(in < 0) LOG_EXIT("Could not open collapsed bin %s: %s. Abort!\n", path, std::strerror(errno));
+    struct stat st;
+    if(fstat(in, &st)) LOG_EXIT("Could not stat collapsed bin %s: %s. Abort!\n", path, std::strerror(errno));
+#if BINMERGE_COPY_FILE_RANGE
+    int method(COPY_FILE_RANGE);
+#elif BINMERGE_SENDFILE
+    int method(SENDFILE);
+#else
+    int method(READ_WRITE);
+#endif
+    for(size_t remaining(st.st_size); remaining;) {
+        ssize_t ret;
+        switch(method) {
+#if BINMERGE_COPY_FILE_RANGE
+            case COPY_FILE_RANGE: ret = copy_file_range(in, nullptr, out, nullptr, remaining, 0); break;
+#endif
+#if BINMERGE_SENDFILE
+            case SENDFILE: ret = sendfile(out, in, nullptr, remaining); break;
+#endif
+            default: ret = copy_rw(in, out, remaining);
+        }
+        if(ret < 0) {
+            if(errno == EINTR) continue;
+            // Cross-filesystem copies and filesystems without support fail before copying anything.
+            if(method != READ_WRITE && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+                LOG_DEBUG("Falling back from copy method %i for %s: %s.\n", method, path, std::strerror(errno));
+                ++method;
+                continue;
+            }
+            LOG_EXIT("Failed to append collapsed bin %s: %s. Abort!\n", path, std::strerror(errno));
+        }
+        if(ret == 0) LOG_EXIT("Collapsed bin %s was truncated while merging. Abort!\n", path);
+        remaining -= ret;
+    }
+    close(in);
+}
+
+/*
+ * @func append_record
+ * Appends the next four lines of a fastq to out.
+ * :returns: [int] Number of lines appended, 0 at the end of the file.
+ */
+static int append_record(kstream_t *ks, kstring_t *line, kstring_t *out)
+{
+    int dret;
+    for(int i(0); i < 4; ++i) {
+        if(ks_getuntil(ks, KS_SEP_LINE, line, &dret) < 0) return i;
+        kputsn(line->s, line->l, out);
+        kputc('\n', out);
+    }
+    return 4;
+}
+
+static gzFile open_bin(const char *path)
+{
+    gzFile ret(gzopen(path, "r"));
+    if(!ret) LOG_EXIT("Could not open collapsed bin %s. Abort!\n", path);
+    gzbuffer(ret, BINMERGE_BUF_SIZE >> 2);
+    return ret;
+}
+
+/*
+ * @func read_bam_rec
+ * Reads the next serialized BAM record of a collapsed bin into rec.
+ * :returns: [int] 1 if a record was read, 0 at the end of the file.
+ */
+static int read_bam_rec(gzFile fp, const char *path, kstring_t *rec)
+{
+    int32_t block_size;
+    const int ret(gzread(fp, &block_size, sizeof(block_size)));
+    if(ret == 0) return 0;
+    if(ret != sizeof(block_size) || block_size < UBAM_FIXED_SIZE - 4)
+        LOG_EXIT("Truncated or corrupt collapsed bin %s. Abort!\n", path);
+    ks_resize(rec, block_size + 4);
+    std::memcpy(rec->s, &block_size, sizeof(block_size));
+    if(gzread(fp, rec->s + 4, block_size) != block_size) LOG_EXIT("Truncated collapsed bin %s. Abort!\n", path);
+    rec->l = block_size + 4;
+    return 1;
+}
+
+static void flush_stdout(kstring_t *out)
+{
+    if(fwrite(out->s, 1, out->l, stdout) != out->l) LOG_EXIT("Failed to write to stdout. Abort!\n");
+    out->l = 0;
+}
+
+BinMerger::BinMerger(marksplit_settings_t *settings, splitterhash_params_t *params,
+                     const char *ffq_r1, const char *ffq_r2):
+    settings_(settings), params_(params), done_(params->n)
+{
+    if(settings_->ubam) {
+        threads_.emplace_back(&BinMerger::merge_bam, this, std::string(settings_->to_stdout ? "-": ffq_r1));
+        return;
+    }
+    if(settings_->to_stdout) {
+        threads_.emplace_back(&BinMerger::merge_stdout, this);
+        return;
+    }
+    const char *suffix(settings_->gzip_output ? ".gz": "");
+    threads_.emplace_back(&BinMerger::merge_file, this, 0, std::string(ffq_r1) + suffix);
+    if(!settings_->is_se) threads_.emplace_back(&BinMerger::merge_file, this, 1, std::string(ffq_r2) + suffix);
+}
+
+void BinMerger::done(int bin, int is_read2)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_);
+        done_[bin] |= 1 << is_read2;
+    }
+    cv_.notify_all();
+}
+
+void BinMerger::wait(int bin, uint8_t mask)
+{
+    std::unique_lock<std::mutex> lock(m_);
+    cv_.wait(lock, [&]() {return (done_[bin] & mask) == mask;});
+}
+
+void BinMerger::finish()
+{
+    for(auto &t: threads_) t.join();
+    threads_.clear();
+}
+
+void BinMerger::merge_file(int is_read2, std::string path)
+{
+    char **fnames(is_read2 ? params_->outfnames_r2: params_->outfnames_r1);
+    const int out(open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+    if(out < 0) LOG_EXIT("Could not open %s for writing: %s. Abort!\n", path.c_str(), std::strerror(errno));
+    for(int i(0); i < params_->n; ++i) {
+        wait(i, 1 << is_read2);
+        LOG_DEBUG("Appending %s to %s.\n", fnames[i], path.c_str());
+        append_file(out, fnames[i]);
+    }
+    if(close(out)) LOG_EXIT("Failed to close %s: %s. Abort!\n", path.c_str(), std::strerror(errno));
+}
+
+void BinMerger::merge_stdout()
+{
+    const int paired(!settings_->is_se);
+    kstring_t out{0, 0, nullptr}, line{0, 0, nullptr};
+    ks_resize(&out, BINMERGE_BUF_SIZE + (BINMERGE_BUF_SIZE >> 2));
+    for(int i(0); i < params_->n; ++i) {
+        wait(i, paired ? 3: 1);
+        gzFile fp1(open_bin(params_->outfnames_r1[i]));
+        if(!paired) {
+            int l;
+            while((l = gzread(fp1, out.s, out.m)) > 0) out.l = l, flush_stdout(&out);
+            if(l < 0) LOG_EXIT("Failed to read collapsed bin %s. Abort!\n", params_->outfnames_r1[i]);
+            gzclose(fp1);
+            continue;
+        }
+        gzFile fp2(open_bin(params_->outfnames_r2[i]));
+        kstream_t *ks1(ks_init(fp1)), *ks2(ks_init(fp2));
+        int n1, n2;
+        for(;;) {
+            n1 = append_record(ks1, &line, &out);
+            n2 = append_record(ks2, &line, &out);
+            if(n1 != 4 || n2 != 4) break;
+            if(out.l >= BINMERGE_BUF_SIZE) flush_stdout(&out);
+        }
+        if(n1 || n2)
+            LOG_EXIT("Unequal number of read 1 and read 2 records in collapsed bins %s and %s. Abort!\n",
+                     params_->outfnames_r1[i], params_->outfnames_r2[i]);
+        ks_destroy(ks1), ks_destroy(ks2);
+        gzclose(fp1), gzclose(fp2);
+    }
+    flush_stdout(&out);
+    fflush(stdout);
+    free(out.s), free(line.s);
+}
+
+void BinMerger::merge_bam(std::string path)
+{
+    const int paired(!settings_->is_se);
+    UBamWriter out(path.c_str(), settings_->gzip_compression, settings_->threads);
+    kstring_t rec1{0, 0, nullptr}, rec2{0, 0, nullptr};
+    for(int i(0); i < params_->n; ++i) {
+        wait(i, paired ? 3: 1);
+        gzFile fp1(open_bin(params_->outfnames_r1[i])), fp2(paired ? open_bin(params_->outfnames_r2[i]): nullptr);
+        int n1, n2(0);
+        for(;;) {
+            n1 = read_bam_rec(fp1, params_->outfnames_r1[i], &rec1);
+            if(paired) n2 = read_bam_rec(fp2, params_->outfnames_r2[i], &rec2);
+            if(!n1 || (paired && !n2)) break;
+            if(paired) out.write_pair(rec1.s, rec2.s);
+            else out.write(rec1.s);
+        }
+        if(n1 || n2)
+            LOG_EXIT("Unequal number of read 1 and read 2 records in collapsed bins %s and %s. Abort!\n",
+                     params_->outfnames_r1[i], params_->outfnames_r2[i]);
+        gzclose(fp1);
+        if(fp2) gzclose(fp2);
+    }
+    free(rec1.s), free(rec2.s);
+}
+
+} /* namespace bmf */
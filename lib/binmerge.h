@@ -0,0 +1,61 @@
+#ifndef BINMERGE_H
+#define BINMERGE_H
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "lib/splitter.h"
+
+namespace bmf {
+
+/*
+ * Merges collapsed bins into the final fastqs in-process.
+ *
+ * Workers report each bin with done() as soon as it has been collapsed. Merger threads append bins in
+ * bin order, each as soon as every earlier bin has been appended, so merging overlaps collapsing.
+ * File output is copied with copy_file_range, falling back to sendfile and then read/write.
+ * Compressed bins are complete gzip files, so their concatenation is a valid multi-member gzip file
+ * and is copied without recompression.
+ * In stdout mode, bins are decompressed and read 1 and read 2 records are interleaved.
+ * In unaligned BAM mode (settings->ubam), bins hold BAM records, which are written with a single UBamWriter,
+ * read pairs adjacent.
+ */
+class BinMerger {
+    marksplit_settings_t *settings_;
+    splitterhash_params_t *params_;
+    std::vector<uint8_t> done_; // Bit r is set once read r + 1 of a bin has been collapsed.
+    std::mutex m_;
+    std::condition_variable cv_;
+    std::vector<std::thread> threads_;
+    void wait(int bin, uint8_t mask);
+    void merge_file(int is_read2, std::string path);
+    void merge_stdout();
+    void merge_bam(std::string path);
+public:
+    /*
+     * :param: settings [marksplit_settings_t *] Settings for the run.
+     * :param: params [splitterhash_params_t *] Collapsed bin paths, in output order.
+     * :param: ffq_r1 [const char *] Final read 1 fastq path. ".gz" is appended if settings->gzip_output is set.
+     * :param: ffq_r2 [const char *] Final read 2 fastq path. Ignored for single-end runs.
+     * If settings->to_stdout is set, ffq_r1 and ffq_r2 are ignored.
+     * If settings->ubam is set, ffq_r1 is the final BAM path and ffq_r2 is ignored.
+     */
+    BinMerger(marksplit_settings_t *settings, splitterhash_params_t *params, const char *ffq_r1, const char *ffq_r2);
+    ~BinMerger() {finish();}
+    BinMerger(const BinMerger &) = delete;
+    BinMerger &operator=(const BinMerger &) = delete;
+    /*
+     * Marks read 1 or read 2 of a bin as collapsed. Thread-safe.
+     */
+    void done(int bin, int is_read2);
+    /*
+     * Waits for every bin to be merged. Every bin must have been reported with done().
+     */
+    void finish();
+};
+
+} /* namespace bmf */
+
+#endif /* BINMERGE_H */
@@ -9,6 +9,8 @@ namespace bmf {
 /* get_binner is written in a type-generic way.
  * You must declare the binner with DECLARE_BINNER and then use
  * get_binner_type to access the correct function.
+ * The first base is the most significant digit, so bin order is the lexicographic order of barcode
+ * prefixes, and the bin of a longer prefix divided by 4^k is the bin of the prefix k bases shorter.
  */
 #define get_binner_type(barcode, length, type_t) get_binner_##type_t(barcode, length)
 // get_binner defaults to uint64_t for its type.
@@ -17,8 +19,7 @@ namespace bmf {
 #define DECLARE_BINNER(type_t) \
     CONST static inline type_t get_binner_##type_t(char *barcode, size_t length) {\
         type_t bin(0);\
-        barcode += length;\
-        while(length--) bin += dlib::ipow(4, length) * nuc2num_acgt(*--barcode);\
+        for(const char *const end(barcode + length); barcode < end; ++barcode) bin = bin * 4 + nuc2num_acgt(*barcode);\
         return bin;\
     }
 
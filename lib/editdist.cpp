@@ -0,0 +1,69 @@
+#include "editdist.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+
+namespace bmf {
+
+int myers_edit_distance(const char *a, int la, const char *b, int lb, int lim)
+{
+    assert(la <= 64);
+    if(!la) return lb;
+    // Only the entries for characters of a or b are read, so only those are cleared.
+    uint64_t peq[256];
+    for(int j(0); j < lb; ++j) peq[(uint8_t)b[j]] = 0;
+    for(int i(0); i < la; ++i) peq[(uint8_t)a[i]] = 0;
+    for(int i(0); i < la; ++i) peq[(uint8_t)a[i]] |= 1uLL << i;
+    const uint64_t last(1uLL << (la - 1));
+    uint64_t pv(~0uLL), mv(0);
+    int score(la); // Distance between a and the prefix of b read so far.
+    for(int j(0); j < lb; ++j) {
+        const uint64_t eq(peq[(uint8_t)b[j]]), xv(eq | mv), xh((((eq & pv) + pv) ^ pv) | eq);
+        uint64_t ph(mv | ~(xh | pv)), mh(pv & xh);
+        if(ph & last) ++score;
+        else if(mh & last) --score;
+        // Each remaining character of b can lower the distance by at most one.
+        if(score - (lb - j - 1) > lim) return score - (lb - j - 1);
+        ph = (ph << 1) | 1, mh <<= 1; // Row 0 rises by one per column.
+        pv = mh | ~(xv | ph);
+        mv = ph & xv;
+    }
+    return score;
+}
+
+int banded_edit_distance(const char *a, int la, const char *b, int lb, int lim)
+{
+    assert(lim <= ED_MAX_LIM);
+    if(std::abs(la - lb) > lim) return std::abs(la - lb);
+    // band[d] holds the current row's cell on diagonal d - lim (column i + d - lim), capped at lim + 1.
+    const int cap(lim + 1), w(2 * lim + 1);
+    int band[2 * ED_MAX_LIM + 1];
+    for(int d(0); d < w; ++d) band[d] = d < lim || d - lim > lb ? cap: d - lim;
+    for(int i(1); i <= la; ++i) {
+        int row_min(cap);
+        for(int d(0); d < w; ++d) {
+            const int j(i + d - lim);
+            int v(cap);
+            if(j == 0) v = i;
+            else if(j > 0 && j <= lb) {
+                v = band[d] + (a[i - 1] != b[j - 1]); // Previous row, same diagonal.
+                if(d + 1 < w) v = std::min(v, band[d + 1] + 1); // Cell above.
+                if(d) v = std::min(v, band[d - 1] + 1); // Cell to the left, already in this row.
+            }
+            row_min = std::min(row_min, band[d] = std::min(v, cap));
+        }
+        if(row_min > lim) return row_min;
+    }
+    return band[lb - la + lim];
+}
+
+int bounded_edit_distance(const char *a, int la, const char *b, int lb, int lim)
+{
+    if(std::abs(la - lb) > lim) return std::abs(la - lb);
+    if(la > lb) std::swap(a, b), std::swap(la, lb);
+    return la <= 64 ? myers_edit_distance(a, la, b, lb, lim): banded_edit_distance(a, la, b, lb, lim);
+}
+
+} /* namespace bmf */
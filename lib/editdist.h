@@ -0,0 +1,38 @@
+#ifndef EDITDIST_H
+#define EDITDIST_H
+
+#define ED_MAX_LIM 63 // Largest limit the banded kernel supports: rsq's mismatch limit is 6 bits.
+
+namespace bmf {
+
+/*
+ * Bounded Levenshtein distance kernels, for callers which only need to know whether two strings
+ * are within lim edits of each other. Neither allocates.
+ * Each returns the distance if it is at most lim, otherwise some value greater than lim.
+ */
+
+/*
+ * @func myers_edit_distance
+ * Bit-parallel (Myers, 1999; Hyyro's global variant): one pass over b, updating a column of 64-bit
+ * difference vectors per character. Stops once the distance can no longer come back within lim.
+ * :param: la [int] Length of a. At most 64.
+ */
+int myers_edit_distance(const char *a, int la, const char *b, int lb, int lim);
+
+/*
+ * @func banded_edit_distance
+ * Dynamic programming over the 2 * lim + 1 diagonals around the main one, since cells further away
+ * are more than lim edits from the start. Stops once a whole row of the band is past lim.
+ * :param: lim [int] At most ED_MAX_LIM.
+ */
+int banded_edit_distance(const char *a, int la, const char *b, int lb, int lim);
+
+/*
+ * @func bounded_edit_distance
+ * myers_edit_distance for strings of up to 64 characters, banded_edit_distance otherwise.
+ */
+int bounded_edit_distance(const char *a, int la, const char *b, int lb, int lim);
+
+} /* namespace bmf */
+
+#endif /* EDITDIST_H */
@@ -0,0 +1,250 @@
+#ifndef FAMTABLE_H
+#define FAMTABLE_H
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "dlib/compiler_util.h"
+#include "dlib/cstr_util.h"
+
+namespace bmf {
+
+/*
+ * Slot in a FamTable's open-addressing array.
+ * Barcodes of up to 64 ACGT bases are packed 2 bits per base, 32 bases per word.
+ */
+struct famkey_t {
+    uint64_t key[2];
+    uint32_t len; // Barcode length. 0 marks an empty slot.
+    uint32_t idx; // Index of the family in the table's entries.
+};
+
+/*
+ * @func pack_barcode
+ * :param: bs [const char *] Barcode sequence.
+ * :param: len [int] Length of bs.
+ * :param: key [uint64_t *] Two words to fill.
+ * :returns: [int] 0 on success, -1 if the barcode is empty, longer than 64 bases
+ * or contains a character other than ACGT.
+ */
+static inline int pack_barcode(const char *bs, int len, uint64_t *key)
+{
+    if(UNLIKELY(len <= 0 || len > 64)) return -1;
+    key[0] = key[1] = 0;
+    for(int i(0), n; i < len; ++i) {
+        if((n = nuc2num(bs[i])) > 3) return -1;
+        key[i >> 5] = (key[i >> 5] << 2) | n;
+    }
+    return 0;
+}
+
+/*
+ * @func unpack_barcode
+ * Inverse of pack_barcode.
+ * :param: key [const uint64_t *] Packed barcode.
+ * :param: len [int] Barcode length, from 1 to 64.
+ * :param: bs [char *] Buffer for len bases. Not null-terminated.
+ */
+static inline void unpack_barcode(const uint64_t *key, int len, char *bs)
+{
+    for(int i(0); i < len; ++i) {
+        const int n(std::min(len - (i & ~31), 32)); // Bases in this base's word.
+        bs[i] = "ACGT"[(key[i >> 5] >> (2 * (n - 1 - (i & 31)))) & 3];
+    }
+}
+
+CONST static inline uint64_t hash_famkey(const uint64_t *key, uint32_t len)
+{
+    // splitmix64 finalizer over both words and the length.
+    uint64_t h(key[0] ^ (key[1] * 0x9E3779B97F4A7C15uLL) ^ ((uint64_t)len << 57));
+    h ^= h >> 30; h *= 0xBF58476D1CE4E5B9uLL;
+    h ^= h >> 27; h *= 0x94D049BB133111EBuLL;
+    return h ^ (h >> 31);
+}
+
+/*
+ * Sort key for a packed barcode: its bases left-aligned in 128 bits, first base highest,
+ * so that comparing (hi, lo, len) orders barcodes lexicographically.
+ */
+struct famsort_t {
+    uint64_t hi;
+    uint64_t lo;
+    uint32_t len;
+    uint32_t idx; // Index of the family in its table's entries.
+};
+
+static inline famsort_t famsort_key(const uint64_t *key, uint32_t len, uint32_t idx)
+{
+    famsort_t ret{0, 0, len, idx};
+    if(len <= 32) ret.hi = key[0] << (64 - 2 * len);
+    else ret.hi = key[0], ret.lo = key[1] << (64 - 2 * (len - 32));
+    return ret;
+}
+
+static inline bool famsort_less(const famsort_t &a, const famsort_t &b)
+{
+    return a.hi != b.hi ? a.hi < b.hi: a.lo != b.lo ? a.lo < b.lo: a.len < b.len;
+}
+
+/*
+ * Byte d of a sort key, least significant first: the length, then lo, then hi.
+ */
+static inline unsigned famsort_digit(const famsort_t &k, int d)
+{
+    return d == 0 ? k.len: d <= 8 ? (k.lo >> (8 * (d - 1))) & 0xFF: (k.hi >> (8 * (d - 9))) & 0xFF;
+}
+
+/*
+ * @func famsort_radix
+ * Sorts keys by famsort_less with an LSD radix sort, a byte at a time.
+ * All byte histograms are counted in one pass, and bytes which are the same for every key
+ * (such as the low bytes of short barcodes, or the length of fixed-length barcodes) are skipped.
+ */
+static inline void famsort_radix(std::vector<famsort_t> &keys)
+{
+    static const int N_DIGITS(17);
+    if(keys.size() < 2) return;
+    std::vector<size_t> counts(N_DIGITS * 256, 0);
+    for(const famsort_t &k: keys)
+        for(int d(0); d < N_DIGITS; ++d) ++counts[d * 256 + famsort_digit(k, d)];
+    std::vector<famsort_t> tmp(keys.size());
+    for(int d(0); d < N_DIGITS; ++d) {
+        size_t *const c(&counts[d * 256]);
+        if(c[famsort_digit(keys[0], d)] == keys.size()) continue;
+        for(size_t i(0), sum(0); i < 256; ++i) {
+            const size_t n(c[i]);
+            c[i] = sum, sum += n;
+        }
+        for(const famsort_t &k: keys) tmp[c[famsort_digit(k, d)]++] = k;
+        keys.swap(tmp);
+    }
+}
+
+/*
+ * Barcode-keyed family table.
+ * Packed barcodes are looked up by linear probing in a flat slot array, which is rehashed
+ * as it fills. Barcodes which cannot be packed (those with Ns, which are QC fail anyway,
+ * or longer than 64 bases) go to an overflow map.
+ * Entries are value-initialized on insertion and stored contiguously in insertion order;
+ * their indices are stable, but references are invalidated by later insertions.
+ */
+template<typename T>
+class FamTable {
+    std::vector<famkey_t> slots_;
+    std::vector<T> entries_;
+    std::unordered_map<std::string, uint32_t> overflow_;
+    uint64_t mask_;
+    size_t n_packed_;
+
+    void rehash(size_t n_slots) {
+        std::vector<famkey_t> old(n_slots);
+        old.swap(slots_);
+        mask_ = n_slots - 1;
+        for(const famkey_t &s: old) {
+            if(!s.len) continue;
+            uint64_t i(hash_famkey(s.key, s.len) & mask_);
+            while(slots_[i].len) i = (i + 1) & mask_;
+            slots_[i] = s;
+        }
+    }
+
+public:
+    FamTable(size_t n_slots=1 << 10): slots_(n_slots), mask_(n_slots - 1), n_packed_(0) {
+        assert((n_slots & (n_slots - 1)) == 0);
+    }
+    /*
+     * @func get
+     * Finds the family for a barcode, adding it if absent.
+     * :param: bs [const char *] Barcode sequence.
+     * :param: len [int] Length of bs.
+     * :param: is_new [int *] Set to 1 if the family was added, 0 otherwise.
+     * :returns: [uint32_t] Index of the family.
+     */
+    uint32_t get(const char *bs, int len, int *is_new) {
+        uint64_t key[2];
+        if(UNLIKELY(pack_barcode(bs, len, key))) {
+            auto it(overflow_.emplace(std::string(bs, len), (uint32_t)entries_.size()));
+            if((*is_new = it.second)) entries_.emplace_back();
+            return it.first->second;
+        }
+        return get_packed(key, len, is_new);
+    }
+    /*
+     * @func get_packed
+     * As get, for a barcode already packed with pack_barcode.
+     */
+    uint32_t get_packed(const uint64_t *key, int len, int *is_new) {
+        if(UNLIKELY((n_packed_ + 1) * 10 > slots_.size() * 7)) rehash(slots_.size() << 1);
+        uint64_t i(hash_famkey(key, len) & mask_);
+        for(;;) {
+            famkey_t &s(slots_[i]);
+            if(!s.len) break;
+            if(s.len == (uint32_t)len && s.key[0] == key[0] && s.key[1] == key[1]) {
+                *is_new = 0;
+                return s.idx;
+            }
+            i = (i + 1) & mask_;
+        }
+        famkey_t &s(slots_[i]);
+        s.key[0] = key[0], s.key[1] = key[1];
+        s.len = len;
+        s.idx = entries_.size();
+        ++n_packed_;
+        *is_new = 1;
+        entries_.emplace_back();
+        return s.idx;
+    }
+    /*
+     * @func sorted_keys
+     * :returns: [std::vector<famsort_t>] Sort keys of the table's packed barcodes, in barcode order.
+     */
+    std::vector<famsort_t> sorted_keys() const {
+        std::vector<famsort_t> ret;
+        ret.reserve(n_packed_);
+        for(const famkey_t &s: slots_)
+            if(s.len) ret.push_back(famsort_key(s.key, s.len, s.idx));
+        famsort_radix(ret);
+        return ret;
+    }
+    /*
+     * @func barcode_order
+     * :returns: [std::vector<uint32_t>] Indices of every entry, packed barcodes in lexicographic order
+     * followed by those which could not be packed, in lexicographic order.
+     */
+    std::vector<uint32_t> barcode_order() const {
+        std::vector<uint32_t> ret;
+        ret.reserve(entries_.size());
+        for(const famsort_t &k: sorted_keys()) ret.push_back(k.idx);
+        if(!overflow_.empty()) {
+            std::vector<std::pair<std::string, uint32_t>> rest(overflow_.begin(), overflow_.end());
+            std::sort(rest.begin(), rest.end());
+            for(const auto &p: rest) ret.push_back(p.second);
+        }
+        return ret;
+    }
+    T &operator[](size_t i) {return entries_[i];}
+    size_t size() const {return entries_.size();}
+    /*
+     * Approximate heap usage of the table itself, excluding anything the entries point to.
+     */
+    size_t bytes() const {
+        return slots_.capacity() * sizeof(famkey_t) + entries_.capacity() * sizeof(T) +
+               overflow_.size() * (sizeof(std::string) + sizeof(uint32_t) + 4 * sizeof(void *) + 64);
+    }
+    /*
+     * Removes all entries and releases the table's memory.
+     */
+    void clear() {
+        std::vector<famkey_t>(1 << 10).swap(slots_);
+        std::vector<T>().swap(entries_);
+        std::unordered_map<std::string, uint32_t>().swap(overflow_);
+        mask_ = slots_.size() - 1;
+        n_packed_ = 0;
+    }
+};
+
+} /* namespace bmf */
+
+#endif /* FAMTABLE_H */
@@ -0,0 +1,258 @@
+#include "fqreader.h"
+
+#include <algorithm>
+#include <climits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "dlib/logging_util.h"
+
+namespace bmf {
+
+/*
+ * @func fq_is_bgzf
+ * :param: h [const unsigned char *] The start of a file.
+ * :param: n [ssize_t] Bytes in h.
+ * :returns: [int] Whether h starts with a BGZF block header.
+ */
+static inline int fq_is_bgzf(const unsigned char *h, ssize_t n)
+{
+    return n >= 16 && h[0] == 0x1f && h[1] == 0x8b && h[2] == 8 && (h[3] & 4) && h[12] == 'B' && h[13] == 'C' &&
+           h[14] == 2 && h[15] == 0;
+}
+
+FqReader::FqReader(const char *path, int threads):
+    fp_(nullptr), bgzf_(nullptr), map_(nullptr), map_size_(0), data_(nullptr), pos_(0), end_(0), eof_(0),
+    cur_{std::vector<char>(), 0}, cur_pos_(0), inflated_(0), stop_(0)
+{
+    const int is_stdin(!path || !*path || std::strcmp(path, "-") == 0);
+    const int fd(is_stdin ? dup(STDIN_FILENO): open(path, O_RDONLY));
+    if(fd < 0) LOG_EXIT("Could not open %s for reading. Abort!\n", is_stdin ? "stdin": path);
+    struct stat st;
+    unsigned char magic[18];
+    // Map regular, uncompressed files. Gzip files, empty files and streams are read through zlib (or htslib).
+    if(!is_stdin && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        const ssize_t n(pread(fd, magic, sizeof(magic), 0));
+        if(!(n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)) {
+            void *map(mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0));
+            if(map != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+                madvise(map, st.st_size, MADV_SEQUENTIAL);
+#endif
+                close(fd);
+                map_ = (char *)map, map_size_ = st.st_size;
+                data_ = map_, end_ = map_size_, eof_ = 1;
+                return;
+            }
+            LOG_DEBUG("Could not map %s. Reading it through zlib.\n", path);
+        } else if(threads > 1 && fq_is_bgzf(magic, n)) {
+            if((bgzf_ = bgzf_dopen(fd, "r")) == nullptr) LOG_EXIT("Could not open %s for reading. Abort!\n", path);
+            if(bgzf_mt(bgzf_, threads, FQ_READER_BGZF_SUB_BLKS))
+                LOG_WARNING("Could not start decompression threads for %s. Reading it with one thread.\n", path);
+            buf_.resize(FQ_READER_BUF_SIZE);
+            data_ = buf_.data();
+            return;
+        }
+    }
+    if((fp_ = gzdopen(fd, "r")) == nullptr) LOG_EXIT("Could not open %s for reading. Abort!\n", is_stdin ? "stdin": path);
+    gzbuffer(fp_, FQ_READER_GZ_BUF_SIZE);
+    buf_.resize(FQ_READER_BUF_SIZE);
+    data_ = buf_.data();
+    if(threads > 1) start_inflater();
+}
+
+FqReader::~FqReader()
+{
+    stop_inflater();
+    if(map_) munmap(map_, map_size_);
+    if(fp_) gzclose(fp_);
+    if(bgzf_) bgzf_close(bgzf_);
+}
+
+/*
+ * Body of the read-ahead thread: decompresses chunks until the input ends or the reader stops it,
+ * keeping at most FQ_READER_READAHEAD chunks ahead of the parser.
+ */
+void FqReader::inflate()
+{
+    for(;;) {
+        fq_chunk_t c{std::vector<char>(), 0};
+        {
+            std::unique_lock<std::mutex> lock(m_);
+            cv_.wait(lock, [&]() {return stop_ || chunks_.size() < FQ_READER_READAHEAD;});
+            if(stop_) return;
+            if(free_chunks_.size()) c = std::move(free_chunks_.back()), free_chunks_.pop_back();
+        }
+        c.data.resize(FQ_READER_CHUNK_SIZE);
+        const int ret(gzread(fp_, c.data.data(), c.data.size()));
+        if(ret < 0) {
+            int err;
+            LOG_EXIT("Failed to read input: %s. Abort!\n", gzerror(fp_, &err));
+        }
+        c.data.resize(ret);
+        c.in_offset = gzoffset(fp_);
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            if(ret) chunks_.push_back(std::move(c));
+            else inflated_ = 1;
+        }
+        cv_.notify_all();
+        if(!ret) return;
+    }
+}
+
+void FqReader::start_inflater()
+{
+    stop_ = inflated_ = 0;
+    cur_.data.clear(), cur_pos_ = 0;
+    inflater_ = std::thread(&FqReader::inflate, this);
+}
+
+void FqReader::stop_inflater()
+{
+    if(!inflater_.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(m_);
+        stop_ = 1;
+    }
+    cv_.notify_all();
+    inflater_.join();
+    for(auto &c: chunks_) free_chunks_.push_back(std::move(c));
+    chunks_.clear();
+}
+
+/*
+ * Copies up to n decompressed bytes into dst.
+ * :returns: [size_t] Bytes copied, 0 at the end of the input.
+ */
+size_t FqReader::read_raw(char *dst, size_t n)
+{
+    if(bgzf_) {
+        const ssize_t ret(bgzf_read(bgzf_, dst, n));
+        if(ret < 0) LOG_EXIT("Failed to read BGZF input. Abort!\n");
+        return ret;
+    }
+    if(!inflater_.joinable()) {
+        const int ret(gzread(fp_, dst, std::min(n, (size_t)INT_MAX)));
+        if(ret < 0) {
+            int err;
+            LOG_EXIT("Failed to read input: %s. Abort!\n", gzerror(fp_, &err));
+        }
+        return ret;
+    }
+    if(cur_pos_ == cur_.data.size()) {
+        std::unique_lock<std::mutex> lock(m_);
+        cv_.wait(lock, [&]() {return chunks_.size() || inflated_;});
+        if(chunks_.empty()) return 0;
+        free_chunks_.push_back(std::move(cur_));
+        cur_ = std::move(chunks_.front()), cur_pos_ = 0;
+        chunks_.pop_front();
+        lock.unlock();
+        cv_.notify_all();
+    }
+    n = std::min(n, cur_.data.size() - cur_pos_);
+    std::memcpy(dst, cur_.data.data() + cur_pos_, n);
+    cur_pos_ += n;
+    return n;
+}
+
+/*
+ * Moves unread bytes to the front of the buffer and reads until it holds at least n of them,
+ * growing the buffer for records longer than it.
+ * :returns: [int] 1 on success, 0 if the input ends first.
+ */
+int FqReader::fill(size_t n)
+{
+    if(map_) return end_ - pos_ >= n;
+    if(pos_) {
+        std::memmove(buf_.data(), buf_.data() + pos_, end_ - pos_);
+        end_ -= pos_, pos_ = 0;
+    }
+    if(n > buf_.size()) buf_.resize(std::max(n, buf_.size() << 1));
+    data_ = buf_.data();
+    while(end_ < n) {
+        const size_t ret(read_raw(buf_.data() + end_, buf_.size() - end_));
+        if(ret == 0) return 0;
+        end_ += ret;
+    }
+    return 1;
+}
+
+/*
+ * @func fq_line
+ * Finds the end of the line starting at p.
+ * :param: eof [int] Whether end is the end of the input, in which case the last line may lack a newline.
+ * :param: len [uint32_t *] Set to the line's length, excluding the newline and any carriage return.
+ * :returns: [const char *] The start of the following line, or null if the line is incomplete.
+ */
+static inline const char *fq_line(const char *p, const char *end, int eof, uint32_t *len)
+{
+    const char *nl(fq_find_nl(p, end));
+    if(!nl) {
+        if(!eof) return nullptr;
+        nl = end;
+    }
+    *len = nl - p - (nl > p && nl[-1] == '\r');
+    return nl == end ? end: nl + 1;
+}
+
+/*
+ * :returns: [int] 1 if a record was parsed, 0 at the end of the input, -1 if the buffer ends mid-record.
+ */
+int FqReader::parse(fq_view_t *rec)
+{
+    const char *p(data_ + pos_), *const end(data_ + end_);
+    while(p < end && (*p == '\n' || *p == '\r')) ++p;
+    pos_ = p - data_;
+    if(p == end) return eof_ ? 0: -1;
+    if(UNLIKELY(*p != '@')) LOG_EXIT("Malformed fastq: record does not start with '@'. Abort!\n");
+    uint32_t hl, sl, pl, ql;
+    const char *const h(p + 1), *s, *plus, *q;
+    if(!(s = fq_line(h, end, eof_, &hl)) || !(plus = fq_line(s, end, eof_, &sl)) ||
+       !(q = fq_line(plus, end, eof_, &pl)) || !(p = fq_line(q, end, eof_, &ql)))
+        return -1;
+    if(UNLIKELY(!pl || *plus != '+' || sl != ql))
+        LOG_EXIT("Malformed fastq record %.*s: expected four lines with sequence and quality of equal length. Abort!\n",
+                 (int)hl, h);
+    rec->name = h;
+    const char *const hend(h + hl);
+    const char *sep(h);
+    while(sep < hend && *sep != ' ' && *sep != '\t') ++sep;
+    rec->name_l = sep - h;
+    rec->comment = sep + (sep < hend);
+    rec->comment_l = hend - rec->comment;
+    rec->seq = s, rec->qual = q, rec->l = sl;
+    pos_ = p - data_;
+    return 1;
+}
+
+int FqReader::rewind()
+{
+    if(map_) {
+        pos_ = 0;
+        return 0;
+    }
+    if(bgzf_) {
+        if(bgzf_seek(bgzf_, 0, SEEK_SET) < 0) return -1;
+    } else {
+        const int readahead(inflater_.joinable());
+        stop_inflater();
+        if(gzrewind(fp_)) return -1;
+        if(readahead) start_inflater();
+    }
+    pos_ = end_ = 0, eof_ = 0;
+    return 0;
+}
+
+size_t FqReader::offset()
+{
+    if(map_) return pos_;
+    if(bgzf_) return bgzf_tell(bgzf_) >> 16; // Address of the current block
+    if(inflater_.joinable()) return cur_.in_offset;
+    const z_off_t in(gzoffset(fp_)), out(gztell(fp_));
+    if(out <= 0) return in;
+    return (size_t)((double)in * (out - (end_ - pos_)) / out);
+}
+
+} /* namespace bmf */
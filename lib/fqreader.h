@@ -0,0 +1,157 @@
+#ifndef FQREADER_H
+#define FQREADER_H
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <zlib.h>
+#if __SSE2__
+#include <emmintrin.h>
+#endif
+#include "htslib/bgzf.h"
+#include "dlib/compiler_util.h"
+
+#define FQ_READER_BUF_SIZE (4uL << 20) // Decompressed bytes held at once for gzip and stream input.
+#define FQ_READER_GZ_BUF_SIZE (256uL << 10) // zlib's input buffer for gzip input.
+#define FQ_READER_CHUNK_SIZE (1uL << 20) // Decompressed bytes per read-ahead chunk.
+#define FQ_READER_READAHEAD 8 // Read-ahead chunks held at once.
+#define FQ_READER_BGZF_SUB_BLKS 256 // Blocks handed to each BGZF decompression thread at once.
+
+namespace bmf {
+
+/*
+ * A fastq record as views into the reader's data. None of the fields are null-terminated.
+ */
+struct fq_view_t {
+    const char *name;
+    const char *comment; // Everything after the first space or tab in the header line.
+    const char *seq;
+    const char *qual;
+    uint32_t name_l;
+    uint32_t comment_l;
+    uint32_t l; // Length of seq and qual.
+};
+
+/*
+ * @func fq_find_nl
+ * :returns: [const char *] The first newline in [p, end), or null if there is none.
+ * Scans 16 bytes at a time with SSE2, where available.
+ */
+static inline const char *fq_find_nl(const char *p, const char *end)
+{
+#if __SSE2__
+    const __m128i nl(_mm_set1_epi8('\n'));
+    for(; p + 16 <= end; p += 16) {
+        const int mask(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), nl)));
+        if(mask) return p + __builtin_ctz(mask);
+    }
+#endif
+    return (const char *)std::memchr(p, '\n', end - p);
+}
+
+/*
+ * @func fq_reader_threads
+ * :param: threads [int] Threads available to a command.
+ * :param: n_inputs [int] Fastqs read at once.
+ * :returns: [int] Decompression threads for each input's FqReader.
+ */
+static inline int fq_reader_threads(int threads, int n_inputs)
+{
+    return threads > 1 ? std::max(threads / n_inputs, 2): 1;
+}
+
+/*
+ * Decompressed input read ahead by FqReader's inflater thread.
+ */
+struct fq_chunk_t {
+    std::vector<char> data;
+    size_t in_offset; // Compressed offset after this chunk.
+};
+
+/*
+ * Fastq reader for collapse's inputs and temporary files.
+ *
+ * Uncompressed regular files are memory-mapped, and records are handed out as views into the mapping,
+ * so parsing is a newline search and nothing is copied.
+ * Gzip files and streams (including stdin, as "-") are decompressed into a large buffer,
+ * from which records are viewed in the same way. Given more than one thread, BGZF files are decompressed
+ * by htslib's thread pool, and other gzip input is decompressed ahead of the parser by a separate thread.
+ * Records must have four lines, as written by Illumina software and by bmftools.
+ * Views are valid until the next call to next() or peek(), or, for mapped files, until the reader is destroyed.
+ */
+class FqReader {
+    gzFile fp_;
+    BGZF *bgzf_;
+    char *map_;
+    size_t map_size_;
+    std::vector<char> buf_;
+    const char *data_;
+    size_t pos_;
+    size_t end_;
+    int eof_; // No more data beyond end_.
+    // Read-ahead of gzip input.
+    std::thread inflater_;
+    std::mutex m_;
+    std::condition_variable cv_;
+    std::deque<fq_chunk_t> chunks_; // Filled, in input order
+    std::vector<fq_chunk_t> free_chunks_;
+    fq_chunk_t cur_; // Chunk being copied into buf_
+    size_t cur_pos_;
+    int inflated_; // The inflater has reached the end of the input.
+    int stop_;
+    void inflate();
+    void start_inflater();
+    void stop_inflater();
+    size_t read_raw(char *dst, size_t n);
+    int fill(size_t n);
+    int parse(fq_view_t *rec);
+public:
+    /*
+     * :param: path [const char *] Input path. Null or "-" for stdin.
+     * :param: threads [int] Decompression threads for BGZF input. If greater than 1,
+     *                       other gzip input is read ahead by one thread.
+     */
+    FqReader(const char *path, int threads=1);
+    ~FqReader();
+    FqReader(const FqReader &) = delete;
+    FqReader &operator=(const FqReader &) = delete;
+    int mapped() const {return map_ != nullptr;}
+    /*
+     * Reads the next record.
+     * :returns: [int] 1 if a record was read, 0 at the end of the file.
+     */
+    int next(fq_view_t *rec) {
+        int ret;
+        while((ret = parse(rec)) < 0)
+            if(!fill(end_ - pos_ + 1)) eof_ = 1;
+        return ret;
+    }
+    /*
+     * Raw access, for inputs which are not fastq.
+     * :returns: [const char *] A pointer to the next n unread bytes, or null if fewer remain.
+     */
+    const char *peek(size_t n) {
+        return end_ - pos_ >= n || fill(n) ? data_ + pos_: nullptr;
+    }
+    /*
+     * Consumes n bytes returned by peek.
+     */
+    void skip(size_t n) {pos_ += n;}
+    /*
+     * Rewinds to the start of the input.
+     * :returns: [int] 0 on success, -1 if the input is a stream.
+     */
+    int rewind();
+    /*
+     * :returns: [size_t] Approximate offset in the (compressed) input of the next unread byte.
+     */
+    size_t offset();
+};
+
+} /* namespace bmf */
+
+#endif /* FQREADER_H */
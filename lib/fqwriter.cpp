@@ -0,0 +1,72 @@
+#include "fqwriter.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include "dlib/logging_util.h"
+
+namespace bmf {
+
+TmpFqWriter::TmpFqWriter(const char *path, const char *mode, size_t flush_size):
+    fd_(-1), bgzf_(nullptr), flush_size_(flush_size), buf{0, 0, nullptr}
+{
+    int level(0);
+    if(!std::strchr(mode, 'T'))
+        for(const char *p(mode); *p; ++p)
+            if(*p >= '0' && *p <= '9') level = *p - '0';
+    if(level) {
+        char bmode[4] {'w', (char)('0' + level), '\0'};
+        if((bgzf_ = bgzf_open(path, bmode)) == nullptr)
+            LOG_EXIT("Could not open %s for writing. Abort!\n", path);
+    } else if((fd_ = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        LOG_EXIT("Could not open %s for writing: %s. Abort!\n", path, std::strerror(errno));
+    }
+    ks_resize(&buf, flush_size_ + (flush_size_ >> 2));
+}
+
+void TmpFqWriter::write_block(const char *s, size_t l)
+{
+    if(bgzf_) {
+        if(bgzf_write(bgzf_, s, l) < 0) LOG_EXIT("Failed to write compressed temporary fastq. Abort!\n");
+        return;
+    }
+    for(size_t written(0); written < l;) {
+        const ssize_t ret(::write(fd_, s + written, l - written));
+        if(ret < 0) {
+            if(errno == EINTR) continue;
+            LOG_EXIT("Failed to write temporary fastq: %s. Abort!\n", std::strerror(errno));
+        }
+        written += ret;
+    }
+}
+
+void TmpFqWriter::write(const char *s, size_t l)
+{
+    if(buf.l + l < flush_size_) {
+        kputsn(s, l, &buf);
+        return;
+    }
+    if(buf.l) flush_buf();
+    // Hand large blocks straight to the file instead of copying them through the buffer.
+    if(l >= flush_size_) write_block(s, l);
+    else kputsn(s, l, &buf);
+}
+
+void TmpFqWriter::close()
+{
+    if(fd_ < 0 && !bgzf_) return;
+    if(buf.l) flush_buf();
+    if(bgzf_) {
+        if(bgzf_close(bgzf_)) LOG_EXIT("Failed to close compressed temporary fastq. Abort!\n");
+        bgzf_ = nullptr;
+    } else {
+        ::close(fd_);
+        fd_ = -1;
+    }
+    free(buf.s);
+    buf = {0, 0, nullptr};
+}
+
+} /* namespace bmf */
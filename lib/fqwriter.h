@@ -0,0 +1,64 @@
+#ifndef FQWRITER_H
+#define FQWRITER_H
+#include <cstddef>
+#include "htslib/bgzf.h"
+#include "htslib/kstring.h"
+
+#define FQ_WRITER_BUDGET (64uL << 20) // Bytes of buffer shared by all of a splitter's handles
+#define FQ_WRITER_MIN_BUF (16uL << 10)
+#define FQ_WRITER_MAX_BUF (1uL << 20)
+
+namespace bmf {
+
+/*
+ * Buffered writer for temporary fastqs.
+ * Records are serialized into one large buffer, which is flushed with a single write once it fills.
+ * Uncompressed handles write straight to the file descriptor; compressed handles go through BGZF,
+ * which compresses each 64 kB block independently. Both are readable with gzopen/kseq, since gzread
+ * passes plain text through and reads concatenated gzip members.
+ */
+class TmpFqWriter {
+    int fd_;
+    BGZF *bgzf_;
+    size_t flush_size_;
+    void write_block(const char *s, size_t l);
+    void flush_buf() {write_block(buf.s, buf.l); buf.l = 0;}
+public:
+    kstring_t buf; // Pending output. Append with the ks* functions and call check().
+    /*
+     * :param: path [const char *] Output path.
+     * :param: mode [const char *] zlib-style mode: "wT" or a compression level of 0 for plain text, "wb<level>" otherwise.
+     * :param: flush_size [size_t] Buffer size at which to flush.
+     */
+    TmpFqWriter(const char *path, const char *mode, size_t flush_size=FQ_WRITER_MAX_BUF);
+    ~TmpFqWriter() {close();}
+    TmpFqWriter(const TmpFqWriter &) = delete;
+    TmpFqWriter &operator=(const TmpFqWriter &) = delete;
+    /*
+     * Flushes the buffer if it has filled.
+     */
+    void check() {if(buf.l >= flush_size_) flush_buf();}
+    /*
+     * Appends a block of text. Blocks at least as large as the buffer skip it.
+     */
+    void write(const char *s, size_t l);
+    /*
+     * Flushes and closes the file. Called by the destructor if not called explicitly.
+     */
+    void close();
+};
+
+/*
+ * @func fq_writer_buf_size
+ * :param: n_handles [int] Number of handles open at once.
+ * :returns: [size_t] Per-handle buffer size for FQ_WRITER_BUDGET, between FQ_WRITER_MIN_BUF and FQ_WRITER_MAX_BUF.
+ */
+static inline size_t fq_writer_buf_size(int n_handles)
+{
+    const size_t ret(FQ_WRITER_BUDGET / (n_handles > 0 ? n_handles: 1));
+    return ret < FQ_WRITER_MIN_BUF ? FQ_WRITER_MIN_BUF: ret > FQ_WRITER_MAX_BUF ? FQ_WRITER_MAX_BUF: ret;
+}
+
+} /* namespace bmf */
+
+#endif /* FQWRITER_H */
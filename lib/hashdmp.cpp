@@ -1,16 +1,20 @@
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cinttypes>
 #include <cstring>
+#include <getopt.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "src/bmf_collapse.h"
 #include "dlib/io_util.h"
+#include "lib/bcluster.h"
+#include "lib/binfq.h"
 #include "lib/mseq.h"
 
 
 namespace bmf {
-void hash_inmem_inline_core(char *in1, char *in2, char *out1, char *out2,
-                            char *homing, int blen, int threshold, int level=0, int mask=0,
-                            int max_blen=-1);
-
 
 void hashdmp_usage()
 {
@@ -23,28 +27,14 @@ void hashdmp_usage()
                     "Flags:\n"
                     "-s\tPerform secondary index consolidation rather than Loeb-like inline consolidation.\n"
                     "-o\tOutput filename.\n"
+                    "-x, --max-mem\tMemory budget for families (e.g., 4G). If exceeded, the input is re-split"
+                    " by barcode and collapsed in pieces. Default: unlimited.\n"
+                    "-k, --cluster\tMerge families whose barcodes differ by at most <INT> bases, by directional adjacency."
+                    " Merged families record their exact-match size in an OF tag. With -x, families are only merged"
+                    " within a piece. Default: 0 (exact matching only).\n"
+                    "-O, --barcode-order\tWrite families in barcode order rather than in order of first appearance.\n"
                     "If output file is unset, defaults to stdout. If input filename is not set, defaults to stdin.\n"
-            );
-}
-void inmem_usage()
-{
-    fprintf(stderr,
-                    "Molecularly demultiplexes marked temporary fastqs into final unique observation records.\n"
-                    "bmftools hashdmp does so in one large hashmap. This may require huge amounts of memory.\n"
-                    "For samples which can't fit into memory, use bmftools dmp or sdmp, which subsets the sample,"
-                    " reducing memory requirements while keeping the constant-time hashmap collapsing.\n"
-                    "Usage: bmftools inmem <opts> -1 <out.r1.fastq> -2 <out.r2.fastq> <r1.fastq> <r2.fastq>.\n"
-                    "Flags:\n"
-                    "-s:\tHoming sequence -- REQUIRED.\n"
-                    "-1:\tPath to output fastq for read 1. REQUIRED.\n"
-                    "-2:\tPath to output fastq for read 2. REQUIRED.\n"
-                    "-l:\tBarcode length. If using variable-length barcodes, this is the minimum barcode length.\n"
-                    "-t:\tHomopolymer failure threshold. A molecular barcode with"
-                    " a homopolymer of length >= this limit is flagged as QC fail. Default: 10.\n"
-                    "-v:\tMaximum barcode length. (Set only if using variable-length barcodes.)\n"
-                    "-m:\tSkip the first <INT> bases from each inline barcode. Default: 0\n"
-                    "-L:\tOutput fastq compression level (Default: plain text).\n"
-                    "If output file is unset, defaults to stdout. If input filename is not set, defaults to stdin.\n"
+                    "Input may be a marked temporary fastq or a binary temporary file (bmftools collapse -B).\n"
             );
 }
 
@@ -70,9 +60,21 @@ int hashcollapse_main(int argc, char *argv[])
     int c;
     int stranded_analysis(1);
     int level(-1);
-    while ((c = getopt(argc, argv, "l:o:sh?")) >= 0) {
+    size_t max_mem(0);
+    int cluster_dist(0);
+    int sorted(0);
+    static const struct option long_options[] {
+        {"max-mem", required_argument, nullptr, 'x'},
+        {"cluster", required_argument, nullptr, 'k'},
+        {"barcode-order", no_argument, nullptr, 'O'},
+        {nullptr, 0, nullptr, 0}
+    };
+    while ((c = getopt_long(argc, argv, "l:o:x:k:Osh?", long_options, nullptr)) >= 0) {
         switch(c) {
+            case 'O': sorted = 1; break;
+            case 'k': cluster_dist = parse_cluster_dist(optarg); break;
             case 'l': level = atoi(optarg)%10; break;
+            case 'x': max_mem = parse_mem_size(optarg); break;
             case 'o': outfname = optarg; break;
             case 's': stranded_analysis = 0; break;
             case '?': case 'h': hashdmp_usage(); return EXIT_SUCCESS;
@@ -85,59 +87,13 @@ int hashcollapse_main(int argc, char *argv[])
     }
     if(argc - 1 == optind) infname = argv[optind];
     else LOG_WARNING("Note: no input filename provided. Defaulting to stdin.\n");
-    stranded_analysis ? stranded_hash_dmp_core(infname, outfname, level)
-                      : hash_dmp_core(infname, outfname, level);
+    stranded_analysis ? stranded_hash_dmp_core(infname, outfname, level, max_mem, cluster_dist, 0, sorted)
+                      : hash_dmp_core(infname, outfname, level, max_mem, cluster_dist, 0, sorted);
     LOG_INFO("Successfully completed bmftools hashdmp!\n");
     return EXIT_SUCCESS;
 }
 
 
-int hashdmp_inmem_main(int argc, char *argv[])
-{
-    if(argc == 1) inmem_usage(), exit(EXIT_FAILURE);
-    char *outfname1(const_cast<char *>("-"));
-    char *outfname2(const_cast<char *>("-"));
-    char *homing(nullptr);
-    int c;
-    int blen(-1);
-    int max_blen(-1);
-    int mask(0);
-    int threshold(10);
-    int level(0); // uncompressed
-    while ((c = getopt(argc, argv, "1:2:v:l:L:l:m:s:t:h?")) >= 0) {
-        switch(c) {
-            case '1': outfname1 = optarg; break;
-            case '2': outfname2 = optarg; break;
-            case 'm': mask = atoi(optarg); break;
-            case 'v': max_blen = atoi(optarg); break;
-            case 'l': blen = atoi(optarg); break;
-            case 'L': level = atoi(optarg) % 10; break;
-            case 's': homing = optarg; break;
-            case 't': threshold = atoi(optarg); break;
-            case '?': case 'h': inmem_usage(); return EXIT_SUCCESS;
-        }
-    }
-    if(argc < 2) {
-        fprintf(stderr, "[E:%s] Required arguments missing. See usage.\n", __func__);
-        hashdmp_usage();
-        exit(EXIT_FAILURE);
-    }
-    if(argc - 2 != optind) {
-        if(argc - 1 != optind)
-            LOG_EXIT("Require at least one input fastq.\n");
-        LOG_EXIT("raise NotImplementedError(\"Single-end inmem not implemented.\")\n")
-    }
-    if(blen < 0) LOG_EXIT("Barcode length required.");
-    if(!homing) LOG_EXIT("Homing sequence required.\n");
-    if(strcmp(outfname1, outfname2) == 0) LOG_EXIT("read 1 and read 2 must be separate files. Abort!\n");
-
-    hash_inmem_inline_core(argv[optind], argv[optind + 1], outfname1, outfname2,
-                           homing, blen, threshold, level, mask,
-                           max_blen);
-    LOG_INFO("Successfully completed bmftools hashdmp!\n");
-    return EXIT_SUCCESS;
-}
-
 namespace {
     class hashtmp_t {
         kstring_t barcode;
@@ -147,488 +103,518 @@ namespace {
     };
 }
 
-inline int get_blen(char *seq, char *homing, int homing_len, int blen, int max_blen, int mask) {
-    for(int i(blen); i <= max_blen; ++i)
-        if(memcmp(seq + i, homing, homing_len) == 0)
-            return i - mask;
-    return -1;
+/*
+ * Hash of a record's barcode, excluding the strand character, for re-splitting a bin.
+ * Both strands of a barcode share a piece, and each depth of re-splitting partitions differently.
+ */
+static inline uint64_t spill_hash(const char *bs, int len, int depth)
+{
+    uint64_t h(0xcbf29ce484222325uLL ^ (0x9e3779b97f4a7c15uLL * (depth + 1)));
+    while(len--) h = (h ^ (uint8_t)*bs++) * 0x100000001b3uLL;
+    return h ^ (h >> 29);
 }
 
-void hash_inmem_inline_core(char *in1, char *in2, char *out1, char *out2,
-                            char *homing, int blen, int threshold, int level, int mask,
-                            int max_blen) {
-    if(max_blen < 0) max_blen = blen;
-    char mode[4];
-#if ZLIB_VER_MAJOR <= 1 && ZLIB_VER_MINOR <= 2 && ZLIB_VER_REVISION < 5
-#pragma message("Note: zlib version < 1.2.5 doesn't support transparent file writing. Writing uncompressed temporary gzip files by default.")
-// If not set, zlib compresses all our files enormously.
-sprintf(mode, level > 0 ? "wb%c": "wb0", level % 10 + '0');
-#else
-sprintf(mode, level > 0 ? "wb%c": "wT", level % 10 + '0');
-#endif
-    if(level > 0) {
-        if(strcmp(out1, "-") && strcmp(strrchr(out1, '\0') - 3, ".gz") != 0) {
-            LOG_WARNING("Output gzip compressed but filename not terminated with .gz. FYI\n");
-        } else if(strcmp(out2, "-") && strcmp(strrchr(out2, '\0') - 3, ".gz") != 0) {
-            LOG_WARNING("Output gzip compressed but filename not terminated with .gz. FYI\n");
-        }
-    } else {
-        if(strcmp(out1, "-") && strcmp(strrchr(out1, '\0') - 3, ".gz") == 0) {
-            LOG_WARNING("Output filename stats with .gz but output is not compressed. FYI\n");
-        } else if(strcmp(out2, "-") && strcmp(strrchr(out2, '\0') - 3, ".gz") == 0) {
-            LOG_WARNING("Output filename stats with .gz but output is not compressed. FYI\n");
-        }
+int SpillPlan::pieces(int is_read2, int estimate)
+{
+    std::unique_lock<std::mutex> lock(m_);
+    if(!is_read2) {
+        pieces_.push_back(estimate);
+        cv_.notify_all();
+        return estimate;
     }
-    FILE *in_handle1(dlib::open_ifp(in1));
-    FILE *in_handle2(dlib::open_ifp(in2));
-    gzFile out_handle1(dlib::open_gzfile(out1, mode));
-    gzFile out_handle2(dlib::open_gzfile(out2, mode));
-    const int homing_len(strlen(homing));
-    if(!in_handle1) {
-        if(dlib::isfile(in1)) {
-            LOG_DEBUG("%s a file, but it's empty....\n", in1);
-            gzclose(out_handle1);
-            return;
-        }
-        LOG_EXIT("Could not open %s for reading. Abort mission!\n", in1);
+    // Read 1 reaches the same re-split on its own thread, or has already finished.
+    cv_.wait(lock, [&]{return next_ < pieces_.size();});
+    return pieces_[next_++];
+}
+
+/*
+ * @func spill_collapse
+ * Re-splits a temporary file which is too large to collapse within max_mem and collapses each piece in turn.
+ * The input is re-read from the start and its records partitioned by barcode into uncompressed temporary
+ * files beside it, in the input's format, so every family (and both strands of a duplex) lands in a single piece.
+ * The number of pieces is extrapolated from how much of the input has been read, unless plan gives it.
+ * :param: rec [TmpFqReader &] Input.
+ * :param: infname [const char *] Input path, used to name the pieces.
+ * :param: bytes [size_t] Memory used by families when the budget was exceeded.
+ * :param: max_mem [size_t] Memory budget.
+ * :param: depth [int] Number of times this input's records have already been re-split.
+ * :param: keys [const std::vector<famsort_t> *] If not null, the sorted keys of the families seen so far.
+ *                                              Pieces then hold consecutive ranges of barcodes placed by these keys,
+ *                                              so that collapsing them in turn keeps the output in barcode order,
+ *                                              and barcodes differing only in their last bases share a piece.
+ *                                              Barcodes which cannot be packed go to the last piece.
+ * :param: cluster_dist [int] Barcode clustering distance, only to warn that clusters cannot span pieces.
+ * :param: plan [SpillPlan *] If not null, shares the number of pieces with the other read of the bin.
+ * :param: is_read2 [int] Whether the input is read 2, which takes its number of pieces from plan.
+ * :param: fn [Collapse] Called as fn(TmpFqReader &prec, const char *path) for each non-empty piece,
+ *                       with prec holding its first record.
+ */
+template<typename Collapse>
+static void spill_collapse(TmpFqReader &rec, const char *infname, size_t bytes, size_t max_mem, int depth,
+                           const std::vector<famsort_t> *keys, int cluster_dist, SpillPlan *plan, int is_read2,
+                           Collapse fn)
+{
+    struct stat st;
+    const size_t consumed(rec.offset());
+    // Extrapolate the bin's total footprint from how much of the input has been read.
+    const double total(stat(infname, &st) || !consumed ? 2. * bytes: (double)bytes * st.st_size / consumed);
+    int n(std::min(std::max((int)(2. * total / max_mem) + 1, 2), SPILL_MAX_PIECES));
+    if(plan) n = plan->pieces(is_read2, n);
+    LOG_INFO("Families from %s exceeded the memory budget of %lu bytes. Re-splitting into %i pieces.\n",
+             infname, max_mem, n);
+    if(cluster_dist && !depth)
+        LOG_WARNING("Barcodes in %s are clustered within each of its pieces, so families whose barcodes fall in "
+                    "different pieces are not merged as they would be without a memory budget.\n", infname);
+    std::vector<std::string> paths;
+    std::vector<TmpFqWriter *> pieces;
+    for(int i(0); i < n; ++i) {
+        paths.emplace_back(std::string(infname) + ".spill" + std::to_string(depth) + "." + std::to_string(i) + ".fastq");
+        pieces.push_back(new TmpFqWriter(paths.back().c_str(), "wT", fq_writer_buf_size(n)));
     }
-    if(!in_handle2) {
-         if(dlib::isfile(in2)) {
-             LOG_DEBUG("%s a file, but it's empty....\n", in2);
-             gzclose(out_handle2);
-             return;
-         }
-         LOG_EXIT("Could not open %s for reading. Abort mission!\n", in2);
-     }
-    gzFile fp1(gzdopen(fileno(in_handle1), "r"));
-    gzFile fp2(gzdopen(fileno(in_handle2), "r"));
-    kseq_t *seq1(kseq_init(fp1));
-    kseq_t *seq2(kseq_init(fp2));
-    kingfisher_hash_t *hash1f(nullptr), *hash2f(nullptr), *hash1r(nullptr), *hash2r(nullptr);
-    kingfisher_hash_t *ce1((kingfisher_hash_t *)malloc(sizeof(kingfisher_hash_t)));
-    kingfisher_hash_t *ce2((kingfisher_hash_t *)malloc(sizeof(kingfisher_hash_t)));
-    kingfisher_hash_t *tmp_hk1 = ce1, *tmp_hk2 = ce2; // Save the pointer location for later comparison.
-    kstring_t barcode{0, 32, (char *)malloc(32uL * sizeof(char))};
-    unsigned blen1, blen2;
-    unsigned offset1, offset2;
-    char pass;
-    size_t barcode_count{0};
-    while(LIKELY(kseq_read(seq1) >= 0 && kseq_read(seq2) >= 0)) {
-        pass = 1;
-        blen1 = get_blen(seq1->seq.s, homing, homing_len, blen, max_blen, mask);
-        blen2 = get_blen(seq2->seq.s, homing, homing_len, blen, max_blen, mask);
-        if(switch_test(seq1, seq2, mask)) {
-            if(blen2 != (unsigned)-1) std::memcpy(barcode.s, seq2->seq.s + mask, blen2);
-            else {
-                pass = 0;
-                blen2 = blen - mask;
-                memset(barcode.s, 'N', blen2);
-            }
-            barcode.l = blen2;
-            //barcode.s[barcode.l] = '\0';
-            if(blen1 != (unsigned)-1) {
-                while(blen1 + blen2 >= barcode.m) {
-                    kroundup32(barcode.m);
-                    barcode.s = (char *)realloc(barcode.s, barcode.m);
-                }
-                std::memcpy(barcode.s + barcode.l, seq1->seq.s + mask, blen2);
-            } else {
-                pass = 0;
-                blen1 = blen - mask;
-                memset(barcode.s + barcode.l, 'N', blen1);
-            }
-            barcode.l = barcode.l + blen1;
-            barcode.s[barcode.l] = '\0';
-            //LOG_DEBUG("Looking for barcode %s.\n", barcode.s);
-            HASH_FIND_STR(hash1r, barcode.s, tmp_hk1);
-            HASH_FIND_STR(hash2r, barcode.s, tmp_hk2);
-            pass &= test_hp(barcode.s, threshold);
-            assert(!tmp_hk1 == !tmp_hk2); // Make sure that both have the same keyset.
-            offset1 = blen1 + homing_len + mask;
-            offset2 = blen2 + homing_len + mask;
-            if(tmp_hk1) {
-                pushback_inmem(tmp_hk2->value, seq1, offset1, pass);
-                pushback_inmem(tmp_hk1->value, seq2, offset2, pass);
-            } else {
-                if(UNLIKELY(++barcode_count % 1000000 == 0))
-                    LOG_INFO("Number of unique barcodes loaded: %lu\n", barcode_count);
-                tmp_hk1 = (kingfisher_hash_t *)malloc(sizeof(kingfisher_hash_t));
-                tmp_hk2 = (kingfisher_hash_t *)malloc(sizeof(kingfisher_hash_t));
-                tmp_hk1->value = init_kfp(seq2->seq.l - offset2);
-                tmp_hk2->value = init_kfp(seq1->seq.l - offset1);
-                std::memcpy(tmp_hk1->id, barcode.s, barcode.l);
-                std::memcpy(tmp_hk2->id, barcode.s, barcode.l);
-                tmp_hk1->id[barcode.l] = '\0';
-                tmp_hk2->id[barcode.l] = '\0';
-                std::memcpy(tmp_hk1->value->barcode + 1, barcode.s, barcode.l);
-                tmp_hk1->value->barcode[0] = '@';
-                tmp_hk1->value->barcode[barcode.l + 1] = '\0';
-                std::memcpy(tmp_hk2->value->barcode + 1, barcode.s, barcode.l);
-                tmp_hk2->value->barcode[0] = '@';
-                tmp_hk2->value->barcode[barcode.l + 1] = '\0';
-                pushback_inmem(tmp_hk2->value, seq1, offset1, pass);
-                pushback_inmem(tmp_hk1->value, seq2, offset2, pass);
-                HASH_ADD_STR(hash1r, id, tmp_hk1);
-                HASH_ADD_STR(hash2r, id, tmp_hk2);
-            }
-        } else {
-            if(blen1 != (unsigned)-1) std::memcpy(barcode.s, seq1->seq.s + mask, blen1);
-            else { // Fail!
-                pass = 0;
-                blen1 = blen - mask;
-                memset(barcode.s, 'N', blen1);
-            }
-            barcode.l = blen1;
-            barcode.s[barcode.l] = '\0';
-            if(blen2 != (unsigned)-1) {
-                while(blen1 + blen2 >= barcode.m) {
-                    kroundup32(barcode.m);
-                    barcode.s = (char *)realloc(barcode.s, barcode.m);
-                }
-                std::memcpy(barcode.s + barcode.l, seq2->seq.s + mask, blen2);
-            } else {
-                pass = 0;
-                blen2 = blen - mask;
-                memset(barcode.s + barcode.l, 'N', blen2);
-            }
-            barcode.l = barcode.l + blen2;
-            barcode.s[barcode.l] = '\0';
-            pass &= test_hp(barcode.s, threshold);
-            offset1 = blen1 + homing_len + mask;
-            offset2 = blen2 + homing_len + mask;
-            HASH_FIND_STR(hash1f, barcode.s, tmp_hk1);
-            if(tmp_hk1) {
-                HASH_FIND_STR(hash2f, barcode.s, tmp_hk2);
-                pushback_inmem(tmp_hk1->value, seq1, offset1, pass);
-                pushback_inmem(tmp_hk2->value, seq2, offset2, pass);
-            } else {
-                if(UNLIKELY(++barcode_count % 1000000 == 0))
-                    LOG_INFO("Number of unique barcodes loaded: %lu\n", barcode_count);
-                // Create
-                tmp_hk1 = (kingfisher_hash_t *)malloc(sizeof(kingfisher_hash_t));
-                tmp_hk2 = (kingfisher_hash_t *)malloc(sizeof(kingfisher_hash_t));
-                tmp_hk1->value = init_kfp(seq1->seq.l - offset1);
-                tmp_hk2->value = init_kfp(seq2->seq.l - offset2);
-                std::memcpy(tmp_hk1->id, barcode.s, barcode.l);
-                std::memcpy(tmp_hk2->id, barcode.s, barcode.l);
-                tmp_hk1->id[barcode.l] = '\0';
-                tmp_hk2->id[barcode.l] = '\0';
-                std::memcpy(tmp_hk1->value->barcode + 1, barcode.s, barcode.l);
-                tmp_hk1->value->barcode[barcode.l + 1] = '\0';
-                tmp_hk1->value->barcode[0] = '@';
-                std::memcpy(tmp_hk2->value->barcode + 1, barcode.s, barcode.l);
-                tmp_hk2->value->barcode[barcode.l + 1] = '\0';
-                tmp_hk2->value->barcode[0] = '@';
-                HASH_ADD_STR(hash1f, id, tmp_hk1);
-                HASH_ADD_STR(hash2f, id, tmp_hk2);
-                pushback_inmem(tmp_hk1->value, seq1, offset1, pass);
-                pushback_inmem(tmp_hk2->value, seq2, offset2, pass);
-            }
-        }
+    std::vector<famsort_t> splitters;
+    if(keys) for(int i(1); i < n; ++i) splitters.push_back((*keys)[keys->size() * i / n]);
+    if(rec.rewind()) LOG_EXIT("Could not rewind %s to re-split it. Abort!\n", infname);
+    for(auto piece: pieces) rec.start(piece);
+    uint64_t key[2];
+    while(rec.next()) {
+        int i;
+        if(!keys) i = spill_hash(rec.bs + 1, rec.blen - 1, depth) % n;
+        else if(pack_barcode(rec.bs + 1, rec.blen - 1, key)) i = n - 1;
+        else i = std::upper_bound(splitters.begin(), splitters.end(), famsort_key(key, rec.blen - 1, 0),
+                                  famsort_less) - splitters.begin();
+        rec.copy(pieces[i]);
     }
-    free(barcode.s);
-    fclose(in_handle1), in_handle1 = nullptr;
-    fclose(in_handle2), in_handle1 = nullptr;
-    gzclose(fp1), fp1 = nullptr;
-    gzclose(fp2), fp2 = nullptr;
-    kseq_destroy(seq1), seq1 = nullptr;
-    kseq_destroy(seq2), seq2 = nullptr;
-    LOG_DEBUG("Loaded all records into memory.\n");
-
-    kstring_t ks1{0, 0, nullptr};
-    kstring_t ks2{0, 0, nullptr};
-    tmpbuffers_t tmp;
-    kingfisher_hash_t *t2(nullptr);
-    HASH_ITER(hh, hash1f, ce1, tmp_hk1) {
-        HASH_FIND_STR(hash1r, ce1->id, t2);
-        HASH_FIND_STR(hash2f, ce1->id, ce2);
-        if(t2) {
-            assert(ce2);
-            HASH_FIND_STR(hash2r, ce1->id, tmp_hk2);
-            assert(tmp_hk2);
-            zstranded_process_write(ce1->value, t2->value, &ks1, &tmp);
-            destroy_kf(t2->value);
-            HASH_DEL(hash1r, t2);
-            zstranded_process_write(ce2->value, tmp_hk2->value, &ks2, &tmp);
-            destroy_kf(tmp_hk2->value);
-            HASH_DEL(hash2r, tmp_hk2);
-        } else {
-            dmp_process_write(ce1->value, &ks1, &tmp, 0);
-            dmp_process_write(ce2->value, &ks2, &tmp, 0);
+    for(auto piece: pieces) delete piece;
+    for(const auto &path: paths) {
+        {
+            TmpFqReader prec(path.c_str());
+            if(prec.next()) fn(prec, path.c_str());
         }
-        destroy_kf(ce1->value);
-        HASH_DEL(hash1f, ce1);
-        destroy_kf(ce2->value);
-        HASH_DEL(hash2f, ce2);
-        gzputs(out_handle1, const_cast<const char *>(ks1.s));
-        ks1.l = 0;
-        gzputs(out_handle2, const_cast<const char *>(ks2.s));
-        ks2.l = 0;
-    }
-    HASH_ITER(hh, hash1r, ce1, tmp_hk1) {
-        HASH_FIND_STR(hash2r, ce1->id, ce2);
-        dmp_process_write(ce1->value, &ks1, &tmp, 1);
-        HASH_DEL(hash1r, ce1);
-        gzputs(out_handle1, const_cast<const char *>(ks1.s));
-        ks1.l = 0;
-        destroy_kf(ce1->value);
-        dmp_process_write(ce2->value, &ks2, &tmp, 1);
-        gzputs(out_handle2, const_cast<const char *>(ks2.s));
-        ks2.l = 0;
-        destroy_kf(ce2->value);
-        HASH_DEL(hash2r, ce2);
+        unlink(path.c_str());
     }
-    gzclose(out_handle1);
-    gzclose(out_handle2);
-    free(ks1.s);
-    free(ks2.s);
 }
 
-void hash_dmp_core(char *infname, char *outfname, int level)
+/*
+ * @func can_spill
+ * :returns: [int] Whether the records for infname can be re-split at this depth.
+ * Streams cannot be re-read, and families too large to split further are collapsed in memory.
+ */
+static int can_spill(const char *infname, int depth)
 {
-    char mode[4];
-#if ZLIB_VER_MAJOR <= 1 && ZLIB_VER_MINOR <= 2 && ZLIB_VER_REVISION < 5
-#pragma message("Note: zlib version < 1.2.5 doesn't support transparent file writing. Writing uncompressed temporary gzip files by default.")
-// If not set, zlib compresses all our files enormously.
-    sprintf(mode, level > 0 ? "wb%i": "wb0", level % 10);
-#else
-    sprintf(mode, level > 0 ? "wb%i": "wT", level % 10);
-#endif
-    LOG_DEBUG("zlib write mode: %s.\n", mode);
-    FILE *in_handle(dlib::open_ifp(infname));
-    gzFile out_handle(gzopen(outfname, mode));
-    if(!in_handle) {
-        if(dlib::isfile(infname)) {
-            LOG_DEBUG("It's a file, but it's empty....\n");
-            gzclose(out_handle);
-            return;
-        }
-        LOG_EXIT("Could not open %s for reading. Abort mission!\n", infname);
+    if(!infname || !*infname || strcmp(infname, "-") == 0) {
+        LOG_WARNING("Input is a stream, which cannot be re-split. Ignoring the memory budget.\n");
+        return 0;
     }
-    gzFile fp(gzdopen(fileno(in_handle), "r"));
-    kseq_t *seq(kseq_init(fp));
-    // Initialized kseq
-    int l(kseq_read(seq));
-    if(l < 0) {
-        gzclose(fp);
-        fclose(in_handle);
-        gzclose(out_handle);
-        kseq_destroy(seq);
-        return;
+    if(depth >= SPILL_MAX_DEPTH) {
+        LOG_WARNING("%s still exceeds the memory budget after %i re-splits. Collapsing it in memory.\n", infname, depth);
+        return 0;
     }
-    char *bs_ptr(barcode_mem_view(seq));
-    const int blen(infer_barcode_length(bs_ptr));
-    LOG_DEBUG("Barcode length (inferred): %i.\n", blen);
-    tmpvars_t *tmp(init_tmpvars_p(bs_ptr, blen, seq->seq.l));
-    std::memcpy(tmp->key, bs_ptr, blen);
-    tmp->key[blen] = '\0';
-    // Start hash table
-    kingfisher_hash_t *hash(nullptr);
-    kingfisher_hash_t *current_entry((kingfisher_hash_t *)malloc(sizeof(kingfisher_hash_t)));
-    kingfisher_hash_t *tmp_hk(current_entry); // Save the pointer location for later comparison.
-    cp_view2buf(bs_ptr + 1, current_entry->id);
-    current_entry->value = init_kfp(tmp->readlen);
-    HASH_ADD_STR(hash, id, current_entry);
-    pushback_kseq(current_entry->value, seq, blen);
+    return 1;
+}
 
+/*
+ * @func family_barcode
+ * :returns: [const char *] A family's barcode, without the strand character, for clustering,
+ *                          or null if the barcode failed QC and should be left alone.
+ */
+static inline const char *family_barcode(const kingfisher_t *kfp)
+{
+    return kfp->pass_fail == '1' ? kfp->barcode + 1: nullptr;
+}
+
+/*
+ * Collapses the records in rec, starting with the one it holds, into out_handle.
+ * :param: cluster_dist [int] If nonzero, families whose barcodes are within this Hamming distance
+ *                            are merged before writing (see lib/bcluster.h).
+ * :param: ubam [int] If set, write unaligned BAM records instead of fastq (see lib/ubam.h).
+ * :param: sorted [int] If set, write families in barcode order.
+ * :param: plan [SpillPlan *] If not null, re-splitting decisions shared with the other read of the bin.
+ * :param: is_read2 [int] Whether the input is read 2 of the bin.
+ */
+static void dmp_collapse(TmpFqReader &rec, const char *infname, gzFile out_handle, size_t max_mem, int cluster_dist,
+                         int ubam, int sorted, SpillPlan *plan, int is_read2, int depth)
+{
+    tmpvars_t *tmp(init_tmpvars_p(const_cast<char *>(rec.bs), rec.blen, rec.l));
+    const size_t fam_bytes(kf_arena_bytes(plan ? plan->readlen: tmp->readlen));
+    // Start hash table
+    FamTable<kingfisher_t *> hash;
+    KFArena arena;
+    int is_new, spill(max_mem != 0);
+    uint32_t idx;
     uint64_t count(0);
     // Add barcodes to the hash table
-    while(LIKELY((l = kseq_read(seq)) >= 0)) {
+    do {
         if(UNLIKELY(++count % 1000000 == 0))
             fprintf(stderr, "[%s::%s] Number of records read: %" PRIu64 ".\n", __func__,
-                    strcmp("-", infname) == 0 ? "stdin": infname,count);
-        cp_view2buf(seq->comment.s + HASH_DMP_OFFSET + 1, tmp->key);
-        HASH_FIND_STR(hash, tmp->key, tmp_hk);
-        if(tmp_hk) pushback_kseq(tmp_hk->value, seq, blen);
-        else {
-            tmp_hk = (kingfisher_hash_t *)malloc(sizeof(kingfisher_hash_t));
-            tmp_hk->value = init_kfp(tmp->readlen);
-            cp_view2buf(seq->comment.s + HASH_DMP_OFFSET + 1, tmp_hk->id);
-            pushback_kseq(tmp_hk->value, seq, blen);
-            HASH_ADD_STR(hash, id, tmp_hk);
+                    ifn_stream(infname), count);
+        idx = rec.lookup(hash, &is_new);
+        if(is_new) {
+            hash[idx] = arena.alloc(tmp->readlen);
+            // Count families rather than arena blocks, so that the budget is not tripped by the first block.
+            if(UNLIKELY(spill && hash.size() * fam_bytes + hash.bytes() > max_mem) && (spill = can_spill(infname, depth))) {
+                const size_t bytes(hash.size() * fam_bytes + hash.bytes());
+                // Clustering splits by barcode range as well, to keep near barcodes in the same piece.
+                const int by_range(sorted || cluster_dist);
+                const std::vector<famsort_t> keys(by_range ? hash.sorted_keys(): std::vector<famsort_t>());
+                arena.release(), hash.clear();
+                tmpvars_destroy(tmp);
+                spill_collapse(rec, infname, bytes, max_mem, depth, by_range ? &keys: nullptr, cluster_dist, plan, is_read2,
+                               [&](TmpFqReader &prec, const char *path) {
+                    dmp_collapse(prec, path, out_handle, max_mem, cluster_dist, ubam, sorted, plan, is_read2, depth + 1);
+                });
+                return;
+            }
         }
+        pushback_rec(hash[idx], rec.bs, rec.blen, rec.pass_fail, rec.seq, rec.qual, rec.l);
+    } while(LIKELY(rec.next()));
+    LOG_DEBUG("Loaded all records into memory. Writing out!\n");
+    if(cluster_dist) {
+        std::vector<const char *> barcodes(hash.size());
+        std::vector<uint32_t> counts(hash.size());
+        for(size_t i(0); i < hash.size(); ++i)
+            barcodes[i] = family_barcode(hash[i]), counts[i] = hash[i]->length;
+        const std::vector<uint32_t> parent(cluster_barcodes(barcodes, counts, cluster_dist));
+        for(size_t i(0); i < hash.size(); ++i)
+            if(parent[i] != i) kf_absorb(hash[parent[i]], hash[i]), hash[i] = nullptr;
     }
-    LOG_DEBUG("Loaded all records into memory. Writing out to %s!\n", ifn_stream(outfname));
     count = 0;
     kstring_t ks{0, 0, nullptr};
-    HASH_ITER(hh, hash, current_entry, tmp_hk) {
+    std::vector<uint32_t> order;
+    if(sorted) order = hash.barcode_order();
+    for(size_t j(0); j < hash.size(); ++j) {
+        const uint32_t i(sorted ? order[j]: j);
+        if(!hash[i]) continue; // Merged into another family.
         ++count;
-        dmp_process_write(current_entry->value, &ks, tmp->buffers, -1);
-        gzputs(out_handle, (const char *)ks.s);
+        if(ubam) dmp_process_bam(hash[i], &ks, tmp->buffers, -1);
+        else dmp_process_write(hash[i], &ks, tmp->buffers, -1);
+        gzwrite(out_handle, ks.s, ks.l);
         ks.l = 0;
-        destroy_kf(current_entry->value);
-        HASH_DEL(hash, current_entry);
-        free(current_entry);
     }
+    LOG_DEBUG("Peak family arena usage for %s: %lu bytes.\n", ifn_stream(infname), arena.peak());
+    arena.release();
     // Demultiplex and write out.
 #if !NDEBUG
     fprintf(stderr, "[D:%s::%s] Total number of collapsed observations: %" PRIu64 ".\n", __func__, ifn_stream(infname), count);
 #endif
     free(ks.s);
-    gzclose(fp);
-    gzclose(out_handle);
-    kseq_destroy(seq);
     tmpvars_destroy(tmp);
 }
-#if !NDEBUG
-KHASH_MAP_INIT_INT(hd, uint64_t)
-#endif
 
-void stranded_hash_dmp_core(char *infname, char *outfname, int level)
+void hash_dmp_core(char *infname, char *outfname, int level, size_t max_mem, int cluster_dist, int ubam, int sorted,
+                   SpillPlan *plan, int is_read2)
 {
-#if !NDEBUG
-    khash_t(hd) *hds = kh_init(hd);
+    char mode[4];
+#if ZLIB_VER_MAJOR <= 1 && ZLIB_VER_MINOR <= 2 && ZLIB_VER_REVISION < 5
+#pragma message("Note: zlib version < 1.2.5 doesn't support transparent file writing. Writing uncompressed temporary gzip files by default.")
+// If not set, zlib compresses all our files enormously.
+    sprintf(mode, level > 0 ? "wb%i": "wb0", level % 10);
+#else
+    sprintf(mode, level > 0 ? "wb%i": "wT", level % 10);
 #endif
-    char mode[4] = "wT"; // Defaults to uncompressed "transparent" gzip output.
-    if(level > 0) sprintf(mode, "wb%i", level % 10);
-    LOG_DEBUG("Writing stranded hash dmp information with mode: '%s'.\n", mode);
+    LOG_DEBUG("zlib write mode: %s.\n", mode);
     gzFile out_handle(gzopen(outfname, mode));
-    gzFile fp(gzopen((infname && *infname) ? infname: "-", "r"));
-    if(!fp) {
-        LOG_EXIT("Could not open %s for reading. Abort mission!\n", infname);
-    }
-    if(!out_handle) {
-        LOG_EXIT("Could not open %s for reading. Abort mission!\n", outfname);
+    if(!out_handle) LOG_EXIT("Could not open %s for writing. Abort mission!\n", outfname);
+    {
+        TmpFqReader rec(infname);
+        if(rec.next())
+            dmp_collapse(rec, infname ? infname: "-", out_handle, max_mem, cluster_dist, ubam, sorted, plan, is_read2, 0);
     }
-    kseq_t *seq(kseq_init(fp));
-    // Initialized kseq
-    int l(kseq_read(seq));
-    if(l < 0) {
-        gzclose(out_handle);
-        gzclose(fp);
-        kseq_destroy(seq);
-        return;
-    }
-    char *bs_ptr = barcode_mem_view(seq);
-    int blen = infer_barcode_length(bs_ptr);
-    LOG_DEBUG("Barcode length (inferred): %i. First barcode: %s.\n", blen, bs_ptr);
-    tmpvars_t *tmp = init_tmpvars_p(bs_ptr, blen, seq->seq.l);
-    std::memcpy(tmp->key, bs_ptr, blen);
-    tmp->key[blen] = '\0';
-    // Start hash table
-    kingfisher_hash_t *hfor(nullptr), *hrev(nullptr); // Hash forward, hash reverse
-    kingfisher_hash_t *crev((kingfisher_hash_t *)malloc(sizeof(kingfisher_hash_t))); // Current reverse, current forward
-    kingfisher_hash_t *cfor((kingfisher_hash_t *)malloc(sizeof(kingfisher_hash_t)));
-    kingfisher_hash_t *tmp_hkr(crev), *tmp_hkf(cfor);
-    uint64_t count(1), fcount(0);
-    /* Handle first record.
-     * We read in a record from the fastq to get the length of the reads
-     * and the barcodes.
-    */
-    if(*bs_ptr == 'F') {
-        ++fcount;
-        cp_view2buf(bs_ptr + 1, cfor->id);
-        cfor->value = init_kfp(tmp->readlen);
-        HASH_ADD_STR(hfor, id, cfor);
-        pushback_kseq(cfor->value, seq, blen);
-    } else {
-        cp_view2buf(bs_ptr + 1, crev->id);
-        crev->value = init_kfp(tmp->readlen);
-        HASH_ADD_STR(hrev, id, crev);
-        pushback_kseq(hrev->value, seq, blen);
-    }
-
-    // Add reads to the hash
-    while(LIKELY((l = kseq_read(seq)) >= 0)) {
+    gzclose(out_handle);
+}
 #if !NDEBUG
-        if(UNLIKELY(++count % 1000000 == 0))
-            fprintf(stderr, "[%s::%s] Number of records processed: %" PRIu64 ".\n", __func__,
-                    *infname == '-' ? "stdin" : infname, count);
-#else
-        ++count;
+KHASH_MAP_INIT_INT(hd, uint64_t)
 #endif
-        if(seq->comment.s[HASH_DMP_OFFSET] == 'F') {
-            ++fcount;
-            cp_view2buf(seq->comment.s + HASH_DMP_OFFSET + 1, tmp->key);
-            HASH_FIND_STR(hfor, tmp->key, tmp_hkf);
-            if(tmp_hkf) pushback_kseq(tmp_hkf->value, seq, blen);
-            else {
-                tmp_hkf = (kingfisher_hash_t *)malloc(sizeof(kingfisher_hash_t));
-                tmp_hkf->value = init_kfp(tmp->readlen);
-                cp_view2buf(seq->comment.s + HASH_DMP_OFFSET + 1, tmp_hkf->id);
-                pushback_kseq(tmp_hkf->value, seq, blen);
-                HASH_ADD_STR(hfor, id, tmp_hkf);
-            }
+
+static std::atomic<size_t> max_arena_peak(0);
+
+size_t kf_arena_peak()
+{
+    return max_arena_peak.load();
+}
+
+kingfisher_t *KFArena::alloc(size_t readlen)
+{
+    const size_t r5(readlen * 5), need(kf_arena_bytes(readlen));
+    char *p;
+    if(need > left_) {
+        if(UNLIKELY(need > KF_ARENA_BLOCK_SIZE)) {
+            // Oversized family: give it its own block and keep filling the current one.
+            if((p = (char *)malloc(need)) == nullptr) LOG_EXIT("Could not allocate %lu bytes for family. Abort!\n", need);
+            blocks_.push_back(p);
+            bytes_ += need;
         } else {
-            cp_view2buf(seq->comment.s + HASH_DMP_OFFSET + 1, tmp->key);
-            HASH_FIND_STR(hrev, tmp->key, tmp_hkr);
-            if(tmp_hkr) pushback_kseq(tmp_hkr->value, seq, blen);
-            else {
-                tmp_hkr = (kingfisher_hash_t *)malloc(sizeof(kingfisher_hash_t));
-                tmp_hkr->value = init_kfp(tmp->readlen);
-                cp_view2buf(seq->comment.s + HASH_DMP_OFFSET + 1, tmp_hkr->id);
-                pushback_kseq(tmp_hkr->value, seq, blen);
-                HASH_ADD_STR(hrev, id, tmp_hkr);
-            }
+            if((cur_ = (char *)malloc(KF_ARENA_BLOCK_SIZE)) == nullptr) LOG_EXIT("Could not allocate family arena block. Abort!\n");
+            blocks_.push_back(cur_);
+            bytes_ += KF_ARENA_BLOCK_SIZE;
+            left_ = KF_ARENA_BLOCK_SIZE - need;
+            p = cur_, cur_ += need;
         }
+        if(bytes_ > peak_) peak_ = bytes_;
+    } else p = cur_, cur_ += need, left_ -= need;
+    kingfisher_t *ret((kingfisher_t *)p);
+    std::memset(ret, 0, sizeof(kingfisher_t));
+    ret->phred_sums = (uint32_t *)(p + sizeof(kingfisher_t));
+    ret->nuc_counts = (uint16_t *)(ret->phred_sums + r5);
+    ret->max_phreds = (char *)(ret->nuc_counts + r5);
+    std::memset(ret->phred_sums, 0, r5 * (sizeof(uint32_t) + sizeof(uint16_t)));
+    std::memset(ret->max_phreds, '#', r5);
+    ret->readlen = readlen;
+    ret->pass_fail = '1';
+    return ret;
+}
+
+/*
+ * Frees every family allocated from the arena.
+ */
+void KFArena::release()
+{
+    for(char *block: blocks_) free(block);
+    blocks_.clear();
+    cur_ = nullptr;
+    left_ = bytes_ = 0;
+    size_t prev(max_arena_peak.load());
+    while(prev < peak_ && !max_arena_peak.compare_exchange_weak(prev, peak_));
+}
+
+stranded_hash_t::~stranded_hash_t()
+{
+    free(bufs);
+}
+
+/*
+ * :param: bs [const char *] Barcode sequence, starting with the strand character (F/R).
+ * :param: blen [int] Length of bs, including the strand character.
+ * :param: pass_fail [char] '1' for pass, '0' for fail.
+ * :param: seq [const char *] Read sequence.
+ * :param: qual [const char *] Read quality string.
+ * :param: l [unsigned] Read length.
+ */
+void stranded_hash_t::add(const char *bs, int blen, char pass_fail, const char *seq, const char *qual, unsigned l)
+{
+    int is_new;
+    push(table.get(bs + 1, blen - 1, &is_new), bs, blen, pass_fail, seq, qual, l);
+}
+
+void stranded_hash_t::add(TmpFqReader &rec)
+{
+    int is_new;
+    push(rec.lookup(table, &is_new), rec.bs, rec.blen, rec.pass_fail, rec.seq, rec.qual, rec.l);
+}
+
+/*
+ * Adds a record to the family for table entry idx on the record's strand.
+ */
+void stranded_hash_t::push(uint32_t idx, const char *bs, int blen, char pass_fail, const char *seq, const char *qual, unsigned l)
+{
+    if(UNLIKELY(readlen < 0)) {
+        readlen = l;
+        bufs->cons_seq_buffer[readlen] = '\0';
     }
+    ++count;
+    kingfisher_t *&kfp(*bs == 'F' ? table[idx].fwd: table[idx].rev);
+    if(!kfp) {
+        kfp = arena.alloc(readlen);
+        (*bs == 'F' ? fwd_order: rev_order).push_back(idx);
+        bytes += family_bytes(spill_readlen ? spill_readlen: readlen);
+    }
+    if(*bs == 'F') ++fcount;
+    pushback_rec(kfp, bs, blen, pass_fail, seq, qual, l);
+}
+
+/*
+ * Demultiplexes and empties the table, writing the collapsed records into ks.
+ * Families found on both strands are written in the forward pass with zstranded_process_write,
+ * followed by reverse-only families, each in the order they were first observed.
+ * If sorted is set, every barcode's families are instead written together, in barcode order.
+ * If ubam is set, families are written as unaligned BAM records instead (see lib/ubam.h).
+ * :param: ks [kstring_t *] Output buffer.
+ * :param: fp [gzFile] If set, ks is flushed to fp after each family and left empty.
+ *                     Otherwise, all output is accumulated in ks.
+ */
+void stranded_hash_t::write(kstring_t *ks, gzFile fp)
+{
 #if !NDEBUG
-    const uint64_t rcount(count - fcount);
-#endif
-    LOG_DEBUG("Number of reverse reads: %lu. Number of forward reads: %lu.\n", rcount, fcount);
-    LOG_DEBUG("Loaded all records into memory. Writing out to %s!\n", ifn_stream(outfname));
-    // Write out all unmatched in forward and handle all barcodes handled from both strands.
-    uint64_t duplex(0), non_duplex(0), non_duplex_fm(0);
-    kstring_t ks{0, 0, nullptr};
-    // Demultiplex and empty the hash.
-#if !NDEBUG
+    khash_t(hd) *hds = kh_init(hd);
     khiter_t ki;
     int hamming_distance, khr;
 #endif
-    HASH_ITER(hh, hfor, cfor, tmp_hkf) {
-        HASH_FIND_STR(hrev, cfor->id, crev);
-        if(crev) {
+    uint64_t duplex(0), non_duplex(0), non_duplex_fm(0);
+    LOG_DEBUG("Number of reverse reads: %lu. Number of forward reads: %lu.\n", count - fcount, fcount);
+    auto write_fam = [&](strand_fam_t &fam) {
+        if(fam.fwd && fam.rev) {
 #if !NDEBUG
-            hamming_distance = kf_hamming(cfor->value, crev->value);
+            kf_kernel().argmax(fam.fwd, bufs->argmax);
+            kf_kernel().argmax(fam.rev, bufs->argmax_r);
+            hamming_distance = kf_hamming(bufs->argmax, bufs->argmax_r, readlen);
             if((ki = kh_get(hd, hds, hamming_distance)) == kh_end(hds)) {
                 ki = kh_put(hd, hds, hamming_distance, &khr);
                 kh_val(hds, ki) = 1;
             } else ++kh_val(hds, ki);
 #endif
             ++duplex;
-            zstranded_process_write(cfor->value, crev->value, &ks, tmp->buffers); // Found from both strands!
-            destroy_kf(cfor->value); destroy_kf(crev->value);
-            HASH_DEL(hrev, crev); HASH_DEL(hfor, cfor);
-            if(crev) free(crev), crev = nullptr;
-            if(cfor) free(cfor), cfor = nullptr;
-
-        } else {
+            if(ubam) zstranded_process_bam(fam.fwd, fam.rev, ks, bufs);
+            else zstranded_process_write(fam.fwd, fam.rev, ks, bufs); // Found from both strands!
+        } else if(fam.fwd) {
             ++non_duplex;
-            if(cfor->value->length > 1) ++non_duplex_fm;
-            dmp_process_write(cfor->value, &ks, tmp->buffers, 0); // No reverse strand found. \='{
-            destroy_kf(cfor->value);
-            gzputs(out_handle, (const char *)ks.s);
-            ks.l = 0;
-            HASH_DEL(hfor, cfor);
-            free(cfor);
-        }
+            if(fam.fwd->length > 1) ++non_duplex_fm;
+            if(ubam) dmp_process_bam(fam.fwd, ks, bufs, 0);
+            else dmp_process_write(fam.fwd, ks, bufs, 0); // No reverse strand found. \='{
+        } else if(fam.rev) {
+            ++non_duplex;
+            if(fam.rev->length > 1) ++non_duplex_fm;
+            if(ubam) dmp_process_bam(fam.rev, ks, bufs, 1);
+            else dmp_process_write(fam.rev, ks, bufs, 1); // Only reverse strand found. \='{
+        } else return; // Already written as duplex, or merged into another family.
+        fam.fwd = fam.rev = nullptr;
+        if(fp && ks->l) gzwrite(fp, ks->s, ks->l), ks->l = 0;
+    };
+    if(sorted) {
+        for(const uint32_t idx: table.barcode_order()) write_fam(table[idx]);
+    } else {
+        // Write out all unmatched in forward and handle all barcodes handled from both strands.
+        for(const uint32_t idx: fwd_order) write_fam(table[idx]);
+        LOG_DEBUG("Before handling reverse only counts for non_duplex: %lu.\n", non_duplex);
+        for(const uint32_t idx: rev_order) write_fam(table[idx]);
     }
 #if !NDEBUG
     fprintf(stderr, "#HD\tCount\n");
-    for(khiter_t ki(kh_begin(hds)); ki != kh_end(hds); ++ki)
+    for(ki = kh_begin(hds); ki != kh_end(hds); ++ki)
         if(kh_exist(hds, ki))
             fprintf(stderr, "%i\t%" PRIu64 "\n", kh_key(hds, ki), kh_val(hds, ki));
     kh_destroy(hd, hds);
 #endif
-    LOG_DEBUG("Before handling reverse only counts for non_duplex: %lu.\n", non_duplex);
-    HASH_ITER(hh, hrev, crev, tmp_hkr) {
-        ++non_duplex;
-        if(crev->value->length > 1) ++non_duplex_fm;
-        dmp_process_write(crev->value, &ks, tmp->buffers, 1); // Only reverse strand found. \='{
-        destroy_kf(crev->value);
-        gzputs(out_handle, (const char *)ks.s);
-        ks.l = 0;
-        HASH_DEL(hrev, crev);
-        free(crev);
-    }
     LOG_DEBUG("Number of duplex observations: %lu.\t"
               "Number of non-duplex observations: %lu.\t"
               "Non-duplex families: %lu\n",
               duplex, non_duplex, non_duplex_fm);
+    LOG_DEBUG("Peak family arena usage: %lu bytes.\n", arena.peak());
+    clear();
+}
+
+/*
+ * @func absorb_strand
+ * Merges a clustered family's strand into its cluster's. If the cluster has not observed that strand,
+ * the family is moved over, taking the cluster's barcode.
+ * :param: dst [kingfisher_t *&] The cluster's family on this strand, or null.
+ * :param: src [kingfisher_t *&] The merged family on this strand, or null. Set to null.
+ * :param: barcode [const char *] The cluster's barcode, without the strand character.
+ */
+static void absorb_strand(kingfisher_t *&dst, kingfisher_t *&src, const char *barcode)
+{
+    if(!src) return;
+    if(dst) kf_absorb(dst, src);
+    else {
+        dst = src;
+        dst->merged = dst->length;
+        std::strcpy(dst->barcode + 1, barcode);
+    }
+    src = nullptr;
+}
+
+/*
+ * Merges families whose barcodes are within max_dist mismatches, as in dmp_collapse.
+ * Both strands of a barcode are clustered together by their total size, so duplexes stay intact,
+ * and the merged families are written where their cluster's first family would have been.
+ */
+void stranded_hash_t::cluster(int max_dist)
+{
+    const size_t n(table.size());
+    std::vector<const char *> barcodes(n);
+    std::vector<uint32_t> counts(n);
+    for(size_t i(0); i < n; ++i) {
+        const strand_fam_t &fam(table[i]);
+        barcodes[i] = family_barcode(fam.fwd ? fam.fwd: fam.rev);
+        counts[i] = (fam.fwd ? fam.fwd->length: 0) + (fam.rev ? fam.rev->length: 0);
+    }
+    const std::vector<uint32_t> parent(cluster_barcodes(barcodes, counts, max_dist));
+    size_t n_merged(0);
+    for(size_t i(0); i < n; ++i) {
+        if(parent[i] == i) continue;
+        strand_fam_t &fam(table[i]), &root(table[parent[i]]);
+        const char *barcode((root.fwd ? root.fwd: root.rev)->barcode + 1);
+        absorb_strand(root.fwd, fam.fwd, barcode);
+        absorb_strand(root.rev, fam.rev, barcode);
+        ++n_merged;
+    }
+    if(!n_merged) return;
+    LOG_DEBUG("Merged %lu of %lu barcodes into clusters.\n", n_merged, n);
+    std::vector<uint8_t> seen(n, 0);
+    for(std::vector<uint32_t> *order: {&fwd_order, &rev_order}) {
+        size_t j(0);
+        for(const uint32_t idx: *order)
+            if(!seen[parent[idx]]) seen[parent[idx]] = 1, (*order)[j++] = parent[idx];
+        order->resize(j);
+        std::fill(seen.begin(), seen.end(), 0);
+    }
+}
+
+/*
+ * Empties the table without writing anything.
+ */
+void stranded_hash_t::clear()
+{
+    arena.release();
+    table.clear();
+    std::vector<uint32_t>().swap(fwd_order);
+    std::vector<uint32_t>().swap(rev_order);
+    count = fcount = bytes = 0;
+}
+
+/*
+ * Collapses the records in rec, starting with the one it holds, into out_handle.
+ */
+static void stranded_collapse(TmpFqReader &rec, const char *infname, gzFile out_handle, size_t max_mem, int cluster_dist,
+                              int ubam, int sorted, SpillPlan *plan, int is_read2, int depth)
+{
+    LOG_DEBUG("First barcode: %s.\n", rec.bs);
+    stranded_hash_t hash;
+    hash.ubam = ubam;
+    hash.sorted = sorted;
+    if(plan) hash.spill_readlen = plan->readlen;
+    int spill(max_mem != 0);
+    // Add reads to the hash
+    do {
+#if !NDEBUG
+        if(UNLIKELY(hash.count % 1000000 == 999999))
+            fprintf(stderr, "[%s::%s] Number of records processed: %" PRIu64 ".\n", __func__,
+                    ifn_stream(infname), hash.count + 1);
+#endif
+        hash.add(rec);
+        if(UNLIKELY(spill && hash.bytes > max_mem) && (spill = can_spill(infname, depth))) {
+            const size_t bytes(hash.bytes);
+            const int by_range(sorted || cluster_dist);
+            const std::vector<famsort_t> keys(by_range ? hash.table.sorted_keys(): std::vector<famsort_t>());
+            hash.clear();
+            spill_collapse(rec, infname, bytes, max_mem, depth, by_range ? &keys: nullptr, cluster_dist, plan, is_read2,
+                           [&](TmpFqReader &prec, const char *path) {
+                stranded_collapse(prec, path, out_handle, max_mem, cluster_dist, ubam, sorted, plan, is_read2, depth + 1);
+            });
+            return;
+        }
+    } while(LIKELY(rec.next()));
+    LOG_DEBUG("Loaded all records into memory. Writing out!\n");
+    if(cluster_dist) hash.cluster(cluster_dist);
+    // Demultiplex and empty the hash.
+    kstring_t ks{0, 0, nullptr};
+    hash.write(&ks, out_handle);
     free(ks.s);
-    gzclose(fp); gzclose(out_handle);
-    kseq_destroy(seq);
-    tmpvars_destroy(tmp);
+}
+
+void stranded_hash_dmp_core(char *infname, char *outfname, int level, size_t max_mem, int cluster_dist, int ubam,
+                            int sorted, SpillPlan *plan, int is_read2)
+{
+    char mode[4] = "wT"; // Defaults to uncompressed "transparent" gzip output.
+    if(level > 0) sprintf(mode, "wb%i", level % 10);
+    LOG_DEBUG("Writing stranded hash dmp information with mode: '%s'.\n", mode);
+    gzFile out_handle(gzopen(outfname, mode));
+    if(!out_handle) {
+        LOG_EXIT("Could not open %s for writing. Abort mission!\n", outfname);
+    }
+    {
+        TmpFqReader rec(infname);
+        if(rec.next()) stranded_collapse(rec, infname, out_handle, max_mem, cluster_dist, ubam, sorted, plan, is_read2, 0);
+    }
+    gzclose(out_handle);
 }
 
 } /* namespace bmf */
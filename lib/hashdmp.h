@@ -1,10 +1,12 @@
 #ifndef BMF_HASHDMP_H
 #define BMF_HASHDMP_H
+#include <condition_variable>
+#include <mutex>
+#include <vector>
 #include "dlib/compiler_util.h"
+#include "lib/bcluster.h"
+#include "lib/famtable.h"
 #include "lib/kingfisher.h"
-extern "C" {
-    #include "include/uthash.h"
-}
 
 
 #ifndef ifn_stream
@@ -14,19 +16,63 @@ extern "C" {
 #undef MAX_BARCODE_LENGTH
 #endif
 #define MAX_BARCODE_LENGTH 128 // Maximum expected inline barcode
+#define SPILL_MAX_PIECES 256 // Most pieces a bin is re-split into at once when it exceeds the memory budget.
+#define SPILL_MAX_DEPTH 3 // Most times a bin's records are re-split before the budget is ignored.
 
 namespace bmf {
 
+class TmpFqReader;
+
+/*
+ * Re-splitting decisions shared by read 1 and read 2 of a bin under a memory budget.
+ * Both reads charge their families at the same read length, so they exceed the budget at the same records.
+ * Read 1 estimates how many pieces each re-split makes, and read 2 waits for and takes the same numbers in turn,
+ * so both are split into the same pieces and their families are written in the same order.
+ */
+class SpillPlan {
+    std::mutex m_;
+    std::condition_variable cv_;
+    std::vector<int> pieces_; // Read 1's piece counts, in the order of its re-splits.
+    size_t next_; // Index in pieces_ of read 2's next re-split.
+public:
+    const int readlen; // Read length at which both reads' families are charged against the budget.
+    explicit SpillPlan(int readlen): next_(0), readlen(readlen) {}
+    /*
+     * :param: estimate [int] Number of pieces estimated by read 1. Ignored for read 2.
+     * :returns: [int] Number of pieces for the next re-split of this read.
+     */
+    int pieces(int is_read2, int estimate);
+};
+
 //KHASH_MAP_INIT_STR(dmp, kingfisher_t *)
-void hash_dmp_core(char *infname, char *outfname, int level);
+/*
+ * Collapse a marked temporary fastq.
+ * :param: max_mem [size_t] If nonzero, a bin whose families exceed this many bytes is re-split by barcode
+ *                          and its pieces collapsed one after another.
+ * :param: cluster_dist [int] If nonzero, families whose barcodes differ by at most this many bases
+ *                            are merged by directional adjacency (see lib/bcluster.h).
+ * :param: ubam [int] If set, families are written as unaligned BAM records without a header,
+ *                    for UBamWriter to merge (see lib/ubam.h), instead of fastq.
+ * :param: sorted [int] If set, families are written in barcode order (see FamTable::barcode_order),
+ *                      rather than in the order in which they were first seen.
+ * :param: plan [SpillPlan *] If not null, shared with the collapse of the other read of the bin,
+ *                             so that both are re-split alike under max_mem (see SpillPlan).
+ * :param: is_read2 [int] Whether infname holds read 2 of the bin, which follows read 1's plan.
+ */
+void hash_dmp_core(char *infname, char *outfname, int level, size_t max_mem=0, int cluster_dist=0, int ubam=0,
+                   int sorted=0, SpillPlan *plan=nullptr, int is_read2=0);
 int hashcollapse_main(int argc, char *argv[]);
-void stranded_hash_dmp_core(char *infname, char *outfname, int level);
+void stranded_hash_dmp_core(char *infname, char *outfname, int level, size_t max_mem=0, int cluster_dist=0,
+                            int ubam=0, int sorted=0, SpillPlan *plan=nullptr, int is_read2=0);
 tmpvars_t *init_tmpvars_p(char *bs_ptr, int blen, int readlen);
 
-struct kingfisher_hash_t {
-    UT_hash_handle hh;
-    char id[MAX_BARCODE_LENGTH + 1];
-    kingfisher_t *value;
+/*
+ * Forward and reverse families sharing a barcode.
+ * Either may be null if that strand has not been observed.
+ */
+struct strand_fam_t {
+    kingfisher_t *fwd;
+    kingfisher_t *rev;
 };
 
 
@@ -51,29 +97,123 @@ static inline void cp_view2buf(char *view, char *buf)
     goto loop_start;
 }
 
-static inline kingfisher_t *init_kfp(size_t readlen)
+#define KF_ARENA_BLOCK_SIZE (1uL << 20)
+
+/*
+ * Bytes used by a family in a KFArena: the kingfisher_t followed by its
+ * phred_sums, nuc_counts and max_phreds arrays, each readlen * 5 long.
+ * Nucleotide lanes in each array are unpadded, so vector kernels use unaligned loads.
+ */
+CONST static inline size_t kf_arena_bytes(size_t readlen)
 {
-    const size_t r5(readlen * 5);
-    kingfisher_t *ret((kingfisher_t *)calloc(1, sizeof(kingfisher_t)));
-    ret->readlen = readlen;
-    ret->max_phreds = (char *)malloc((r5) * sizeof(char));
-    ret->nuc_counts = (uint16_t *)calloc(r5, sizeof(uint16_t));
-    ret->phred_sums = (uint32_t *)calloc(r5, sizeof(uint32_t));
-    memset(ret->max_phreds, '#', r5);
-    ret->pass_fail = '1';
-    return ret;
+    return (sizeof(kingfisher_t) + readlen * 5 * (sizeof(uint32_t) + sizeof(uint16_t) + sizeof(char)) + 7) & ~(size_t)7;
 }
 
-static inline void destroy_kf(kingfisher_t *kfp)
+/*
+ * Bump allocator for kingfisher_t accumulators.
+ * Each family is carved out of a large block in one piece instead of four mallocs.
+ * Families are never freed individually: the whole arena is released once its bin
+ * has been written out.
+ */
+class KFArena {
+    std::vector<char *> blocks_;
+    char *cur_;
+    size_t left_;
+    size_t bytes_; // Bytes held in blocks.
+    size_t peak_; // Maximum of bytes_ over the arena's lifetime.
+public:
+    KFArena(): cur_(nullptr), left_(0), bytes_(0), peak_(0) {}
+    ~KFArena() {release();}
+    KFArena(const KFArena &) = delete;
+    KFArena &operator=(const KFArena &) = delete;
+    kingfisher_t *alloc(size_t readlen);
+    void release();
+    size_t bytes() const {return bytes_;}
+    size_t peak() const {return peak_;}
+};
+
+/*
+ * @func kf_arena_peak
+ * :returns: [size_t] The largest peak of any KFArena released so far in this process.
+ * The peak of the largest bin is what determines the memory required for a collapse job.
+ */
+size_t kf_arena_peak();
+
+tmpvars_t *init_tmpvars_p(char *bs_ptr, int blen, int readlen);
+
+/*
+ * Approximate heap usage of a single family in a stranded_hash_t,
+ * counting two table slots per family for the table's load factor.
+ */
+CONST static inline size_t family_bytes(size_t readlen)
 {
-    free(kfp->nuc_counts);
-    free(kfp->phred_sums);
-    free(kfp->max_phreds);
-    free(kfp);
+    return 2 * sizeof(famkey_t) + sizeof(strand_fam_t) + sizeof(uint32_t) + kf_arena_bytes(readlen);
 }
 
-tmpvars_t *init_tmpvars_p(char *bs_ptr, int blen, int readlen);
+/*
+ * Forward and reverse families for one bin of a stranded collapse.
+ * Records are added one at a time, so a bin can be filled either from a marked
+ * temporary fastq (stranded_hash_dmp_core) or directly by the marking thread (see lib/streamdmp.h).
+ */
+struct stranded_hash_t {
+    FamTable<strand_fam_t> table; // Both strands of a barcode share an entry.
+    std::vector<uint32_t> fwd_order; // Entries in the order their forward families were created
+    std::vector<uint32_t> rev_order; // Entries in the order their reverse families were created
+    KFArena arena;
+    tmpbuffers_t *bufs;
+    int readlen; // Inferred from the first record added.
+    uint64_t count;
+    uint64_t fcount;
+    size_t bytes; // Approximate heap usage of the families currently held.
+    int ubam; // Write unaligned BAM records instead of fastq (see lib/ubam.h).
+    int sorted; // Write families in barcode order, both strands of a barcode together.
+    int spill_readlen; // If nonzero, the read length at which families are counted in bytes.
+    stranded_hash_t():
+        bufs((tmpbuffers_t *)malloc(sizeof(tmpbuffers_t))),
+        readlen(-1), count(0), fcount(0), bytes(0), ubam(0), sorted(0), spill_readlen(0) {}
+    ~stranded_hash_t();
+    void add(const char *bs, int blen, char pass_fail, const char *seq, const char *qual, unsigned l);
+    void add(TmpFqReader &rec);
+    void cluster(int max_dist);
+    void write(kstring_t *ks, gzFile fp=nullptr);
+    void clear();
+private:
+    void push(uint32_t idx, const char *bs, int blen, char pass_fail, const char *seq, const char *qual, unsigned l);
+};
+
 
+/*
+ * @func parse_mem_size
+ * Parses a memory size, such as "12G", with an optional K, M or G suffix (powers of 1024).
+ * :returns: [size_t] Size in bytes.
+ */
+static inline size_t parse_mem_size(const char *str)
+{
+    char *end;
+    double ret(strtod(str, &end));
+    switch(*end) {
+        case 'k': case 'K': ret *= 1uL << 10; break;
+        case 'm': case 'M': ret *= 1uL << 20; break;
+        case 'g': case 'G': ret *= 1uL << 30; break;
+        case '\0': break;
+        default: LOG_EXIT("Could not parse memory size '%s'. Abort!\n", str);
+    }
+    return (size_t)ret;
+}
+
+/*
+ * @func parse_cluster_dist
+ * Parses a barcode clustering distance, which must be between 0 and BC_CLUSTER_MAX_DIST.
+ */
+static inline int parse_cluster_dist(const char *str)
+{
+    char *end;
+    const long ret(strtol(str, &end, 10));
+    if(*end || ret < 0 || ret > BC_CLUSTER_MAX_DIST)
+        LOG_EXIT("Barcode clustering distance must be an integer between 0 and %i, not '%s'. Abort!\n",
+                 BC_CLUSTER_MAX_DIST, str);
+    return ret;
+}
 
 static inline void tmpvars_destroy(tmpvars_t *tmp)
 {
@@ -0,0 +1,426 @@
+#include "inmem.h"
+
+#include <algorithm>
+#include <cassert>
+#include <getopt.h>
+#include <memory>
+#include "src/bmf_collapse.h"
+#include "lib/streamdmp.h"
+
+namespace bmf {
+
+void inmem_usage()
+{
+    fprintf(stderr,
+                    "Molecularly demultiplexes inline-barcoded fastqs into final unique observation records"
+                    " in memory, without marking and splitting them into temporary files.\n"
+                    "Every family is held in memory at once, so this requires memory on the order of"
+                    " the number of unique barcodes times the read length times 30 bytes.\n"
+                    "If it fits, this is faster than bmftools collapse inline.\n"
+                    "Usage: bmftools inmem <opts> -1 <out.r1.fastq> -2 <out.r2.fastq> <r1.fastq> <r2.fastq>.\n"
+                    "Single-end: bmftools inmem <opts> -1 <out.fastq> <r1.fastq>.\n"
+                    "Flags:\n"
+                    "-s:\tHoming sequence -- REQUIRED.\n"
+                    "-1:\tPath to output fastq for read 1. Default: stdout.\n"
+                    "-2:\tPath to output fastq for read 2. REQUIRED for paired-end input.\n"
+                    "-l:\tBarcode length. If using variable-length barcodes, this is the minimum barcode length.\n"
+                    "-t:\tHomopolymer failure threshold. A molecular barcode with"
+                    " a homopolymer of length >= this limit is flagged as QC fail. Default: 10.\n"
+                    "-v:\tMaximum barcode length. (Set only if using variable-length barcodes.)\n"
+                    "-m:\tSkip the first <INT> bases from each inline barcode. Default: 0\n"
+                    "-L:\tOutput fastq compression level (Default: plain text).\n"
+                    "-p:\tNumber of threads. Default: %i.\n"
+                    "-O:\tWrite families in barcode order.\n"
+                    "Input may be gzipped. \"-\" reads read 1 from stdin.\n"
+            , DEFAULT_N_THREADS);
+}
+
+int hashdmp_inmem_main(int argc, char *argv[])
+{
+    if(argc == 1) inmem_usage(), exit(EXIT_FAILURE);
+    char *outfname1(const_cast<char *>("-"));
+    char *outfname2(const_cast<char *>("-"));
+    int c;
+    inmem_settings_t settings{nullptr, 0, -1, -1, 0, 10, 0, DEFAULT_N_THREADS, 0, 0};
+    while ((c = getopt(argc, argv, "1:2:v:l:L:m:p:s:t:Oh?")) >= 0) {
+        switch(c) {
+            case 'O': settings.sorted = 1; break;
+            case '1': outfname1 = optarg; break;
+            case '2': outfname2 = optarg; break;
+            case 'm': settings.mask = atoi(optarg); break;
+            case 'v': settings.max_blen = atoi(optarg); break;
+            case 'l': settings.blen = atoi(optarg); break;
+            case 'L': settings.level = atoi(optarg) % 10; break;
+            case 'p': settings.threads = atoi(optarg); break;
+            case 's': settings.homing = optarg; break;
+            case 't': settings.threshold = atoi(optarg); break;
+            case '?': case 'h': inmem_usage(); return EXIT_SUCCESS;
+        }
+    }
+    if(argc - 2 != optind) {
+        if(argc - 1 != optind)
+            LOG_EXIT("Require at least one input fastq.\n");
+        settings.is_se = 1;
+    }
+    if(settings.blen < 0) LOG_EXIT("Barcode length required.\n");
+    if(!settings.homing) LOG_EXIT("Homing sequence required.\n");
+    if(!settings.is_se && strcmp(outfname1, outfname2) == 0)
+        LOG_EXIT("read 1 and read 2 must be separate files. Abort!\n");
+    settings.homing_len = strlen(settings.homing);
+    if(settings.max_blen < 0) settings.max_blen = settings.blen;
+    if(settings.max_blen < settings.blen) LOG_EXIT("Maximum barcode length is less than the barcode length. Abort!\n");
+    if((settings.is_se ? 1: 2) * (settings.max_blen - settings.mask) >= MAX_BARCODE_LENGTH)
+        LOG_EXIT("Barcodes of up to %i bases exceed the maximum barcode length of %i. Abort!\n",
+                 (settings.is_se ? 1: 2) * (settings.max_blen - settings.mask), MAX_BARCODE_LENGTH - 1);
+
+    inmem_collapse(&settings, argv[optind], settings.is_se ? nullptr: argv[optind + 1], outfname1, outfname2);
+    LOG_INFO("Successfully completed bmftools inmem!\n");
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Mirrors switch_test: compares reads from mask to their ends.
+ * :returns: [int] 1 if r1's sequence sorts before r2's.
+ */
+static inline int view_switch_test(const fq_view_t *r1, const fq_view_t *r2, int mask)
+{
+    const int l1(std::max((int)r1->l - mask, 0)), l2(std::max((int)r2->l - mask, 0));
+    const int cmp(l1 && l2 ? memcmp(r1->seq + mask, r2->seq + mask, std::min(l1, l2)): 0);
+    return cmp ? cmp < 0: l1 < l2;
+}
+
+/*
+ * Finds a read's homing sequence at or after blen and appends the bases from mask up to it to the scan.
+ * :returns: [int] Offset of the homing sequence, or -1 if it is not in [blen, max_blen].
+ */
+int InmemCollapser::scan(const fq_view_t *rec)
+{
+    const inmem_settings_t *s(settings_);
+    return bc_scan_read(&bc_, rec->seq, rec->l, s->mask, s->max_blen, s->homing, s->homing_len, s->blen, s->max_blen);
+}
+
+/*
+ * Appends a read's barcode to ks: its bases from mask up to the homing sequence, or blen - mask Ns
+ * if it has no homing sequence.
+ */
+static inline void append_inmem_barcode(kstring_t *ks, const fq_view_t *rec, int found, int blen, int mask)
+{
+    const int l(found >= 0 ? found - mask: blen - mask);
+    ks_resize(ks, ks->l + l + 1);
+    if(found >= 0) std::memcpy(ks->s + ks->l, rec->seq + mask, l);
+    else memset(ks->s + ks->l, 'N', l);
+    ks->l += l;
+}
+
+/*
+ * Start of a read after its barcode and homing sequence.
+ */
+static inline int inmem_offset(const inmem_settings_t *s, int found, int l)
+{
+    return std::min((found >= 0 ? found: s->blen) + s->homing_len, l);
+}
+
+// FNV-1a, for barcodes which cannot be packed.
+static inline uint64_t hash_barcode(const char *bs, size_t l)
+{
+    uint64_t h(0xcbf29ce484222325uLL);
+    for(size_t i(0); i < l; ++i) h = (h ^ (uint8_t)bs[i]) * 0x100000001b3uLL;
+    return h;
+}
+
+InmemCollapser::InmemCollapser(const inmem_settings_t *settings):
+    settings_(settings),
+    n_workers_(std::max(settings->threads, 1)),
+    shards_(new inmem_shard_t[INMEM_SHARDS]),
+    workers_(new inmem_worker_t[n_workers_]),
+    queued_(0),
+    input_done_(0),
+    barcode_{0, 0, nullptr}
+{
+    for(int i(0); i < INMEM_SHARDS; ++i) {
+        inmem_shard_t &s(shards_[i]);
+        s.pending = s.out1 = s.out2 = kstring_t{0, 0, nullptr};
+        s.done = 0;
+    }
+    LOG_DEBUG("In-memory collapse with %i shards and %i workers.\n", INMEM_SHARDS, n_workers_);
+    for(int i(0); i < n_workers_; ++i) threads_.emplace_back(&InmemCollapser::work, this, i);
+}
+
+InmemCollapser::~InmemCollapser()
+{
+    if(!input_done_) {
+        input_done_ = 1;
+        for(int i(0); i < n_workers_; ++i) {
+            { std::lock_guard<std::mutex> lock(workers_[i].m); }
+            workers_[i].cv.notify_all();
+        }
+    }
+    for(auto &t: threads_) if(t.joinable()) t.join();
+    for(int i(0); i < INMEM_SHARDS; ++i) {
+        inmem_shard_t &s(shards_[i]);
+        free(s.pending.s), free(s.out1.s), free(s.out2.s);
+    }
+    free(barcode_.s);
+    delete[] shards_;
+    delete[] workers_;
+}
+
+void InmemCollapser::add(const fq_view_t *r1, const fq_view_t *r2)
+{
+    const inmem_settings_t *settings(settings_);
+    // One pass over each prefix finds the homing sequence and checks and packs the barcode before it.
+    const int switched(r2 && view_switch_test(r1, r2, settings->mask));
+    const fq_view_t *first(switched ? r2: r1), *second(switched ? r1: r2);
+    bc_scan_init(&bc_);
+    const int found_first(scan(first)), found_second(second ? scan(second): 0);
+    const int found1(switched ? found_second: found_first), found2(switched ? found_first: found_second);
+    const int all_found(found_first >= 0 && found_second >= 0);
+    inmem_rec_hdr_t hdr;
+    hdr.l1 = r1->l, hdr.l2 = r2 ? r2->l: 0;
+    hdr.offset1 = inmem_offset(settings, found1, r1->l);
+    hdr.offset2 = r2 ? inmem_offset(settings, found2, r2->l): 0;
+    hdr.switched = switched;
+    hdr.pass = all_found && bc_scan_pass(&bc_, settings->threshold);
+    // Barcodes with Ns or a missing homing sequence are looked up by sequence.
+    uint64_t h;
+    if((hdr.packed = all_found && bc_scan_packed(&bc_))) {
+        hdr.blen = bc_.len;
+        h = hash_famkey(bc_.key, bc_.len);
+    } else {
+        barcode_.l = 0;
+        append_inmem_barcode(&barcode_, first, found_first, settings->blen, settings->mask);
+        if(second) append_inmem_barcode(&barcode_, second, found_second, settings->blen, settings->mask);
+        hdr.blen = barcode_.l;
+        h = hash_barcode(barcode_.s, barcode_.l);
+    }
+    int shard;
+    if(settings->sorted) {
+        // By the barcode's first bases, so that shards hold consecutive ranges of barcodes.
+        shard = hdr.packed ? famsort_key(bc_.key, bc_.len, 0).hi >> (64 - INMEM_SHARD_BITS): INMEM_SHARDS - 1;
+    } else shard = h >> (64 - INMEM_SHARD_BITS); // The high bits, since each shard's table probes from the low bits.
+    inmem_shard_t &s(shards_[shard]);
+    if(UNLIKELY(s.pending.m == 0)) ks_resize(&s.pending, INMEM_CHUNK_SIZE + 1024);
+    ks_resize(&s.pending, s.pending.l + sizeof(hdr) + sizeof(bc_.key) + hdr.blen + 2 * (hdr.l1 + hdr.l2));
+    char *p(s.pending.s + s.pending.l);
+    std::memcpy(p, &hdr, sizeof(hdr)), p += sizeof(hdr);
+    if(hdr.packed) std::memcpy(p, bc_.key, sizeof(bc_.key)), p += sizeof(bc_.key);
+    else std::memcpy(p, barcode_.s, hdr.blen), p += hdr.blen;
+    std::memcpy(p, r1->seq, hdr.l1), p += hdr.l1;
+    std::memcpy(p, r1->qual, hdr.l1), p += hdr.l1;
+    if(r2) {
+        std::memcpy(p, r2->seq, hdr.l2), p += hdr.l2;
+        std::memcpy(p, r2->qual, hdr.l2), p += hdr.l2;
+    }
+    s.pending.l = p - s.pending.s;
+    if(s.pending.l >= INMEM_CHUNK_SIZE) enqueue(shard);
+}
+
+void InmemCollapser::enqueue(int shard)
+{
+    inmem_shard_t &s(shards_[shard]);
+    kstring_t data(s.pending);
+    s.pending = kstring_t{0, 0, nullptr};
+    if(queued_.load() + data.l > INMEM_MAX_QUEUED) {
+        // Let the workers catch up before reading further.
+        std::unique_lock<std::mutex> lock(queued_m_);
+        queued_cv_.wait(lock, [&]{return queued_.load() <= INMEM_MAX_QUEUED / 2;});
+    }
+    queued_ += data.l;
+    inmem_worker_t &w(workers_[shard % n_workers_]);
+    {
+        std::lock_guard<std::mutex> lock(w.m);
+        w.q.push_back(inmem_chunk_t{shard, data});
+    }
+    w.cv.notify_one();
+}
+
+static inline void set_inmem_barcode(kingfisher_t *kfp, const char *bs, int blen)
+{
+    kfp->barcode[0] = '@';
+    std::memcpy(kfp->barcode + 1, bs, blen);
+    kfp->barcode[blen + 1] = '\0';
+}
+
+void InmemCollapser::consume(int shard, const char *data, size_t l)
+{
+    inmem_shard_t &s(shards_[shard]);
+    const int is_se(settings_->is_se);
+    const char *const end(data + l);
+    inmem_rec_hdr_t hdr;
+    uint64_t key[2];
+    char buf[MAX_BARCODE_LENGTH];
+    const char *bs;
+    int is_new;
+    uint32_t idx;
+    while(data < end) {
+        std::memcpy(&hdr, data, sizeof(hdr)), data += sizeof(hdr);
+        if(hdr.packed) {
+            std::memcpy(key, data, sizeof(key)), data += sizeof(key);
+            idx = s.table.get_packed(key, hdr.blen, &is_new);
+            bs = nullptr;
+        } else {
+            bs = data, data += hdr.blen;
+            idx = s.table.get(bs, hdr.blen, &is_new);
+        }
+        const char *seq1(data), *qual1(seq1 + hdr.l1), *seq2(qual1 + hdr.l1), *qual2(seq2 + hdr.l2);
+        data = qual2 + hdr.l2;
+        inmem_fam_t &fam(s.table[idx]);
+        // Switched pairs are collapsed with read 2 in the read 1 family, so that they line up with
+        // the forward families for duplex consensus.
+        kingfisher_t *&fa(hdr.switched ? fam.r1.rev: fam.r1.fwd), *&fb(hdr.switched ? fam.r2.rev: fam.r2.fwd);
+        if(hdr.switched) {
+            std::swap(seq1, seq2), std::swap(qual1, qual2);
+            std::swap(hdr.l1, hdr.l2), std::swap(hdr.offset1, hdr.offset2);
+        }
+        assert(is_se || !fa == !fb); // Make sure that both have the same keyset.
+        if(!fa) {
+            // Packed barcodes only need their sequence written out when they start a family.
+            if(!bs) unpack_barcode(key, hdr.blen, buf), bs = buf;
+            fa = s.arena.alloc(hdr.l1 - hdr.offset1);
+            set_inmem_barcode(fa, bs, hdr.blen);
+            if(!is_se) {
+                fb = s.arena.alloc(hdr.l2 - hdr.offset2);
+                set_inmem_barcode(fb, bs, hdr.blen);
+            }
+            (hdr.switched ? s.rev_order: s.fwd_order).push_back(idx);
+        }
+        pushback_inmem(fa, seq1, qual1, hdr.l1, hdr.offset1, hdr.pass);
+        if(!is_se) pushback_inmem(fb, seq2, qual2, hdr.l2, hdr.offset2, hdr.pass);
+    }
+}
+
+void InmemCollapser::finish_shard(int shard)
+{
+    inmem_shard_t &s(shards_[shard]);
+    const int is_se(settings_->is_se);
+    tmpbuffers_t tmp;
+    if(settings_->sorted) {
+        for(const uint32_t i: s.table.barcode_order()) {
+            inmem_fam_t &fam(s.table[i]);
+            if(fam.r1.fwd && fam.r1.rev) {
+                zstranded_process_write(fam.r1.fwd, fam.r1.rev, &s.out1, &tmp);
+                if(!is_se) zstranded_process_write(fam.r2.fwd, fam.r2.rev, &s.out2, &tmp);
+            } else {
+                const int is_rev(!fam.r1.fwd);
+                dmp_process_write(is_rev ? fam.r1.rev: fam.r1.fwd, &s.out1, &tmp, is_rev);
+                if(!is_se) dmp_process_write(is_rev ? fam.r2.rev: fam.r2.fwd, &s.out2, &tmp, is_rev);
+            }
+        }
+        s.fwd_order.clear(), s.rev_order.clear();
+    }
+    for(const uint32_t i: s.fwd_order) {
+        inmem_fam_t &fam(s.table[i]);
+        if(fam.r1.rev) {
+            zstranded_process_write(fam.r1.fwd, fam.r1.rev, &s.out1, &tmp);
+            if(!is_se) zstranded_process_write(fam.r2.fwd, fam.r2.rev, &s.out2, &tmp);
+            fam.r1.rev = fam.r2.rev = nullptr;
+        } else {
+            dmp_process_write(fam.r1.fwd, &s.out1, &tmp, 0);
+            if(!is_se) dmp_process_write(fam.r2.fwd, &s.out2, &tmp, 0);
+        }
+    }
+    for(const uint32_t i: s.rev_order) {
+        inmem_fam_t &fam(s.table[i]);
+        if(!fam.r1.rev) continue; // Already written as duplex.
+        dmp_process_write(fam.r1.rev, &s.out1, &tmp, 1);
+        if(!is_se) dmp_process_write(fam.r2.rev, &s.out2, &tmp, 1);
+    }
+    s.arena.release();
+    s.table.clear();
+    std::vector<uint32_t>().swap(s.fwd_order);
+    std::vector<uint32_t>().swap(s.rev_order);
+    if(settings_->level > 0) {
+        gzip_member(&s.out1, settings_->level);
+        if(!is_se) gzip_member(&s.out2, settings_->level);
+    }
+    {
+        std::lock_guard<std::mutex> lock(done_m_);
+        s.done = 1;
+    }
+    done_cv_.notify_all();
+}
+
+void InmemCollapser::work(int index)
+{
+    inmem_worker_t &w(workers_[index]);
+    for(;;) {
+        std::unique_lock<std::mutex> lock(w.m);
+        w.cv.wait(lock, [&]{return !w.q.empty() || input_done_.load();});
+        if(w.q.empty()) break;
+        inmem_chunk_t chunk(w.q.front());
+        w.q.pop_front();
+        lock.unlock();
+        consume(chunk.shard, chunk.data.s, chunk.data.l);
+        if((queued_ -= chunk.data.l) <= INMEM_MAX_QUEUED / 2) {
+            { std::lock_guard<std::mutex> qlock(queued_m_); }
+            queued_cv_.notify_all();
+        }
+        free(chunk.data.s);
+    }
+    for(int shard(index); shard < INMEM_SHARDS; shard += n_workers_) finish_shard(shard);
+}
+
+size_t InmemCollapser::finish(const char *out1, const char *out2)
+{
+    for(int i(0); i < INMEM_SHARDS; ++i)
+        if(shards_[i].pending.l) enqueue(i);
+    input_done_ = 1;
+    for(int i(0); i < n_workers_; ++i) {
+        { std::lock_guard<std::mutex> lock(workers_[i].m); }
+        workers_[i].cv.notify_all();
+    }
+    const int is_se(settings_->is_se);
+    FILE *fp1(strcmp(out1, "-") ? fopen(out1, "wb"): stdout);
+    FILE *fp2(is_se ? nullptr: strcmp(out2, "-") ? fopen(out2, "wb"): stdout);
+    if(!fp1 || (!is_se && !fp2)) LOG_EXIT("Could not open output files for writing. Abort!\n");
+    for(int i(0); i < INMEM_SHARDS; ++i) {
+        inmem_shard_t &s(shards_[i]);
+        {
+            std::unique_lock<std::mutex> lock(done_m_);
+            done_cv_.wait(lock, [&]{return s.done;});
+        }
+        if(fwrite(s.out1.s, 1, s.out1.l, fp1) != s.out1.l) LOG_EXIT("Failed to write to %s. Abort!\n", out1);
+        if(fp2 && fwrite(s.out2.s, 1, s.out2.l, fp2) != s.out2.l) LOG_EXIT("Failed to write to %s. Abort!\n", out2);
+        free(s.out1.s), free(s.out2.s);
+        s.out1 = s.out2 = kstring_t{0, 0, nullptr};
+    }
+    for(auto &t: threads_) t.join();
+    // Buffered output is only known to be written once it is flushed.
+    if(fp1 == stdout ? fflush(fp1): fclose(fp1)) LOG_EXIT("Failed to write to %s. Abort!\n", out1);
+    if(fp2 && (fp2 == stdout ? fflush(fp2): fclose(fp2))) LOG_EXIT("Failed to write to %s. Abort!\n", out2);
+    return kf_arena_peak();
+}
+
+static void check_extension(const char *path, int level)
+{
+    if(!path || strcmp(path, "-") == 0) return;
+    const int gz(strlen(path) >= 3 && strcmp(strrchr(path, '\0') - 3, ".gz") == 0);
+    if(level > 0 && !gz) LOG_WARNING("Output gzip compressed but filename not terminated with .gz. FYI\n");
+    else if(level == 0 && gz) LOG_WARNING("Output filename ends with .gz but output is not compressed. FYI\n");
+}
+
+void inmem_collapse(const inmem_settings_t *settings, const char *in1, const char *in2,
+                    const char *out1, const char *out2)
+{
+    check_extension(out1, settings->level);
+    if(!settings->is_se) check_extension(out2, settings->level);
+    const int reader_threads(fq_reader_threads(settings->threads, settings->is_se ? 1: 2));
+    FqReader reader1(in1, reader_threads);
+    std::unique_ptr<FqReader> reader2(settings->is_se ? nullptr: new FqReader(in2, reader_threads));
+    InmemCollapser collapser(settings);
+    fq_view_t rec1, rec2;
+    uint64_t n_records(0);
+    while(reader1.next(&rec1)) {
+        if(reader2) {
+            if(!reader2->next(&rec2)) LOG_EXIT("%s has more records than %s. Abort!\n", in1, in2);
+            collapser.add(&rec1, &rec2);
+        } else collapser.add(&rec1, nullptr);
+        if(UNLIKELY(++n_records % 1000000 == 0)) LOG_INFO("Number of records loaded: %lu\n", n_records);
+    }
+    if(reader2 && reader2->next(&rec2)) LOG_EXIT("%s has more records than %s. Abort!\n", in2, in1);
+    LOG_DEBUG("Loaded all %lu records.\n", n_records);
+    const size_t peak(collapser.finish(out1, out2));
+    LOG_INFO("Peak family arena usage of any shard: %lu bytes.\n", peak);
+}
+
+} /* namespace bmf */
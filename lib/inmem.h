@@ -0,0 +1,148 @@
+#ifndef INMEM_H
+#define INMEM_H
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "lib/bcscan.h"
+#include "lib/fqreader.h"
+#include "lib/hashdmp.h"
+
+#define INMEM_SHARD_BITS 6
+#define INMEM_SHARDS (1 << INMEM_SHARD_BITS) // Fixed, so that output does not depend on the number of threads.
+#define INMEM_CHUNK_SIZE (256uL << 10)
+#define INMEM_MAX_QUEUED (512uL << 20) // Bytes handed to workers but not yet collapsed, past which reading waits.
+
+namespace bmf {
+
+/*
+ * In-memory collapse for bmftools inmem.
+ *
+ * Collapses inline-barcoded fastqs in one pass, without marking or splitting them into temporary files.
+ * The reading thread finds each record's homing sequence and barcode (see lib/bcscan.h) and packs the record
+ * into a chunk for its shard, chosen by barcode hash. Each worker owns the shards with shard % n_workers
+ * == worker index, so a shard's table is only touched by one thread and records are only handed off a chunk
+ * at a time. A table entry holds both reads of a pair on both strands; single-end families use r1.fwd.
+ *
+ * Families are written shard by shard, in shard order, each shard's forward families (merged with their
+ * reverse families, if any) in order of first appearance, then its remaining reverse families.
+ * With settings->sorted, shards hold barcodes by their first bases instead, and each shard's families are
+ * written in barcode order, so the whole output is in barcode order. Barcodes which cannot be packed
+ * (those with Ns or without a homing sequence) all go to the last shard.
+ */
+
+struct inmem_settings_t {
+    char *homing;
+    int homing_len;
+    int blen; // First offset at which the homing sequence is searched for: mask plus the minimum barcode length.
+    int max_blen; // Last offset at which the homing sequence is searched for.
+    int mask; // Bases skipped before the barcode.
+    int threshold; // Homopolymer failure threshold.
+    int level; // Output gzip compression level. 0 for plain text.
+    int threads;
+    int is_se;
+    int sorted; // Write families in barcode order.
+};
+
+/*
+ * Read 1 and read 2 families for a barcode, on both strands.
+ */
+struct inmem_fam_t {
+    strand_fam_t r1;
+    strand_fam_t r2;
+};
+
+/*
+ * Packed record layout in a chunk:
+ * inmem_rec_hdr_t, packed key (if packed) or barcode sequence, seq1, qual1, seq2, qual2.
+ * l2 is 0 for single-end data.
+ */
+struct inmem_rec_hdr_t {
+    uint16_t l1;
+    uint16_t l2;
+    uint16_t offset1; // Start of read 1 after its barcode and homing sequence.
+    uint16_t offset2;
+    uint16_t blen;
+    uint8_t packed; // The barcode is stored as a key packed by pack_barcode.
+    uint8_t switched; // Read 2's barcode sorts first, so the pair belongs to the reverse families.
+    uint8_t pass;
+};
+
+struct inmem_chunk_t {
+    int shard;
+    kstring_t data;
+};
+
+struct inmem_shard_t {
+    FamTable<inmem_fam_t> table;
+    KFArena arena;
+    std::vector<uint32_t> fwd_order; // Families in order of their first forward pair.
+    std::vector<uint32_t> rev_order;
+    kstring_t pending; // Records not yet handed to the worker.
+    kstring_t out1;
+    kstring_t out2;
+    int done;
+};
+
+struct inmem_worker_t {
+    std::mutex m;
+    std::condition_variable cv;
+    std::deque<inmem_chunk_t> q;
+};
+
+class InmemCollapser {
+    const inmem_settings_t *settings_;
+    const int n_workers_;
+    inmem_shard_t *shards_;
+    inmem_worker_t *workers_;
+    std::vector<std::thread> threads_;
+    std::atomic<size_t> queued_;
+    std::atomic<int> input_done_;
+    std::mutex queued_m_;
+    std::condition_variable queued_cv_;
+    std::mutex done_m_;
+    std::condition_variable done_cv_;
+    bc_scan_t bc_;
+    kstring_t barcode_;
+
+    int scan(const fq_view_t *rec);
+    void enqueue(int shard);
+    void consume(int shard, const char *data, size_t l);
+    void finish_shard(int shard);
+    void work(int index);
+
+public:
+    InmemCollapser(const inmem_settings_t *settings);
+    ~InmemCollapser();
+    InmemCollapser(const InmemCollapser &) = delete;
+    InmemCollapser &operator=(const InmemCollapser &) = delete;
+    /*
+     * Adds a read pair, or a single read if r2 is null. The records are copied.
+     */
+    void add(const fq_view_t *r1, const fq_view_t *r2);
+    /*
+     * Hands off all remaining records, waits for the workers and writes the collapsed output.
+     * :param: out1 [const char *] Path for read 1, or "-" for stdout.
+     * :param: out2 [const char *] Path for read 2. Ignored for single-end data.
+     * :returns: [size_t] The largest family arena of any shard. See kf_arena_peak.
+     */
+    size_t finish(const char *out1, const char *out2);
+};
+
+/*
+ * @func inmem_collapse
+ * Collapses inline-barcoded fastqs fully in memory.
+ * :param: in1 [const char *] Read 1 fastq, which may be gzipped.
+ * :param: in2 [const char *] Read 2 fastq. Ignored for single-end data.
+ * :param: out1 [const char *] Output path for read 1, or "-" for stdout.
+ * :param: out2 [const char *] Output path for read 2. Ignored for single-end data.
+ */
+void inmem_collapse(const inmem_settings_t *settings, const char *in1, const char *in2,
+                    const char *out1, const char *out2);
+int hashdmp_inmem_main(int argc, char *argv[]);
+
+} /* namespace bmf */
+
+#endif /* INMEM_H */
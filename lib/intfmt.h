@@ -0,0 +1,118 @@
+#ifndef INTFMT_H
+#define INTFMT_H
+#include <cstdint>
+#include <cstring>
+#include "htslib/kstring.h"
+
+namespace bmf {
+
+/*
+ * Decimal formatting for the tags written in collapsed fastq comments.
+ * FA and PV hold one integer per cycle, so formatting them with ksprintf dominated the cost of writing families.
+ * These write two digits at a time from a table, straight into a kstring whose capacity is reserved up front.
+ */
+
+static const char DIGIT_PAIRS[201] {
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899"
+};
+
+/*
+ * @func u32_digits
+ * :returns: [int] Number of decimal digits in v.
+ */
+static inline int u32_digits(uint32_t v)
+{
+    return v < 10 ? 1: v < 100 ? 2: v < 1000 ? 3: v < 10000 ? 4: v < 100000 ? 5:
+           v < 1000000 ? 6: v < 10000000 ? 7: v < 100000000 ? 8: v < 1000000000 ? 9: 10;
+}
+
+/*
+ * @func u32_to_dec
+ * Writes v in decimal at p, without a terminating null.
+ * :returns: [char *] The end of the digits written.
+ */
+static inline char *u32_to_dec(uint32_t v, char *p)
+{
+    char *const end(p + u32_digits(v));
+    p = end;
+    while(v >= 100) {
+        const unsigned i((v % 100) << 1);
+        v /= 100;
+        *--p = DIGIT_PAIRS[i + 1], *--p = DIGIT_PAIRS[i];
+    }
+    if(v >= 10) *--p = DIGIT_PAIRS[(v << 1) + 1], *--p = DIGIT_PAIRS[v << 1];
+    else *--p = '0' + v;
+    return end;
+}
+
+/*
+ * @func kput_u32
+ * Appends v in decimal to ks.
+ */
+static inline void kput_u32(uint32_t v, kstring_t *ks)
+{
+    ks_resize(ks, ks->l + 11);
+    ks->l = u32_to_dec(v, ks->s + ks->l) - ks->s;
+    ks->s[ks->l] = '\0';
+}
+
+/*
+ * @func kput_u32_array
+ * Appends each of the n values in arr to ks in decimal, each preceded by a comma, as in a SAM B array.
+ */
+template<typename T>
+static inline void kput_u32_array(const T *arr, int n, kstring_t *ks)
+{
+    ks_resize(ks, ks->l + 11 * n + 1);
+    char *p(ks->s + ks->l);
+    for(int i(0); i < n; ++i) *p++ = ',', p = u32_to_dec(arr[i], p);
+    *p = '\0';
+    ks->l = p - ks->s;
+}
+
+/*
+ * @func kput_ratio
+ * Appends num / den to ks with the given number of decimal places, exactly as printf("%.*f") would
+ * print the double num / den, but in integer arithmetic.
+ * Exact ties, negative values and values too large to round exactly fall back to ksprintf.
+ * :param: decimals [int] Decimal places, at most 9.
+ */
+static inline void kput_ratio(int64_t num, int64_t den, int decimals, kstring_t *ks)
+{
+    static const uint64_t pow10[] {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000};
+    const uint64_t scale(pow10[decimals]);
+    // Below 2^52, the double num / den is too close to num / den to round differently, except at a tie.
+    if(num < 0 || den <= 0 || (uint64_t)num >= (UINT64_C(1) << 52) / scale) {
+        ksprintf(ks, "%.*f", decimals, (double)num / den);
+        return;
+    }
+    uint64_t q(num * scale / den);
+    const uint64_t r2((num * scale % den) << 1);
+    if(r2 == (uint64_t)den) {
+        ksprintf(ks, "%.*f", decimals, (double)num / den);
+        return;
+    }
+    q += r2 > (uint64_t)den;
+    const uint64_t integral(q / scale);
+    if(integral > UINT32_MAX) {
+        ksprintf(ks, "%.*f", decimals, (double)num / den);
+        return;
+    }
+    kput_u32(integral, ks);
+    if(!decimals) return;
+    ks_resize(ks, ks->l + decimals + 2);
+    char *p(ks->s + ks->l);
+    *p++ = '.';
+    for(uint64_t frac(q % scale), i(decimals); i--; frac /= 10) p[i] = '0' + frac % 10;
+    p += decimals;
+    *p = '\0';
+    ks->l = p - ks->s;
+}
+
+} /* namespace bmf */
+
+#endif /* INTFMT_H */
@@ -0,0 +1,285 @@
+#include "kfkernel.h"
+
+#include "lib/kingfisher.h"
+#if defined(__x86_64__) || defined(__i386__)
+#    include <immintrin.h>
+#    define KF_X86 1
+#endif
+
+namespace bmf {
+
+/*
+ * Scalar kernels. The vector kernels use these for the cycles left over after their last full vector.
+ */
+static inline void pb_range(kingfisher_t *kfp, const char *seq, const char *qual, unsigned start, unsigned l)
+{
+    const unsigned rl(kfp->readlen);
+    for(unsigned i(start), index; i < l; ++i) {
+        index = nuc2num(seq[i]) * rl + i;
+        ++kfp->nuc_counts[index];
+        kfp->phred_sums[index] += qual[i] - 33;
+        if(qual[i] > kfp->max_phreds[index]) kfp->max_phreds[index] = qual[i];
+    }
+}
+
+static inline void argmax_range(const kingfisher_t *kfp, uint8_t *out, unsigned start)
+{
+    const unsigned rl(kfp->readlen);
+    for(unsigned i(start); i < rl; ++i) out[i] = kf_argmax(kfp->phred_sums, rl, i);
+}
+
+static inline void merge_range(kingfisher_t *kfpf, const kingfisher_t *kfpr,
+                               const uint8_t *argf, const uint8_t *argr, uint8_t *out, unsigned start)
+{
+    const unsigned rl(kfpf->readlen);
+    for(unsigned i(start), index; i < rl; ++i) {
+        const uint8_t f(argf[i]), r(argr[i]);
+        if(f == r) {
+            index = f * rl + i;
+            if(kfpr->max_phreds[index] > kfpf->max_phreds[index]) kfpf->max_phreds[index] = kfpr->max_phreds[index];
+        } else if(f == 4) {
+            index = r * rl + i;
+            kfpf->max_phreds[index] = kfpr->max_phreds[index];
+        } else if(r == 4) {
+            index = f * rl + i;
+        } else {
+            out[i] = KF_NO_CALL;
+            continue;
+        }
+        kfpf->phred_sums[index] += kfpr->phred_sums[index];
+        kfpf->nuc_counts[index] += kfpr->nuc_counts[index];
+        out[i] = index / rl;
+    }
+}
+
+static void pushback_scalar(kingfisher_t *kfp, const char *seq, const char *qual, unsigned l)
+{
+    pb_range(kfp, seq, qual, 0, l);
+}
+
+static void argmax_scalar(const kingfisher_t *kfp, uint8_t *out)
+{
+    argmax_range(kfp, out, 0);
+}
+
+static void merge_scalar(kingfisher_t *kfpf, const kingfisher_t *kfpr, const uint8_t *argf, const uint8_t *argr, uint8_t *out)
+{
+    merge_range(kfpf, kfpr, argf, argr, out, 0);
+}
+
+const kf_kernel_t &kf_kernel_scalar()
+{
+    static const kf_kernel_t ret{&pushback_scalar, &argmax_scalar, &merge_scalar, "scalar"};
+    return ret;
+}
+
+#if KF_X86
+
+/*
+ * SSE4.2: 16 cycles per iteration for pushback and merge, 4 for argmax.
+ */
+__attribute__((target("sse4.2")))
+static void pushback_sse42(kingfisher_t *kfp, const char *seq, const char *qual, unsigned l)
+{
+    const unsigned rl(kfp->readlen);
+    const __m128i ones(_mm_set1_epi8(1)), offset(_mm_set1_epi8(33));
+    __m128i m[5];
+    unsigned i(0);
+    for(; i + 16 <= l; i += 16) {
+        const __m128i s(_mm_loadu_si128((const __m128i *)(seq + i)));
+        const __m128i q(_mm_loadu_si128((const __m128i *)(qual + i)));
+        const __m128i qv(_mm_sub_epi8(q, offset));
+        m[0] = _mm_cmpeq_epi8(s, _mm_set1_epi8('A'));
+        m[1] = _mm_cmpeq_epi8(s, _mm_set1_epi8('C'));
+        m[2] = _mm_cmpeq_epi8(s, _mm_set1_epi8('G'));
+        m[3] = _mm_cmpeq_epi8(s, _mm_set1_epi8('T'));
+        m[4] = _mm_andnot_si128(_mm_or_si128(_mm_or_si128(m[0], m[1]), _mm_or_si128(m[2], m[3])), _mm_set1_epi8(-1));
+        for(unsigned n(0); n < 5; ++n) {
+            if(_mm_testz_si128(m[n], m[n])) continue; // No bases of this nucleotide in these cycles.
+            uint16_t *c(kfp->nuc_counts + n * rl + i);
+            uint32_t *p(kfp->phred_sums + n * rl + i);
+            char *x(kfp->max_phreds + n * rl + i);
+            const __m128i one(_mm_and_si128(m[n], ones)), qm(_mm_and_si128(m[n], qv));
+            _mm_storeu_si128((__m128i *)c, _mm_add_epi16(_mm_loadu_si128((__m128i *)c), _mm_cvtepu8_epi16(one)));
+            _mm_storeu_si128((__m128i *)(c + 8), _mm_add_epi16(_mm_loadu_si128((__m128i *)(c + 8)),
+                                                               _mm_cvtepu8_epi16(_mm_srli_si128(one, 8))));
+            _mm_storeu_si128((__m128i *)p, _mm_add_epi32(_mm_loadu_si128((__m128i *)p), _mm_cvtepu8_epi32(qm)));
+            _mm_storeu_si128((__m128i *)(p + 4), _mm_add_epi32(_mm_loadu_si128((__m128i *)(p + 4)),
+                                                               _mm_cvtepu8_epi32(_mm_srli_si128(qm, 4))));
+            _mm_storeu_si128((__m128i *)(p + 8), _mm_add_epi32(_mm_loadu_si128((__m128i *)(p + 8)),
+                                                               _mm_cvtepu8_epi32(_mm_srli_si128(qm, 8))));
+            _mm_storeu_si128((__m128i *)(p + 12), _mm_add_epi32(_mm_loadu_si128((__m128i *)(p + 12)),
+                                                                _mm_cvtepu8_epi32(_mm_srli_si128(qm, 12))));
+            _mm_storeu_si128((__m128i *)x, _mm_max_epu8(_mm_loadu_si128((__m128i *)x), _mm_and_si128(m[n], q)));
+        }
+    }
+    pb_range(kfp, seq, qual, i, l);
+}
+
+__attribute__((target("sse4.2")))
+static void argmax_sse42(const kingfisher_t *kfp, uint8_t *out)
+{
+    const unsigned rl(kfp->readlen);
+    const uint32_t *const sums(kfp->phred_sums);
+    unsigned i(0);
+    for(; i + 4 <= rl; i += 4) {
+        __m128i best(_mm_loadu_si128((const __m128i *)(sums + i))), best_n(_mm_setzero_si128());
+        for(int n(1); n < 5; ++n) {
+            const __m128i v(_mm_loadu_si128((const __m128i *)(sums + n * rl + i)));
+            const __m128i ge(_mm_cmpeq_epi32(_mm_max_epu32(v, best), v));
+            best = _mm_max_epu32(v, best);
+            best_n = _mm_blendv_epi8(best_n, _mm_set1_epi32(n), ge);
+        }
+        best_n = _mm_packus_epi16(_mm_packs_epi32(best_n, best_n), best_n);
+        const uint32_t packed(_mm_cvtsi128_si32(best_n));
+        std::memcpy(out + i, &packed, sizeof(packed));
+    }
+    argmax_range(kfp, out, i);
+}
+
+__attribute__((target("sse4.2")))
+static void merge_sse42(kingfisher_t *kfpf, const kingfisher_t *kfpr, const uint8_t *argf, const uint8_t *argr, uint8_t *out)
+{
+    const unsigned rl(kfpf->readlen);
+    const __m128i four(_mm_set1_epi8(4));
+    unsigned i(0);
+    for(; i + 16 <= rl; i += 16) {
+        const __m128i f(_mm_loadu_si128((const __m128i *)(argf + i)));
+        const __m128i r(_mm_loadu_si128((const __m128i *)(argr + i)));
+        const __m128i eq(_mm_cmpeq_epi8(f, r));
+        const __m128i f4(_mm_cmpeq_epi8(f, four));
+        __m128i c(_mm_blendv_epi8(_mm_set1_epi8(KF_NO_CALL), f, _mm_cmpeq_epi8(r, four)));
+        c = _mm_blendv_epi8(_mm_blendv_epi8(c, r, f4), f, eq);
+        const __m128i copy(_mm_andnot_si128(eq, f4)); // Forward was N: take reverse's max phred.
+        for(unsigned n(0); n < 5; ++n) {
+            const __m128i sel(_mm_cmpeq_epi8(c, _mm_set1_epi8(n)));
+            if(_mm_testz_si128(sel, sel)) continue;
+            const unsigned o(n * rl + i);
+            uint16_t *cf(kfpf->nuc_counts + o);
+            const uint16_t *cr(kfpr->nuc_counts + o);
+            uint32_t *pf(kfpf->phred_sums + o);
+            const uint32_t *pr(kfpr->phred_sums + o);
+            char *xf(kfpf->max_phreds + o);
+            const __m128i xr(_mm_loadu_si128((const __m128i *)(kfpr->max_phreds + o)));
+            __m128i x(_mm_loadu_si128((__m128i *)xf));
+            x = _mm_blendv_epi8(x, _mm_max_epu8(x, xr), _mm_and_si128(sel, eq));
+            x = _mm_blendv_epi8(x, xr, _mm_and_si128(sel, copy));
+            _mm_storeu_si128((__m128i *)xf, x);
+            __m128i s(sel);
+            for(unsigned k(0); k < 16; k += 8, s = _mm_srli_si128(s, 8))
+                _mm_storeu_si128((__m128i *)(cf + k),
+                                 _mm_add_epi16(_mm_loadu_si128((__m128i *)(cf + k)),
+                                               _mm_and_si128(_mm_cvtepi8_epi16(s), _mm_loadu_si128((const __m128i *)(cr + k)))));
+            s = sel;
+            for(unsigned k(0); k < 16; k += 4, s = _mm_srli_si128(s, 4))
+                _mm_storeu_si128((__m128i *)(pf + k),
+                                 _mm_add_epi32(_mm_loadu_si128((__m128i *)(pf + k)),
+                                               _mm_and_si128(_mm_cvtepi8_epi32(s), _mm_loadu_si128((const __m128i *)(pr + k)))));
+        }
+        _mm_storeu_si128((__m128i *)(out + i), c);
+    }
+    merge_range(kfpf, kfpr, argf, argr, out, i);
+}
+
+/*
+ * AVX2: 32 cycles per iteration for pushback, 8 for argmax.
+ * Merge runs once per duplex family rather than once per read, so it uses the SSE4.2 kernel.
+ */
+__attribute__((target("avx2")))
+static void pushback_avx2(kingfisher_t *kfp, const char *seq, const char *qual, unsigned l)
+{
+    const unsigned rl(kfp->readlen);
+    const __m256i ones(_mm256_set1_epi8(1)), offset(_mm256_set1_epi8(33));
+    __m256i m[5];
+    unsigned i(0);
+    for(; i + 32 <= l; i += 32) {
+        const __m256i s(_mm256_loadu_si256((const __m256i *)(seq + i)));
+        const __m256i q(_mm256_loadu_si256((const __m256i *)(qual + i)));
+        const __m256i qv(_mm256_sub_epi8(q, offset));
+        m[0] = _mm256_cmpeq_epi8(s, _mm256_set1_epi8('A'));
+        m[1] = _mm256_cmpeq_epi8(s, _mm256_set1_epi8('C'));
+        m[2] = _mm256_cmpeq_epi8(s, _mm256_set1_epi8('G'));
+        m[3] = _mm256_cmpeq_epi8(s, _mm256_set1_epi8('T'));
+        m[4] = _mm256_andnot_si256(_mm256_or_si256(_mm256_or_si256(m[0], m[1]), _mm256_or_si256(m[2], m[3])),
+                                   _mm256_set1_epi8(-1));
+        for(unsigned n(0); n < 5; ++n) {
+            if(_mm256_testz_si256(m[n], m[n])) continue;
+            uint16_t *c(kfp->nuc_counts + n * rl + i);
+            uint32_t *p(kfp->phred_sums + n * rl + i);
+            char *x(kfp->max_phreds + n * rl + i);
+            const __m256i one(_mm256_and_si256(m[n], ones)), qm(_mm256_and_si256(m[n], qv));
+            const __m128i one_lo(_mm256_castsi256_si128(one)), one_hi(_mm256_extracti128_si256(one, 1));
+            const __m128i qm_lo(_mm256_castsi256_si128(qm)), qm_hi(_mm256_extracti128_si256(qm, 1));
+            _mm256_storeu_si256((__m256i *)c, _mm256_add_epi16(_mm256_loadu_si256((__m256i *)c), _mm256_cvtepu8_epi16(one_lo)));
+            _mm256_storeu_si256((__m256i *)(c + 16), _mm256_add_epi16(_mm256_loadu_si256((__m256i *)(c + 16)),
+                                                                      _mm256_cvtepu8_epi16(one_hi)));
+            _mm256_storeu_si256((__m256i *)p, _mm256_add_epi32(_mm256_loadu_si256((__m256i *)p), _mm256_cvtepu8_epi32(qm_lo)));
+            _mm256_storeu_si256((__m256i *)(p + 8), _mm256_add_epi32(_mm256_loadu_si256((__m256i *)(p + 8)),
+                                                                     _mm256_cvtepu8_epi32(_mm_srli_si128(qm_lo, 8))));
+            _mm256_storeu_si256((__m256i *)(p + 16), _mm256_add_epi32(_mm256_loadu_si256((__m256i *)(p + 16)),
+                                                                      _mm256_cvtepu8_epi32(qm_hi)));
+            _mm256_storeu_si256((__m256i *)(p + 24), _mm256_add_epi32(_mm256_loadu_si256((__m256i *)(p + 24)),
+                                                                      _mm256_cvtepu8_epi32(_mm_srli_si128(qm_hi, 8))));
+            _mm256_storeu_si256((__m256i *)x, _mm256_max_epu8(_mm256_loadu_si256((__m256i *)x), _mm256_and_si256(m[n], q)));
+        }
+    }
+    pb_range(kfp, seq, qual, i, l);
+}
+
+__attribute__((target("avx2")))
+static void argmax_avx2(const kingfisher_t *kfp, uint8_t *out)
+{
+    const unsigned rl(kfp->readlen);
+    const uint32_t *const sums(kfp->phred_sums);
+    unsigned i(0);
+    for(; i + 8 <= rl; i += 8) {
+        __m256i best(_mm256_loadu_si256((const __m256i *)(sums + i))), best_n(_mm256_setzero_si256());
+        for(int n(1); n < 5; ++n) {
+            const __m256i v(_mm256_loadu_si256((const __m256i *)(sums + n * rl + i)));
+            const __m256i ge(_mm256_cmpeq_epi32(_mm256_max_epu32(v, best), v));
+            best = _mm256_max_epu32(v, best);
+            best_n = _mm256_blendv_epi8(best_n, _mm256_set1_epi32(n), ge);
+        }
+        // Narrow 8 x 32-bit lane indices to bytes.
+        const __m128i lo(_mm256_castsi256_si128(best_n)), hi(_mm256_extracti128_si256(best_n, 1));
+        const __m128i packed(_mm_packus_epi16(_mm_packs_epi32(lo, hi), _mm_setzero_si128()));
+        _mm_storel_epi64((__m128i *)(out + i), packed);
+    }
+    argmax_range(kfp, out, i);
+}
+
+const kf_kernel_t &kf_kernel_sse42()
+{
+    static const kf_kernel_t ret{&pushback_sse42, &argmax_sse42, &merge_sse42, "sse4.2"};
+    return ret;
+}
+
+const kf_kernel_t &kf_kernel_avx2()
+{
+    static const kf_kernel_t ret{&pushback_avx2, &argmax_avx2, &merge_sse42, "avx2"};
+    return ret;
+}
+
+static const kf_kernel_t &select_kernel()
+{
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) return kf_kernel_avx2();
+    if(__builtin_cpu_supports("sse4.2")) return kf_kernel_sse42();
+    return kf_kernel_scalar();
+}
+
+#else
+
+const kf_kernel_t &kf_kernel_sse42() {return kf_kernel_scalar();}
+const kf_kernel_t &kf_kernel_avx2() {return kf_kernel_scalar();}
+static const kf_kernel_t &select_kernel() {return kf_kernel_scalar();}
+
+#endif /* KF_X86 */
+
+const kf_kernel_t &kf_kernel()
+{
+    static const kf_kernel_t &ret(select_kernel());
+    return ret;
+}
+
+} /* namespace bmf */
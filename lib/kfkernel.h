@@ -0,0 +1,56 @@
+#ifndef KFKERNEL_H
+#define KFKERNEL_H
+#include <cstdint>
+
+namespace bmf {
+
+struct kingfisher_t;
+
+#define KF_NO_CALL 5 // Merged call for positions where the strands disagree.
+
+/*
+ * Consensus kernels over kingfisher_t accumulators.
+ * Accumulators are laid out struct-of-arrays: one lane of readlen cycles per nucleotide (ACGTN),
+ * so lane n of phred_sums is phred_sums[n * readlen, (n + 1) * readlen).
+ * This lets each kernel handle a full vector of cycles per instruction.
+ */
+struct kf_kernel_t {
+    /*
+     * Adds a read's bases to a family.
+     * :param: seq [const char *] Read sequence. Bases other than ACGT count as N.
+     * :param: qual [const char *] Quality string.
+     * :param: l [unsigned] Number of cycles to add. Must not exceed kfp->readlen.
+     */
+    void (*pushback)(kingfisher_t *kfp, const char *seq, const char *qual, unsigned l);
+    /*
+     * Writes the consensus nucleotide (0-4) of every cycle to out: the lane with the greatest phred sum,
+     * with ties going to the later lane.
+     */
+    void (*argmax)(const kingfisher_t *kfp, uint8_t *out);
+    /*
+     * Merges the reverse family into the forward family for duplex consensus.
+     * For each cycle, the call is the strands' shared call, the reverse call if forward is N,
+     * the forward call if reverse is N, or KF_NO_CALL if they disagree.
+     * Counts and phred sums of the call's lane are added to kfpf; its max phred is the larger of the two
+     * when both strands agreed and reverse's when forward was N.
+     * :param: argf [const uint8_t *] argmax of kfpf.
+     * :param: argr [const uint8_t *] argmax of kfpr.
+     * :param: out [uint8_t *] The merged call for each cycle. May alias argf.
+     */
+    void (*merge)(kingfisher_t *kfpf, const kingfisher_t *kfpr, const uint8_t *argf, const uint8_t *argr, uint8_t *out);
+    const char *name;
+};
+
+const kf_kernel_t &kf_kernel_scalar();
+const kf_kernel_t &kf_kernel_sse42(); // Falls back to scalar if not compiled for x86.
+const kf_kernel_t &kf_kernel_avx2(); // Falls back to sse42 if not compiled for x86.
+
+/*
+ * @func kf_kernel
+ * :returns: [const kf_kernel_t &] The fastest kernel supported by this CPU, chosen on first use.
+ */
+const kf_kernel_t &kf_kernel();
+
+} /* namespace bmf */
+
+#endif /* KFKERNEL_H */
@@ -2,44 +2,118 @@
 
 #include "dlib/bam_util.h"
 #include "dlib/io_util.h"
+#include "lib/phredtable.h"
+#include "lib/ubam.h"
 
 namespace bmf {
 
-#define dmp_pos(kfp, bufs, argmaxret, i, index, diffcount)\
+#define dmp_pos(kfp, bufs, argmaxret, i, index, diffcount, pt)\
     do {\
-        bufs->cons_quals[i] = pvalue_to_phred(igamc_pvalues(kfp->length, LOG10_TO_CHI2((kfp->phred_sums[index]))));\
+        bufs->cons_quals[i] = pt.get(kfp->length, kfp->phred_sums[index]);\
         bufs->agrees[i] = kfp->nuc_counts[index];\
         diffcount -= bufs->agrees[i];\
-        if(argmaxret != 4) diffcount -= kfp->nuc_counts[i * 5 + 4]; /*(Skip Ns in counting diffs) */\
+        if(argmaxret != 4) diffcount -= kfp->nuc_counts[4 * kfp->readlen + i]; /*(Skip Ns in counting diffs) */\
         if(bufs->cons_quals[i] > 2 && (double)bufs->agrees[i] / kfp->length > MIN_FRAC_AGREED)\
             bufs->cons_seq_buffer[i] = num2nuc(argmaxret);\
         else bufs->cons_quals[i] = 2, bufs->cons_seq_buffer[i] = 'N';\
     } while(0)
 
-void dmp_process_write(kingfisher_t *kfp, kstring_t *ks, tmpbuffers_t *bufs, int is_rev)
+/*
+ * @func dmp_consensus
+ * Calls the consensus of a family into bufs.
+ * :returns: [int] Number of bases in the family which differ from the consensus, ignoring Ns.
+ */
+static int dmp_consensus(kingfisher_t *kfp, tmpbuffers_t *bufs)
 {
-    int i, diffs(kfp->length * kfp->readlen);
-    for(i = 0; i < kfp->readlen; ++i) {
-        const int argmaxret(kfp_argmax(kfp, i));
-        const int index(argmaxret + i * 5);
-        dmp_pos(kfp, bufs, argmaxret, i, index, diffs);
+    int diffs(kfp->length * kfp->readlen);
+    const PhredTable &pt(phred_table());
+    kf_kernel().argmax(kfp, bufs->argmax);
+    for(int i(0); i < kfp->readlen; ++i) {
+        const int argmaxret(bufs->argmax[i]);
+        const int index(argmaxret * kfp->readlen + i);
+        dmp_pos(kfp, bufs, argmaxret, i, index, diffs, pt);
     }
-    kputc('@', ks); kputs(kfp->barcode + 1, ks); kputc(' ', ks); 
-    kfill_both(kfp->readlen, bufs->agrees, bufs->cons_quals, ks);
     bufs->cons_seq_buffer[kfp->readlen] = '\0';
+    return diffs;
+}
+
+/*
+ * @func kput_seq_qual
+ * Appends the consensus sequence, separator and quality lines of a fastq record to ks.
+ */
+static inline void kput_seq_qual(kingfisher_t *kfp, tmpbuffers_t *bufs, kstring_t *ks)
+{
+    ks_resize(ks, ks->l + 2 * kfp->readlen + 5);
+    char *p(ks->s + ks->l);
+    std::memcpy(p, bufs->cons_seq_buffer, kfp->readlen), p += kfp->readlen;
+    *p++ = '\n', *p++ = '+', *p++ = '\n';
+    for(int i(0); i < kfp->readlen; ++i)
+        *p++ = kfp->max_phreds[nuc2num(bufs->cons_seq_buffer[i]) * kfp->readlen + i];
+    *p++ = '\n';
+    *p = '\0';
+    ks->l = p - ks->s;
+}
+
+void dmp_process_write(kingfisher_t *kfp, kstring_t *ks, tmpbuffers_t *bufs, int is_rev)
+{
+    const int diffs(dmp_consensus(kfp, bufs));
+    kputc('@', ks); kputs(kfp->barcode + 1, ks); kputc(' ', ks);
+    kfill_both(kfp->readlen, bufs->agrees, bufs->cons_quals, ks);
     kputsnl("\tFP:i:", ks);
     kputc(kfp->pass_fail, ks);
-    ksprintf(ks, "\tFM:i:%i", kfp->length);
+    kputsnl("\tFM:i:", ks), bmf::kput_u32(kfp->length, ks);
     if(is_rev != -1) {
-        ksprintf(ks, "\tRV:i:%i", is_rev ? kfp->length: 0);
+        kputsnl("\tRV:i:", ks), bmf::kput_u32(is_rev ? kfp->length: 0, ks);
         kputsnl("\tDR:i:0", ks);
     }
-    ksprintf(ks, "\tNF:f:%0.4f", (double) diffs / kfp->length);
-    kputc('\n', ks);
-    kputsn(bufs->cons_seq_buffer, kfp->readlen, ks);
-    kputsnl("\n+\n", ks);
-    for(i = 0; i < kfp->readlen; ++i) kputc(kfp->max_phreds[nuc2num(bufs->cons_seq_buffer[i]) + 5 * i], ks);
+    kputsnl("\tNF:f:", ks), bmf::kput_ratio(diffs, kfp->length, 4, ks);
+    if(kfp->merged) kputsnl("\tOF:i:", ks), bmf::kput_u32(kfp->length - kfp->merged, ks);
     kputc('\n', ks);
+    kput_seq_qual(kfp, bufs, ks);
+}
+
+/*
+ * @func ubam_fill
+ * Appends the record for a called consensus to ks as an unaligned BAM record,
+ * up to and including its NF tag. See lib/ubam.h.
+ * :returns: [size_t] Offset of the record in ks, for ubam_finish.
+ */
+static size_t ubam_fill(const kingfisher_t *kfp, kstring_t *ks, const tmpbuffers_t *bufs, int fm, int rv, int dr, double nf)
+{
+    const size_t start(ubam_start(ks, kfp->barcode + 1, bufs->cons_seq_buffer, kfp->readlen));
+    for(int i(0); i < kfp->readlen; ++i)
+        ks->s[ks->l++] = kfp->max_phreds[nuc2num(bufs->cons_seq_buffer[i]) * kfp->readlen + i] - 33;
+    ubam_aux_u32_array(ks, "FA", bufs->agrees, kfp->readlen);
+    ubam_aux_u32_array(ks, "PV", bufs->cons_quals, kfp->readlen);
+    ubam_aux_int(ks, "FP", kfp->pass_fail - '0');
+    ubam_aux_int(ks, "FM", fm);
+    if(rv >= 0) {
+        ubam_aux_int(ks, "RV", rv);
+        ubam_aux_int(ks, "DR", dr);
+    }
+    ubam_aux_float(ks, "NF", nf);
+    return start;
+}
+
+void dmp_process_bam(kingfisher_t *kfp, kstring_t *ks, tmpbuffers_t *bufs, int is_rev)
+{
+    const int diffs(dmp_consensus(kfp, bufs));
+    const size_t start(ubam_fill(kfp, ks, bufs, kfp->length, is_rev == -1 ? -1: is_rev ? kfp->length: 0, 0,
+                                 (double) diffs / kfp->length));
+    if(kfp->merged) ubam_aux_int(ks, "OF", kfp->length - kfp->merged);
+    ubam_finish(ks, start);
+}
+
+void kf_absorb(kingfisher_t *dst, const kingfisher_t *src)
+{
+    const int r5(dst->readlen * 5);
+    for(int i(0); i < r5; ++i) {
+        dst->phred_sums[i] += src->phred_sums[i];
+        dst->nuc_counts[i] += src->nuc_counts[i];
+        if(src->max_phreds[i] > dst->max_phreds[i]) dst->max_phreds[i] = src->max_phreds[i];
+    }
+    dst->length += src->length;
+    dst->merged += src->length;
 }
 
 std::vector<double> get_igamc_threshold(int family_size, int max_phred, double delta) {
@@ -70,47 +144,62 @@ std::vector<std::vector<double>> get_igamc_thresholds(size_t max_family_size, in
     return ret;
 }
 
+/*
+ * @func zstranded_consensus
+ * Calls the consensus of a family observed on both strands into bufs.
+ * Note: the reverse family is folded into the forward family.
+ * :returns: [int] Number of bases in the families which differ from the consensus, ignoring Ns.
+ */
+static int zstranded_consensus(kingfisher_t *kfpf, kingfisher_t *kfpr, tmpbuffers_t *bufs)
+{
+    int diffs((kfpf->length + kfpr->length) * kfpf->readlen), index, i;
+    const PhredTable &pt(phred_table());
+    const kf_kernel_t &kernel(kf_kernel());
+    kernel.argmax(kfpf, bufs->argmax);
+    kernel.argmax(kfpr, bufs->argmax_r);
+    // Fold the reverse family into the forward at each cycle whose strands agree or where one strand is N.
+    kernel.merge(kfpf, kfpr, bufs->argmax, bufs->argmax_r, bufs->argmax);
+    for(i = 0; i < kfpf->readlen; ++i) {
+        const int argmaxret(bufs->argmax[i]);
+        if(argmaxret == KF_NO_CALL) {
+            bufs->cons_quals[i] = 0, bufs->agrees[i] = 0, bufs->cons_seq_buffer[i] = 'N';
+            continue;
+        }
+        index = argmaxret * kfpf->readlen + i;
+        dmp_pos(kfpf, bufs, argmaxret, i, index, diffs, pt);
+    }
+    bufs->cons_seq_buffer[kfpf->readlen] = '\0';
+    return diffs;
+}
+
 // kfp forward, kfp reverse
 // Note: You print kfpf->barcode + 1 because that skips the F/R/Z char.
 void zstranded_process_write(kingfisher_t *kfpf, kingfisher_t *kfpr, kstring_t *ks, tmpbuffers_t *bufs)
 {
     const int FM (kfpf->length + kfpr->length);
-    int diffs(FM * kfpf->readlen), index, i;
-    for(i = 0; i < kfpf->readlen; ++i) {
-        const int argmaxretf(kfp_argmax(kfpf, i)); // Forward consensus nucleotide
-        const int argmaxretr(kfp_argmax(kfpr, i)); // Reverse consensus nucleotide
-        if(argmaxretf == argmaxretr) { // Both strands supported the same base call.
-            index = i * 5 + argmaxretf;
-            kfpf->phred_sums[index] += kfpr->phred_sums[index];
-            kfpf->nuc_counts[index] += kfpr->nuc_counts[index];
-            dmp_pos(kfpf, bufs, argmaxretf, i, index, diffs);
-            if(kfpr->max_phreds[index] > kfpf->max_phreds[index]) kfpf->max_phreds[index] = kfpr->max_phreds[index];
-        } else if(argmaxretf == 4) { // Forward is N'd and reverse is not. Reverse call is probably right.
-            index = i * 5 + argmaxretr;
-            kfpf->phred_sums[index] += kfpr->phred_sums[index];
-            kfpf->nuc_counts[index] += kfpr->nuc_counts[index];
-            dmp_pos(kfpf, bufs, argmaxretr, i, index, diffs);
-            kfpf->max_phreds[index] = kfpr->max_phreds[index];
-        } else if(argmaxretr == 4) { // Forward is N'd and reverse is not. Reverse call is probably right.
-            index = i * 5 + argmaxretf;
-            kfpf->phred_sums[index] += kfpr->phred_sums[index];
-            kfpf->nuc_counts[index] += kfpr->nuc_counts[index];
-            dmp_pos(kfpf, bufs, argmaxretf, i, index, diffs);
-            // Don't update max_phreds, since the max phred is already here.
-        } else bufs->cons_quals[i] = 0, bufs->agrees[i] = 0, bufs->cons_seq_buffer[i] = 'N';
-    }
-    ksprintf(ks, "@%s ", kfpf->barcode + 1);
+    const int diffs(zstranded_consensus(kfpf, kfpr, bufs));
+    kputc('@', ks); kputs(kfpf->barcode + 1, ks); kputc(' ', ks);
     // Add read name
     kfill_both(kfpf->readlen, bufs->agrees, bufs->cons_quals, ks);
-    bufs->cons_seq_buffer[kfpf->readlen] = '\0';
-    ksprintf(ks, "\tFP:i:%c\tFM:i:%i\tRV:i:%i\tNF:f:%f\tDR:i:%i\n%s\n+\n", kfpf->pass_fail,
-             FM, kfpr->length, (double) diffs / FM, kfpf->length && kfpr->length,
-             bufs->cons_seq_buffer);
-    for(i = 0; i < kfpf->readlen; ++i)
-        kputc(kfpf->max_phreds[nuc2num(bufs->cons_seq_buffer[i]) + 5 * i], ks);
+    kputsnl("\tFP:i:", ks), kputc(kfpf->pass_fail, ks);
+    kputsnl("\tFM:i:", ks), bmf::kput_u32(FM, ks);
+    kputsnl("\tRV:i:", ks), bmf::kput_u32(kfpr->length, ks);
+    kputsnl("\tNF:f:", ks), bmf::kput_ratio(diffs, FM, 6, ks);
+    kputsnl("\tDR:i:", ks), kputc('0' + (kfpf->length && kfpr->length), ks);
+    if(kfpf->merged + kfpr->merged) kputsnl("\tOF:i:", ks), bmf::kput_u32(FM - kfpf->merged - kfpr->merged, ks);
     kputc('\n', ks);
+    kput_seq_qual(kfpf, bufs, ks);
     //const int ND = get_num_differ
     return;
 }
 
+void zstranded_process_bam(kingfisher_t *kfpf, kingfisher_t *kfpr, kstring_t *ks, tmpbuffers_t *bufs)
+{
+    const int FM (kfpf->length + kfpr->length);
+    const int diffs(zstranded_consensus(kfpf, kfpr, bufs));
+    const size_t start(ubam_fill(kfpf, ks, bufs, FM, kfpr->length, kfpf->length && kfpr->length, (double) diffs / FM));
+    if(kfpf->merged + kfpr->merged) ubam_aux_int(ks, "OF", FM - kfpf->merged - kfpr->merged);
+    ubam_finish(ks, start);
+}
+
 } /* namespace bmf */
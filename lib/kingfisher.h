@@ -1,6 +1,7 @@
 #ifndef KINGFISHER_H
 #define KINGFISHER_H
 #include <assert.h>
+#include <algorithm>
 #include <cmath>
 #include <cstring>
 #include <zlib.h>
@@ -10,6 +11,8 @@
 #include "dlib/cstr_util.h"
 #include "include/igamc_cephes.h"
 #include "lib/splitter.h"
+#include "lib/kfkernel.h"
+#include "lib/intfmt.h"
 
 #ifdef MAX_BARCODE_LENGTH
 #undef MAX_BARCODE_LENGTH
@@ -36,6 +39,8 @@ struct tmpbuffers_t {
     char cons_seq_buffer[SEQBUF_SIZE];
     uint32_t cons_quals[SEQBUF_SIZE];
     uint16_t agrees[SEQBUF_SIZE];
+    uint8_t argmax[SEQBUF_SIZE]; // Consensus nucleotide per cycle
+    uint8_t argmax_r[SEQBUF_SIZE]; // Consensus nucleotide per cycle for the reverse family of a duplex
 };
 
 
@@ -49,11 +54,16 @@ struct tmpvars_t {
 };
 
 
+/*
+ * Family accumulator. The three arrays are readlen * 5 long, one lane of readlen cycles per nucleotide:
+ * the entry for nucleotide n at cycle i is [n * readlen + i]. See lib/kfkernel.h.
+ */
 struct kingfisher_t {
     uint16_t *nuc_counts; // Count of nucleotides of this form
     uint32_t *phred_sums; // Sums of -10log10(p-value)
     char *max_phreds; // Maximum phred score observed at position. Use this as the final sequence for the quality to maintain compatibility with GATK and other tools.
     int length; // Number of reads in family
+    int merged; // Reads merged in from other barcodes by clustering (see lib/bcluster.h)
     int readlen; // Length of reads
     char barcode[MAX_BARCODE_LENGTH + 1];
     char pass_fail;
@@ -62,87 +72,111 @@ struct kingfisher_t {
 
 void zstranded_process_write(kingfisher_t *kfpf, kingfisher_t *kfpr, kstring_t *ks, tmpbuffers_t *bufs);
 void dmp_process_write(kingfisher_t *kfp, kstring_t *ks, tmpbuffers_t *bufs, int is_rev);
-CONST static inline int kfp_argmax(kingfisher_t *kfp, int index);
-static inline int kf_hamming(kingfisher_t *kf1, kingfisher_t *kf2) {
+/*
+ * Unaligned BAM counterparts of zstranded_process_write and dmp_process_write,
+ * which append the same record as a serialized BAM record (see lib/ubam.h).
+ */
+void zstranded_process_bam(kingfisher_t *kfpf, kingfisher_t *kfpr, kstring_t *ks, tmpbuffers_t *bufs);
+void dmp_process_bam(kingfisher_t *kfp, kstring_t *ks, tmpbuffers_t *bufs, int is_rev);
+/*
+ * @func kf_absorb
+ * Adds the reads of family src (with an error-containing barcode) to family dst.
+ * Both families must have the same read length.
+ */
+void kf_absorb(kingfisher_t *dst, const kingfisher_t *src);
+/*
+ * @func kf_hamming
+ * Number of cycles at which two families call different bases, ignoring Ns.
+ * :param: argmax1 [const uint8_t *] Consensus nucleotides of the first family.
+ * :param: argmax2 [const uint8_t *] Consensus nucleotides of the second family.
+ * :param: readlen [int] Length of the families' reads.
+ */
+CONST static inline int kf_hamming(const uint8_t *argmax1, const uint8_t *argmax2, int readlen) {
     int ret(0);
-    for(int i(0), argmaxret1, argmaxret2; i < kf1->readlen; ++i)
-        if((argmaxret1 = kfp_argmax(kf1, i)) != (argmaxret2 = kfp_argmax(kf2, i)))
-            ret += (argmaxret1 != 4) && (argmaxret2 != 4);
+    for(int i(0); i < readlen; ++i)
+        ret += (argmax1[i] != argmax2[i]) && (argmax1[i] != 4) && (argmax2[i] != 4);
     return ret;
 }
 
 
 static inline void kfill_both(int readlen, uint16_t *agrees, uint32_t *quals, kstring_t *ks)
 {
-    int i;
     kputsnl("FA:B:I", ks);
-    for(i = 0; i < readlen; ++i) ksprintf(ks, ",%u", agrees[i]);
+    bmf::kput_u32_array(agrees, readlen, ks);
     kputsnl("\tPV:B:I", ks);
-    for(i = 0; i < readlen; ++i) ksprintf(ks, ",%u", quals[i]);
-}
-
-static inline void pb_pos(kingfisher_t *kfp, kseq_t *seq, unsigned i) {
-    const uint32_t posdata(nuc2num(seq->seq.s[i]) + i * 5);
-    ++kfp->nuc_counts[posdata];
-    kfp->phred_sums[posdata] += seq->qual.s[i] - 33;
-    if(seq->qual.s[i] > kfp->max_phreds[posdata]) kfp->max_phreds[posdata] = seq->qual.s[i];
+    bmf::kput_u32_array(quals, readlen, ks);
 }
 
-static inline void pushback_inmem(kingfisher_t *kfp, kseq_t *seq, int offset, int pass) {
+/*
+ * @func pushback_inmem
+ * Adds a read to a family for bmftools inmem.
+ * :param: seq [const char *] Sequence of the whole read.
+ * :param: qual [const char *] Quality string of the whole read.
+ * :param: l [int] Length of the read.
+ * :param: offset [int] Start of the read after its barcode and homing sequence.
+ * :param: pass [int] 1 if the barcode passed QC.
+ */
+static inline void pushback_inmem(kingfisher_t *kfp, const char *seq, const char *qual, int l, int offset, int pass) {
     if(!kfp->length++) {
         kfp->pass_fail = pass + '0';
     } else {
-        if(kfp->readlen + offset != (int64_t)seq->seq.l) {
+        if(kfp->readlen + offset != l) {
             if(pass) return; // Don't bother, it's an error.
-            offset = seq->seq.l - kfp->readlen;
+            offset = l - kfp->readlen;
         }
     }
-    uint32_t posdata, i;
-    for(i = offset; i < seq->seq.l; ++i) {
-        posdata = nuc2num(seq->seq.s[i]) + (i - offset) * 5;
-        assert(posdata < (unsigned)kfp->readlen * 5);
-        ++kfp->nuc_counts[posdata];
-        kfp->phred_sums[posdata] += seq->qual.s[i] - 33;
-        if(seq->qual.s[i] > kfp->max_phreds[posdata])
-            kfp->max_phreds[posdata] = seq->qual.s[i];
-    }
+    assert(l - offset <= kfp->readlen);
+    kf_kernel().pushback(kfp, seq + offset, qual + offset, l - offset);
 }
 
-static inline void pushback_kseq(kingfisher_t *kfp, kseq_t *seq, int blen)
+/*
+ * @func pushback_rec
+ * Adds a marked read to a family.
+ * :param: bs [const char *] Barcode sequence, including the leading strand character (F/R/Z).
+ * :param: blen [int] Length of bs, including the strand character.
+ * :param: pass_fail [char] '1' if the barcode passed QC, '0' otherwise.
+ * :param: seq [const char *] Sequence of the read.
+ * :param: qual [const char *] Quality string of the read.
+ * :param: l [unsigned] Length of the read.
+ */
+static inline void pushback_rec(kingfisher_t *kfp, const char *bs, int blen, char pass_fail,
+                                const char *seq, const char *qual, unsigned l)
 {
     if(!kfp->length++) { // Increment while checking
-        kfp->pass_fail = seq->comment.s[FP_OFFSET];
-        std::memcpy(kfp->barcode, seq->comment.s + HASH_DMP_OFFSET, blen);
+        kfp->pass_fail = pass_fail;
+        std::memcpy(kfp->barcode, bs, blen);
         kfp->barcode[blen] = '\0';
     }
-    for(unsigned i(0); i < seq->seq.l; ++i) pb_pos(kfp, seq, i);
+    kf_kernel().pushback(kfp, seq, qual, std::min(l, (unsigned)kfp->readlen));
+}
+
+static inline void pushback_kseq(kingfisher_t *kfp, kseq_t *seq, int blen)
+{
+    pushback_rec(kfp, seq->comment.s + HASH_DMP_OFFSET, blen, seq->comment.s[FP_OFFSET],
+                 seq->seq.s, seq->qual.s, seq->seq.l);
 }
 
 
 /*
- * @func arr_max_u32
- * :param: arr [uint32_t *] 2-d array of values. 5 * index + basecall is the index to use.
- * :param: index [int] Base in read to find the maximum value for.
+ * @func kf_argmax
+ * :param: arr [const uint32_t *] Per-nucleotide lanes of values. index + readlen * basecall is the index to use.
+ * :param: readlen [unsigned] Length of each lane.
+ * :param: index [unsigned] Base in read to find the maximum value for.
  * :returns: [int] the nucleotide number for the maximum value at this index in the read.
+ * Ties go to the later nucleotide, so a tie with N is an N.
  */
-CONST static inline int arr_max_u32(uint32_t *arr, int index)
+CONST static inline int kf_argmax(const uint32_t *arr, unsigned readlen, unsigned index)
 {
-    arr += index * 5;
-    return (arr[0] > arr[1]) ? ((arr[0] > arr[2]) ? ((arr[0] > arr[3]) ? (arr[0] > arr[4] ? 0: 4)
-                                                                       : (arr[3] > arr[4] ? 3: 4))
-                                                  : (arr[2] > arr[3])  ? (arr[2] > arr[4] ? 2: 4)
-                                                                       : (arr[3] > arr[4] ? 3: 4))
-                             : ((arr[1] > arr[2]) ? ((arr[1] > arr[3]) ? (arr[1] > arr[4] ? 1: 4)
-                                                                       : (arr[3] > arr[4] ? 3: 4))
-                                                  : ((arr[2] > arr[3]) ? (arr[2] > arr[4] ? 2: 4)
-                                                                       : (arr[3] > arr[4] ? 3: 4)));
-
+    arr += index;
+    int ret(0);
+    for(int n(1); n < 5; ++n) if(arr[n * readlen] >= arr[ret * readlen]) ret = n;
+    return ret;
 }
 
 
-CONST static inline int kfp_argmax(kingfisher_t *kfp, int index)
+CONST static inline int kfp_argmax(const kingfisher_t *kfp, int index)
 {
-    return arr_max_u32(kfp->phred_sums, index);
+    return kf_argmax(kfp->phred_sums, kfp->readlen, index);
 }
 
 std::vector<double> get_igamc_threshold(int family_size, int max_phred=MAX_PV, double delta=0.002);
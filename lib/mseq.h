@@ -4,8 +4,10 @@
 #include <cstdint>
 #include <cstring>
 #include "htslib/kseq.h"
+#include "htslib/kstring.h"
 #include "dlib/compiler_util.h"
 #include "dlib/cstr_util.h"
+#include "lib/fqwriter.h"
 #include "lib/rescaler.h"
 
 #ifdef MAX_BARCODE_LENGTH
@@ -122,31 +124,59 @@ static inline int set_barcode(kseq_t *seq1, kseq_t *seq2, char *barcode, uint32_
 #define mask_mseq(seqvar, n_len) mask_mseq_chars(seqvar, n_len, 'N', '#')
 
 void mseq_destroy(mseq_t *mvar);
-mseq_t *mseq_init(kseq_t *seq, char *rescaler, int is_read2, int maxrlen=-1);
-mseq_t *mseq_rescale_init(kseq_t *seq, char *rescaler, tmp_mseq_t *tmp, int is_read2, int maxrlen=-1);
-static inline void mseq2fq_stranded(gzFile handle, mseq_t *mvar, int pass_fail, char *barcode, char prefix)
+mseq_t *mseq_init(kseq_t *seq, const Rescaler *rescaler, int is_read2, int maxrlen=-1);
+mseq_t *mseq_rescale_init(kseq_t *seq, const Rescaler *rescaler, tmp_mseq_t *tmp, int is_read2, int maxrlen=-1);
+/*
+ * @func mseq2ks_stranded
+ * Appends a marked record to a kstring as temporary fastq text:
+ * "@<name> ~#!#~|FP=<pass_fail>|BS=<prefix><barcode>\n<seq>\n+\n<qual>\n"
+ * The record is sized once and copied in with memcpy.
+ */
+static inline void mseq2ks_stranded(kstring_t *ks, mseq_t *mvar, int pass_fail, char *barcode, char prefix)
+{
+    static const char tag[] {" ~#!#~|FP="};
+    const size_t name_l(std::strlen(mvar->name)), bc_l(std::strlen(barcode)),
+                 seq_l(std::strlen(mvar->seq)), qual_l(std::strlen(mvar->qual));
+    ks_resize(ks, ks->l + name_l + bc_l + seq_l + qual_l + sizeof(tag) + 12);
+    char *p(ks->s + ks->l);
+    *p++ = '@';
+    std::memcpy(p, mvar->name, name_l), p += name_l;
+    std::memcpy(p, tag, sizeof(tag) - 1), p += sizeof(tag) - 1;
+    *p++ = pass_fail + '0';
+    std::memcpy(p, "|BS=", 4), p += 4;
+    *p++ = prefix;
+    std::memcpy(p, barcode, bc_l), p += bc_l;
+    *p++ = '\n';
+    std::memcpy(p, mvar->seq, seq_l), p += seq_l;
+    std::memcpy(p, "\n+\n", 3), p += 3;
+    std::memcpy(p, mvar->qual, qual_l), p += qual_l;
+    *p++ = '\n';
+    *p = '\0';
+    ks->l = p - ks->s;
+}
+
+static inline void mseq2fq_stranded(TmpFqWriter *handle, mseq_t *mvar, int pass_fail, char *barcode, char prefix)
 {
-    gzprintf(handle, "@%s ~#!#~|FP=%c|BS=%c%s\n%s\n+\n%s\n",
-             mvar->name, pass_fail + '0', prefix, barcode, mvar->seq, mvar->qual);
+    mseq2ks_stranded(&handle->buf, mvar, pass_fail, barcode, prefix);
+    handle->check();
 }
 
-static inline void mseq2fq(gzFile handle, mseq_t *mvar, int pass_fail, char *barcode)
+static inline void mseq2fq(TmpFqWriter *handle, mseq_t *mvar, int pass_fail, char *barcode)
 {
-    gzprintf(handle, "@%s ~#!#~|FP=%c|BS=Z%s\n%s\n+\n%s\n",
-             mvar->name, pass_fail + '0', barcode, mvar->seq, mvar->qual);
+    mseq2fq_stranded(handle, mvar, pass_fail, barcode, 'Z');
 }
 
 
 /*
  * :param: [kseq_t *] seq - kseq handle
  * :param: [mseq_t *] ret - initialized mseq_t pointer.
- * :param: [char *] rescaler - pointer to a 1-dimensional projection of a 4-dimensional array of rescaled phred scores.
+ * :param: [const Rescaler *] rescaler - quality rescaler, or null to keep qualities as they are.
  * :param: [tmp_mseq_t *] tmp - pointer to a tmp_mseq_t object
  * for holding information for conditional reverse complementing.
  * :param: [int] n_len - the number of bases to N at the beginning of each read.
  * :param: [int] is_read2 - true if the read is read2.
  */
-static inline void update_mseq(mseq_t *mvar, kseq_t *seq, char *rescaler, tmp_mseq_t *tmp, int n_len, int is_read2)
+static inline void update_mseq(mseq_t *mvar, kseq_t *seq, const Rescaler *rescaler, tmp_mseq_t *tmp, int n_len, int is_read2)
 {
     std::memcpy(mvar->name, seq->name.s, seq->name.l);
     mvar->name[seq->name.l] = '\0';
@@ -154,9 +184,7 @@ static inline void update_mseq(mseq_t *mvar, kseq_t *seq, char *rescaler, tmp_ms
     mvar->seq[seq->seq.l - n_len] = '\0';
     mvar->qual[seq->qual.l - n_len] = '\0';
     if(rescaler)
-        for(unsigned i(n_len); i < seq->seq.l; ++i)
-            mvar->qual[i - n_len] = rescale_qscore(is_read2, seq->qual.s[i], i,
-                                                   seq->seq.s[i], seq->seq.l, rescaler);
+        rescaler->rescale(mvar->qual, seq->seq.s + n_len, seq->qual.s + n_len, n_len, seq->seq.l - n_len, is_read2);
     else std::memcpy(mvar->qual, seq->qual.s + n_len, seq->qual.l - n_len);
 }
 
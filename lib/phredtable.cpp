@@ -0,0 +1,85 @@
+#include "phredtable.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "dlib/logging_util.h"
+
+namespace bmf {
+
+static const char PHRED_TABLE_MAGIC[8] {'B', 'M', 'F', 'P', 'H', 'R', 'D', '1'};
+
+PhredTable::PhredTable(uint32_t max_fm, uint32_t max_q): max_fm_(max_fm), max_q_(max_q)
+{
+    init_offsets();
+}
+
+void PhredTable::init_offsets()
+{
+    offsets_.resize(max_fm_ + 2);
+    offsets_[0] = offsets_[1] = 0;
+    for(uint32_t n(1); n <= max_fm_; ++n) offsets_[n + 1] = offsets_[n] + n * max_q_ + 1;
+    table_.resize(offsets_[max_fm_ + 1]);
+}
+
+void PhredTable::build()
+{
+    for(uint32_t n(1); n <= max_fm_; ++n)
+        for(uint32_t sum(0); sum <= n * max_q_; ++sum)
+            table_[offsets_[n] + sum] = fisher_phred(n, sum);
+}
+
+int PhredTable::read(const char *path)
+{
+    FILE *fp(fopen(path, "rb"));
+    if(!fp) return -1;
+    char magic[sizeof(PHRED_TABLE_MAGIC)];
+    uint32_t dims[2];
+    int ret(-1);
+    if(fread(magic, 1, sizeof(magic), fp) == sizeof(magic) &&
+       memcmp(magic, PHRED_TABLE_MAGIC, sizeof(magic)) == 0 &&
+       fread(dims, sizeof(uint32_t), 2, fp) == 2 && dims[0] == max_fm_ && dims[1] == max_q_ &&
+       fread(table_.data(), sizeof(uint16_t), table_.size(), fp) == table_.size() &&
+       fgetc(fp) == EOF)
+        ret = 0;
+    fclose(fp);
+    return ret;
+}
+
+int PhredTable::write(const char *path) const
+{
+    FILE *fp(fopen(path, "wb"));
+    if(!fp) return -1;
+    const uint32_t dims[2] {max_fm_, max_q_};
+    int ret((fwrite(PHRED_TABLE_MAGIC, 1, sizeof(PHRED_TABLE_MAGIC), fp) == sizeof(PHRED_TABLE_MAGIC) &&
+             fwrite(dims, sizeof(uint32_t), 2, fp) == 2 &&
+             fwrite(table_.data(), sizeof(uint16_t), table_.size(), fp) == table_.size()) ? 0: -1);
+    if(fclose(fp)) ret = -1;
+    return ret;
+}
+
+static PhredTable make_phred_table()
+{
+    PhredTable ret;
+    const char *path(getenv(PHRED_TABLE_ENV));
+    if(path && *path) {
+        if(ret.read(path) == 0) {
+            LOG_DEBUG("Loaded consensus quality table from %s.\n", path);
+            return ret;
+        }
+        ret.build();
+        if(ret.write(path)) LOG_WARNING("Could not write consensus quality table to %s.\n", path);
+        else LOG_INFO("Wrote consensus quality table to %s.\n", path);
+        return ret;
+    }
+    ret.build();
+    return ret;
+}
+
+const PhredTable &phred_table()
+{
+    static const PhredTable table(make_phred_table()); // Initialization is thread-safe in C++11.
+    return table;
+}
+
+} /* namespace bmf */
@@ -0,0 +1,67 @@
+#ifndef PHREDTABLE_H
+#define PHREDTABLE_H
+#include <cstdint>
+#include <vector>
+#include "dlib/compiler_util.h"
+#include "include/igamc_cephes.h"
+
+#define PHRED_TABLE_MAX_FM 64 // Largest family size held in the table.
+#define PHRED_TABLE_MAX_Q 93 // Largest per-read phred score ('~' - 33).
+#define PHRED_TABLE_ENV "BMF_PHRED_TABLE" // Path to a cached table, read if present and written if not.
+
+namespace bmf {
+
+/*
+ * @func fisher_phred
+ * Fisher's method: combines the phred scores of a family's reads supporting a base call into
+ * the phred-scaled p-value of the consensus call.
+ * :param: family_size [int] Number of reads in the family.
+ * :param: phred_sum [uint32_t] Sum of the phred scores supporting the base call.
+ */
+CONST static inline uint32_t fisher_phred(int family_size, uint32_t phred_sum)
+{
+    return pvalue_to_phred(igamc_pvalues(family_size, LOG10_TO_CHI2(phred_sum)));
+}
+
+/*
+ * Direct-index table of fisher_phred for family sizes up to PHRED_TABLE_MAX_FM and
+ * phred sums up to family_size * PHRED_TABLE_MAX_Q.
+ * Values outside the table (duplex positions, where both strands' sums are combined,
+ * or very large families) fall back to fisher_phred, so lookups are always exact.
+ */
+class PhredTable {
+    std::vector<uint16_t> table_;
+    std::vector<uint32_t> offsets_; // offsets_[n] is the start of family size n's row.
+    uint32_t max_fm_;
+    uint32_t max_q_;
+
+    void init_offsets();
+public:
+    PhredTable(uint32_t max_fm=PHRED_TABLE_MAX_FM, uint32_t max_q=PHRED_TABLE_MAX_Q);
+    uint32_t get(int family_size, uint32_t phred_sum) const {
+        if(LIKELY((uint32_t)family_size <= max_fm_ && phred_sum <= (uint32_t)family_size * max_q_))
+            return table_[offsets_[family_size] + phred_sum];
+        return fisher_phred(family_size, phred_sum);
+    }
+    void build();
+    /*
+     * Reads or writes the table as a binary blob.
+     * :returns: [int] 0 on success, -1 on failure. read fails on malformed blobs
+     * or blobs built with different dimensions.
+     */
+    int read(const char *path);
+    int write(const char *path) const;
+    uint32_t max_fm() const {return max_fm_;}
+    uint32_t max_q() const {return max_q_;}
+};
+
+/*
+ * @func phred_table
+ * :returns: [const PhredTable &] The process-wide table, built or loaded on first use.
+ * If PHRED_TABLE_ENV is set to a path, the table is read from it, or written to it if it cannot be read.
+ */
+const PhredTable &phred_table();
+
+} /* namespace bmf */
+
+#endif /* PHREDTABLE_H */
@@ -0,0 +1,242 @@
+#include "rescaler.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "dlib/cstr_util.h"
+#include "dlib/logging_util.h"
+#if defined(__x86_64__) || defined(__i386__)
+#    include <immintrin.h>
+#    define RS_X86 1
+#endif
+
+namespace bmf {
+
+static const char RESCALER_MAGIC[8] {'B', 'M', 'F', 'R', 'S', 'C', 'L', '2'};
+#define RESCALER_PAD 4 // Trailing bytes, so the gather kernel can read a full dword at the last entry.
+#define RS_MIN_Q 2
+#define RS_MAX_Q 93 // Largest quality a fastq can hold.
+
+static inline size_t table_size(uint32_t readlen) {return (size_t)2 * readlen * 4 * RESCALER_ROW;}
+
+static inline unsigned qual_index(char qual)
+{
+    return std::min(std::max((int)(uint8_t)qual - 35, 0), RESCALER_ROW - 1); // Subtract 33, then 2 for the first row.
+}
+
+Rescaler::Rescaler(const char *vals, uint32_t readlen): table_(table_size(readlen) + RESCALER_PAD), readlen_(readlen)
+{
+    for(int readnum(0); readnum < 2; ++readnum) {
+        for(uint32_t cycle(0); cycle < readlen; ++cycle) {
+            char *r((char *)row(readnum, cycle));
+            for(int base(0); base < 4; ++base, r += RESCALER_ROW)
+                for(unsigned q(0); q < RESCALER_ROW; ++q)
+                    r[q] = vals[((cycle * 2 + readnum) * NQSCORES + std::min(q, (unsigned)NQSCORES - 1)) * 4 + base] + 33;
+        }
+    }
+}
+
+static inline bool operator==(const rescaler_stamp_t &a, const rescaler_stamp_t &b)
+{
+    return a.size == b.size && a.mtime_sec == b.mtime_sec && a.mtime_nsec == b.mtime_nsec;
+}
+
+int rescaler_stamp(const char *path, rescaler_stamp_t *ret)
+{
+    struct stat st;
+    if(stat(path, &st)) return -1;
+#ifdef __APPLE__
+    *ret = {(uint64_t)st.st_size, st.st_mtimespec.tv_sec, st.st_mtimespec.tv_nsec};
+#else
+    *ret = {(uint64_t)st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+#endif
+    return 0;
+}
+
+Rescaler::Rescaler(const char *path): readlen_(0)
+{
+    rescaler_stamp_t source;
+    if(rescaler_stamp(path, &source)) LOG_EXIT("Could not open file %s. Abort mission!\n", path);
+    const std::string cache_path(std::string(path) + RESCALER_CACHE_SUFFIX);
+    if(read(cache_path.c_str(), source) == 0) {
+        LOG_DEBUG("Loaded rescaler from %s.\n", cache_path.c_str());
+        return;
+    }
+    parse(path);
+    // The cache is optional: the text file may be somewhere read-only.
+    if(write(cache_path.c_str(), source)) LOG_DEBUG("Could not cache rescaler at %s.\n", cache_path.c_str());
+}
+
+/*
+ * Values are truncated to integers (bmftools err writes integers) and limited to qualities a fastq can hold.
+ */
+void Rescaler::parse(const char *path)
+{
+    FILE *fp(fopen(path, "rb"));
+    if(fp == nullptr) LOG_EXIT("Could not open file %s. Abort mission!\n", path);
+    std::string buf;
+    char tmp[1 << 16];
+    for(size_t n; (n = fread(tmp, 1, sizeof(tmp), fp)) > 0;) buf.append(tmp, n);
+    fclose(fp);
+    std::vector<char> vals;
+    vals.reserve(buf.size() / 2);
+    size_t n_capped(0);
+    for(const char *p(buf.c_str()), *end; *p;) {
+        errno = 0;
+        long v(strtol(p, (char **)&end, 10));
+        if(end == p || errno) LOG_EXIT("Malformed rescaler %s at byte %li. Abort!\n", path, (long)(p - buf.c_str()));
+        if(*end == '.') while(isdigit(*++end));
+        if(v > RS_MAX_Q) v = RS_MAX_Q, ++n_capped;
+        else if(v < RS_MIN_Q) v = RS_MIN_Q;
+        vals.push_back(v);
+        while(*end == '|' || *end == ':' || *end == ',' || isspace(*end)) ++end;
+        p = end;
+    }
+    const size_t per_cycle(2 * NQSCORES * 4);
+    if(vals.empty() || vals.size() % per_cycle)
+        LOG_EXIT("Rescaler %s has %lu values, which is not a multiple of %lu per cycle. Abort!\n",
+                 path, vals.size(), per_cycle);
+    if(n_capped)
+        LOG_WARNING("%lu rescaled quality scores in %s are above the max that can be held in the fastq format. "
+                    "Capping them at 93.\n", n_capped, path);
+    LOG_DEBUG("Parsed rescaler for read length %lu from %s.\n", vals.size() / per_cycle, path);
+    *this = Rescaler(vals.data(), vals.size() / per_cycle);
+}
+
+int Rescaler::read(const char *path, const rescaler_stamp_t &source)
+{
+    FILE *fp(fopen(path, "rb"));
+    if(!fp) return -1;
+    char magic[sizeof(RESCALER_MAGIC)];
+    rescaler_stamp_t stamp;
+    uint32_t readlen;
+    int ret(-1);
+    if(fread(magic, 1, sizeof(magic), fp) == sizeof(magic) &&
+       memcmp(magic, RESCALER_MAGIC, sizeof(magic)) == 0 &&
+       fread(&stamp, sizeof(stamp), 1, fp) == 1 && stamp == source &&
+       fread(&readlen, sizeof(readlen), 1, fp) == 1 && readlen) {
+        std::vector<char> table(table_size(readlen) + RESCALER_PAD);
+        if(fread(table.data(), 1, table_size(readlen), fp) == table_size(readlen) && fgetc(fp) == EOF) {
+            table_.swap(table), readlen_ = readlen;
+            ret = 0;
+        }
+    }
+    fclose(fp);
+    return ret;
+}
+
+int Rescaler::write(const char *path, const rescaler_stamp_t &source) const
+{
+    // Unique per process, so concurrent runs sharing a rescaler don't write over each other's temporary file.
+    const std::string tmp_path(std::string(path) + ".tmp." + std::to_string(getpid()));
+    FILE *fp(fopen(tmp_path.c_str(), "wb"));
+    if(!fp) return -1;
+    int ret((fwrite(RESCALER_MAGIC, 1, sizeof(RESCALER_MAGIC), fp) == sizeof(RESCALER_MAGIC) &&
+             fwrite(&source, sizeof(source), 1, fp) == 1 &&
+             fwrite(&readlen_, sizeof(readlen_), 1, fp) == 1 &&
+             fwrite(table_.data(), 1, table_size(readlen_), fp) == table_size(readlen_)) ? 0: -1);
+    if(fclose(fp)) ret = -1;
+    if(ret == 0 && rename(tmp_path.c_str(), path)) ret = -1;
+    if(ret) remove(tmp_path.c_str());
+    return ret;
+}
+
+char Rescaler::get(int readnum, unsigned cycle, char base, char qual) const
+{
+    return base == 'N' ? '#': row(readnum, cycle)[nuc2num_acgt(base) * RESCALER_ROW + qual_index(qual)];
+}
+
+/*
+ * Kernels take the rows of the first cycle to rescale.
+ */
+typedef void (*rescale_fn)(const char *rows, char *out, const char *seq, const char *qual, unsigned l);
+
+static void rescale_range(const char *rows, char *out, const char *seq, const char *qual, unsigned start, unsigned l)
+{
+    for(unsigned i(start); i < l; ++i)
+        out[i] = seq[i] == 'N' ? '#': rows[(i * 4 + nuc2num_acgt(seq[i])) * RESCALER_ROW + qual_index(qual[i])];
+}
+
+static void rescale_scalar(const char *rows, char *out, const char *seq, const char *qual, unsigned l)
+{
+    rescale_range(rows, out, seq, qual, 0, l);
+}
+
+#if RS_X86
+
+/*
+ * AVX2: 8 cycles per iteration. Every cycle has its own rows, so a shuffle over one table can't serve
+ * a vector of cycles; instead the byte offsets of all 8 lookups are computed at once and gathered.
+ */
+__attribute__((target("avx2")))
+static void rescale_avx2(const char *rows, char *out, const char *seq, const char *qual, unsigned l)
+{
+    const __m256i cycle_offsets(_mm256_setr_epi32(0, 1 * 4 * RESCALER_ROW, 2 * 4 * RESCALER_ROW, 3 * 4 * RESCALER_ROW,
+                                                  4 * 4 * RESCALER_ROW, 5 * 4 * RESCALER_ROW, 6 * 4 * RESCALER_ROW,
+                                                  7 * 4 * RESCALER_ROW));
+    const __m256i c(_mm256_set1_epi32('C')), g(_mm256_set1_epi32('G')), t(_mm256_set1_epi32('T')),
+                  n(_mm256_set1_epi32('N')), hash(_mm256_set1_epi32('#'));
+    const __m256i qoff(_mm256_set1_epi32(35)), qmax(_mm256_set1_epi32(RESCALER_ROW - 1)), zero(_mm256_setzero_si256());
+    const __m256i low_bytes(_mm256_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                             0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1));
+    unsigned i(0);
+    for(; i + 8 <= l; i += 8) {
+        const __m256i s(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(seq + i))));
+        __m256i q(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(qual + i))));
+        q = _mm256_min_epi32(_mm256_max_epi32(_mm256_sub_epi32(q, qoff), zero), qmax);
+        // nuc2num_acgt: C, G and T are 1, 2 and 3; anything else uses A's row.
+        const __m256i code(_mm256_or_si256(_mm256_or_si256(_mm256_and_si256(_mm256_cmpeq_epi32(s, c), _mm256_set1_epi32(1)),
+                                                           _mm256_and_si256(_mm256_cmpeq_epi32(s, g), _mm256_set1_epi32(2))),
+                                           _mm256_and_si256(_mm256_cmpeq_epi32(s, t), _mm256_set1_epi32(3))));
+        const __m256i idx(_mm256_add_epi32(_mm256_add_epi32(cycle_offsets, _mm256_slli_epi32(code, 6)), q));
+        static_assert(RESCALER_ROW == 1 << 6, "The AVX2 rescaler kernel shifts by log2(RESCALER_ROW).");
+        __m256i v(_mm256_i32gather_epi32((const int *)(rows + (size_t)i * 4 * RESCALER_ROW), idx, 1));
+        v = _mm256_blendv_epi8(v, hash, _mm256_cmpeq_epi32(s, n));
+        v = _mm256_shuffle_epi8(v, low_bytes);
+        _mm_storel_epi64((__m128i *)(out + i),
+                         _mm_unpacklo_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)));
+    }
+    rescale_range(rows, out, seq, qual, i, l);
+}
+
+static rescale_fn select_kernel(const char **name)
+{
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) return *name = "avx2", &rescale_avx2;
+    return *name = "scalar", &rescale_scalar;
+}
+
+#else
+
+static rescale_fn select_kernel(const char **name) {return *name = "scalar", &rescale_scalar;}
+
+#endif /* RS_X86 */
+
+struct rescale_kernel_t {
+    const char *name;
+    rescale_fn fn;
+    rescale_kernel_t(): fn(select_kernel(&name)) {}
+};
+
+static const rescale_kernel_t &rescale_kernel()
+{
+    static const rescale_kernel_t ret; // Initialization is thread-safe in C++11.
+    return ret;
+}
+
+const char *rescale_kernel_name() {return rescale_kernel().name;}
+
+void Rescaler::rescale(char *out, const char *seq, const char *qual, unsigned start, unsigned l, int readnum) const
+{
+    if(start + l > readlen_)
+        LOG_EXIT("Read of length %u is longer than the rescaler's read length, %u. Abort!\n", start + l, readlen_);
+    rescale_kernel().fn(row(readnum, start), out, seq, qual, l);
+}
+
+} /* namespace bmf */
@@ -1,107 +1,96 @@
 #ifndef ARRAY_PARSER_H
 #define ARRAY_PARSER_H
-#include <assert.h>
+#include <cstdint>
+#include <vector>
 #include "dlib/io_util.h"
 
 #define NQSCORES 45uL // Number of q scores in sequencing.
-
-#ifdef __GNUC__
-#define INLINE __attribute__((always_inline)) inline
-#else
-#define INLINE inline
-#endif
+#define RESCALER_ROW 64 // Bytes per [readnum][cycle][base] row of a Rescaler: NQSCORES, padded to a cache line.
+#define RESCALER_CACHE_SUFFIX ".bmfrs" // Binary cache written next to a flat text rescaler.
 
 namespace bmf {
 
-#if !NDEBUG
-// The rescale_qscore is a little obfuscated. A human-readable equivalent is included before it.
-// In debug mode, it asserts that both versions return the same value.
-CONST static INLINE char rescale_qscore_check(int readnum, char qscore, int cycle, char base, int readlen, char *rescaler)
-{
-    if(base == 'N') return '#';
-    int index(readnum);
-    int mult(2);
-    index += cycle * mult;
-    mult *= readlen;
-    index += (qscore - 35) * mult; // Subtract 35 - 33 to get to phred space, 2 to offset by 2.
-    mult *= NQSCORES;
-    index += mult * nuc2num_acgt(base);
-    return rescaler[index] + 33;
-}
-#endif // !NDEBUG for rescale_qscore_check.
-
 /*
- * @func rescale_qscore
- * Returns a rescaled qscore using readnumber, qscore, cycle, base call, and an associated rescaling array.
- * :param: readnum [int] 0 if 1, 1 if read 2
- * :param: qscore [char] Character in quality string, with 33 offset. (e.g., '#' means 0.)
- * :param: cycle [int] Cycle number on the sequencer, 0-based.
- * :param: base [char] base call at position.
- * @discussion: Note - the rescaled q score in the flat text file has not been offset by 33.
- * This was done to make it more human-readable, though it does necessitate incrementing the quality score
- * by 33 each time a qscore is returned. Thoughts?
- *
+ * Identifies the version of a text rescaler a cache was built from.
  */
-CONST static INLINE char rescale_qscore(int readnum, char qscore, int cycle, char base, int readlen, char *rescaler) {
-    return (base == 'N') ? '#'
-                         : rescaler[readnum + (cycle << 1) + (readlen << 1) * (qscore - 35) + (NQSCORES * (readlen << 1)) * nuc2num_acgt(base)] + 33;
-}
+struct rescaler_stamp_t {
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+};
 
-static void period_to_null(char *c)
-{
-    for(;*c;++c) if(*c == '.') *c = 0;
-}
+/*
+ * @func rescaler_stamp
+ * :returns: [int] 0 on success, -1 if path can't be stat'd.
+ */
+int rescaler_stamp(const char *path, rescaler_stamp_t *ret);
 
+/*
+ * Rescales base qualities with the flat text tables written by bmftools err fm.
+ *
+ * Each line of the text file is one cycle, holding read 1's and read 2's tables separated by '|'.
+ * Each table is NQSCORES comma-separated groups of 4 colon-separated values, one per base (ACGT),
+ * for original phred scores 2 through NQSCORES + 1.
+ *
+ * The table is held as [readnum][cycle][base][qscore], with each row padded to RESCALER_ROW bytes
+ * and already offset by 33, so a read's lookups walk forward through its own rows.
+ * Quality scores outside the table are clamped to its ends.
+ *
+ * Parsed tables are cached in binary at <path>RESCALER_CACHE_SUFFIX, along with the text file's
+ * size and modification time. The cache is only used while both still match exactly.
+ */
+class Rescaler {
+    std::vector<char> table_;
+    uint32_t readlen_;
 
-static inline char *parse_1d_rescaler(char *qual_rescale_fname)
-{
-    int length, lnum;
-    size_t arr_len, index;
-    FILE *fp;
-    char *buffer, *ret, *tok;
-    const int readlen(dlib::count_lines(qual_rescale_fname));
-    LOG_DEBUG("Number of lines: %i.\n", readlen);
-    if((fp = fopen(qual_rescale_fname, "rb")) == nullptr) {
-        LOG_EXIT("Could not open file %s. Abort mission!\n", qual_rescale_fname);
-    }
-    // Get the length of the file contents.
-    fseek(fp, 0, SEEK_END);
-    length = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    buffer = (char *)malloc((size_t)length);
-    if(!buffer) LOG_EXIT("Could not allocate memory.\n");
-    fread(buffer, 1, length, fp);
-    fclose(fp), fp = nullptr;
-    arr_len = 2 * readlen * NQSCORES * 4;
-    ret = (char *)malloc(arr_len * sizeof(char));
-    memset(ret, -127, arr_len); // Set all of these char values to -127, which is definitely unprintable
-    tok = nullptr;
-    index = 0;
-    LOG_DEBUG("Parsing in array with read len %lu from %s...\n",
-              arr_len, qual_rescale_fname);
-    for(lnum = 0; lnum < readlen; ++lnum) {
-        for(int readnum = 0; readnum < 2; ++readnum) {
-            for(unsigned qnum = 0; qnum < NQSCORES; ++qnum) {
-                for(int bnum = 0; bnum < 4; ++bnum) {
-                    if((tok = strtok(tok ? nullptr : buffer, "|:,\n")) == nullptr)
-                        break;
-                    period_to_null(tok);
-                    ret[index++] = static_cast<char>(atof(tok) + 0.5); // Round up.
-                    if(ret[index - 1] > 93) {
-                        LOG_WARNING("Rescaled quality score above the max"
-                                    " that can be held in the fastq format. Capping at 93. Value: %i.\n",
-                                    ret[index - 1]);
-                        ret[index - 1] = 93;
-                    } else if(ret[index - 1] < 2) ret[index - 1] = 2;
-                }
-            }
-        }
+    void parse(const char *path);
+public:
+    /*
+     * Loads the rescaler at path, from its binary cache if it is up to date.
+     */
+    explicit Rescaler(const char *path);
+    /*
+     * Builds a rescaler for readlen cycles from values in the order they appear in the text file,
+     * [cycle][readnum][qscore][base], not offset by 33.
+     */
+    Rescaler(const char *vals, uint32_t readlen);
+    /*
+     * @func rescale
+     * Writes rescaled quality scores for l cycles of a read starting at cycle start.
+     * Bases called N get '#'. Bases other than ACGTN use A's table.
+     * :param: out [char *] Output quality string, l long. May alias qual.
+     * :param: seq [const char *] Base calls from cycle start.
+     * :param: qual [const char *] Quality string from cycle start, with 33 offset.
+     * :param: start [unsigned] Cycle of seq[0], 0-based.
+     * :param: l [unsigned] Number of cycles.
+     * :param: readnum [int] 0 for read 1, 1 for read 2.
+     */
+    void rescale(char *out, const char *seq, const char *qual, unsigned start, unsigned l, int readnum) const;
+    /*
+     * @func get
+     * :returns: [char] Rescaled quality of a single base, with 33 offset.
+     */
+    char get(int readnum, unsigned cycle, char base, char qual) const;
+    /*
+     * Reads or writes the table as a binary blob, tagged with the stamp of the text file it came from.
+     * write goes through a temporary file renamed into place, so readers never see a partial blob.
+     * :returns: [int] 0 on success, -1 on failure. read fails on malformed blobs
+     * and on blobs from any other version of the text file.
+     */
+    int read(const char *path, const rescaler_stamp_t &source);
+    int write(const char *path, const rescaler_stamp_t &source) const;
+    uint32_t readlen() const {return readlen_;}
+    bool operator==(const Rescaler &o) const {return readlen_ == o.readlen_ && table_ == o.table_;}
+    const char *row(int readnum, unsigned cycle) const {
+        return table_.data() + (size_t)(readnum * readlen_ + cycle) * 4 * RESCALER_ROW;
     }
-    assert(index == arr_len);
-    assert(lnum == readlen);
-    free(buffer);
-    return ret;
-}
+};
+
+/*
+ * @func rescale_kernel_name
+ * :returns: [const char *] Name of the kernel Rescaler::rescale dispatches to on this CPU.
+ */
+const char *rescale_kernel_name();
 
 } /* namespace bmf */
 
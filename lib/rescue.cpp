@@ -0,0 +1,105 @@
+#include "rescue.h"
+
+#include <algorithm>
+
+namespace bmf {
+
+static const uint8_t BASE_CODES[4] {1, 2, 4, 8}; // A, C, G, T in BAM's 4-bit encoding.
+static const uint8_t N_CODE(15);
+
+/*
+ * :returns: [int] Whether c is one of A, C, G or T rather than N or another ambiguity code.
+ */
+static inline int is_base(uint8_t c)
+{
+    return c && !(c & (c - 1));
+}
+
+static inline uint64_t block_seed(const bam1_t *b, int s)
+{
+    return (0xcbf29ce484222325uLL ^ ((uint64_t)s << 48 | (uint64_t)b->core.l_qname << 32 | (uint32_t)b->core.l_qseq))
+           * 0x100000001b3uLL;
+}
+
+static inline uint64_t hash_base(uint64_t h, uint8_t c)
+{
+    return (h ^ c) * 0x100000001b3uLL;
+}
+
+void RescueIndex::reset(int mmlim)
+{
+    n_blocks_ = mmlim + 1;
+    n_ = 0;
+    buckets_.clear();
+    masked_.assign(n_blocks_, std::vector<uint32_t>());
+    wild_.clear();
+}
+
+/*
+ * Fills keys_ with block s of b, once for each of the sequences its Ns could stand for.
+ * :returns: [int] 0, -1 if the block holds more than RESCUE_MAX_EXPAND Ns, or -2 if it holds another ambiguity code.
+ */
+int RescueIndex::block_keys(const bam1_t *b, int s)
+{
+    const uint8_t *const seq(bam_get_seq(b));
+    const int start(s * b->core.l_qseq / n_blocks_), end((s + 1) * b->core.l_qseq / n_blocks_);
+    int npos[RESCUE_MAX_EXPAND], n_ns(0);
+    for(int i(start); i < end; ++i) {
+        const uint8_t c(bam_seqi(seq, i));
+        if(c == N_CODE) {
+            if(n_ns == RESCUE_MAX_EXPAND) return -1;
+            npos[n_ns++] = i;
+        } else if(!is_base(c)) return -2;
+    }
+    keys_.clear();
+    for(int combo(0); combo < 1 << (2 * n_ns); ++combo) {
+        uint64_t h(block_seed(b, s));
+        for(int i(start), k(0); i < end; ++i)
+            h = hash_base(h, k < n_ns && i == npos[k] ? BASE_CODES[(combo >> (2 * k++)) & 3]: bam_seqi(seq, i));
+        keys_.push_back(h);
+    }
+    return 0;
+}
+
+void RescueIndex::add(const bam1_t *b, uint32_t idx)
+{
+    if(idx >= n_) n_ = idx + 1;
+    for(int s(0); s < n_blocks_; ++s) {
+        switch(block_keys(b, s)) {
+        case 0: for(const uint64_t key: keys_) buckets_[key].push_back(idx); break;
+        case -1: masked_[s].push_back(idx); break;
+        default: wild_.push_back(idx); return;
+        }
+    }
+}
+
+void RescueIndex::all_after(uint32_t after)
+{
+    candidates_.clear();
+    for(uint32_t i(after + 1); i < n_; ++i) candidates_.push_back(i);
+}
+
+const std::vector<uint32_t> &RescueIndex::candidates(const bam1_t *b, uint32_t after)
+{
+    candidates_.clear();
+    auto append = [&](const std::vector<uint32_t> &idx) {
+        for(const uint32_t i: idx) if(i > after) candidates_.push_back(i);
+    };
+    for(int s(0); s < n_blocks_; ++s) {
+        if(block_keys(b, s)) {
+            all_after(after);
+            return candidates_;
+        }
+        for(const uint64_t key: keys_) {
+            auto it(buckets_.find(key));
+            if(it != buckets_.end()) append(it->second);
+        }
+        append(masked_[s]);
+    }
+    append(wild_);
+    std::sort(candidates_.begin(), candidates_.end());
+    candidates_.erase(std::unique(candidates_.begin(), candidates_.end()), candidates_.end());
+    return candidates_;
+}
+
+} /* namespace bmf */
@@ -0,0 +1,60 @@
+#ifndef RESCUE_H
+#define RESCUE_H
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include "htslib/sam.h"
+
+#define RESCUE_INDEX_MIN 32 // Stacks smaller than this are compared pair by pair.
+#define RESCUE_MAX_EXPAND 2 // Most Ns in one block expanded to each of ACGT. Blocks with more match every record.
+
+namespace bmf {
+
+/*
+ * Candidate index for positional rescue (bmftools rsq).
+ *
+ * Reads whose sequences differ at no more than mmlim positions, not counting positions where either is N,
+ * agree exactly in at least one of mmlim + 1 blocks (pigeonhole), so each record is only checked against
+ * records which share a block with it instead of against the whole stack.
+ * An N matches any base, so a block with up to RESCUE_MAX_EXPAND Ns is indexed and looked up as each of the
+ * sequences its Ns could stand for. Records with more Ns in a block are kept in that block's masked list,
+ * which every query includes, and queries with more Ns in a block, or with other ambiguity codes, return every record.
+ * Keys also hold the read and name lengths, so records which could never be merged rarely share a bucket.
+ *
+ * Records are merged in place, which changes their sequences, so a record is added again after each merge.
+ * Its old entries are left, since extra candidates only cost a distance check.
+ */
+class RescueIndex {
+    int n_blocks_;
+    uint32_t n_; // One past the largest index added.
+    std::unordered_map<uint64_t, std::vector<uint32_t>> buckets_;
+    std::vector<std::vector<uint32_t>> masked_; // Records with more than RESCUE_MAX_EXPAND Ns in each block.
+    std::vector<uint32_t> wild_; // Records with ambiguity codes other than N.
+    std::vector<uint32_t> candidates_;
+    std::vector<uint64_t> keys_;
+
+    int block_keys(const bam1_t *b, int s);
+    void all_after(uint32_t after);
+
+public:
+    RescueIndex(int mmlim=0): n_blocks_(mmlim + 1), n_(0), masked_(n_blocks_) {}
+    /*
+     * Empties the index and sets the mismatch limit for the next stack.
+     */
+    void reset(int mmlim);
+    /*
+     * Indexes record idx, or indexes it again after its sequence has changed.
+     */
+    void add(const bam1_t *b, uint32_t idx);
+    /*
+     * :param: b [const bam1_t *] Query record.
+     * :param: after [uint32_t] Only records with larger indices are returned.
+     * :returns: [const std::vector<uint32_t> &] Indices of every record after which could be within mmlim of b,
+     *                                           in increasing order, without duplicates. Valid until the next call.
+     */
+    const std::vector<uint32_t> &candidates(const bam1_t *b, uint32_t after);
+};
+
+} /* namespace bmf */
+
+#endif /* RESCUE_H */
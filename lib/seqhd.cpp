@@ -0,0 +1,112 @@
+#include "seqhd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#    include <immintrin.h>
+#    define HD_X86 1
+#endif
+
+namespace bmf {
+
+static const uint64_t NIBBLE_LOW_BITS(0x1111111111111111uLL);
+
+/*
+ * :returns: [int] Mismatches between the 16 bases packed in a and b, not counting Ns.
+ */
+static inline int word_hd(uint64_t a, uint64_t b)
+{
+    const uint64_t x(a ^ b);
+    // Bit 0 of each nibble is set in diff if the bases differ and in n if either is N (all four bits set).
+    const uint64_t diff((x | x >> 1 | x >> 2 | x >> 3) & NIBBLE_LOW_BITS);
+    const uint64_t n((a & a >> 1 & a >> 2 & a >> 3) | (b & b >> 1 & b >> 2 & b >> 3));
+    return __builtin_popcountll(diff & ~n);
+}
+
+/*
+ * Loads up to 8 bytes, low byte first, so that nibbles keep their place in every byte on any platform.
+ */
+static inline uint64_t load_bytes(const uint8_t *p, int n)
+{
+    uint64_t ret(0);
+    for(int i(0); i < n; ++i) ret |= (uint64_t)p[i] << (i << 3);
+    return ret;
+}
+
+static int hd_swar(const uint8_t *a, const uint8_t *b, int l, int lim)
+{
+    const int n_bytes(l >> 1);
+    int hd(0), i(0);
+    for(; i + 8 <= n_bytes; i += 8)
+        if((hd += word_hd(load_bytes(a + i, 8), load_bytes(b + i, 8))) > lim)
+            return hd;
+    // Remaining whole bytes, then the last base if l is odd, which is the high nibble of its byte.
+    const int tail(n_bytes - i);
+    uint64_t wa(load_bytes(a + i, tail)), wb(load_bytes(b + i, tail));
+    if(l & 1) wa |= (uint64_t)(a[n_bytes] & 0xf0) << (tail << 3), wb |= (uint64_t)(b[n_bytes] & 0xf0) << (tail << 3);
+    return hd + word_hd(wa, wb);
+}
+
+const seq_hd_kernel_t &seq_hd_kernel_swar()
+{
+    static const seq_hd_kernel_t ret{&hd_swar, "swar"};
+    return ret;
+}
+
+#if HD_X86
+
+/*
+ * AVX2: 64 bases per iteration. Each byte of the mismatch mask has bit 0 set for its low nibble
+ * and bit 4 for its high nibble, which are summed per byte and then across the vector with sad.
+ * 16-bit shifts carry bits across bytes only into bits the masks clear.
+ */
+__attribute__((target("avx2")))
+static int hd_avx2(const uint8_t *a, const uint8_t *b, int l, int lim)
+{
+    const int n_bytes(l >> 1);
+    const __m256i low_bits(_mm256_set1_epi8(0x11)), ones(_mm256_set1_epi8(1)), zero(_mm256_setzero_si256());
+    int hd(0), i(0);
+    for(; i + 32 <= n_bytes; i += 32) {
+        const __m256i va(_mm256_loadu_si256((const __m256i *)(a + i))), vb(_mm256_loadu_si256((const __m256i *)(b + i)));
+        const __m256i x(_mm256_xor_si256(va, vb));
+        const __m256i diff(_mm256_and_si256(_mm256_or_si256(_mm256_or_si256(x, _mm256_srli_epi16(x, 1)),
+                                                            _mm256_or_si256(_mm256_srli_epi16(x, 2), _mm256_srli_epi16(x, 3))),
+                                            low_bits));
+        const __m256i na(_mm256_and_si256(_mm256_and_si256(va, _mm256_srli_epi16(va, 1)),
+                                          _mm256_and_si256(_mm256_srli_epi16(va, 2), _mm256_srli_epi16(va, 3))));
+        const __m256i nb(_mm256_and_si256(_mm256_and_si256(vb, _mm256_srli_epi16(vb, 1)),
+                                          _mm256_and_si256(_mm256_srli_epi16(vb, 2), _mm256_srli_epi16(vb, 3))));
+        const __m256i mm(_mm256_andnot_si256(_mm256_or_si256(na, nb), diff));
+        const __m256i counts(_mm256_add_epi8(_mm256_and_si256(mm, ones), _mm256_and_si256(_mm256_srli_epi16(mm, 4), ones)));
+        const __m256i sums(_mm256_sad_epu8(counts, zero));
+        const __m128i s(_mm_add_epi64(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1)));
+        if((hd += _mm_cvtsi128_si32(s) + _mm_extract_epi32(s, 2)) > lim) return hd;
+    }
+    return hd + hd_swar(a + i, b + i, l - (i << 1), lim - hd);
+}
+
+const seq_hd_kernel_t &seq_hd_kernel_avx2()
+{
+    static const seq_hd_kernel_t ret{&hd_avx2, "avx2"};
+    return ret;
+}
+
+static const seq_hd_kernel_t &select_kernel()
+{
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) return seq_hd_kernel_avx2();
+    return seq_hd_kernel_swar();
+}
+
+#else
+
+const seq_hd_kernel_t &seq_hd_kernel_avx2() {return seq_hd_kernel_swar();}
+static const seq_hd_kernel_t &select_kernel() {return seq_hd_kernel_swar();}
+
+#endif /* HD_X86 */
+
+const seq_hd_kernel_t &seq_hd_kernel()
+{
+    static const seq_hd_kernel_t &ret(select_kernel());
+    return ret;
+}
+
+} /* namespace bmf */
@@ -0,0 +1,36 @@
+#ifndef SEQHD_H
+#define SEQHD_H
+#include <cstdint>
+
+namespace bmf {
+
+/*
+ * Hamming distance kernels over BAM's 4-bit packed sequences (two bases per byte, high nibble first).
+ * Positions where either sequence is N (0xf) are not counted, as in read_hd (src/bmf_rsq.h).
+ * Bytes are compared a word or a vector at a time: the XOR of the two buffers is nonzero in each
+ * mismatching nibble, from which nibbles which are N in either sequence are masked before counting.
+ */
+struct seq_hd_kernel_t {
+    /*
+     * :param: a [const uint8_t *] Packed sequence, as from bam_get_seq.
+     * :param: b [const uint8_t *] Packed sequence of the same length.
+     * :param: l [int] Number of bases.
+     * :param: lim [int] Mismatch limit. Counting stops once it has been passed.
+     * :returns: [int] The distance if it is at most lim, otherwise some value greater than lim.
+     */
+    int (*hd)(const uint8_t *a, const uint8_t *b, int l, int lim);
+    const char *name;
+};
+
+const seq_hd_kernel_t &seq_hd_kernel_swar(); // 16 bases per 64-bit word.
+const seq_hd_kernel_t &seq_hd_kernel_avx2(); // Falls back to swar if not compiled for x86.
+
+/*
+ * @func seq_hd_kernel
+ * :returns: [const seq_hd_kernel_t &] The fastest kernel supported by this CPU, chosen on first use.
+ */
+const seq_hd_kernel_t &seq_hd_kernel();
+
+} /* namespace bmf */
+
+#endif /* SEQHD_H */
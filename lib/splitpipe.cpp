@@ -0,0 +1,221 @@
+#include "splitpipe.h"
+
+#include <algorithm>
+#include <cassert>
+#include "dlib/logging_util.h"
+
+namespace bmf {
+
+void fq_batch_t::add(const fq_view_t &rec)
+{
+    const size_t start(data.size());
+    data.resize(start + rec.name_l + 2 * rec.l + 3);
+    char *p(data.data() + start);
+    recs.push_back(fq_rec_t{(uint32_t)start, (uint32_t)(start + rec.name_l + 1),
+                            (uint32_t)(start + rec.name_l + rec.l + 2), rec.name_l, rec.l});
+    std::memcpy(p, rec.name, rec.name_l), p += rec.name_l, *p++ = '\0';
+    std::memcpy(p, rec.seq, rec.l), p += rec.l, *p++ = '\0';
+    std::memcpy(p, rec.qual, rec.l), p[rec.l] = '\0';
+}
+
+SplitPipeline::SplitPipeline(marksplit_settings_t *settings, mark_splitter_t *splitter,
+                             const std::vector<char *> &paths):
+    settings_(settings), splitter_(splitter), n_inputs_(paths.size()),
+    n_workers_(std::max(settings->threads, 1)),
+    n_writers_(std::min(std::max(settings->threads, 1), splitter->n_handles)),
+    max_batches_(2 * n_workers_ + 2),
+    next_id_(0), count_(0), ended_(0), workers_done_(0)
+{
+    assert(n_inputs_ > 0 && n_inputs_ <= SPLIT_MAX_INPUTS);
+    const int decompress_threads(fq_reader_threads(settings->threads, n_inputs_));
+    for(int i(0); i < n_inputs_; ++i) {
+        readers_[i].in = new FqReader(paths[i], decompress_threads);
+        readers_[i].n_batches = 0;
+        readers_[i].done = 0;
+    }
+    // Enough outputs for every worker to hold one while others wait on writers.
+    for(size_t i(0); i < max_batches_; ++i)
+        outs_.push_back(new split_out_t(splitter->n_handles, splitter->tmp_out_handles_r2 != nullptr, settings->binary_tmp));
+    free_outs_ = outs_;
+    for(int i(0); i < n_inputs_; ++i) reader_threads_.emplace_back(&SplitPipeline::read, this, i);
+    for(int i(0); i < n_writers_; ++i) writer_threads_.emplace_back(&SplitPipeline::write, this, i);
+    LOG_DEBUG("Splitting with %i reader(s), %i worker(s) and %i writer(s).\n", n_inputs_, n_workers_, n_writers_);
+}
+
+SplitPipeline::~SplitPipeline()
+{
+    {
+        std::lock_guard<std::mutex> lock(in_m_);
+        ended_ = 1;
+    }
+    in_cv_.notify_all();
+    for(auto &t: reader_threads_) if(t.joinable()) t.join();
+    {
+        std::lock_guard<std::mutex> lock(out_m_);
+        workers_done_ = 1;
+    }
+    out_cv_.notify_all();
+    for(auto &t: writer_threads_) if(t.joinable()) t.join();
+    for(int i(0); i < n_inputs_; ++i) {
+        split_reader_t &r(readers_[i]);
+        for(auto b: r.q) delete b;
+        for(auto b: r.free_batches) delete b;
+        delete r.in;
+    }
+    for(auto o: outs_) delete o;
+}
+
+void SplitPipeline::read(int i)
+{
+    split_reader_t &r(readers_[i]);
+    fq_view_t rec;
+    for(;;) {
+        fq_batch_t *b;
+        {
+            std::unique_lock<std::mutex> lock(in_m_);
+            in_cv_.wait(lock, [&]() {return ended_ || r.free_batches.size() || r.n_batches < max_batches_;});
+            if(ended_) break;
+            if(r.free_batches.size()) b = r.free_batches.back(), r.free_batches.pop_back();
+            else b = new fq_batch_t, ++r.n_batches;
+        }
+        b->clear();
+        while(b->recs.size() < SPLIT_BATCH_SIZE && r.in->next(&rec)) b->add(rec);
+        const size_t n(b->recs.size());
+        {
+            std::lock_guard<std::mutex> lock(in_m_);
+            if(n) r.q.push_back(b);
+            else r.free_batches.push_back(b);
+        }
+        in_cv_.notify_all();
+        if(n < SPLIT_BATCH_SIZE) break;
+    }
+    {
+        std::lock_guard<std::mutex> lock(in_m_);
+        r.done = 1;
+    }
+    in_cv_.notify_all();
+}
+
+int SplitPipeline::first(kseq_t *seqs)
+{
+    std::unique_lock<std::mutex> lock(in_m_);
+    for(int i(0); i < n_inputs_; ++i) {
+        split_reader_t &r(readers_[i]);
+        in_cv_.wait(lock, [&]() {return r.q.size() || r.done;});
+        if(r.q.empty()) return 0;
+        std::memset(seqs + i, 0, sizeof(kseq_t));
+        r.q.front()->view(0, seqs + i);
+    }
+    return 1;
+}
+
+/*
+ * Gets a free output and the next batch from every input.
+ * The output is taken first, so that a worker never holds a batch while waiting on writers.
+ * :returns: [int] 0 once any input has run out.
+ */
+int SplitPipeline::take(split_out_t **out, fq_batch_t **batches)
+{
+    {
+        std::unique_lock<std::mutex> lock(out_m_);
+        out_cv_.wait(lock, [&]() {return free_outs_.size();});
+        *out = free_outs_.back();
+        free_outs_.pop_back();
+    }
+    std::unique_lock<std::mutex> lock(in_m_);
+    // Wait until every input has a batch (or has run out) before taking any,
+    // so that concurrent workers cannot pair batch k of one input with batch k + 1 of another.
+    in_cv_.wait(lock, [&]() {
+        if(ended_) return true;
+        for(int i(0); i < n_inputs_; ++i) if(readers_[i].q.empty() && !readers_[i].done) return false;
+        return true;
+    });
+    for(int i(0); i < n_inputs_ && !ended_; ++i) if(readers_[i].q.empty()) ended_ = 1;
+    if(ended_) {
+        lock.unlock();
+        in_cv_.notify_all();
+        std::lock_guard<std::mutex> out_lock(out_m_);
+        free_outs_.push_back(*out);
+        out_cv_.notify_all();
+        return 0;
+    }
+    size_t n(SPLIT_BATCH_SIZE);
+    for(int i(0); i < n_inputs_; ++i) {
+        batches[i] = readers_[i].q.front();
+        readers_[i].q.pop_front();
+        n = std::min(n, batches[i]->recs.size());
+    }
+    if(n < SPLIT_BATCH_SIZE) ended_ = 1; // An input is exhausted. Any remaining records in other inputs are unpaired.
+    (*out)->id = next_id_++;
+    (*out)->n = n;
+    if(count_ / settings_->notification_interval != (count_ + n) / settings_->notification_interval)
+        LOG_INFO("Number of records processed: %lu.\n", (count_ + n) / settings_->notification_interval * settings_->notification_interval);
+    count_ += n;
+    return 1;
+}
+
+void SplitPipeline::give(split_out_t *out, fq_batch_t **batches)
+{
+    {
+        std::lock_guard<std::mutex> lock(in_m_);
+        for(int i(0); i < n_inputs_; ++i) readers_[i].free_batches.push_back(batches[i]);
+    }
+    in_cv_.notify_all();
+    out->pending.store(n_writers_);
+    {
+        std::lock_guard<std::mutex> lock(out_m_);
+        ready_.emplace(out->id, out);
+    }
+    out_cv_.notify_all();
+}
+
+/*
+ * Appends each marked batch's text for this writer's bins to their temporary fastqs, in batch order.
+ */
+void SplitPipeline::write(int w)
+{
+    const int paired(splitter_->tmp_out_handles_r2 != nullptr);
+    for(uint64_t id(0);; ++id) {
+        split_out_t *out;
+        {
+            std::unique_lock<std::mutex> lock(out_m_);
+            out_cv_.wait(lock, [&]() {return ready_.find(id) != ready_.end() || (workers_done_ && id >= next_id_);});
+            auto it(ready_.find(id));
+            if(it == ready_.end()) return;
+            out = it->second;
+        }
+        for(int bin(w); bin < splitter_->n_handles; bin += n_writers_) {
+            kstring_t &ks1(out->r1[bin]);
+            if(ks1.l) splitter_->tmp_out_handles_r1[bin]->write(ks1.s, ks1.l), ks1.l = 0;
+            if(paired) {
+                kstring_t &ks2(out->r2[bin]);
+                if(ks2.l) splitter_->tmp_out_handles_r2[bin]->write(ks2.s, ks2.l), ks2.l = 0;
+            }
+        }
+        if(out->pending.fetch_sub(1) == 1) {
+            {
+                std::lock_guard<std::mutex> lock(out_m_);
+                ready_.erase(id);
+                free_outs_.push_back(out);
+            }
+            out_cv_.notify_all();
+        }
+    }
+}
+
+/*
+ * Waits for workers to run out of batches and for writers to flush everything they produced.
+ */
+void SplitPipeline::finish(std::vector<std::thread> &workers)
+{
+    for(auto &t: workers) t.join();
+    {
+        std::lock_guard<std::mutex> lock(out_m_);
+        workers_done_ = 1;
+    }
+    out_cv_.notify_all();
+    for(auto &t: writer_threads_) t.join();
+    writer_threads_.clear();
+}
+
+} /* namespace bmf */
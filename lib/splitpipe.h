@@ -0,0 +1,174 @@
+#ifndef SPLITPIPE_H
+#define SPLITPIPE_H
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "htslib/kstring.h"
+#include "lib/binfq.h"
+#include "lib/fqreader.h"
+#include "lib/mseq.h"
+#include "lib/splitter.h"
+
+#define SPLIT_BATCH_SIZE 4096 // Records per batch handed from readers to workers.
+#define SPLIT_MAX_INPUTS 3 // Read 1, read 2 and an index fastq.
+
+namespace bmf {
+
+/*
+ * Pipelined mark/split.
+ *
+ * One reader thread per input fastq parses records (see FqReader) into batches. With more than one thread,
+ * each reader's input is decompressed ahead of it (on a thread pool, for BGZF), so records and batches
+ * still come out in input order.
+ * Worker threads take the next batch from every reader together, so that record i of each batch
+ * belongs to the same read (pair), and mark each record into per-bin text buffers.
+ * Writer threads each own the bins with bin % n_writers == writer index and append those buffers to
+ * the temporary fastqs in batch order, so every temporary fastq matches the single-threaded splitter.
+ */
+
+/*
+ * Offsets of one record's fields in its batch's data. Each field is null-terminated.
+ */
+struct fq_rec_t {
+    uint32_t name;
+    uint32_t seq;
+    uint32_t qual;
+    uint32_t name_l;
+    uint32_t seq_l;
+};
+
+struct fq_batch_t {
+    std::vector<char> data;
+    std::vector<fq_rec_t> recs;
+    void clear() {data.clear(); recs.clear();}
+    void add(const fq_view_t &rec);
+    /*
+     * Points a kseq_t's name, seq and qual at record i. The comment is left empty.
+     */
+    void view(size_t i, kseq_t *out) {
+        const fq_rec_t &r(recs[i]);
+        out->name.s = data.data() + r.name, out->name.l = out->name.m = r.name_l;
+        out->seq.s = data.data() + r.seq, out->seq.l = out->seq.m = r.seq_l;
+        out->qual.s = data.data() + r.qual, out->qual.l = out->qual.m = r.seq_l;
+    }
+};
+
+/*
+ * Marked records from one batch, as temporary fastq text (or binary records) for each bin.
+ * This is a sink for markers, as is StreamCollapser (lib/streamdmp.h).
+ */
+struct split_out_t {
+    std::vector<kstring_t> r1;
+    std::vector<kstring_t> r2; // Empty for single-end.
+    uint64_t id; // Batch number
+    size_t n; // Number of records
+    std::atomic<int> pending; // Writers which have not yet written their bins.
+    const int binary; // Write records in the binary format (see lib/binfq.h)
+    split_out_t(int n_bins, int paired, int binary): r1(n_bins, kstring_t{0, 0, nullptr}),
+                                                     r2(paired ? n_bins: 0, kstring_t{0, 0, nullptr}),
+                                                     id(0), n(0), pending(0), binary(binary) {}
+    ~split_out_t() {
+        for(auto &ks: r1) free(ks.s);
+        for(auto &ks: r2) free(ks.s);
+    }
+    void add(uint64_t bin, mseq_t *rs1, mseq_t *rs2, int pass_fail, char *barcode, char prefix) {
+        if(binary) {
+            mseq2bin_stranded(&r1[bin], rs1, pass_fail, barcode, prefix);
+            if(rs2) mseq2bin_stranded(&r2[bin], rs2, pass_fail, barcode, prefix);
+            return;
+        }
+        mseq2ks_stranded(&r1[bin], rs1, pass_fail, barcode, prefix);
+        if(rs2) mseq2ks_stranded(&r2[bin], rs2, pass_fail, barcode, prefix);
+    }
+};
+
+struct split_reader_t {
+    FqReader *in;
+    std::deque<fq_batch_t *> q; // Filled batches, in input order
+    std::vector<fq_batch_t *> free_batches;
+    size_t n_batches; // Batches allocated
+    int done;
+};
+
+class SplitPipeline {
+    marksplit_settings_t *settings_;
+    mark_splitter_t *splitter_;
+    const int n_inputs_;
+    const int n_workers_;
+    const int n_writers_;
+    const size_t max_batches_; // Per reader
+    split_reader_t readers_[SPLIT_MAX_INPUTS];
+    std::vector<std::thread> reader_threads_;
+    std::vector<std::thread> writer_threads_;
+    std::mutex in_m_;
+    std::condition_variable in_cv_;
+    uint64_t next_id_;
+    uint64_t count_;
+    int ended_; // An input ran out; no more batches will be handed out.
+    std::vector<split_out_t *> outs_;
+    std::vector<split_out_t *> free_outs_;
+    std::map<uint64_t, split_out_t *> ready_;
+    std::mutex out_m_;
+    std::condition_variable out_cv_;
+    int workers_done_;
+
+    void read(int i);
+    void write(int w);
+    int take(split_out_t **out, fq_batch_t **batches);
+    void give(split_out_t *out, fq_batch_t **batches);
+    template<typename Marker>
+    void work(Marker &marker) {
+        split_out_t *out;
+        fq_batch_t *batches[SPLIT_MAX_INPUTS];
+        kseq_t views[SPLIT_MAX_INPUTS];
+        std::memset(views, 0, sizeof(views));
+        while(take(&out, batches)) {
+            for(size_t i(0); i < out->n; ++i) {
+                for(int j(0); j < n_inputs_; ++j) batches[j]->view(i, views + j);
+                marker.mark(views, *out);
+            }
+            give(out, batches);
+        }
+    }
+    void finish(std::vector<std::thread> &workers);
+public:
+    /*
+     * Opens the inputs and starts their readers.
+     * :param: paths [const std::vector<char *> &] Input fastqs, in the order markers expect them.
+     */
+    SplitPipeline(marksplit_settings_t *settings, mark_splitter_t *splitter, const std::vector<char *> &paths);
+    ~SplitPipeline();
+    /*
+     * @func first
+     * Waits for the first record of each input, for inferring read length and the like.
+     * :param: seqs [kseq_t *] Set to views of the first records.
+     * :returns: [int] 1 if every input had a record, 0 otherwise.
+     */
+    int first(kseq_t *seqs);
+    /*
+     * @func run
+     * Marks and splits all records.
+     * Each worker constructs its own Marker from args, which must provide
+     * mark(kseq_t *seqs, split_out_t &sink), with seqs holding the current record from each input.
+     * :returns: [uint64_t] Number of records (or sets of records) processed.
+     */
+    template<typename Marker, typename... Args>
+    uint64_t run(Args... args) {
+        std::vector<std::thread> workers;
+        for(int i(0); i < n_workers_; ++i)
+            workers.emplace_back([this, args...]() {
+                Marker marker(args...);
+                work(marker);
+            });
+        finish(workers);
+        return count_;
+    }
+};
+
+} /* namespace bmf */
+
+#endif /* SPLITPIPE_H */
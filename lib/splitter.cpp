@@ -1,11 +1,14 @@
 #include "splitter.h"
 
+#include <algorithm>
 #include <cstring>
 #include "htslib/kstring.h"
 #include "dlib/cstr_util.h"
 #include "dlib/compiler_util.h"
 #include "dlib/misc_util.h"
+#include "lib/binfq.h"
 #include "lib/binner.h"
+#include "lib/rescaler.h"
 
 namespace bmf {
 
@@ -24,10 +27,63 @@ void free_marksplit_settings(marksplit_settings_t settings)
     cond_free(settings.input_r1_path);
     cond_free(settings.input_r2_path);
     cond_free(settings.index_fq_path);
-    cond_free(settings.rescaler);
+    delete settings.rescaler;
     cond_free(settings.rescaler_path);
     cond_free(settings.homing_sequence);
     cond_free(settings.ffq_prefix);
+    cond_free(settings.bin_map);
+}
+
+void bin_sample_t::add(uint64_t bin, mseq_t *rs1, mseq_t *rs2, int pass_fail, char *barcode, char prefix)
+{
+    if(!prefix_len) {
+        prefix_len = std::min((int)std::strlen(barcode), BIN_MAX_PREFIX);
+        counts.resize(dlib::ipow(4, prefix_len));
+    }
+    ++counts[get_binner(barcode, prefix_len)];
+    ++n;
+}
+
+void plan_bins(marksplit_settings_t *settings, const bin_sample_t &sample)
+{
+    const int max_bins(settings->n_handles);
+    if(sample.n < 16uL * max_bins || sample.prefix_len < (int)settings->n_nucs) {
+        LOG_DEBUG("Sampled %lu barcodes. Binning by the first %i bases.\n", sample.n, (int)settings->n_nucs);
+        return;
+    }
+    // Choose the prefix length.
+    std::vector<uint64_t> counts;
+    int len;
+    for(len = settings->n_nucs; len <= sample.prefix_len; ++len) {
+        const uint64_t stride(dlib::ipow(4, sample.prefix_len - len));
+        counts.assign(sample.counts.size() / stride, 0);
+        // get_binner puts the first base in the most significant digit, so this keeps the first len bases.
+        for(size_t i(0); i < sample.counts.size(); ++i) counts[i / stride] += sample.counts[i];
+        if(*std::max_element(counts.begin(), counts.end()) * max_bins <= sample.n) break;
+    }
+    len = std::min(len, sample.prefix_len);
+    // Fill each bin up to an even share of what remains.
+    uint32_t *map((uint32_t *)malloc(counts.size() * sizeof(uint32_t)));
+    uint64_t remaining(sample.n), in_bin(0), largest(0);
+    int bin(0);
+    for(size_t i(0); i < counts.size(); ++i) {
+        map[i] = bin;
+        in_bin += counts[i];
+        if(bin + 1 < max_bins && in_bin && in_bin * (max_bins - bin) >= remaining) {
+            largest = std::max(largest, in_bin);
+            remaining -= in_bin, in_bin = 0;
+            ++bin;
+        }
+    }
+    // A bin closed on the last prefix is left empty.
+    if(bin && map[counts.size() - 1] != (uint32_t)bin) --bin;
+    largest = std::max(largest, in_bin);
+    cond_free(settings->bin_map);
+    settings->bin_map = map;
+    settings->bin_prefix_len = len;
+    settings->n_handles = bin + 1;
+    LOG_INFO("Placed %i bins on %i-base barcode prefixes from %lu sampled barcodes. "
+             "Largest bin: %0.2f%% of reads.\n", settings->n_handles, len, sample.n, 100. * largest / sample.n);
 }
 
 splitterhash_params_t *init_splitterhash(marksplit_settings_t *settings, mark_splitter_t *splitter_ptr)
@@ -84,6 +140,10 @@ void splitter_destroy(mark_splitter_t *var)
         for(int i(0); i < var->n_handles; ++i)
             cond_free(var->fnames_r2[i]);
 
+    for(int i(0); i < var->n_handles; ++i) {
+        if(var->tmp_out_handles_r1) delete var->tmp_out_handles_r1[i];
+        if(var->tmp_out_handles_r2) delete var->tmp_out_handles_r2[i];
+    }
     cond_free(var->tmp_out_handles_r1);
     cond_free(var->tmp_out_handles_r2);
 }
@@ -92,14 +152,15 @@ void splitter_destroy(mark_splitter_t *var)
 mark_splitter_t init_splitter_pe(marksplit_settings_t* settings)
 {
     mark_splitter_t ret {
-        (gzFile *)calloc(settings->n_handles, sizeof(gzFile)), // tmp_out_handles_r1
-        (gzFile *)calloc(settings->n_handles, sizeof(gzFile)), // tmp_out_handles_r2
+        (TmpFqWriter **)calloc(settings->n_handles, sizeof(TmpFqWriter *)), // tmp_out_handles_r1
+        (TmpFqWriter **)calloc(settings->n_handles, sizeof(TmpFqWriter *)), // tmp_out_handles_r2
         settings->n_nucs, // n_nucs
-        (int)dlib::ipow(4, settings->n_nucs), // n_handles
+        settings->n_handles, // n_handles
         (char **)calloc(ret.n_handles, sizeof(char *)), // infnames_r1
         (char **)calloc(ret.n_handles, sizeof(char *))  // infnames_r2
     };
     kstring_t ks {0, 0, nullptr};
+    const size_t buf_size(fq_writer_buf_size(2 * ret.n_handles));
     for (int i(0); i < ret.n_handles; i++) {
         ks.l = 0;
         ksprintf(&ks, "%s.tmp.%i.R1.fastq", settings->tmp_basename, i);
@@ -108,8 +169,10 @@ mark_splitter_t init_splitter_pe(marksplit_settings_t* settings)
         ks.l = 0;
         ksprintf(&ks, "%s.tmp.%i.R2.fastq", settings->tmp_basename, i);
         ret.fnames_r2[i] = dlib::kstrdup(&ks);
-        ret.tmp_out_handles_r1[i] = gzopen(ret.fnames_r1[i], settings->mode);
-        ret.tmp_out_handles_r2[i] = gzopen(ret.fnames_r2[i], settings->mode);
+        ret.tmp_out_handles_r1[i] = new TmpFqWriter(ret.fnames_r1[i], settings->mode, buf_size);
+        ret.tmp_out_handles_r2[i] = new TmpFqWriter(ret.fnames_r2[i], settings->mode, buf_size);
+        if(settings->binary_tmp)
+            binfq_write_header(ret.tmp_out_handles_r1[i]), binfq_write_header(ret.tmp_out_handles_r2[i]);
     }
     return ret;
 }
@@ -117,19 +180,21 @@ mark_splitter_t init_splitter_pe(marksplit_settings_t* settings)
 mark_splitter_t init_splitter_se(marksplit_settings_t* settings)
 {
     mark_splitter_t ret {
-        (gzFile *)calloc(settings->n_handles, sizeof(gzFile)), // tmp_out_handles_r1
+        (TmpFqWriter **)calloc(settings->n_handles, sizeof(TmpFqWriter *)), // tmp_out_handles_r1
         nullptr, // tmp_out_handles_r2
         settings->n_nucs, // n_nucs
-        (int)dlib::ipow(4, settings->n_nucs), // n_handles
+        settings->n_handles, // n_handles
         (char **)calloc(ret.n_handles, sizeof(char *)), // infnames_r1
         nullptr  // infnames_r2
     };
     kstring_t ks {0, 0, nullptr};
+    const size_t buf_size(fq_writer_buf_size(ret.n_handles));
     for (int i(0); i < ret.n_handles; i++) {
         ks.l = 0;
         ksprintf(&ks, "%s.tmp.%i.fastq", settings->tmp_basename, i);
         ret.fnames_r1[i] = dlib::kstrdup(&ks);
-        ret.tmp_out_handles_r1[i] = gzopen(ret.fnames_r1[i], settings->mode);
+        ret.tmp_out_handles_r1[i] = new TmpFqWriter(ret.fnames_r1[i], settings->mode, buf_size);
+        if(settings->binary_tmp) binfq_write_header(ret.tmp_out_handles_r1[i]);
     }
     free(ks.s);
     return ret;
@@ -1,10 +1,18 @@
 #ifndef SPLITTER_H
 #define SPLITTER_H
 #include <cstdint>
+#include <vector>
 #include <zlib.h>
+#include "lib/fqwriter.h"
+
+#define BIN_SAMPLE_SIZE 200000 // Number of barcodes sampled to place bin boundaries.
+#define BIN_MAX_PREFIX 10 // Longest barcode prefix used to place bin boundaries (4^10 prefixes).
 
 namespace bmf {
 
+struct mseq_t;
+class Rescaler;
+
 struct marksplit_settings_t {
     uint32_t blen:16;
     uint32_t blen1_2:16;
@@ -29,18 +37,51 @@ struct marksplit_settings_t {
     uint32_t gzip_compression:4;
     uint32_t hp_threshold:5;
     uint32_t ignore_homing:1;
+    uint32_t stream:1; // Collapse in a single pass without temporary split fastqs
+    uint32_t binary_tmp:1; // Write temporary split files in the binary format (see lib/binfq.h)
+    uint32_t ubam:1; // Write final output as unaligned BAM (see lib/ubam.h)
+    uint32_t barcode_order:1; // Write each bin's families in barcode order (see FamTable::barcode_order)
     char *tmp_basename;
-    char *rescaler; // Four-dimensional rescaler array. Size: [readlen, NQSCORES, 4] (length of reads, number of original quality scores, number of bases)
+    Rescaler *rescaler; // Quality rescaler (see lib/rescaler.h), or null
     char *rescaler_path; // Path to rescaler for
     int threads;
+    uint64_t stream_budget; // Memory budget for streaming collapse, in MB
+    uint64_t max_mem; // Memory budget for collapsing bins, in bytes, shared between threads. 0 for no limit.
+    int cluster_dist; // Hamming distance within which barcodes are clustered after collapsing each bin. 0 to disable.
     char mode[4];
+    uint32_t *bin_map; // Bin for each barcode prefix of length bin_prefix_len. If null, bin by the first n_nucs bases.
+    int bin_prefix_len;
 };
 
 void free_marksplit_settings(marksplit_settings_t settings);
 
+/*
+ * Sink for markers which counts the barcode prefixes of a sample of records, for plan_bins.
+ */
+struct bin_sample_t {
+    int prefix_len;
+    uint64_t n;
+    std::vector<uint64_t> counts;
+    bin_sample_t(): prefix_len(0), n(0) {}
+    void add(uint64_t bin, mseq_t *rs1, mseq_t *rs2, int pass_fail, char *barcode, char prefix);
+};
+
+/*
+ * @func plan_bins
+ * Places bin boundaries by observed barcode frequency.
+ * Bins hold contiguous ranges of barcode prefixes, so that each receives about the same share of the sample.
+ * The prefix length is the shortest (of at least settings->n_nucs bases) for which no single prefix
+ * holds more than one bin's share, up to BIN_MAX_PREFIX.
+ * Sets settings->bin_map and settings->bin_prefix_len and lowers settings->n_handles
+ * if fewer bins are needed. Small samples leave the default binning in place.
+ * :param: settings [marksplit_settings_t *] Settings, with n_handles set to the maximum number of bins.
+ * :param: sample [const bin_sample_t &] Counted barcode prefixes.
+ */
+void plan_bins(marksplit_settings_t *settings, const bin_sample_t &sample);
+
 struct mark_splitter_t {
-    gzFile *tmp_out_handles_r1;
-    gzFile *tmp_out_handles_r2;
+    TmpFqWriter **tmp_out_handles_r1;
+    TmpFqWriter **tmp_out_handles_r2; // Null for single-end.
     uint32_t n_nucs;
     int n_handles;
     char **fnames_r1;
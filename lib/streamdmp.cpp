@@ -0,0 +1,314 @@
+#include "streamdmp.h"
+
+#include <algorithm>
+#include "lib/ubam.h"
+
+namespace bmf {
+
+void gzip_member(kstring_t *ks, int level)
+{
+    z_stream zs;
+    std::memset(&zs, 0, sizeof(zs));
+    if(deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        LOG_EXIT("Could not initialize deflate stream. Abort!\n");
+    kstring_t out{0, 0, nullptr};
+    ks_resize(&out, deflateBound(&zs, ks->l));
+    zs.next_in = (Bytef *)ks->s;
+    zs.avail_in = ks->l;
+    zs.next_out = (Bytef *)out.s;
+    zs.avail_out = out.m;
+    if(deflate(&zs, Z_FINISH) != Z_STREAM_END)
+        LOG_EXIT("Failed to compress collapsed bin. Abort!\n");
+    out.l = zs.total_out;
+    deflateEnd(&zs);
+    free(ks->s);
+    *ks = out;
+}
+
+/*
+ * Writes l bytes to fp, exiting if the write fails (for example, if the disk is full).
+ * :param: path [const char *] Name of the output, for the error message.
+ */
+static void write_or_exit(const void *s, size_t l, FILE *fp, const char *path)
+{
+    if(fwrite(s, 1, l, fp) != l) LOG_EXIT("Failed to write to %s. Abort!\n", path);
+}
+
+/*
+ * Closes fp, or flushes it if it is stdout, exiting if buffered output could not be written.
+ */
+static void close_or_exit(FILE *fp, const char *path)
+{
+    if(fp == stdout ? fflush(fp): fclose(fp)) LOG_EXIT("Failed to write to %s. Abort!\n", path);
+}
+
+/*
+ * Writes the records in r1 and r2 to fp, alternating one fastq record from each.
+ */
+static void write_interleaved(const kstring_t *r1, const kstring_t *r2, FILE *fp)
+{
+    const char *p1(r1->s), *p2(r2->s);
+    const char *const e1(r1->s + r1->l), *const e2(r2->s + r2->l);
+    const char *end;
+    int i;
+    while(p1 < e1 && p2 < e2) {
+        for(end = p1, i = 0; i < 4; ++i) end = (const char *)memchr(end, '\n', e1 - end) + 1;
+        write_or_exit(p1, end - p1, fp, "stdout"), p1 = end;
+        for(end = p2, i = 0; i < 4; ++i) end = (const char *)memchr(end, '\n', e2 - end) + 1;
+        write_or_exit(p2, end - p2, fp, "stdout"), p2 = end;
+    }
+    if(p1 != e1 || p2 != e2)
+        LOG_EXIT("Unequal number of read 1 and read 2 records in collapsed bin. Abort!\n");
+}
+
+StreamCollapser::StreamCollapser(marksplit_settings_t *settings):
+    settings_(settings),
+    n_bins_(settings->n_handles),
+    n_workers_(std::max(settings->threads, 1)),
+    budget_((size_t)settings->stream_budget << 20),
+    bins_(new stream_bin_t[n_bins_]),
+    workers_(new stream_worker_t[n_workers_]),
+    used_(0),
+    input_done_(0),
+    n_spilled_(0)
+{
+    // Keep the records not yet handed to workers to about a quarter of the budget.
+    chunk_size_ = std::min(std::max(budget_ / (4 * n_bins_), (size_t)1 << 16), (size_t)1 << 20);
+    for(int i(0); i < n_bins_; ++i) {
+        stream_bin_t &b(bins_[i]);
+        b.pending = b.out1 = b.out2 = kstring_t{0, 0, nullptr};
+        b.spill = nullptr;
+        b.spill_path = nullptr;
+        b.done = 0;
+    }
+    LOG_DEBUG("Streaming collapse with %i bins, %i workers, chunk size %lu and budget %lu.\n",
+              n_bins_, n_workers_, chunk_size_, budget_);
+    for(int i(0); i < n_workers_; ++i) threads_.emplace_back(&StreamCollapser::work, this, i);
+}
+
+StreamCollapser::~StreamCollapser()
+{
+    if(!input_done_) {
+        input_done_ = 1;
+        for(int i(0); i < n_workers_; ++i) {
+            { std::lock_guard<std::mutex> lock(workers_[i].m); }
+            workers_[i].cv.notify_all();
+        }
+    }
+    for(auto &t: threads_) if(t.joinable()) t.join();
+    for(int i(0); i < n_bins_; ++i) {
+        stream_bin_t &b(bins_[i]);
+        free(b.pending.s), free(b.out1.s), free(b.out2.s);
+        if(b.spill) fclose(b.spill);
+        free(b.spill_path);
+    }
+    delete[] bins_;
+    delete[] workers_;
+}
+
+void StreamCollapser::add(uint64_t bin, const mseq_t *r1, const mseq_t *r2, int pass_fail, const char *barcode, char prefix)
+{
+    stream_bin_t &b(bins_[bin]);
+    const size_t blen(strlen(barcode));
+    const stream_rec_hdr_t hdr{(uint16_t)strlen(r1->seq), (uint16_t)(r2 ? strlen(r2->seq): 0),
+                               (uint16_t)(blen + 1), (char)(pass_fail + '0'), '\0'};
+    if(UNLIKELY(b.pending.m == 0)) ks_resize(&b.pending, chunk_size_ + 1024);
+    ks_resize(&b.pending, b.pending.l + sizeof(hdr) + hdr.blen + 2 * (hdr.l1 + hdr.l2));
+    char *p(b.pending.s + b.pending.l);
+    std::memcpy(p, &hdr, sizeof(hdr)), p += sizeof(hdr);
+    *p++ = prefix;
+    std::memcpy(p, barcode, blen), p += blen;
+    std::memcpy(p, r1->seq, hdr.l1), p += hdr.l1;
+    std::memcpy(p, r1->qual, hdr.l1), p += hdr.l1;
+    if(r2) {
+        std::memcpy(p, r2->seq, hdr.l2), p += hdr.l2;
+        std::memcpy(p, r2->qual, hdr.l2), p += hdr.l2;
+    }
+    b.pending.l = p - b.pending.s;
+    if(b.pending.l >= chunk_size_) enqueue(bin);
+}
+
+void StreamCollapser::enqueue(int bin)
+{
+    stream_bin_t &b(bins_[bin]);
+    kstring_t data(b.pending);
+    b.pending = kstring_t{0, 0, nullptr};
+    if(b.spill_path || used_.load() + data.l > budget_) {
+        spill(bin, &data);
+        return;
+    }
+    used_ += data.l;
+    stream_worker_t &w(workers_[bin % n_workers_]);
+    {
+        std::lock_guard<std::mutex> lock(w.m);
+        w.q.push_back(stream_chunk_t{bin, data});
+    }
+    w.cv.notify_one();
+}
+
+/*
+ * Appends a chunk to its bin's spill file. Chunks are length-prefixed so that they can be
+ * read back one at a time.
+ */
+void StreamCollapser::spill(int bin, kstring_t *data)
+{
+    stream_bin_t &b(bins_[bin]);
+    if(!b.spill_path) {
+        kstring_t ks{0, 0, nullptr};
+        ksprintf(&ks, "%s.spill.%i.bin", settings_->tmp_basename, bin);
+        b.spill_path = ks.s;
+        if((b.spill = fopen(b.spill_path, "wb")) == nullptr)
+            LOG_EXIT("Could not open spill file %s. Abort!\n", b.spill_path);
+        if(!n_spilled_++)
+            LOG_INFO("Memory budget of %lu MB exceeded. Spilling bins to disk.\n", budget_ >> 20);
+    }
+    const uint64_t l(data->l);
+    write_or_exit(&l, sizeof(l), b.spill, b.spill_path);
+    write_or_exit(data->s, data->l, b.spill, b.spill_path);
+    free(data->s);
+}
+
+void StreamCollapser::consume(int bin, const char *data, size_t l)
+{
+    stream_bin_t &b(bins_[bin]);
+    const size_t before(b.r1.bytes + b.r2.bytes);
+    const char *const end(data + l);
+    stream_rec_hdr_t hdr;
+    const char *bs;
+    while(data < end) {
+        std::memcpy(&hdr, data, sizeof(hdr)), data += sizeof(hdr);
+        bs = data, data += hdr.blen;
+        b.r1.add(bs, hdr.blen, hdr.pass_fail, data, data + hdr.l1, hdr.l1);
+        data += hdr.l1 << 1;
+        if(!settings_->is_se) {
+            b.r2.add(bs, hdr.blen, hdr.pass_fail, data, data + hdr.l2, hdr.l2);
+            data += hdr.l2 << 1;
+        }
+    }
+    used_ += b.r1.bytes + b.r2.bytes - before;
+}
+
+void StreamCollapser::consume_spill(int bin)
+{
+    stream_bin_t &b(bins_[bin]);
+    FILE *fp(fopen(b.spill_path, "rb"));
+    if(!fp) LOG_EXIT("Could not open spill file %s for reading. Abort!\n", b.spill_path);
+    kstring_t ks{0, 0, nullptr};
+    uint64_t l;
+    while(fread(&l, sizeof(l), 1, fp) == 1) {
+        ks_resize(&ks, l);
+        if(fread(ks.s, 1, l, fp) != l) LOG_EXIT("Truncated spill file %s. Abort!\n", b.spill_path);
+        consume(bin, ks.s, l);
+    }
+    free(ks.s);
+    fclose(fp);
+    if(settings_->cleanup) remove(b.spill_path);
+}
+
+void StreamCollapser::finish_bin(int bin)
+{
+    stream_bin_t &b(bins_[bin]);
+    if(b.spill_path) consume_spill(bin);
+    const size_t bytes(b.r1.bytes + b.r2.bytes);
+    if(settings_->cluster_dist) {
+        // Both reads see the same barcodes and counts, so they cluster alike and stay paired.
+        b.r1.cluster(settings_->cluster_dist);
+        if(!settings_->is_se) b.r2.cluster(settings_->cluster_dist);
+    }
+    b.r1.ubam = b.r2.ubam = settings_->ubam;
+    b.r1.sorted = b.r2.sorted = settings_->barcode_order;
+    b.r1.write(&b.out1);
+    if(!settings_->is_se) b.r2.write(&b.out2);
+    used_ -= bytes;
+    if(settings_->gzip_compression && !settings_->to_stdout && !settings_->ubam) {
+        gzip_member(&b.out1, settings_->gzip_compression);
+        if(!settings_->is_se) gzip_member(&b.out2, settings_->gzip_compression);
+    }
+    {
+        std::lock_guard<std::mutex> lock(done_m_);
+        b.done = 1;
+    }
+    done_cv_.notify_all();
+}
+
+void StreamCollapser::work(int index)
+{
+    stream_worker_t &w(workers_[index]);
+    for(;;) {
+        std::unique_lock<std::mutex> lock(w.m);
+        w.cv.wait(lock, [&]{return !w.q.empty() || input_done_.load();});
+        if(w.q.empty()) break;
+        stream_chunk_t chunk(w.q.front());
+        w.q.pop_front();
+        lock.unlock();
+        consume(chunk.bin, chunk.data.s, chunk.data.l);
+        used_ -= chunk.data.l;
+        free(chunk.data.s);
+    }
+    for(int bin(index); bin < n_bins_; bin += n_workers_) finish_bin(bin);
+}
+
+void StreamCollapser::finish(const char *ffq_r1, const char *ffq_r2)
+{
+    for(int i(0); i < n_bins_; ++i)
+        if(bins_[i].pending.l) enqueue(i);
+    for(int i(0); i < n_bins_; ++i)
+        if(bins_[i].spill) close_or_exit(bins_[i].spill, bins_[i].spill_path), bins_[i].spill = nullptr;
+    input_done_ = 1;
+    for(int i(0); i < n_workers_; ++i) {
+        { std::lock_guard<std::mutex> lock(workers_[i].m); }
+        workers_[i].cv.notify_all();
+    }
+    if(settings_->ubam) {
+        finish_bam(ffq_r1);
+        return;
+    }
+    FILE *out1(settings_->to_stdout ? stdout: fopen(ffq_r1, "wb"));
+    FILE *out2(settings_->to_stdout || settings_->is_se ? nullptr: fopen(ffq_r2, "wb"));
+    if(!out1 || (!settings_->to_stdout && !settings_->is_se && !out2))
+        LOG_EXIT("Could not open final output files for writing. Abort!\n");
+    const char *const path1(settings_->to_stdout ? "stdout": ffq_r1);
+    for(int i(0); i < n_bins_; ++i) {
+        stream_bin_t &b(bins_[i]);
+        {
+            std::unique_lock<std::mutex> lock(done_m_);
+            done_cv_.wait(lock, [&]{return b.done;});
+        }
+        if(settings_->to_stdout && !settings_->is_se) write_interleaved(&b.out1, &b.out2, out1);
+        else {
+            write_or_exit(b.out1.s, b.out1.l, out1, path1);
+            if(out2) write_or_exit(b.out2.s, b.out2.l, out2, ffq_r2);
+        }
+        free(b.out1.s), free(b.out2.s);
+        b.out1 = b.out2 = kstring_t{0, 0, nullptr};
+    }
+    for(auto &t: threads_) t.join();
+    if(n_spilled_) LOG_INFO("Spilled %lu of %i bins to disk.\n", n_spilled_, n_bins_);
+    close_or_exit(out1, path1);
+    if(out2) close_or_exit(out2, ffq_r2);
+}
+
+/*
+ * Writes the collapsed bins to a single unaligned BAM in bin order as they complete. See lib/ubam.h.
+ */
+void StreamCollapser::finish_bam(const char *path)
+{
+    {
+        UBamWriter out(settings_->to_stdout ? "-": path, settings_->gzip_compression, settings_->threads);
+        for(int i(0); i < n_bins_; ++i) {
+            stream_bin_t &b(bins_[i]);
+            {
+                std::unique_lock<std::mutex> lock(done_m_);
+                done_cv_.wait(lock, [&]{return b.done;});
+            }
+            if(settings_->is_se) out.write_all(b.out1.s, b.out1.l);
+            else out.write_pairs(&b.out1, &b.out2);
+            free(b.out1.s), free(b.out2.s);
+            b.out1 = b.out2 = kstring_t{0, 0, nullptr};
+        }
+    }
+    for(auto &t: threads_) t.join();
+    if(n_spilled_) LOG_INFO("Spilled %lu of %i bins to disk.\n", n_spilled_, n_bins_);
+}
+
+} /* namespace bmf */
@@ -0,0 +1,119 @@
+#ifndef STREAMDMP_H
+#define STREAMDMP_H
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "lib/hashdmp.h"
+#include "lib/mseq.h"
+#include "lib/splitter.h"
+
+#define DEFAULT_STREAM_BUDGET_MB 4096
+
+namespace bmf {
+
+/*
+ * Streaming collapse for bmftools collapse inline.
+ *
+ * Instead of writing each marked record to a temporary fastq for its bin and then re-reading
+ * and re-parsing it, the marking thread packs records into per-bin chunks which are handed to
+ * collapse worker threads. Each worker owns the bins with bin % n_workers == worker index
+ * and adds records to that bin's stranded_hash_t tables as they arrive.
+ *
+ * When the bytes held in queued chunks plus the workers' family tables exceed the memory budget,
+ * the bin whose chunk tipped the budget is spilled: that chunk and all later chunks for the bin are
+ * appended to a temporary file, which its worker reads after marking has finished.
+ * Because spilled chunks always follow the chunks already queued for the bin, every bin sees its
+ * records in input order, and its output matches stranded_hash_dmp_core on the corresponding
+ * temporary fastq.
+ *
+ * Collapsed bins are written to the final output in bin order as they complete.
+ */
+
+/*
+ * @func gzip_member
+ * Replaces the contents of ks with a single gzip member holding them.
+ * Concatenating these members is equivalent to concatenating the gzip files
+ * written per bin by hash_dmp_core and stranded_hash_dmp_core.
+ */
+void gzip_member(kstring_t *ks, int level);
+
+/*
+ * Packed record layout in a chunk:
+ * stream_rec_hdr_t, barcode (with leading strand character), seq1, qual1, seq2, qual2.
+ * l2 is 0 for single-end data.
+ */
+struct stream_rec_hdr_t {
+    uint16_t l1;
+    uint16_t l2;
+    uint16_t blen; // Includes the strand character.
+    char pass_fail; // '1' for pass, '0' for fail.
+    char pad;
+};
+
+struct stream_chunk_t {
+    int bin;
+    kstring_t data;
+};
+
+struct stream_bin_t {
+    stranded_hash_t r1;
+    stranded_hash_t r2;
+    kstring_t pending; // Records not yet handed to the worker.
+    kstring_t out1;
+    kstring_t out2;
+    FILE *spill;
+    char *spill_path;
+    int done;
+};
+
+struct stream_worker_t {
+    std::mutex m;
+    std::condition_variable cv;
+    std::deque<stream_chunk_t> q;
+};
+
+class StreamCollapser {
+    marksplit_settings_t *settings_;
+    const int n_bins_;
+    const int n_workers_;
+    size_t chunk_size_;
+    const size_t budget_;
+    stream_bin_t *bins_;
+    stream_worker_t *workers_;
+    std::vector<std::thread> threads_;
+    std::atomic<size_t> used_; // Queued chunks plus family tables.
+    std::atomic<int> input_done_;
+    std::mutex done_m_;
+    std::condition_variable done_cv_;
+    uint64_t n_spilled_;
+
+    void enqueue(int bin);
+    void spill(int bin, kstring_t *data);
+    void consume(int bin, const char *data, size_t l);
+    void consume_spill(int bin);
+    void finish_bin(int bin);
+    void finish_bam(const char *path);
+    void work(int index);
+
+public:
+    StreamCollapser(marksplit_settings_t *settings);
+    ~StreamCollapser();
+    /*
+     * Adds a marked read or read pair to a bin.
+     * r1 is collapsed into the read 1 output and r2 (nullptr for single-end) into the read 2 output.
+     */
+    void add(uint64_t bin, const mseq_t *r1, const mseq_t *r2, int pass_fail, const char *barcode, char prefix);
+    /*
+     * Hands off all remaining records, waits for the workers and writes the collapsed output.
+     * If settings->to_stdout is set, read pairs are interleaved to stdout and ffq_r1/ffq_r2 are ignored.
+     * If settings->ubam is set, ffq_r1 is the final unaligned BAM path and ffq_r2 is ignored.
+     */
+    void finish(const char *ffq_r1, const char *ffq_r2);
+};
+
+} /* namespace bmf */
+
+#endif /* STREAMDMP_H */
@@ -0,0 +1,49 @@
+#include "ubam.h"
+
+#include "dlib/logging_util.h"
+
+namespace bmf {
+
+#define UBAM_BGZF_SUB_BLKS 256 // Blocks handed to each BGZF compression thread at once.
+
+UBamWriter::UBamWriter(const char *path, int level, int threads): path_(path)
+{
+    char mode[4];
+    sprintf(mode, "wb%i", level % 10);
+    if((fp_ = bgzf_open(path, mode)) == nullptr)
+        LOG_EXIT("Could not open %s for writing. Abort!\n", std::strcmp(path, "-") ? path: "stdout");
+    if(threads > 1 && bgzf_mt(fp_, threads, UBAM_BGZF_SUB_BLKS))
+        LOG_WARNING("Could not start compression threads for %s. Writing it with one thread.\n", path);
+    // Header: magic, text and an empty reference list.
+    static const char text[] {"@HD\tVN:1.6\tSO:unsorted\tGO:query\n"
+                              "@PG\tID:bmftools\tPN:bmftools\tVN:" BMF_VERSION "\tDS:bmftools collapse\n"};
+    const int32_t l_text(sizeof(text) - 1), n_ref(0);
+    if(bgzf_write(fp_, "BAM\1", 4) < 0 || bgzf_write(fp_, &l_text, sizeof(l_text)) < 0 ||
+       bgzf_write(fp_, text, l_text) < 0 || bgzf_write(fp_, &n_ref, sizeof(n_ref)) < 0)
+        LOG_EXIT("Failed to write BAM header to %s. Abort!\n", path);
+    // The header gets a block of its own, as htslib writes it.
+    if(bgzf_flush(fp_)) LOG_EXIT("Failed to write BAM header to %s. Abort!\n", path);
+}
+
+UBamWriter::~UBamWriter()
+{
+    if(bgzf_close(fp_)) LOG_EXIT("Failed to close %s. Abort!\n", path_);
+}
+
+void UBamWriter::write(const char *rec, size_t l)
+{
+    // Start records at block boundaries where they fit, as bam_write1 does.
+    if(bgzf_flush_try(fp_, l) < 0 || bgzf_write(fp_, rec, l) < 0)
+        LOG_EXIT("Failed to write to %s. Abort!\n", path_);
+}
+
+void UBamWriter::write_pairs(kstring_t *r1, kstring_t *r2)
+{
+    char *p1(r1->s), *p2(r2->s);
+    char *const e1(r1->s + r1->l), *const e2(r2->s + r2->l);
+    for(; p1 < e1 && p2 < e2; p1 += ubam_rec_len(p1), p2 += ubam_rec_len(p2)) write_pair(p1, p2);
+    if(p1 != e1 || p2 != e2)
+        LOG_EXIT("Unequal number of read 1 and read 2 records in collapsed bin. Abort!\n");
+}
+
+} /* namespace bmf */
@@ -0,0 +1,171 @@
+#ifndef UBAM_H
+#define UBAM_H
+#include <cstdint>
+#include <cstring>
+#include "htslib/bgzf.h"
+#include "htslib/hts.h"
+#include "htslib/kstring.h"
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "Unaligned BAM records are built in host byte order, which must be little-endian."
+#endif
+
+#define UBAM_FLAG_OFFSET 18 // Offset of the flag in a serialized record, counting block_size.
+#define UBAM_FIXED_SIZE 36 // Bytes before the read name, counting block_size.
+#define UBAM_FLAG_SE 0x4 // Unmapped
+#define UBAM_FLAG_R1 0x4d // Paired, unmapped, mate unmapped, read 1
+#define UBAM_FLAG_R2 0x8d // Paired, unmapped, mate unmapped, read 2
+
+namespace bmf {
+
+/*
+ * Unaligned BAM output for bmftools collapse -U.
+ *
+ * Collapsed families are serialized as BAM records (as written by bam_write1, starting with block_size)
+ * directly into the same kstring buffers and temporary bin files used for fastq output,
+ * so FA and PV are stored as native B:I arrays instead of being printed and re-parsed.
+ * Bins hold records without a header, flagged UBAM_FLAG_SE; UBamWriter adds the header
+ * and marks read pairs as it writes them.
+ */
+
+/*
+ * @func ubam_start
+ * Appends the fixed fields, read name and packed sequence of an unmapped record to ks.
+ * The caller then appends l_seq base qualities and any aux fields, and calls ubam_finish.
+ * :param: name [const char *] Read name.
+ * :param: seq [const char *] Read sequence.
+ * :param: l_seq [int] Length of seq.
+ * :returns: [size_t] Offset of the record in ks, for ubam_finish.
+ */
+static inline size_t ubam_start(kstring_t *ks, const char *name, const char *seq, int l_seq)
+{
+    const size_t start(ks->l);
+    const int l_name(std::strlen(name) + 1);
+    ks_resize(ks, ks->l + UBAM_FIXED_SIZE + l_name + ((l_seq + 1) >> 1) + l_seq + 1);
+    const int32_t fixed[] {0, -1, -1, (int32_t)(l_name | 4680 << 16), UBAM_FLAG_SE << 16, l_seq, -1, -1, 0};
+    static_assert(sizeof(fixed) == UBAM_FIXED_SIZE, "Fixed BAM fields are 36 bytes, counting block_size.");
+    uint8_t *p((uint8_t *)ks->s + ks->l);
+    std::memcpy(p, fixed, sizeof(fixed)), p += sizeof(fixed);
+    std::memcpy(p, name, l_name), p += l_name;
+    for(int i(0); i + 1 < l_seq; i += 2)
+        *p++ = seq_nt16_table[(uint8_t)seq[i]] << 4 | seq_nt16_table[(uint8_t)seq[i + 1]];
+    if(l_seq & 1) *p++ = seq_nt16_table[(uint8_t)seq[l_seq - 1]] << 4;
+    ks->l = (char *)p - ks->s;
+    return start;
+}
+
+/*
+ * @func ubam_finish
+ * Sets the block_size of the record starting at offset start of ks, once all of its fields have been appended.
+ */
+static inline void ubam_finish(kstring_t *ks, size_t start)
+{
+    const int32_t block_size(ks->l - start - 4);
+    std::memcpy(ks->s + start, &block_size, sizeof(block_size));
+}
+
+/*
+ * @func ubam_aux_int
+ * Appends an integer aux field, stored in the smallest unsigned type which holds it (as samtools does).
+ */
+static inline void ubam_aux_int(kstring_t *ks, const char *tag, uint32_t val)
+{
+    ks_resize(ks, ks->l + 7);
+    char *p(ks->s + ks->l);
+    *p++ = tag[0], *p++ = tag[1];
+    if(val <= UINT8_MAX) *p++ = 'C', *p++ = val;
+    else if(val <= UINT16_MAX) {
+        const uint16_t v(val);
+        *p++ = 'S', std::memcpy(p, &v, sizeof(v)), p += sizeof(v);
+    } else *p++ = 'I', std::memcpy(p, &val, sizeof(val)), p += sizeof(val);
+    ks->l = p - ks->s;
+}
+
+static inline void ubam_aux_float(kstring_t *ks, const char *tag, float val)
+{
+    ks_resize(ks, ks->l + 7);
+    char *p(ks->s + ks->l);
+    *p++ = tag[0], *p++ = tag[1], *p++ = 'f';
+    std::memcpy(p, &val, sizeof(val));
+    ks->l += 7;
+}
+
+/*
+ * @func ubam_aux_u32_array
+ * Appends a B:I aux field. Other bmftools commands read FA and PV as uint32_t arrays, so they are not narrowed.
+ */
+template<typename T>
+static inline void ubam_aux_u32_array(kstring_t *ks, const char *tag, const T *arr, int n)
+{
+    ks_resize(ks, ks->l + 8 + 4 * n);
+    char *p(ks->s + ks->l);
+    *p++ = tag[0], *p++ = tag[1], *p++ = 'B', *p++ = 'I';
+    const int32_t count(n);
+    std::memcpy(p, &count, sizeof(count)), p += sizeof(count);
+    for(int i(0); i < n; ++i) {
+        const uint32_t v(arr[i]);
+        std::memcpy(p, &v, sizeof(v)), p += sizeof(v);
+    }
+    ks->l = p - ks->s;
+}
+
+/*
+ * @func ubam_rec_len
+ * :returns: [size_t] Length of the serialized record starting at rec, counting block_size.
+ */
+static inline size_t ubam_rec_len(const char *rec)
+{
+    int32_t block_size;
+    std::memcpy(&block_size, rec, sizeof(block_size));
+    return block_size + 4;
+}
+
+static inline void ubam_set_flag(char *rec, uint16_t flag)
+{
+    std::memcpy(rec + UBAM_FLAG_OFFSET, &flag, sizeof(flag));
+}
+
+/*
+ * Writes serialized records to a BGZF-compressed unaligned BAM with an empty reference list.
+ */
+class UBamWriter {
+    BGZF *fp_;
+    const char *path_;
+public:
+    /*
+     * :param: path [const char *] Output path. "-" for stdout.
+     * :param: level [int] Compression level.
+     * :param: threads [int] Compression threads.
+     */
+    UBamWriter(const char *path, int level, int threads);
+    ~UBamWriter();
+    UBamWriter(const UBamWriter &) = delete;
+    UBamWriter &operator=(const UBamWriter &) = delete;
+    /*
+     * Writes a single-end record.
+     */
+    void write(const char *rec) {write(rec, ubam_rec_len(rec));}
+    /*
+     * Writes a read pair, flagging them as reads 1 and 2.
+     */
+    void write_pair(char *r1, char *r2) {
+        ubam_set_flag(r1, UBAM_FLAG_R1), ubam_set_flag(r2, UBAM_FLAG_R2);
+        write(r1), write(r2);
+    }
+    /*
+     * Writes the single-end records in data, which is l bytes long.
+     */
+    void write_all(const char *data, size_t l) {
+        for(const char *const end(data + l); data < end; data += ubam_rec_len(data)) write(data);
+    }
+    /*
+     * Writes the pairs of records in r1 and r2, one record from each at a time.
+     */
+    void write_pairs(kstring_t *r1, kstring_t *r2);
+private:
+    void write(const char *rec, size_t l);
+};
+
+} /* namespace bmf */
+
+#endif /* UBAM_H */
@@ -1,16 +1,31 @@
 #include "bmf_collapse.h"
 
+#include <algorithm>
 #include <getopt.h>
+#include <memory>
 #include <omp.h>
+#include <sys/stat.h>
 #include <zlib.h>
 #include "dlib/nix_util.h"
+#include "lib/binfq.h"
+#include "lib/binmerge.h"
+#include "lib/bcscan.h"
 #include "lib/binner.h"
 #include "lib/mseq.h"
+#include "lib/splitpipe.h"
+#include "lib/streamdmp.h"
 #define __STDC_FORMAT_MACROS
 #include <cinttypes>
 
 namespace bmf {
 
+static const struct option collapse_long_options[] {
+    {"max-mem", required_argument, nullptr, 'x'},
+    {"cluster", required_argument, nullptr, 'k'},
+    {"ubam", no_argument, nullptr, 'U'},
+    {"barcode-order", no_argument, nullptr, 'O'},
+    {nullptr, 0, nullptr, 0}
+};
 
 void dmp_usage() {
     fprintf(stderr, "Collapses initial fastq by exact barcode matching.\n"
@@ -35,10 +50,10 @@ void idmp_usage()
                         " a homopolymer of length >= this limit is flagged as QC fail."
                         "Default: 10.\n"
                         "-I: Ignore homing sequence. Not recommended, but possible under certain experimental conditions.\n"
-                        "-n: Number of nucleotides at the beginning of the barcode to use to split the output. Default: %i.\n"
+                        "-n: Split into at most 4^n bins, placed by the barcode frequencies of the first records. Default: %i.\n"
                         "-m: Mask first n nucleotides in read for barcode. Default: 0.\n"
                         "-M: Set maximum readlength for cases with variable read length. Default: -1 (infer from first read)\n"
-                        "-p: Number of threads to use if running uthash_dmp. Default: %i.\n"
+                        "-p: Number of threads to use for splitting and for running hash_dmp. Default: %i.\n"
                         "-D: Use this flag to only mark/split and avoid final demultiplexing/consolidation.\n"
                         "-f: If running hash_dmp, this sets the Final Fastq Prefix. \n"
                         "The Final Fastq files will be named '<ffq_prefix>.R1.fq' and '<ffq_prefix>.R2.fq'.\n"
@@ -47,11 +62,24 @@ void idmp_usage()
                         " (-1), other barcode lengths will not be considered.\n"
                         "-z: Flag to write out final output as compressed. Default: False.\n"
                         "-T: If unset, write uncompressed plain text temporary files. If not, use that compression level for temporary files.\n"
+                        "-B: Write temporary files in a compact binary format instead of marked fastq.\n"
                         "-g: Gzip compression ratio if writing gzipped. Default (if writing compressed): 1 (mostly to reduce I/O).\n"
                         "-u: Set notification/update interval for split. Default: 1000000.\n"
                         "-w: Set flag to leave temporary files. Primarily for debugging.\n"
+                        "-e: Stream mode. Collapse while marking, without writing temporary split fastqs.\n"
+                        "-E: Memory budget in MB for stream mode. Bins which do not fit are spilled to disk. 0 spills every bin. Default: %i.\n"
+                        "-x, --max-mem: Memory budget for collapsing bins (e.g., 16G), shared between threads."
+                        " Bins which exceed it are re-split by barcode and collapsed in pieces. Default: unlimited.\n"
+                        "-k, --cluster: Merge families whose barcodes differ by at most this many bases, by directional adjacency."
+                        " Merged families record their exact-match size in an OF tag. With -x, families are only merged"
+                        " within a piece of a re-split bin. Default: 0 (exact matching only).\n"
+                        "-U, --ubam: Write collapsed reads to '<ffq_prefix>.bam' (or stdout, with -=) as unaligned BAM, compressed with -g and -p threads,"
+                        " with FA and PV as B:I arrays.\n"
+                        "-O, --barcode-order: Write each bin's families in barcode order. Bins hold consecutive barcode ranges,"
+                        " so the whole output is in barcode order (families with Ns in their barcodes ending each bin)"
+                        " and does not depend on the number of threads.\n"
                         "-h: Print usage.\n"
-                    , DEFAULT_N_NUCS, DEFAULT_N_THREADS);
+                    , DEFAULT_N_NUCS, DEFAULT_N_THREADS, DEFAULT_STREAM_BUDGET_MB);
 
 }
 
@@ -105,140 +133,74 @@ void cleanup_hashdmp(marksplit_settings_t *settings, splitterhash_params_t *para
     }
 }
 
+/*
+ * :returns: [int] Length of the first read in a temporary file, or 0 if it is empty.
+ */
+static int first_readlen(const char *path)
+{
+    TmpFqReader rec(path);
+    return rec.next() ? rec.l: 0;
+}
+
 /*
  * Executes hash_dmp_fn on each of the temporary files in the splitterhash
  * and cleans up if not disabled.
+ * Bins are collapsed largest first, so that a large bin is not left running alone at the end.
+ * Read 1 and read 2 of each bin are scheduled together, so that they run while both are in the page cache
+ * and merger (if not null) can append the bin as soon as possible.
+ * With a memory budget, both reads of a pair share a SpillPlan, so that they are re-split alike
+ * and their families stay in the same order.
  */
-void parallel_hash_dmp_core(marksplit_settings_t *settings, splitterhash_params_t *params, hash_dmp_fn func)
+void parallel_hash_dmp_core(marksplit_settings_t *settings, splitterhash_params_t *params, hash_dmp_fn func,
+                            BinMerger *merger)
 {
+    const int n_reads(settings->is_se ? 1: 2);
+    // Up to one bin per thread is held in memory at once.
+    const size_t max_mem(settings->max_mem / std::max(settings->threads, 1));
+    std::vector<std::pair<off_t, int>> order;
+    struct stat st;
+    for(int i(0); i < settings->n_handles; ++i) {
+        off_t size(stat(params->infnames_r1[i], &st) ? 0: st.st_size);
+        if(n_reads == 2 && !stat(params->infnames_r2[i], &st)) size += st.st_size;
+        order.emplace_back(-size, i);
+    }
+    std::sort(order.begin(), order.end());
+    // Read lengths are found before collapsing, since inputs are removed as they are collapsed.
+    std::vector<std::unique_ptr<SpillPlan>> plans(settings->n_handles);
+    if(max_mem && n_reads == 2)
+        for(int i(0); i < settings->n_handles; ++i)
+            plans[i].reset(new SpillPlan(std::max(first_readlen(params->infnames_r1[i]),
+                                                  first_readlen(params->infnames_r2[i]))));
     #pragma omp parallel for schedule(dynamic, 1)
-    for(int i = 0; i < settings->n_handles; ++i) {
-        LOG_DEBUG("Now running hash dmp core on input filename %s and output filename %s.\n",
-                 params->infnames_r1[i], params->outfnames_r1[i]);
-        func(params->infnames_r1[i], params->outfnames_r1[i], settings->gzip_compression);
-        if(settings->cleanup) {
-            kstring_t ks{0, 0, nullptr};
-            ksprintf(&ks, "rm %s", params->infnames_r1[i]);
-            dlib::check_call(ks.s);
-            free(ks.s);
-        }
-    }
-    if(settings->is_se) {
-        LOG_DEBUG("Only dmp'ing single end.\n");
-        return; // Don't dmp imaginary files....
-    }
-    #pragma omp parallel for schedule(dynamic, 1)
-    for(int i = 0; i < settings->n_handles; ++i) {
+    for(int i = 0; i < settings->n_handles * n_reads; ++i) {
+        const int bin(order[i / n_reads].second), is_read2(i % n_reads);
+        char *infname(is_read2 ? params->infnames_r2[bin]: params->infnames_r1[bin]);
+        char *outfname(is_read2 ? params->outfnames_r2[bin]: params->outfnames_r1[bin]);
         LOG_DEBUG("Now running hash dmp core on input filename %s and output filename %s.\n",
-                  params->infnames_r2[i], params->outfnames_r2[i]);
-        func(params->infnames_r2[i], params->outfnames_r2[i], settings->gzip_compression);
+                 infname, outfname);
+        // Unaligned BAM bins are left uncompressed, since they are compressed again as they are merged.
+        func(infname, outfname, settings->ubam ? 0: settings->gzip_compression, max_mem, settings->cluster_dist,
+             settings->ubam, settings->barcode_order, plans[bin].get(), is_read2);
         if(settings->cleanup) {
             kstring_t ks{0, 0, nullptr};
-            ksprintf(&ks, "rm %s", params->infnames_r2[i]);
+            ksprintf(&ks, "rm %s", infname);
             dlib::check_call(ks.s);
             free(ks.s);
         }
+        if(merger) merger->done(bin, is_read2);
     }
 }
 
-
-void cat_fastqs_se(marksplit_settings_t *settings, splitterhash_params_t *params, char *ffq_r1)
-{
-    kstring_t ks{0, 0, nullptr};
-    // Clear output files.
-    ksprintf(&ks, settings->gzip_output ? "> %s.gz" : "> %s", ffq_r1);
-    dlib::check_call(ks.s);
-    ks.l = 0;
-    ksprintf(&ks, "/bin/cat ");
-    for(int i(0); i < settings->n_handles; ++i) {
-        if(!dlib::isfile(params->outfnames_r1[i]))
-            LOG_EXIT("Output filename is not a file. Abort! ('%s').\n", params->outfnames_r1[i]);
-        ksprintf(&ks, " %s", params->outfnames_r1[i]);
-    }
-    ksprintf(&ks, " > %s", ffq_r1);
-    if(settings->gzip_output) kputsnl(".gz", &ks);
-    dlib::check_popen(ks.s);
-    free(ks.s);
-}
-/*
- * Make sure that no rescaler values are invalid
- */
-void check_rescaler(marksplit_settings_t *settings, int arr_size)
-{
-    if(settings->rescaler)
-        for(int i(0); i < arr_size; ++i)
-            if(settings->rescaler[i] <= 0)
-                LOG_EXIT("Invalid value in rescaler %i at index %i.\n", settings->rescaler[i], i);
-}
 /*
- * Emits final results to stdout
+ * Make sure that the rescaler covers every cycle of the reads.
+ * Values are limited to valid qualities when it is loaded.
  */
-
-void call_stdout(marksplit_settings_t *settings, splitterhash_params_t *params, char *ffq_r1, char *ffq_r2)
-{
-    kstring_t str1{0, 0, nullptr}, str2{0, 0, nullptr};
-    kstring_t final{0, 0, nullptr};
-    kputs((settings->gzip_output)? "zcat": "cat", &str1);
-    ks_resize(&str1, 1 << 10);
-    for(int i(0); i < settings->n_handles; ++i)
-        ksprintf(&str1, " %s", params->outfnames_r1[i]);
-    kputsnl(" | paste -d'~' - - - - ", &str1);
-    str2.s = dlib::kstrdup(&str1); // strdup the string.
-    for(uint32_t i(0); i < str2.l; ++i) {
-        LOG_DEBUG("Current str.s + i: %s.\n", str2.s + i);
-        if(memcmp(str2.s + i, "R1", 2) == 0)
-            str2.s[i + 1] = '2';
-    }
-
-    const char final_template[]{"pr -mts'~' <(%s) <(%s) | tr '~' '\\n'"};
-    ksprintf(&final, final_template, str1.s, str2.s);
-    dlib::bash_system(final.s);
-    free(str1.s), free(str2.s);
-    free(final.s);
-}
-
-void cat_fastqs(marksplit_settings_t *settings, splitterhash_params_t *params, char *ffq_r1, char *ffq_r2)
-{
-    settings->is_se ? cat_fastqs_se(settings, params, ffq_r1)
-                    : cat_fastqs_pe(settings, params, ffq_r1, ffq_r2);
-}
-
-void cat_fastqs_pe(marksplit_settings_t *settings, splitterhash_params_t *params, char *ffq_r1, char *ffq_r2)
+void check_rescaler(marksplit_settings_t *settings, int readlen)
 {
-    kstring_t ks1{0, 0, nullptr};
-    kputsnl("> ", &ks1), kputs(ffq_r1, &ks1);
-    if(settings->gzip_output) kputsnl(".gz", &ks1);
-    // Clear output files.
-    //ksprintf(&ks1, settings->gzip_output ? "> %s.gz" : "> %s", ffq_r1);
-    dlib::check_call(ks1.s); ks1.l = 0;
-    ksprintf(&ks1, settings->gzip_output ? "> %s.gz" : "> %s", ffq_r2);
-    dlib::check_call(ks1.s); ks1.l = 0;
-    kputsnl("/bin/cat ", &ks1);
-    kstring_t ks2{0};
-    kputsn(ks1.s, ks1.l, &ks2);
-    for(int i(0); i < settings->n_handles; ++i) {
-        if(!dlib::isfile(params->outfnames_r1[i]))
-            LOG_EXIT("Output filename is not a file. Abort! ('%s').\n", params->outfnames_r1[i]);
-        if(!dlib::isfile(params->outfnames_r2[i]))
-            LOG_EXIT("Output filename is not a file. Abort! ('%s').\n", params->outfnames_r2[i]);
-        ksprintf(&ks1, "%s ", params->outfnames_r1[i]);
-        ksprintf(&ks2, "%s ", params->outfnames_r2[i]);
-    }
-    ksprintf(&ks1, " > %s", ffq_r1);
-    ksprintf(&ks2, " > %s", ffq_r2);
-    if(settings->gzip_output) {
-        kputsnl(".gz", &ks1);
-        kputsnl(".gz", &ks2);
-    }
-    FILE *c1_popen(popen(ks1.s, "w"));
-    FILE *c2_popen(popen(ks2.s, "w"));
-    int ret;
-    if((ret = ((pclose(c2_popen) << 8) | pclose(c1_popen)))) {
-        LOG_EXIT("Background cat command(s) failed. (Code: %i, '%s' or %i, '%s').\n", ret >> 8, ks1.s, ret & 0xff, ks2.s);
-    }
-    free(ks1.s), free(ks2.s);
+    if(settings->rescaler && (uint32_t)readlen > settings->rescaler->readlen())
+        LOG_EXIT("Rescaler %s is for reads of length %u, but reads are %i long.\n",
+                 settings->rescaler_path, settings->rescaler->readlen(), readlen);
 }
-
 /*
  * Check for invalid characters and convert all lower-case to upper case.
  */
@@ -259,64 +221,247 @@ void clean_homing_sequence(char *sequence) {
 
 
 /*
- * Pre-processes (pp) and splits fastqs with inline barcodes.
+ * @func get_bin
+ * :param: settings [const marksplit_settings_t *] Settings, with the bin map from plan_bins, if any.
+ * :param: barcode [char *] Barcode for the record.
+ * :returns: [uint64_t] Bin for the barcode.
  */
-mark_splitter_t pp_split_inline_se(marksplit_settings_t *settings)
+static inline uint64_t get_bin(const marksplit_settings_t *settings, char *barcode)
 {
-    uint64_t bin(0), count(1); // Initialze count to 1 because of the read used to get read length.
-    const int default_nlen(settings->blen + settings->offset + settings->homing_sequence_length);
-    LOG_DEBUG("Opening fastq file %s.\n", settings->input_r1_path);
-    if(!dlib::isfile(settings->input_r1_path))
-        LOG_EXIT("Could not open read paths: at least one is not a file.\n");
-    if(settings->rescaler_path)
-        settings->rescaler = parse_1d_rescaler(settings->rescaler_path);
-    mark_splitter_t splitter(init_splitter(settings));
-    gzFile fp(gzopen(settings->input_r1_path, "r"));
-    kseq_t *seq(kseq_init(fp));
-    // Manually process the first pair of reads so that we have the read length.
-    int pass_fail = 1;
-    if(kseq_read(seq) < 0) {
+    const uint64_t ret(settings->bin_map ? settings->bin_map[get_binner(barcode, settings->bin_prefix_len)]
+                                         : get_binner(barcode, settings->n_nucs));
+    assert(ret < (uint64_t)settings->n_handles);
+    return ret;
+}
+
+/*
+ * Marks records with inline barcodes.
+ * seqs holds read 1, then read 2 for paired-end data.
+ * Each marked record is passed to sink.add(bin, r1, r2, pass_fail, barcode, prefix), with r2 null
+ * for single-end data. For pairs whose reads are switched, r1 is the mseq for read 2 and vice versa.
+ * Markers keep per-thread scratch space, so each thread needs its own.
+ */
+class InlineMarker {
+    marksplit_settings_t *settings_;
+    tmp_mseq_t *tmp_;
+    mseq_t *rseq1_;
+    mseq_t *rseq2_;
+    const int default_nlen_;
+public:
+    /*
+     * :param: first [const kseq_t *] The first record from each input, for read length.
+     */
+    InlineMarker(marksplit_settings_t *settings, const kseq_t *first):
+        settings_(settings),
+        tmp_(init_tm_ptr(first[0].seq.l, settings->blen)),
+        rseq1_((mseq_t *)calloc(1, sizeof(mseq_t))),
+        rseq2_((mseq_t *)calloc(1, sizeof(mseq_t))),
+        default_nlen_((settings->is_se ? settings->blen: settings->blen1_2) + settings->offset + settings->homing_sequence_length)
+    {
+        rseq1_->blen = rseq2_->blen = settings->blen;
+    }
+    ~InlineMarker() {
+        tm_destroy(tmp_);
+        mseq_destroy(rseq1_), mseq_destroy(rseq2_);
+    }
+    template<typename Sink>
+    void mark(kseq_t *seqs, Sink &sink) {
+        const int offset(settings_->offset), hlen(settings_->homing_sequence_length);
+        int pass_fail, n_len, found;
+        bc_scan_t bc;
+        bc_scan_init(&bc);
+        if(settings_->is_se) {
+            // One pass over the prefix finds the homing sequence and checks the barcode for Ns and homopolymers.
+            found = bc_scan_read(&bc, seqs->seq.s, seqs->seq.l, offset, offset + settings_->blen,
+                                 settings_->homing_sequence, hlen, settings_->blen + offset, settings_->max_blen);
+            n_len = found >= 0 ? found + hlen: default_nlen_;
+            pass_fail = found >= 0 && bc_scan_pass(&bc, settings_->hp_threshold);
+            update_mseq(rseq1_, seqs, settings_->rescaler, tmp_, n_len, 0);
+            std::memcpy(rseq1_->barcode, seqs->seq.s + offset, settings_->blen);
+            rseq1_->barcode[settings_->blen] = '\0';
+            sink.add(get_bin(settings_, rseq1_->barcode), rseq1_, nullptr, pass_fail, rseq1_->barcode, 'F');
+            return;
+        }
+        kseq_t *seq1(seqs), *seq2(seqs + 1);
+        const int switched(switch_test(seq1, seq2, offset)), blen1_2(settings_->blen1_2);
+        // The homing sequence follows read 1's half of the barcode. The halves are scanned in barcode order.
+        const char *homing(settings_->ignore_homing ? nullptr: settings_->homing_sequence);
+        const int search_hlen(settings_->ignore_homing ? 0: hlen);
+        if(switched) {
+            bc_scan_read(&bc, seq2->seq.s, seq2->seq.l, offset, offset + blen1_2, nullptr, 0, 0, -1);
+            found = bc_scan_read(&bc, seq1->seq.s, seq1->seq.l, offset, offset + blen1_2,
+                                 homing, search_hlen, blen1_2 + offset, settings_->max_blen);
+        } else {
+            found = bc_scan_read(&bc, seq1->seq.s, seq1->seq.l, offset, offset + blen1_2,
+                                 homing, search_hlen, blen1_2 + offset, settings_->max_blen);
+            bc_scan_read(&bc, seq2->seq.s, seq2->seq.l, offset, offset + blen1_2, nullptr, 0, 0, -1);
+        }
+        if(settings_->ignore_homing) n_len = blen1_2 + offset, pass_fail = 1;
+        else n_len = found >= 0 ? found + hlen: default_nlen_, pass_fail = found >= 0;
+        pass_fail &= bc_scan_pass(&bc, settings_->hp_threshold);
+        update_mseq(rseq1_, seq1, settings_->rescaler, tmp_, n_len, 0);
+        update_mseq(rseq2_, seq2, settings_->rescaler, tmp_, n_len, 1);
+        if(switched) std::swap(seq1, seq2);
+        std::memcpy(rseq1_->barcode, seq1->seq.s + offset, blen1_2);
+        std::memcpy(rseq1_->barcode + blen1_2, seq2->seq.s + offset, blen1_2);
+        rseq1_->barcode[settings_->blen] = '\0';
+        const uint64_t bin(get_bin(settings_, rseq1_->barcode));
+        if(switched) sink.add(bin, rseq2_, rseq1_, pass_fail, rseq1_->barcode, 'R');
+        else sink.add(bin, rseq1_, rseq2_, pass_fail, rseq1_->barcode, 'F');
+    }
+};
+
+/*
+ * Marks records with secondary index barcodes.
+ * seqs holds read 1, read 2 (omitted for single-end data) and the index read.
+ * The barcode is settings->salt bases from read 1, the index read, and settings->salt bases from read 2.
+ */
+class SecondaryMarker {
+    marksplit_settings_t *settings_;
+    tmp_mseq_t *tmp_;
+    mseq_t *rseq1_;
+    mseq_t *rseq2_;
+public:
+    /*
+     * :param: first [const kseq_t *] The first record from each input, for read and index lengths.
+     */
+    SecondaryMarker(marksplit_settings_t *settings, const kseq_t *first):
+        settings_(settings),
+        tmp_(init_tm_ptr(first[0].seq.l, first[settings->is_se ? 1: 2].seq.l + 2 * settings->salt)),
+        rseq1_((mseq_t *)calloc(1, sizeof(mseq_t))),
+        rseq2_((mseq_t *)calloc(1, sizeof(mseq_t))) {}
+    ~SecondaryMarker() {
+        tm_destroy(tmp_);
+        mseq_destroy(rseq1_), mseq_destroy(rseq2_);
+    }
+    template<typename Sink>
+    void mark(kseq_t *seqs, Sink &sink) {
+        const int salt(settings_->salt);
+        kseq_t *seq1(seqs), *seq2(settings_->is_se ? nullptr: seqs + 1), *seq_index(seqs + (settings_->is_se ? 1: 2));
+        char *bc(rseq1_->barcode);
+        std::memcpy(bc, seq1->seq.s + settings_->offset, salt); // Copy in the appropriate nucleotides.
+        std::memcpy(bc + salt, seq_index->seq.s, seq_index->seq.l); // Copy in the barcode
+        if(seq2) {
+            std::memcpy(bc + salt + seq_index->seq.l, seq2->seq.s + settings_->offset, salt);
+            bc[salt * 2 + seq_index->seq.l] = '\0';
+        } else bc[salt + seq_index->seq.l] = '\0';
+        update_mseq(rseq1_, seq1, settings_->rescaler, tmp_, 0, 0);
+        if(seq2) update_mseq(rseq2_, seq2, settings_->rescaler, tmp_, 0, 1);
+        bc_scan_t scan;
+        bc_scan_init(&scan);
+        bc_scan_append(&scan, bc, salt * (seq2 ? 2: 1) + seq_index->seq.l);
+        sink.add(get_bin(settings_, bc), rseq1_, seq2 ? rseq2_: nullptr,
+                 bc_scan_pass(&scan, settings_->hp_threshold), bc, 'Z');
+    }
+};
+
+/*
+ * Checks input paths and loads the rescaler for collapse inline.
+ */
+static void prepare_inline_inputs(marksplit_settings_t *settings)
+{
+    if(settings->is_se) {
+        LOG_DEBUG("Opening fastq file %s.\n", settings->input_r1_path);
+        if(!dlib::isfile(settings->input_r1_path))
+            LOG_EXIT("Could not open read paths: at least one is not a file.\n");
+    } else {
+        LOG_DEBUG("Opening fastq files %s and %s.\n", settings->input_r1_path, settings->input_r2_path);
+        if(!(strcmp(settings->input_r1_path, settings->input_r2_path))) {
+            LOG_EXIT("Hey, it looks like you're trying to use the same path for both r1 and r2. "
+                    "At least try to fool me by making a symbolic link.\n");
+        }
+        if(!dlib::isfile(settings->input_r1_path) || !dlib::isfile(settings->input_r2_path)) {
+            LOG_EXIT("Could not open read paths: at least one is not a file.\n");
+        }
+    }
+    if(settings->rescaler_path) settings->rescaler = new Rescaler(settings->rescaler_path);
+}
+
+/*
+ * Reads one record at a time from each of several fastqs, as the null-terminated kseq_t views markers take.
+ */
+class FqZipReader {
+    std::vector<FqReader *> in_;
+    fq_batch_t buf_;
+public:
+    kseq_t views[SPLIT_MAX_INPUTS];
+    FqZipReader(const std::vector<char *> &paths, int threads=1) {
+        std::memset(views, 0, sizeof(views));
+        for(const auto path: paths) in_.push_back(new FqReader(path, fq_reader_threads(threads, paths.size())));
+    }
+    ~FqZipReader() {for(auto in: in_) delete in;}
+    /*
+     * :returns: [int] 1 if a record was read from every input, 0 once any input ends.
+     */
+    int next() {
+        fq_view_t rec;
+        buf_.clear();
+        for(auto in: in_) {
+            if(!in->next(&rec)) return 0;
+            buf_.add(rec);
+        }
+        for(size_t i(0); i < in_.size(); ++i) buf_.view(i, views + i);
+        return 1;
+    }
+};
+
+/*
+ * Marks the first BIN_SAMPLE_SIZE records of the inputs and places bin boundaries from their barcodes.
+ * Must be called before the splitter (or stream collapser) is created, since it may lower settings->n_handles.
+ * :param: paths [const std::vector<char *> &] Input fastqs, in the order Marker expects them.
+ */
+template<typename Marker>
+static void sample_bins(marksplit_settings_t *settings, const std::vector<char *> &paths)
+{
+    FqZipReader in(paths);
+    bin_sample_t sample;
+    if(in.next()) {
+        Marker marker(settings, in.views);
+        do marker.mark(in.views, sample);
+        while(sample.n < BIN_SAMPLE_SIZE && in.next());
+    }
+    plan_bins(settings, sample);
+}
+
+/*
+ * Marks and splits fastqs into the temporary fastqs for each bin, using a SplitPipeline.
+ * :param: paths [const std::vector<char *> &] Input fastqs, in the order Marker expects them.
+ * :returns: [uint64_t] Number of records (or pairs) processed.
+ */
+template<typename Marker>
+static uint64_t split_pipelined(marksplit_settings_t *settings, mark_splitter_t *splitter, const std::vector<char *> &paths)
+{
+    SplitPipeline pipeline(settings, splitter, paths);
+    kseq_t first[SPLIT_MAX_INPUTS];
+    if(!pipeline.first(first)) {
             free_marksplit_settings(*settings);
-            splitter_destroy(&splitter);
             LOG_EXIT("Could not open fastqs for reading. Abort!\n");
     }
-    LOG_DEBUG("Read length (inferred): %lu.\n", seq->seq.l);
-    check_rescaler(settings, seq->seq.l * 4 * 2 * NQSCORES);
-    tmp_mseq_t *tmp(init_tm_ptr(seq->seq.l, settings->blen));
-    int n_len(nlen_homing_se(seq, settings, default_nlen, &pass_fail));
-    mseq_t *rseq(mseq_rescale_init(seq, settings->rescaler, tmp, 0, settings->maxrlen));
-    rseq->barcode[settings->blen] = '\0';
-    std::memcpy(rseq->barcode, seq->seq.s + settings->offset, settings->blen);
-    pass_fail &= test_hp(rseq->barcode, settings->hp_threshold);
-    // Get first barcode.
-    update_mseq(rseq, seq, settings->rescaler, tmp, n_len, 0);
-    bin = get_binner_type(rseq->barcode, settings->n_nucs, uint64_t);
-    assert(bin < (uint64_t)settings->n_handles);
-    mseq2fq_stranded(splitter.tmp_out_handles_r1[bin], rseq, pass_fail, rseq->barcode, 'F');
-    while(LIKELY(kseq_read(seq) >= 0)) {
-        if(UNLIKELY(++count % settings->notification_interval == 0))
-            LOG_INFO("Number of records processed: %lu.\n", count);
-        // Sets pass_fail and gets n_len
-        n_len = nlen_homing_se(seq, settings, default_nlen, &pass_fail);
-        // Update mseq
-        update_mseq(rseq, seq, settings->rescaler, tmp, n_len, 0);
-        // Update barcode
-        std::memcpy(rseq->barcode, seq->seq.s + settings->offset, settings->blen);
-        // Update QC Fail
-        pass_fail &= test_hp(rseq->barcode, settings->hp_threshold);
-        // Get bin
-        bin = bmf::get_binner_type(rseq->barcode, settings->n_nucs, uint64_t);
-        assert(bin < (uint64_t)settings->n_handles);
-        // Write the processed read to the bin
-        mseq2fq_stranded(splitter.tmp_out_handles_r1[bin], rseq, pass_fail, rseq->barcode, 'F');
+    const int readlen(first[0].seq.l);
+    LOG_DEBUG("Read length (inferred): %i.\n", readlen);
+    if(!settings->index_fq_path || !settings->is_se) check_rescaler(settings, readlen);
+    const uint64_t count(pipeline.run<Marker>(settings, (const kseq_t *)first));
+    for(int i(0); i < splitter->n_handles; ++i) {
+        delete splitter->tmp_out_handles_r1[i];
+        splitter->tmp_out_handles_r1[i] = nullptr;
+        if(splitter->tmp_out_handles_r2) {
+            delete splitter->tmp_out_handles_r2[i];
+            splitter->tmp_out_handles_r2[i] = nullptr;
+        }
     }
+    return count;
+}
+
+/*
+ * Pre-processes (pp) and splits fastqs with inline barcodes.
+ */
+mark_splitter_t pp_split_inline_se(marksplit_settings_t *settings)
+{
+    prepare_inline_inputs(settings);
+    sample_bins<InlineMarker>(settings, {settings->input_r1_path});
+    mark_splitter_t splitter(init_splitter(settings));
+    const uint64_t count(split_pipelined<InlineMarker>(settings, &splitter, {settings->input_r1_path}));
     LOG_INFO("Collapsing %lu initial reads....\n", count);
-    LOG_DEBUG("Cleaning up.\n");
-    for(int i(0); i < splitter.n_handles; ++i) gzclose(splitter.tmp_out_handles_r1[i]);
-    tm_destroy(tmp);
-    mseq_destroy(rseq);
-    kseq_destroy(seq);
-    gzclose(fp);
     return splitter;
 }
 
@@ -326,101 +471,44 @@ mark_splitter_t pp_split_inline_se(marksplit_settings_t *settings)
  */
 mark_splitter_t pp_split_inline(marksplit_settings_t *settings)
 {
-    LOG_DEBUG("Opening fastq files %s and %s.\n", settings->input_r1_path, settings->input_r2_path);
-    if(!(strcmp(settings->input_r1_path, settings->input_r2_path))) {
-        LOG_EXIT("Hey, it looks like you're trying to use the same path for both r1 and r2. "
-                "At least try to fool me by making a symbolic link.\n");
-    }
-    if(!dlib::isfile(settings->input_r1_path) || !dlib::isfile(settings->input_r2_path)) {
-        LOG_EXIT("Could not open read paths: at least one is not a file.\n");
-    }
-    if(settings->rescaler_path) settings->rescaler = parse_1d_rescaler(settings->rescaler_path);
+    prepare_inline_inputs(settings);
+    sample_bins<InlineMarker>(settings, {settings->input_r1_path, settings->input_r2_path});
     mark_splitter_t splitter(init_splitter(settings));
-    gzFile fp1(gzopen(settings->input_r1_path, "r"));
-    gzFile fp2(gzopen(settings->input_r2_path, "r"));
-    if(fp1 == nullptr) LOG_EXIT("Could not open file at %s\n", settings->input_r1_path);
-    if(fp2 == nullptr) LOG_EXIT("Could not open file at %s\n", settings->input_r2_path);
-    kseq_t *seq1(kseq_init(fp1));
-    kseq_t *seq2(kseq_init(fp2));
-    // Manually process the first pair of reads so that we have the read length.
-    int pass_fail(1);
-    if(kseq_read(seq1) < 0 || kseq_read(seq2) < 0) {
+    const uint64_t count(split_pipelined<InlineMarker>(settings, &splitter,
+                                                       {settings->input_r1_path, settings->input_r2_path}));
+    LOG_INFO("Collapsing %lu initial read pairs....\n", count);
+    return splitter;
+}
+
+/*
+ * Marks and collapses fastqs with inline barcodes in a single pass,
+ * without writing temporary split fastqs. See lib/streamdmp.h.
+ * Marking runs in this thread, since StreamCollapser takes records from a single producer.
+ */
+void stream_collapse_inline(marksplit_settings_t *settings, char *ffq_r1, char *ffq_r2)
+{
+    prepare_inline_inputs(settings);
+    FqZipReader in(settings->is_se ? std::vector<char *>{settings->input_r1_path}
+                                   : std::vector<char *>{settings->input_r1_path, settings->input_r2_path},
+                   settings->threads);
+    if(!in.next()) {
             free_marksplit_settings(*settings);
-            splitter_destroy(&splitter);
             LOG_EXIT("Could not open fastqs for reading. Abort!\n");
     }
-    LOG_DEBUG("Read length (inferred): %lu.\n", seq1->seq.l);
-    check_rescaler(settings, seq1->seq.l * 4 * 2 * NQSCORES);
-    tmp_mseq_t *tmp(init_tm_ptr(seq1->seq.l, settings->blen));
-    int switch_reads(switch_test(seq1, seq2, settings->offset));
-    const int default_nlen(settings->blen1_2 + settings->offset + settings->homing_sequence_length);
-    int n_len(settings->ignore_homing ? settings->blen1_2 + settings->offset + settings->homing_sequence_length
-                                      : nlen_homing_default(seq1, seq2, settings, default_nlen, &pass_fail));
-    mseq_t *rseq1(mseq_rescale_init(seq1, settings->rescaler, tmp, 0, settings->maxrlen));
-    mseq_t *rseq2(mseq_rescale_init(seq2, settings->rescaler, tmp, 1, settings->maxrlen));
-    if(switch_reads) {
-        std::memcpy(rseq1->barcode, seq2->seq.s + settings->offset, settings->blen1_2);
-        std::memcpy(rseq1->barcode + settings->blen1_2, seq1->seq.s + settings->offset, settings->blen1_2);
-    } else {
-        std::memcpy(rseq1->barcode, seq1->seq.s + settings->offset, settings->blen1_2);
-        std::memcpy(rseq1->barcode + settings->blen1_2, seq2->seq.s + settings->offset, settings->blen1_2);
-    }
-    pass_fail &= test_hp(rseq1->barcode, settings->hp_threshold);
-    // Get first barcode.
-    update_mseq(rseq1, seq1, settings->rescaler, tmp, n_len, 0);
-    update_mseq(rseq2, seq2, settings->rescaler, tmp, n_len, 1);
-    uint64_t bin(get_binner_type(rseq1->barcode, settings->n_nucs, uint64_t));
-    assert(bin < (uint64_t)settings->n_handles);
-    if(switch_reads) {
-        mseq2fq_stranded(splitter.tmp_out_handles_r1[bin], rseq2, pass_fail, rseq1->barcode, 'R');
-        mseq2fq_stranded(splitter.tmp_out_handles_r2[bin], rseq1, pass_fail, rseq1->barcode, 'R');
-    } else {
-        mseq2fq_stranded(splitter.tmp_out_handles_r1[bin], rseq1, pass_fail, rseq1->barcode, 'F');
-        mseq2fq_stranded(splitter.tmp_out_handles_r2[bin], rseq2, pass_fail, rseq1->barcode, 'F');
-    }
-    uint64_t count(1uL);
-    while(LIKELY(kseq_read(seq1) >= 0 && kseq_read(seq2) >= 0)) {
+    LOG_DEBUG("Read length (inferred): %lu.\n", in.views[0].seq.l);
+    check_rescaler(settings, in.views[0].seq.l);
+    if(settings->is_se) sample_bins<InlineMarker>(settings, {settings->input_r1_path});
+    else sample_bins<InlineMarker>(settings, {settings->input_r1_path, settings->input_r2_path});
+    StreamCollapser sink(settings);
+    InlineMarker marker(settings, in.views);
+    uint64_t count(0);
+    do {
         if(UNLIKELY(++count % settings->notification_interval == 0))
             LOG_INFO("Number of records processed: %lu.\n", count);
-        // Sets pass_fail
-        n_len = settings->ignore_homing ? settings->blen1_2 + settings->offset
-                                        : nlen_homing_default(seq1, seq2, settings, default_nlen, &pass_fail);
-        // Update mseqs
-        update_mseq(rseq1, seq1, settings->rescaler, tmp, n_len, 0);
-        update_mseq(rseq2, seq2, settings->rescaler, tmp, n_len, 1);
-
-        if(switch_test(seq1, seq2, settings->offset)) {
-            // Copy barcode over
-            std::memcpy(rseq1->barcode, seq2->seq.s + settings->offset, settings->blen1_2);
-            std::memcpy(rseq1->barcode + settings->blen1_2, seq1->seq.s + settings->offset, settings->blen1_2);
-            // Test for homopolymer failure
-            pass_fail &= test_hp(rseq1->barcode, settings->hp_threshold);
-            bin = get_binner_type(rseq1->barcode, settings->n_nucs, uint64_t);
-            assert(bin < (uint64_t)settings->n_handles);
-            // Write out
-            mseq2fq_stranded(splitter.tmp_out_handles_r1[bin], rseq2, pass_fail, rseq1->barcode, 'R');
-            mseq2fq_stranded(splitter.tmp_out_handles_r2[bin], rseq1, pass_fail, rseq1->barcode, 'R');
-        } else {
-            std::memcpy(rseq1->barcode, seq1->seq.s + settings->offset, settings->blen1_2);
-            std::memcpy(rseq1->barcode + settings->blen1_2, seq2->seq.s + settings->offset, settings->blen1_2);
-            pass_fail &= test_hp(rseq1->barcode, settings->hp_threshold);
-            bin = bmf::get_binner_type(rseq1->barcode, settings->n_nucs, uint64_t);
-            assert(bin < (uint64_t)settings->n_handles);
-            mseq2fq_stranded(splitter.tmp_out_handles_r1[bin], rseq1, pass_fail, rseq1->barcode, 'F');
-            mseq2fq_stranded(splitter.tmp_out_handles_r2[bin], rseq2, pass_fail, rseq1->barcode, 'F');
-        }
-    }
-    LOG_INFO("Collapsing %lu initial read pairs....\n", count);
-    LOG_DEBUG("Cleaning up.\n");
-    for(int i(0); i < splitter.n_handles; ++i) {
-        gzclose(splitter.tmp_out_handles_r1[i]);
-        gzclose(splitter.tmp_out_handles_r2[i]);
-    }
-    tm_destroy(tmp);
-    mseq_destroy(rseq1), mseq_destroy(rseq2);
-    kseq_destroy(seq1), kseq_destroy(seq2);
-    gzclose(fp1), gzclose(fp2);
-    return splitter;
+        marker.mark(in.views, sink);
+    } while(LIKELY(in.next()));
+    LOG_INFO(settings->is_se ? "Collapsing %lu initial reads....\n": "Collapsing %lu initial read pairs....\n", count);
+    sink.finish(ffq_r1, ffq_r2);
 }
 
 int idmp_main(int argc, char *argv[]);
@@ -454,6 +542,7 @@ int idmp_main(int argc, char *argv[])
     settings.cleanup = 1;
     settings.run_hash_dmp = 1;
     settings.maxrlen = -1;
+    settings.stream_budget = DEFAULT_STREAM_BUDGET_MB;
 #if ZLIB_VER_MAJOR <= 1 && ZLIB_VER_MINOR <= 2 && ZLIB_VER_REVISION < 5
 #pragma message("Note: zlib version < 1.2.5 doesn't support transparent file writing. Writing uncompressed temporary gzip files by default.")
     // If not set, zlib compresses all our files enormously.
@@ -464,11 +553,16 @@ int idmp_main(int argc, char *argv[])
 
     //omp_set_dynamic(0); // Tell omp that I want to set my number of threads 4realz
     int c;
-    while ((c = getopt(argc, argv, "T:t:o:n:s:l:m:M:r:p:f:v:u:g:i:zwcdDh?S=")) > -1) {
+    while ((c = getopt_long(argc, argv, "T:t:o:n:s:l:m:M:r:p:f:v:u:g:i:E:x:k:BOUzwcdDeh?S=", collapse_long_options, nullptr)) > -1) {
         switch(c) {
+            case 'B': settings.binary_tmp = 1; break;
+            case 'U': settings.ubam = 1; break;
+            case 'O': settings.barcode_order = 1; break;
             case 'c': LOG_WARNING("Deprecated option -c.\n"); break;
             case 'd': LOG_WARNING("Deprecated option -d.\n"); break;
             case 'D': settings.run_hash_dmp = 0; break;
+            case 'e': settings.stream = 1; break;
+            case 'E': settings.stream_budget = strtoull(optarg, nullptr, 10); break;
             case 'f': settings.ffq_prefix = strdup(optarg); break;
             case 'g': settings.gzip_compression = (uint32_t)atoi(optarg)%10; break;
             case 'l': settings.blen = atoi(optarg); break;
@@ -488,6 +582,8 @@ int idmp_main(int argc, char *argv[])
             case 'w': settings.cleanup = 0; break;
             case 'z': settings.gzip_output = 1; break;
             case 'T': sprintf(settings.mode, "wb%c", atoi(optarg) % 10 + '0'); break;
+            case 'x': settings.max_mem = parse_mem_size(optarg); break;
+            case 'k': settings.cluster_dist = parse_cluster_dist(optarg); break;
             case 'S': settings.is_se = 1; break;
             case '=': settings.to_stdout = 1; break;
             case '?': case 'h': idmp_usage(); exit(EXIT_SUCCESS);
@@ -573,6 +669,23 @@ int idmp_main(int argc, char *argv[])
                   settings.tmp_basename);
     }
 
+    if(settings.stream) {
+        if(!settings.run_hash_dmp) LOG_EXIT("Stream mode (-e) writes no temporary files, so it cannot be combined with -D.\n");
+        if(!settings.ffq_prefix) make_outfname(&settings);
+        kstring_t ffq_r1{0, 0, nullptr}, ffq_r2{0, 0, nullptr};
+        if(settings.ubam) ksprintf(&ffq_r1, "%s.bam", settings.ffq_prefix);
+        else {
+            ksprintf(&ffq_r1, settings.gzip_output ? "%s.R1.fq.gz": "%s.R1.fq", settings.ffq_prefix);
+            ksprintf(&ffq_r2, settings.gzip_output ? "%s.R2.fq.gz": "%s.R2.fq", settings.ffq_prefix);
+        }
+        stream_collapse_inline(&settings, ffq_r1.s, ffq_r2.s);
+        LOG_INFO("Peak family arena usage for a single bin: %lu bytes.\n", kf_arena_peak());
+        free(ffq_r1.s), free(ffq_r2.s);
+        free_marksplit_settings(settings);
+        LOG_INFO("Successfully completed bmftools collapse inline!\n");
+        return EXIT_SUCCESS;
+    }
+
     // Run core
     mark_splitter_t splitter(settings.is_se ? pp_split_inline_se(&settings)
                                             : pp_split_inline(&settings));
@@ -584,16 +697,18 @@ int idmp_main(int argc, char *argv[])
         goto cleanup;
     }
     if(!settings.ffq_prefix) make_outfname(&settings);
-    // Run cores.
-    parallel_hash_dmp_core(&settings, params, &stranded_hash_dmp_core);
-
-    // Remove temporary split files.
-    ksprintf(&ffq_r1, "%s.R1.fq", settings.ffq_prefix);
-    ksprintf(&ffq_r2, "%s.R2.fq", settings.ffq_prefix);
-    // Cat temporary files together.
-    if(settings.to_stdout)
-        call_stdout(&settings, params, ffq_r1.s, ffq_r2.s);
-    else cat_fastqs(&settings, params, ffq_r1.s, ffq_r2.s);
+    if(settings.ubam) ksprintf(&ffq_r1, "%s.bam", settings.ffq_prefix);
+    else {
+        ksprintf(&ffq_r1, "%s.R1.fq", settings.ffq_prefix);
+        ksprintf(&ffq_r2, "%s.R2.fq", settings.ffq_prefix);
+    }
+    {
+        // Run cores, merging collapsed bins into the final fastqs as they finish.
+        BinMerger merger(&settings, params, ffq_r1.s, ffq_r2.s);
+        parallel_hash_dmp_core(&settings, params, &stranded_hash_dmp_core, &merger);
+        merger.finish();
+    }
+    LOG_INFO("Peak family arena usage for a single bin: %lu bytes.\n", kf_arena_peak());
     free(ffq_r1.s), free(ffq_r2.s);
     cleanup_hashdmp(&settings, params);
     splitterhash_destroy(params);
@@ -614,135 +729,63 @@ void sdmp_usage(char *argv[])
                         "-i: Index fastq path. REQUIRED.\n"
                         "-t: Homopolymer failure threshold. A molecular barcode with a homopolymer of length >= this limit is flagged as QC fail. Default: 10\n"
                         "-o: Temporary fastq file prefix.\n"
-                        "-n: Number of nucleotides at the beginning of the barcode to use to split the output. Default: %i.\n"
+                        "-n: Split into at most 4^n bins, placed by the barcode frequencies of the first records. Default: %i.\n"
                         "-z: Flag to write gzip compressed output. Default: False.\n"
                         "-T: If unset, write uncompressed plain text temporary files. If not, use that compression level for temporary files.\n"
+                        "-B: Write temporary files in a compact binary format instead of marked fastq.\n"
                         "-g: Gzip compression ratio if writing compressed. Default: 1 (mostly to reduce I/O).\n"
                         "-s: Number of bases from reads 1 and 2 with which to salt the barcode. Default: 0.\n"
                         "-m: Number of bases in the start of reads to skip when salting. Default: 0.\n"
                         "-M: Set maximum readlength for cases with variable read length. Default: -1 (infer from first read)\n"
                         "-D: Use this flag to only mark/split and avoid final demultiplexing/consolidation.\n"
-                        "-p: Number of threads to use if running hash_dmp. Default: %i.\n"
+                        "-p: Number of threads to use for splitting and for running hash_dmp. Default: %i.\n"
                         "-v: Set notification interval for split. Default: 1000000.\n"
                         "-r: Path to flat text file with rescaled quality scores. If not provided, it will not be used.\n"
                         "-w: Flag to leave temporary files instead of deleting them, as in default behavior.\n"
                         "-f: If running hash_dmp, this sets the Final Fastq Prefix. \n"
                         "-S: Single-end mode. Ignores read 2.\n"
                         "-=: Emit final fastqs to stdout in interleaved form. Ignores -f.\n"
+                        "-x, --max-mem: Memory budget for collapsing bins (e.g., 16G), shared between threads."
+                        " Bins which exceed it are re-split by barcode and collapsed in pieces. Default: unlimited.\n"
+                        "-k, --cluster: Merge families whose barcodes differ by at most this many bases, by directional adjacency."
+                        " Merged families record their exact-match size in an OF tag. With -x, families are only merged"
+                        " within a piece of a re-split bin. Default: 0 (exact matching only).\n"
+                        "-U, --ubam: Write collapsed reads to '<ffq_prefix>.bam' (or stdout, with -=) as unaligned BAM, compressed with -g and -p threads,"
+                        " with FA and PV as B:I arrays.\n"
+                        "-O, --barcode-order: Write each bin's families in barcode order. Bins hold consecutive barcode ranges,"
+                        " so the whole output is in barcode order (families with Ns in their barcodes ending each bin)"
+                        " and does not depend on the number of threads.\n"
                 , DEFAULT_N_NUCS, DEFAULT_N_THREADS);
 }
 
 static mark_splitter_t splitmark_core_rescale(marksplit_settings_t *settings)
 {
     LOG_DEBUG("Path to index fq: %s.\n", settings->index_fq_path);
-    gzFile fp_read1, fp_read2, fp_index;
-    kseq_t *seq1, *seq2, *seq_index;
-    int l1, l2, l_index;
-    mark_splitter_t splitter(init_splitter(settings));
     for(const auto path: {settings->input_r1_path, settings->input_r2_path, settings->index_fq_path})
         if(!dlib::isfile(path))
             LOG_EXIT("%s is not a file. Abort!\n", path);
-    // Open fastqs
+    sample_bins<SecondaryMarker>(settings, {settings->input_r1_path, settings->input_r2_path, settings->index_fq_path});
+    mark_splitter_t splitter(init_splitter(settings));
     LOG_DEBUG("Splitter now opening files R1 ('%s'), R2 ('%s'), index ('%s').\n",
               settings->input_r1_path, settings->input_r2_path, settings->index_fq_path);
-    fp_read1 = gzopen(settings->input_r1_path, "r"), fp_read2 = gzopen(settings->input_r2_path, "r");
-    seq1 = kseq_init(fp_read1), seq2 = kseq_init(fp_read2);
-    l1 = kseq_read(seq1), l2 = kseq_read(seq2);
-
-    fp_index = gzopen(settings->index_fq_path, "r");
-    seq_index = kseq_init(fp_index),
-    l_index = kseq_read(seq_index);
-
-    uint64_t bin(0);
-    int pass_fail(1);
-    tmp_mseq_t *tmp(init_tm_ptr(seq1->seq.l, seq_index->seq.l + 2 * settings->salt));
-    if(l1 < 0 || l2 < 0 || l_index < 0)
-        LOG_EXIT("Could not read input fastqs. Abort mission!\n");
-    check_rescaler(settings, NQSCORES * 2 * 4 * seq1->seq.l);
-    mseq_t *rseq1(mseq_init(seq1, settings->rescaler, 0)); // rseq1 is initialized
-    mseq_t *rseq2(mseq_init(seq2, settings->rescaler, 1)); // rseq2 is initialized
-    std::memcpy(rseq1->barcode, seq1->seq.s + settings->offset, settings->salt); // Copy in the appropriate nucleotides.
-    std::memcpy(rseq1->barcode + settings->salt, seq_index->seq.s, seq_index->seq.l); // Copy in the barcode
-    std::memcpy(rseq1->barcode + settings->salt + seq_index->seq.l, seq2->seq.s + settings->offset, settings->salt);
-    rseq1->barcode[settings->salt * 2 + seq_index->seq.l] = '\0';
-    update_mseq(rseq1, seq1, settings->rescaler, tmp, 0, 0);
-    update_mseq(rseq2, seq2, settings->rescaler, tmp, 0, 1);
-    pass_fail = test_hp(rseq1->barcode, settings->hp_threshold);
-    bin = get_binner_type(rseq1->barcode, settings->n_nucs, uint64_t);
-    mseq2fq(splitter.tmp_out_handles_r1[bin], rseq1, pass_fail, rseq1->barcode);
-    mseq2fq(splitter.tmp_out_handles_r2[bin], rseq2, pass_fail, rseq1->barcode);
-    uint64_t count(1uL);
-    while(LIKELY((l1 = kseq_read(seq1)) >= 0 && (l2 = kseq_read(seq2) >= 0))
-            && (l_index = kseq_read(seq_index)) >= 0) {
-        if(UNLIKELY(++count % settings->notification_interval == 0))
-            LOG_INFO("Number of records processed: %lu.\n", count);
-        std::memcpy(rseq1->barcode, seq1->seq.s + settings->offset, settings->salt); // Copy in the appropriate nucleotides.
-        std::memcpy(rseq1->barcode + settings->salt, seq_index->seq.s, seq_index->seq.l); // Copy in the barcode
-        std::memcpy(rseq1->barcode + settings->salt + seq_index->seq.l, seq2->seq.s + settings->offset, settings->salt);
-        update_mseq(rseq1, seq1, settings->rescaler, tmp, 0, 0);
-        update_mseq(rseq2, seq2, settings->rescaler, tmp, 0, 1);
-        pass_fail = test_hp(rseq1->barcode, settings->hp_threshold);
-        bin = get_binner_type(rseq1->barcode, settings->n_nucs, uint64_t);
-        mseq2fq(splitter.tmp_out_handles_r1[bin], rseq1, pass_fail, rseq1->barcode);
-        mseq2fq(splitter.tmp_out_handles_r2[bin], rseq2, pass_fail, rseq1->barcode);
-    }
-    tm_destroy(tmp);
-    mseq_destroy(rseq1); mseq_destroy(rseq2);
-    kseq_destroy(seq1); kseq_destroy(seq2); kseq_destroy(seq_index);
-    gzclose(fp_read1); gzclose(fp_read2); gzclose(fp_index);
-    for(int j(0); j < settings->n_handles; ++j) {
-        gzclose(splitter.tmp_out_handles_r1[j]);
-        gzclose(splitter.tmp_out_handles_r2[j]);
-        splitter.tmp_out_handles_r1[j] = splitter.tmp_out_handles_r2[j] = nullptr;
-    }
+    const uint64_t count(split_pipelined<SecondaryMarker>(settings, &splitter,
+                         {settings->input_r1_path, settings->input_r2_path, settings->index_fq_path}));
     LOG_INFO("Collapsing %lu initial read pairs....\n", count);
     return splitter;
 }
 
 static mark_splitter_t splitmark_core_rescale_se(marksplit_settings_t *settings)
 {
-    mark_splitter_t splitter(init_splitter(settings));
     if(!dlib::isfile(settings->input_r1_path) ||
        !dlib::isfile(settings->index_fq_path)) {
         LOG_EXIT("At least one input path ('%s', '%s') is not a file. Abort!\n",
                  settings->input_r1_path, settings->index_fq_path);
     }
-    // Open fastqs
-    gzFile fp(gzopen(settings->input_r1_path, "r")), fp_index(gzopen(settings->index_fq_path, "r"));
-    kseq_t *seq(kseq_init(fp)), *seq_index(kseq_init(fp_index));
-    int l(kseq_read(seq));
-    int l_index(kseq_read(seq_index));
-
-    tmp_mseq_t *tmp(init_tm_ptr(seq->seq.l, seq_index->seq.l + settings->salt));
-    if(l < 0 || l_index < 0)
-        LOG_EXIT("Could not read input fastqs. Abort mission!\n");
-    mseq_t *rseq(mseq_init(seq, settings->rescaler, 0));
-    std::memcpy(rseq->barcode, seq->seq.s + settings->offset, settings->salt); // Copy in the appropriate nucleotides.
-    std::memcpy(rseq->barcode + settings->salt, seq_index->seq.s, seq_index->seq.l); // Copy in the barcode
-    rseq->barcode[settings->salt + seq_index->seq.l] = '\0';
-    update_mseq(rseq, seq, settings->rescaler, tmp, 0, 0);
-    mseq2fq(splitter.tmp_out_handles_r1[get_binner_type(rseq->barcode, settings->n_nucs, uint64_t)],
-            rseq, test_hp(rseq->barcode, settings->hp_threshold), rseq->barcode);
-    uint64_t count(1uL);
-    while (LIKELY((l = kseq_read(seq)) >= 0 && (l_index = kseq_read(seq_index)) >= 0)) {
-        if(UNLIKELY(++count % settings->notification_interval == 0))
-            fprintf(stderr, "[%s] Number of records processed: %" PRIu64 ".\n", __func__, count);
-        std::memcpy(rseq->barcode, seq->seq.s + settings->offset, settings->salt); // Copy in the appropriate nucleotides.
-        std::memcpy(rseq->barcode + settings->salt, seq_index->seq.s, seq_index->seq.l); // Copy in the barcode
-        update_mseq(rseq, seq, settings->rescaler, tmp, 0, 0);
-        mseq2fq(splitter.tmp_out_handles_r1[get_binner_type(rseq->barcode, settings->n_nucs, uint64_t)],
-                rseq, test_hp(rseq->barcode, settings->hp_threshold), rseq->barcode);
-    }
-    tm_destroy(tmp);
-    mseq_destroy(rseq);
-    kseq_destroy(seq); kseq_destroy(seq_index);
-    gzclose(fp); gzclose(fp_index);
-    for(int j(0); j < settings->n_handles; ++j) {
-        gzclose(splitter.tmp_out_handles_r1[j]);
-        splitter.tmp_out_handles_r1[j] = nullptr;
-    }
+    sample_bins<SecondaryMarker>(settings, {settings->input_r1_path, settings->index_fq_path});
+    mark_splitter_t splitter(init_splitter(settings));
+    const uint64_t count(split_pipelined<SecondaryMarker>(settings, &splitter,
+                         {settings->input_r1_path, settings->index_fq_path}));
     LOG_INFO("Collapsing %lu initial reads....\n", count);
-    // Set out handles to nullptr.
     return splitter;
 }
 
@@ -770,8 +813,11 @@ int sdmp_main(int argc, char *argv[])
 #endif
 
     int c;
-    while ((c = getopt(argc, argv, "t:o:i:n:M:m:s:f:u:p:g:v:r:T:IhdDczw?S=")) > -1) {
+    while ((c = getopt_long(argc, argv, "t:o:i:n:M:m:s:f:u:p:g:v:r:T:x:k:BOUIhdDczw?S=", collapse_long_options, nullptr)) > -1) {
         switch(c) {
+            case 'B': settings.binary_tmp = 1; break;
+            case 'U': settings.ubam = 1; break;
+            case 'O': settings.barcode_order = 1; break;
             case 'd': LOG_WARNING("Deprecated option -d.\n"); break;
             case 'D': settings.run_hash_dmp = 0; break;
             case 'f': settings.ffq_prefix = strdup(optarg); break;
@@ -791,8 +837,10 @@ int sdmp_main(int argc, char *argv[])
             case 'w': settings.cleanup = 0; break;
             case 'r':
                 settings.rescaler_path = strdup(optarg);
-                settings.rescaler = parse_1d_rescaler(settings.rescaler_path);
+                settings.rescaler = new Rescaler(settings.rescaler_path);
                 break;
+            case 'x': settings.max_mem = parse_mem_size(optarg); break;
+            case 'k': settings.cluster_dist = parse_cluster_dist(optarg); break;
             case 'S': settings.is_se = 1; break;
             case '=': settings.to_stdout = 1; break;
             case '?': case 'h': sdmp_usage(argv); return EXIT_SUCCESS;
@@ -855,14 +903,16 @@ int sdmp_main(int argc, char *argv[])
     params = init_splitterhash(&settings, &splitter);
     fprintf(stderr, "[%s] Running dmp block in parallel with %i threads.\n", __func__, settings.threads);
 
-    parallel_hash_dmp_core(&settings, params, &hash_dmp_core);
-    // Make sure that both files are empty.
     char ffq_r1[200], ffq_r2[200];
-    sprintf(ffq_r1, settings.gzip_output ? "%s.R1.fq": "%s.R1.fq.gz", settings.ffq_prefix);
+    if(settings.ubam) sprintf(ffq_r1, "%s.bam", settings.ffq_prefix);
+    else sprintf(ffq_r1, settings.gzip_output ? "%s.R1.fq": "%s.R1.fq.gz", settings.ffq_prefix);
     sprintf(ffq_r2, settings.gzip_output ? "%s.R2.fq": "%s.R2.fq.gz", settings.ffq_prefix);
-    if(settings.to_stdout)
-        call_stdout(&settings, params, ffq_r1, ffq_r2);
-    else cat_fastqs(&settings, params, ffq_r1, ffq_r2);
+    {
+        BinMerger merger(&settings, params, ffq_r1, ffq_r2);
+        parallel_hash_dmp_core(&settings, params, &hash_dmp_core, &merger);
+        merger.finish();
+    }
+    LOG_INFO("Peak family arena usage for a single bin: %lu bytes.\n", kf_arena_peak());
     cleanup_hashdmp(&settings, params);
     splitterhash_destroy(params);
 
@@ -1,8 +1,17 @@
 #include "bmf_rsq.h"
+#include <condition_variable>
 #include <cstring>
+#include <deque>
 #include <getopt.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include "dlib/cstr_util.h"
 #include "include/igamc_cephes.h" /// for igamc
+#include "lib/auxint.h"
+#include "lib/editdist.h"
+#include "lib/rescue.h"
 #include <algorithm>
 
 namespace bmf {
@@ -23,46 +32,47 @@ struct rsq_aux_t {
     uint32_t trust_unmasked:1;
     uint32_t accept_unbalanced:1;
     bam_hdr_t *hdr; // BAM header
+    int threads; // Threads flattening stacks, which are also used to compress the output.
     std::unordered_map<std::string, std::string> realign_pairs;
 };
 
+#define RSQ_BATCH_RECORDS (1 << 14) // Records per batch handed to a worker in parallel rescue.
+#define RSQ_BATCHES_PER_THREAD 4 // Batches read ahead of the writer per worker.
+
+/*
+ * Records for parallel rescue in input order: stacks to flatten, and records to write as they are.
+ * The batch owns the records' data.
+ */
+struct rsq_batch_t {
+    std::vector<bam1_t> recs;
+    std::vector<uint32_t> ends; // End of each unit in recs.
+    std::vector<uint8_t> is_stack; // Whether each unit is a stack rather than one record to pass through.
+    uint64_t id;
+};
+
+template<typename StackFn, typename DistanceMetric>
+class RescuePool;
+
 inline void bam2ffq(bam1_t *b, FILE *fp, const int is_supp=0);
 inline void add_dummy_tags(bam1_t *b);
 
 void update_bam1(bam1_t *p, bam1_t *b);
 void update_bam1_unmasked(bam1_t *p, bam1_t *b);
+static void write_recs_se(rsq_aux_t *settings, bam1_t *recs, unsigned n);
+static void write_recs_pe(rsq_aux_t *settings, bam1_t *recs, unsigned n);
 
-struct HammingDistance {
-    inline int operator()(const bam1_t *b, const bam1_t *p) const {
-        return read_hd(b, p);
-    }
-};
-
+/*
+ * Edit distance between read names (barcodes), stopping once past the limit. See lib/editdist.h.
+ */
 struct LevenshteinDistance {
-    std::vector<std::uint8_t> mat;
-    // Based on levenshtein_distance from
-    // https://en.wikibooks.org/wiki/Algorithm_Implementation/Strings/Levenshtein_distance#C.2B.2B
-    int operator()(const bam1_t *b, const bam1_t *p) {
+    static const int indexable = 0;
+    int operator()(const bam1_t *b, const bam1_t *p, int lim) const {
         const char *bn(bam_get_qname(b)), *pn(bam_get_qname(p));
-        assert(b->core.l_qname == p->core.l_qname);
-        const unsigned nlen(b->core.l_qseq + 1);
-        if(UNLIKELY(mat.size() == 0)) {
-            mat.resize(nlen * nlen);
-            for(unsigned i(0); i < nlen; ++i) mat[i] = mat[nlen * i] = i;
-        }
-        for(unsigned i(1); i < nlen; ++i) {
-            for(unsigned j(1); j < nlen; ++j) {
-                mat[nlen * i + j] = std::min(std::min(mat[nlen * (i - 1) + j] + 1,
-                                                      mat[nlen * i + j - 1]   + 1),
-                                             mat[nlen * (i - 1) + j - 1] + (bn[i - 1] != pn[j - 1]));
-            }
-        }
-        return mat.back();
+        return bounded_edit_distance(bn, std::strlen(bn), pn, std::strlen(pn), lim);
     }
-    LevenshteinDistance(int size=0): mat(size * size) {}
 };
 
-template<typename StackFn, typename DistanceMetric=HammingDistance>
+template<typename StackFn, typename DistanceMetric=PackedHammingDistance>
 struct Stack {
     uint16_t mmlim:8;
     uint16_t trust_unmasked:1;
@@ -70,9 +80,10 @@ struct Stack {
     unsigned n; // Number used
     unsigned m; // Maximum allocated
     bam1_t *a; // Array
-    bam1_t **stack; // Pointers to reads.
     StackFn fn;
     DistanceMetric dm;
+    RescueIndex index;
+    RescuePool<StackFn, DistanceMetric> *pool; // Flattens and writes stacks when rescuing in parallel.
 
     Stack(rsq_aux_t *settings, unsigned _m=0):
             mmlim(settings->mmlim),
@@ -80,17 +91,14 @@ struct Stack {
             infer(settings->infer),
             n(0),
             m(_m),
-            a((bam1_t *)calloc(m, sizeof(bam1_t))),
-            stack((bam1_t **)malloc(m * sizeof(bam1_t *))), dm{}
+            a((bam1_t *)calloc(m, sizeof(bam1_t))), dm{}, index(settings->mmlim), pool(nullptr)
     {
-        for(unsigned i(0); i < m; ++i) stack[i] = a + i;
     }
     ~Stack() {
         LOG_DEBUG("m: %u.\n", m);
         for(unsigned i(0); i < m; ++i)
             if(a[i].data)
                 free(a[i].data);
-        free(stack);
         free(a);
     }
     void add(const bam1_t *b) {
@@ -98,9 +106,7 @@ struct Stack {
             m <<= 1;
             LOG_DEBUG("Max increased to %lu.\n", m);
             a = (bam1_t *)realloc(a, sizeof(bam1_t) * m); //
-            stack = (bam1_t **)realloc(stack, sizeof(bam1_t *) * m); //
             memset(a + n, 0, (m - n) * sizeof(bam1_t)); // Zero-initialize later records.
-            for(unsigned i(n); i < m; ++i) stack[i] = a + i;
             LOG_DEBUG("Finished adding.\n");
         }
         bam_copy1(a + n++, b);
@@ -112,8 +118,29 @@ struct Stack {
     }
     void write_stack_pe(rsq_aux_t *settings);
     void write_stack_se(rsq_aux_t *settings);
-    void flatten();
-    void flatten_infer();
+    /*
+     * Ends the current stack: writes it, or hands it to the pool.
+     */
+    void flush(rsq_aux_t *settings) {
+        if(!pool) {
+            if(settings->is_se) write_stack_se(settings);
+            else                write_stack_pe(settings);
+            return;
+        }
+        pool->add_stack(a, n);
+        memset(a, 0, n * sizeof(bam1_t)); // The pool owns their data now.
+        n = 0;
+    }
+    /*
+     * Writes a record which is not rescued, in its place among the stacks.
+     */
+    void pass(rsq_aux_t *settings, bam1_t *b) {
+        if(pool) pool->add_record(b);
+        else     sam_write1(settings->out, settings->hdr, b);
+    }
+    int merge(bam1_t *recs, unsigned i, unsigned j);
+    void flatten(bam1_t *recs, unsigned count);
+    void flatten() {flatten(a, n);}
     void pe_core(rsq_aux_t *settings);
     void pe_core_infer(rsq_aux_t *settings);
     void se_core(rsq_aux_t *settings);
@@ -134,13 +161,14 @@ void Stack<StackFn, DistanceMetric>::se_core_infer(rsq_aux_t *settings) {
         add_dummy_tags(b);
         if(b->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) continue;
         if(b->core.flag & (BAM_FUNMAP | BAM_FMUNMAP)) {
-            sam_write1(settings->out, settings->hdr, b); continue;
+            pass(settings, b); continue;
         }
         //LOG_DEBUG("Read a read!\n");
-        if(fn(b, a) == 0) write_stack_se(settings); // Flattens and clears stack.
+        if(fn(b, a) == 0) flush(settings); // Flattens and clears stack.
         add(b);
     }
-    write_stack_se(settings);
+    flush(settings);
+    if(pool) pool->finish();
     bam_destroy1(b);
     // Handle any unpaired reads, though there shouldn't be any in real datasets.
     if(settings->realign_pairs.size()) {
@@ -166,15 +194,16 @@ void Stack<StackFn, DistanceMetric>::se_core(rsq_aux_t *settings) {
     while (LIKELY(sam_read1(settings->in, settings->hdr, b) >= 0)) {
         if(UNLIKELY(++count % 1000000 == 0)) LOG_INFO("Records read: %lu.\n", count);
         if(b->core.flag & (BAM_FUNMAP | BAM_FMUNMAP)) {
-            sam_write1(settings->out, settings->hdr, b);
+            pass(settings, b);
             continue;
         }
         if(b->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) continue;
         //LOG_DEBUG("Read a read!\n");
-        if(fn(b, a) == 0) write_stack_se(settings); // Flattens and clears stack.
+        if(fn(b, a) == 0) flush(settings); // Flattens and clears stack.
         add(b);
     }
-    write_stack_se(settings);
+    flush(settings);
+    if(pool) pool->finish();
     bam_destroy1(b);
     // Handle any unpaired reads, though there shouldn't be any in real datasets.
     LOG_DEBUG("Number of orphan reads: %lu.\n", settings->realign_pairs.size());
@@ -202,16 +231,17 @@ void Stack<StackFn, DistanceMetric>::pe_core_infer(rsq_aux_t *settings)
         if(UNLIKELY(++count % 1000000 == 0)) LOG_INFO("Records read: %lu.\n", count);
         add_dummy_tags(b);
         if(b->core.flag & (BAM_FUNMAP | BAM_FMUNMAP)) {
-            sam_write1(settings->out, settings->hdr, b);
+            pass(settings, b);
             continue;
         }
         if(b->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY))
             continue;
         if(n == 0 || fn(b, a) == 0)
-            write_stack_pe(settings); // Flattens and clears stack.
+            flush(settings); // Flattens and clears stack.
         add(b);
     }
-    write_stack_pe(settings);
+    flush(settings);
+    if(pool) pool->finish();
     bam_destroy1(b);
     // Handle any unpaired reads, though there shouldn't be any in real datasets.
     LOG_DEBUG("Number of orphan reads: %lu.\n", settings->realign_pairs.size());
@@ -240,11 +270,11 @@ void Stack<StackFn, DistanceMetric>::pe_core(rsq_aux_t *settings)
         if(UNLIKELY(++count % 1000000 == 0)) LOG_INFO("Records read: %lu.\n", count);
         if(b->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) continue;
         if(b->core.flag & (BAM_FUNMAP | BAM_FMUNMAP)) {
-            sam_write1(settings->out, settings->hdr, b);
+            pass(settings, b);
             continue;
         }
         //LOG_DEBUG("Read a read!\n");
-        if(fn(b, a) == 0) write_stack_pe(settings); // Flattens and clears stack.
+        if(fn(b, a) == 0) flush(settings); // Flattens and clears stack.
 #if !NDEBUG
         else {
             assert(bam_is_r1(b) == bam_is_r1(a));
@@ -252,7 +282,8 @@ void Stack<StackFn, DistanceMetric>::pe_core(rsq_aux_t *settings)
 #endif
         add(b);
     }
-    write_stack_pe(settings);
+    flush(settings);
+    if(pool) pool->finish();
     bam_destroy1(b);
     // Handle any unpaired reads, though there shouldn't be any in real datasets.
     LOG_DEBUG("Number of orphan reads: %lu.\n", settings->realign_pairs.size());
@@ -266,72 +297,55 @@ void Stack<StackFn, DistanceMetric>::pe_core(rsq_aux_t *settings)
     }
 }
 
+/*
+ * Merges read i into read j if they have the same read and name lengths and are within mmlim.
+ * :returns: [int] Whether read i was merged.
+ */
 template<typename StackFn, typename DistanceMetric>
-inline void Stack<StackFn, DistanceMetric>::flatten_infer()
+inline int Stack<StackFn, DistanceMetric>::merge(bam1_t *recs, unsigned i, unsigned j)
 {
-    unsigned i, j;
-    for(i = 0; i < n; ++i) stack[i] = a + i;
-    std::sort(stack, stack + n, [](bam1_t *a, bam1_t *b) {
-            return a ? (b ? 0: 1): b ? strcmp(bam_get_qname(a), bam_get_qname(b)): 0;
-    });
-    for(i = 0; i < n; ++i) {
-        for(j = i + 1; j < n; ++j) {
-            //assert(key == ucs_sort_core_key(a[j]));
-            //assert(ucs == dlib::get_unclipped_start(a[j]));
-            //assert(tid == a[j]->core.tid);
-            //assert(mucs == bam_itag(a[j], "MU"));
-            if(stack[i]->core.l_qseq  != stack[j]->core.l_qseq ||
-               stack[i]->core.l_qname != stack[j]->core.l_qname)
-                continue;
-            //LOG_DEBUG("Flattening %s into %s.\n", bam_get_qname(a[i]), bam_get_qname(a[j]));
-            if(dm(a + j, a + i) > mmlim) continue;
-            if(trust_unmasked) update_bam1_unmasked(a + j, a + i);
-            else               update_bam1(a + j, a + i);
-            (a + i)->data = nullptr;
-            free((a + i)->data), (a + i)->data = nullptr;
-            break;
-            // "break" in case there are multiple within hamming distance.
-            // Otherwise, I'll end up having memory mistakes.
-            // Besides, that read set will get merged into the later read in the set.
-        }
-    }
+    if(recs[i].core.l_qseq != recs[j].core.l_qseq || recs[i].core.l_qname != recs[j].core.l_qname ||
+       dm(recs + j, recs + i, mmlim) > mmlim)
+        return 0;
+    if(trust_unmasked) update_bam1_unmasked(recs + j, recs + i);
+    else               update_bam1(recs + j, recs + i);
+    free(recs[i].data), recs[i].data = nullptr;
+    return 1;
 }
 
+/*
+ * Each read is merged into the first later read in the stack within mmlim, which carries the merged
+ * family on to be compared with the reads after it.
+ * Large stacks only check the candidates RescueIndex finds, which are every read which could be in range,
+ * so the merges are the same as comparing all pairs.
+ */
 template<typename StackFn, typename DistanceMetric>
-void Stack<StackFn, DistanceMetric>::flatten()
+void Stack<StackFn, DistanceMetric>::flatten(bam1_t *recs, unsigned count)
 {
-    if(infer) return flatten_infer();
-    unsigned i, j;
-    for(i = 0; i < n; ++i) stack[i] = a + i;
-    std::sort(stack, stack + n, [](const bam1_t *a, const bam1_t *b) {
-            return a ? (b ? 0: 1): b ? strcmp(bam_get_qname(a), bam_get_qname(b)): 0;
-    });
-    for(i = 0; i < n; ++i) {
-        for(j = i + 1; j < n; ++j) {
-            //assert(key == ucs_sort_core_key(stack->a[j]));
-            //assert(ucs == dlib::get_unclipped_start(stack->a[j]));
-            //assert(tid == stack->a[j]->core.tid);
-            //assert(mucs == bam_itag(stack->a[j], "MU"));
-            if(stack[i]->core.l_qseq != stack[j]->core.l_qseq)
-                continue;
-            if(stack[i]->core.l_qname != stack[j]->core.l_qname)
-                continue;
-            if(dm(a + j, a + i) > mmlim) continue;
-            if(trust_unmasked) update_bam1_unmasked(stack[j], stack[i]);
-            else               update_bam1(stack[j], stack[i]);
-            free(stack[i]->data), stack[i]->data = nullptr;
-            break;
-            // "break" in case there are multiple within hamming distance.
-            // Besides, that read set will get merged into the later read in the set.
+    if(!DistanceMetric::indexable || count < RESCUE_INDEX_MIN) {
+        for(unsigned i(0); i < count; ++i)
+            for(unsigned j(i + 1); j < count; ++j)
+                if(merge(recs, i, j)) break;
+        return;
+    }
+    index.reset(mmlim);
+    for(unsigned i(0); i < count; ++i) index.add(recs + i, i);
+    for(unsigned i(0); i < count; ++i) {
+        for(const uint32_t j: index.candidates(recs + i, i)) {
+            if(merge(recs, i, j)) {
+                index.add(recs + j, j); // Merging changes read j's sequence.
+                break;
+            }
         }
     }
 }
 
-template<typename StackFn, typename DistanceMetric>
-void Stack<StackFn, DistanceMetric>::write_stack_se(rsq_aux_t *settings)
+/*
+ * Writes a flattened stack. Records merged into others have null data and are skipped.
+ */
+static void write_recs_se(rsq_aux_t *settings, bam1_t *a, unsigned n)
 {
     LOG_DEBUG("Writing stack se.\n");
-    flatten();
     uint8_t *data;
 #if !NDEBUG
     for(unsigned i(0); i < n; ++i) {
@@ -346,14 +360,10 @@ void Stack<StackFn, DistanceMetric>::write_stack_se(rsq_aux_t *settings)
                 sam_write1(settings->out, settings->hdr, (a + i));
         }
     }
-    clear();
 }
 
-template<typename StackFn, typename DistanceMetric>
-void Stack<StackFn, DistanceMetric>::write_stack_pe(rsq_aux_t *settings)
+static void write_recs_pe(rsq_aux_t *settings, bam1_t *a, unsigned n)
 {
-    flatten();
-    if(settings->is_se) return write_stack_se(settings);
     //size_t n = 0;
     //LOG_DEBUG("Starting to write stack\n");
     uint8_t *data;
@@ -408,9 +418,26 @@ void Stack<StackFn, DistanceMetric>::write_stack_pe(rsq_aux_t *settings)
             }
         }
     }
+}
+
+template<typename StackFn, typename DistanceMetric>
+void Stack<StackFn, DistanceMetric>::write_stack_se(rsq_aux_t *settings)
+{
+    flatten();
+    write_recs_se(settings, a, n);
     clear();
 }
 
+template<typename StackFn, typename DistanceMetric>
+void Stack<StackFn, DistanceMetric>::write_stack_pe(rsq_aux_t *settings)
+{
+    flatten();
+    if(settings->is_se) write_recs_se(settings, a, n);
+    else                write_recs_pe(settings, a, n);
+    clear();
+}
+
+
 inline void bam2ffq(bam1_t *b, FILE *fp, const int is_supp)
 {
     int i;
@@ -468,7 +495,15 @@ inline int switch_names(char *n1, char *n2) {
 }
 
 
-void update_bam1_unmasked(bam1_t *p, bam1_t *b)
+/*
+ * @func merged_int_tags
+ * Takes b's name if it sorts first, and fills tags with p's family size tags after merging b into it.
+ * They are written with bam_aux_set_ints along with NC, once the bases are merged, so that p's aux data
+ * is rewritten at most once per merge and the PV and FA arrays stay put while bases are merged.
+ * :param: tags [bmf::aux_int_t *] Room for at least 4 tags.
+ * :returns: [unsigned] Number of tags filled.
+ */
+static unsigned merged_int_tags(bam1_t *p, bam1_t *b, bmf::aux_int_t *tags)
 {
     uint8_t *bdata(bam_aux_get(b, "FM"));
     uint8_t *pdata(bam_aux_get(p, "FM"));
@@ -476,42 +511,35 @@ void update_bam1_unmasked(bam1_t *p, bam1_t *b)
         fprintf(stderr, "Required FM tag not found. Abort mission!\n");
         exit(EXIT_FAILURE);
     }
-    int bFM(bam_aux2i(bdata));
-    int pFM(bam_aux2i(pdata));
-    int pTMP(0);
+    unsigned n(0);
+    const int pFM(bam_aux2i(pdata) + bam_aux2i(bdata));
+    int pRV(0);
     if(switch_names(bam_get_qname(p), bam_get_qname(b))) {
         std::memcpy(bam_get_qname(p), bam_get_qname(b), b->core.l_qname);
         assert(strlen(bam_get_qname(p)) == strlen(bam_get_qname(b)));
     }
-    pFM += bFM;
-    bam_aux_del(p, pdata);
-    bam_aux_append(p, "FM", 'i', sizeof(int), (uint8_t *)&pFM);
+    tags[n++] = {"FM", pFM};
     if((pdata = bam_aux_get(p, "RV")) != nullptr) {
-        pTMP = bam_aux2i(pdata) + bam_itag(b, "RV");
-        bam_aux_del(p, pdata);
-        bam_aux_append(p, "RV", 'i', sizeof(int), (uint8_t *)&pTMP);
+        pRV = bam_aux2i(pdata) + bam_itag(b, "RV");
+        tags[n++] = {"RV", pRV};
     }
+    // If the collapsed observation is now duplex but wasn't before, this updates the DR tag.
+    if(pRV != pFM && pRV && (pdata = bam_aux_get(p, "DR")) && bam_aux2i(pdata) == 0)
+        tags[n++] = {"DR", 1};
+    bdata = bam_aux_get(b, "NP");
+    if((pdata = bam_aux_get(p, "NP"))) tags[n++] = {"NP", bam_aux2i(pdata) + (bdata ? bam_aux2i(bdata) : 1)};
+    else                               tags[n++] = {"NP", (bdata ? bam_aux2i(bdata) : 1) + 1};
+    return n;
+}
+
+void update_bam1_unmasked(bam1_t *p, bam1_t *b)
+{
+    bmf::aux_int_t tags[5];
+    unsigned n_tags(merged_int_tags(p, b, tags));
     // Handle NC (Number Changed) tag
-    pdata = bam_aux_get(p, "NC");
-    bdata = bam_aux_get(b, "NC");
+    uint8_t *pdata(bam_aux_get(p, "NC")), *bdata(bam_aux_get(b, "NC"));
     int n_changed(dlib::int_tag_zero(pdata) + dlib::int_tag_zero(bdata));
     const int was_merged(((!!pdata) << 1) | (!!bdata));
-    if(pdata) bam_aux_del(p, pdata);
-    // If the collapsed observation is now duplex but wasn't before, this updates the DR tag.
-    if(pTMP != pFM && pTMP && (pdata = bam_aux_get(p, "DR")) && bam_aux2i(pdata) == 0) {
-        pTMP = 1;
-        bam_aux_del(p, pdata);
-        bam_aux_append(p, "DR", 'i', sizeof(int), (uint8_t *)&pTMP);
-    }
-    if((pdata = bam_aux_get(p, "NP"))) {
-        bdata = bam_aux_get(b, "NP");
-        pTMP = bam_aux2i(pdata) + (bdata ? bam_aux2i(bdata) : 1);
-        bam_aux_del(p, pdata);
-    } else {
-        bdata = bam_aux_get(b, "NP");
-        pTMP = (bdata ? bam_aux2i(bdata) : 1) + 1;
-    }
-    bam_aux_append(p, "NP", 'i', sizeof(int), reinterpret_cast<uint8_t *>(&pTMP));
     uint32_t *bPV((uint32_t *)dlib::array_tag(b, "PV")); // Length of this should be b->l_qseq
     uint32_t *pPV((uint32_t *)dlib::array_tag(p, "PV"));
     uint32_t *bFA((uint32_t *)dlib::array_tag(b, "FA"));
@@ -630,52 +658,17 @@ void update_bam1_unmasked(bam1_t *p, bam1_t *b)
             }
         }
     }
-    bam_aux_append(p, "NC", 'i', sizeof(int), (uint8_t *)&n_changed);
+    tags[n_tags++] = {"NC", n_changed};
+    bmf::bam_aux_set_ints(p, tags, n_tags); // After the loops: this may move p's aux data.
 }
 
 void update_bam1(bam1_t *p, bam1_t *b)
 {
-    uint8_t *bdata(bam_aux_get(b, "FM"));
-    uint8_t *pdata(bam_aux_get(p, "FM"));
-    if(UNLIKELY(!bdata || !pdata)) {
-        fprintf(stderr, "Required FM tag not found. Abort mission!\n");
-        exit(EXIT_FAILURE);
-    }
-    int bFM(bam_aux2i(bdata));
-    int pFM(bam_aux2i(pdata));
-    int pTMP(0);
-    if(switch_names(bam_get_qname(p), bam_get_qname(b))) {
-        std::memcpy(bam_get_qname(p), bam_get_qname(b), b->core.l_qname);
-        assert(strlen(bam_get_qname(p)) == strlen(bam_get_qname(b)));
-    }
-    pFM += bFM;
-    bam_aux_del(p, pdata);
-    bam_aux_append(p, "FM", 'i', sizeof(int), (uint8_t *)&pFM);
-    if((pdata = bam_aux_get(p, "RV")) != nullptr) {
-        pTMP = bam_aux2i(pdata) + bam_itag(b, "RV");
-        bam_aux_del(p, pdata);
-        bam_aux_append(p, "RV", 'i', sizeof(int), (uint8_t *)&pTMP);
-    }
+    bmf::aux_int_t tags[5];
+    unsigned n_tags(merged_int_tags(p, b, tags));
     // Handle NC (Number Changed) tag
-    pdata = bam_aux_get(p, "NC");
-    bdata = bam_aux_get(b, "NC");
+    uint8_t *pdata(bam_aux_get(p, "NC")), *bdata(bam_aux_get(b, "NC"));
     int n_changed(dlib::int_tag_zero(pdata) + dlib::int_tag_zero(bdata));
-    if(pdata) bam_aux_del(p, pdata);
-    // If the collapsed observation is now duplex but wasn't before, this updates the DR tag.
-    if(pTMP != pFM && pTMP && (pdata = bam_aux_get(p, "DR")) && bam_aux2i(pdata) == 0) {
-        pTMP = 1;
-        bam_aux_del(p, pdata);
-        bam_aux_append(p, "DR", 'i', sizeof(int), (uint8_t *)&pTMP);
-    }
-    if((pdata = bam_aux_get(p, "NP"))) {
-        bdata = bam_aux_get(b, "NP");
-        pTMP = bam_aux2i(pdata) + (bdata ? bam_aux2i(bdata) : 1);
-        bam_aux_del(p, pdata);
-    } else {
-        bdata = bam_aux_get(b, "NP");
-        pTMP = (bdata ? bam_aux2i(bdata) : 1) + 1;
-    }
-    bam_aux_append(p, "NP", 'i', sizeof(int), reinterpret_cast<uint8_t *>(&pTMP));
     uint32_t *bPV((uint32_t *)dlib::array_tag(b, "PV")); // Length of this should be b->l_qseq
     uint32_t *pPV((uint32_t *)dlib::array_tag(p, "PV"));
     uint32_t *bFA((uint32_t *)dlib::array_tag(b, "FA"));
@@ -731,7 +724,8 @@ void update_bam1(bam1_t *p, bam1_t *b)
             }
         }
     }
-    bam_aux_append(p, "NC", 'i', sizeof(int), (uint8_t *)&n_changed);
+    tags[n_tags++] = {"NC", n_changed};
+    bmf::bam_aux_set_ints(p, tags, n_tags); // After the loops: this may move p's aux data.
 }
 
 
@@ -766,24 +760,150 @@ inline void add_dummy_tags(bam1_t *b)
 }
 
 
+/*
+ * Parallel rescue. Stacks are independent, so the reading thread gathers them into batches,
+ * which workers flatten, each with its own Stack. Batches are written by the reading thread
+ * in the order they were read, so output is the same as with one thread, and realign_pairs
+ * is only ever touched by that thread.
+ */
+template<typename StackFn, typename DistanceMetric>
+class RescuePool {
+    rsq_aux_t *settings_;
+    std::vector<std::thread> threads_;
+    std::mutex m_;
+    std::condition_variable todo_cv_;
+    std::condition_variable done_cv_;
+    std::deque<rsq_batch_t *> todo_;
+    std::map<uint64_t, rsq_batch_t *> done_; // Flattened batches waiting for those before them.
+    uint64_t next_id_;
+    uint64_t next_write_;
+    const uint64_t max_in_flight_;
+    int stop_;
+    rsq_batch_t *cur_;
+
+    void work() {
+        Stack<StackFn, DistanceMetric> stack(settings_);
+        for(;;) {
+            rsq_batch_t *batch;
+            {
+                std::unique_lock<std::mutex> lock(m_);
+                todo_cv_.wait(lock, [this]() {return stop_ || !todo_.empty();});
+                if(todo_.empty()) return;
+                batch = todo_.front();
+                todo_.pop_front();
+            }
+            for(size_t u(0), start(0); u < batch->ends.size(); start = batch->ends[u++])
+                if(batch->is_stack[u]) stack.flatten(&batch->recs[start], batch->ends[u] - start);
+            {
+                std::lock_guard<std::mutex> lock(m_);
+                done_.emplace(batch->id, batch);
+            }
+            done_cv_.notify_one();
+        }
+    }
+    /*
+     * Writes the next batch in input order.
+     * :param: block [int] Wait for it to be flattened.
+     * :returns: [int] Whether a batch was written.
+     */
+    int write_next(int block) {
+        rsq_batch_t *batch;
+        {
+            std::unique_lock<std::mutex> lock(m_);
+            if(block) done_cv_.wait(lock, [this]() {return done_.count(next_write_) != 0;});
+            auto it(done_.find(next_write_));
+            if(it == done_.end()) return 0;
+            batch = it->second;
+            done_.erase(it);
+        }
+        for(size_t u(0), start(0); u < batch->ends.size(); start = batch->ends[u++]) {
+            if(!batch->is_stack[u]) sam_write1(settings_->out, settings_->hdr, &batch->recs[start]);
+            else if(settings_->is_se) write_recs_se(settings_, &batch->recs[start], batch->ends[u] - start);
+            else write_recs_pe(settings_, &batch->recs[start], batch->ends[u] - start);
+        }
+        for(bam1_t &b: batch->recs) free(b.data);
+        delete batch;
+        ++next_write_;
+        return 1;
+    }
+    void submit() {
+        if(cur_->ends.empty()) return;
+        cur_->id = next_id_++;
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            todo_.push_back(cur_);
+        }
+        todo_cv_.notify_one();
+        cur_ = new rsq_batch_t;
+        // Write whatever is ready, waiting only while too many batches are held.
+        while(write_next(next_id_ - next_write_ >= max_in_flight_));
+    }
+
+public:
+    RescuePool(rsq_aux_t *settings):
+        settings_(settings), next_id_(0), next_write_(0),
+        max_in_flight_(settings->threads * RSQ_BATCHES_PER_THREAD), stop_(0), cur_(new rsq_batch_t)
+    {
+        for(int i(0); i < settings->threads; ++i) threads_.emplace_back(&RescuePool::work, this);
+    }
+    ~RescuePool() {
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            stop_ = 1;
+        }
+        todo_cv_.notify_all();
+        for(auto &t: threads_) t.join();
+        for(bam1_t &b: cur_->recs) free(b.data);
+        delete cur_;
+    }
+    /*
+     * Takes a stack of n records, including their data.
+     */
+    void add_stack(bam1_t *recs, unsigned n) {
+        if(!n) return;
+        cur_->recs.insert(cur_->recs.end(), recs, recs + n);
+        cur_->ends.push_back(cur_->recs.size());
+        cur_->is_stack.push_back(1);
+        if(cur_->recs.size() >= RSQ_BATCH_RECORDS) submit();
+    }
+    /*
+     * Copies a record to write as it is.
+     */
+    void add_record(const bam1_t *b) {
+        bam1_t rec{};
+        bam_copy1(&rec, b);
+        cur_->recs.push_back(rec);
+        cur_->ends.push_back(cur_->recs.size());
+        cur_->is_stack.push_back(0);
+    }
+    /*
+     * Flattens and writes everything added.
+     */
+    void finish() {
+        submit();
+        while(next_write_ < next_id_) write_next(1);
+    }
+};
+
+template<typename StackFn, typename DistanceMetric>
+static void rescue_core(rsq_aux_t *settings)
+{
+    Stack<StackFn, DistanceMetric> stack(settings, 1 << 8);
+    std::unique_ptr<RescuePool<StackFn, DistanceMetric>> pool(settings->threads > 1 ? new RescuePool<StackFn, DistanceMetric>(settings)
+                                                                                    : nullptr);
+    stack.pool = pool.get();
+    if(settings->is_se) stack.se_core(settings);
+    else                stack.pe_core(settings);
+}
+
 void bam_rsq_bookends(rsq_aux_t *settings)
 {
     if(settings->is_se) {
-        if(settings->use_ed_dist) {
-            Stack<StackFnPosSe, LevenshteinDistance> stack(settings, 1 << 8);
-            stack.se_core(settings);
-        } else {
-            Stack<StackFnPosSe, HammingDistance> stack(settings, 1 << 8);
-            stack.se_core(settings);
-        }
+        if(settings->use_ed_dist) rescue_core<StackFnPosSe, LevenshteinDistance>(settings);
+        else                      rescue_core<StackFnPosSe, PackedHammingDistance>(settings);
     } else {
-        if(settings->use_ed_dist) {
-            Stack<StackFnPosPe, LevenshteinDistance> stack(settings, 1 << 8);
-            stack.pe_core(settings);
-        } else {
-            Stack<StackFnPosPe, HammingDistance> stack(settings, 1 << 8);
-            stack.pe_core(settings);
-        }
+        if(settings->use_ed_dist) rescue_core<StackFnPosPe, LevenshteinDistance>(settings);
+        else                      rescue_core<StackFnPosPe, PackedHammingDistance>(settings);
     }
 }
 
@@ -802,9 +922,10 @@ int rsq_usage(int retcode)
                     "-S      Flag to indicate that this rescue is for single-end data.\n"
                     "-t      Mismatch limit. Default: 2\n"
                     "-l      Set bam compression level. Valid: 0-9. (0 == uncompressed)\n"
-                    "-L      Use Levenshtein edit distance rather than Hamming distance during rescue."
+                    "-L      Compare barcodes by Levenshtein edit distance rather than reads by Hamming distance during rescue.\n"
                     "-m      Trust unmasked bases if reads being collapsed disagree but one is unmasked. Default: mask anyways.\n"
                     "-i      Flag to ignore barcodes and infer solely by positional information.\n"
+                    "-p      Number of threads for flattening stacks and compressing output. Default: 1.\n"
                     "-u      Ignore unbalanced pairs. Typically, unbalanced pairs means the bam is corrupted or unsorted.\n"
                     "        Use this flag to still return a zero exit status, but only use if you know what you're doing.\n"
                     "This flag adds artificial auxiliary tags to treat unbarcoded reads as if they were singletons.\n"
@@ -826,13 +947,14 @@ int rsq_main(int argc, char *argv[])
 
     if(argc < 3) return rsq_usage(EXIT_FAILURE);
 
-    while ((c = getopt(argc, argv, "l:f:t:LmiSHsh?")) >= 0) {
+    while ((c = getopt(argc, argv, "l:f:t:p:LmiSHsh?")) >= 0) {
         switch (c) {
         case 's': settings.write_supp = 1; break;
         case 'S': settings.is_se = 1; break;
         case 'm': settings.trust_unmasked = 1; break;
         case 'u': settings.accept_unbalanced = 1; break;
         case 't': settings.mmlim = atoi(optarg); break;
+        case 'p': settings.threads = atoi(optarg); break;
         case 'f': fqname = optarg; break;
         case 'l': wmode[2] = atoi(optarg)%10 + '0';break;
         case 'i': settings.infer = 1; break;
@@ -869,6 +991,7 @@ int rsq_main(int argc, char *argv[])
     settings.out = sam_open(argv[optind+1], wmode);
     if (settings.in == 0 || settings.out == 0)
         LOG_EXIT("fail to read/write input files\n");
+    if(settings.threads > 1) hts_set_threads(settings.out, settings.threads);
     sam_hdr_write(settings.out, settings.hdr);
 
     bam_rsq_bookends(&settings);
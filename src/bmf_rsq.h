@@ -3,6 +3,7 @@
 #include <assert.h>
 #include "dlib/sort_util.h"
 #include "dlib/bam_util.h"
+#include "lib/seqhd.h"
 
 #define STACK_START 128
 #define READ_HD_LIMIT 6
@@ -103,6 +104,31 @@ CONST static inline int read_pass_hd(const bam1_t *b, const bam1_t *p, const int
     return 1;
 }
 
+/*
+ * DistanceMetric policies for Stack. operator() returns the distance between two reads,
+ * or any value greater than lim once it is known to be greater.
+ * Metrics with indexable set compare read sequences, counting no mismatch where either read has an N,
+ * so RescueIndex (lib/rescue.h) finds every pair within the limit.
+ */
+struct HammingDistance {
+    static const int indexable = 1;
+    inline int operator()(const bam1_t *b, const bam1_t *p, int lim) const {
+        return read_hd(b, p, lim);
+    }
+};
+
+/*
+ * read_hd over whole words of packed bases at a time, stopping once past the limit. See lib/seqhd.h.
+ */
+struct PackedHammingDistance {
+    static const int indexable = 1;
+    int (*hd)(const uint8_t *a, const uint8_t *b, int l, int lim);
+    PackedHammingDistance(): hd(seq_hd_kernel().hd) {}
+    inline int operator()(const bam1_t *b, const bam1_t *p, int lim) const {
+        return hd(bam_get_seq(b), bam_get_seq(p), b->core.l_qseq, lim);
+    }
+};
+
 } /* namespace bmf */
 
 #endif /* BMF_RSQ_H */
@@ -0,0 +1,138 @@
+#include "lib/bcluster.h"
+#include "lib/famtable.h"
+#include "lib/hashdmp.h"
+#include "test/test_util.h"
+#include <assert.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <numeric>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+using namespace bmf;
+
+static std::vector<uint32_t> cluster(const std::vector<std::string> &bcs, const std::vector<uint32_t> &counts, int k)
+{
+    std::vector<const char *> ptrs;
+    for(auto &bc: bcs) ptrs.push_back(bc.size() ? bc.c_str(): nullptr);
+    return cluster_barcodes(ptrs, counts, k);
+}
+
+static int hamming(const std::string &a, const std::string &b)
+{
+    int ret(0);
+    for(size_t i(0); i < a.size(); ++i) ret += a[i] != b[i];
+    return ret;
+}
+
+/*
+ * All-pairs directional clustering, to check the pigeonhole index against.
+ */
+static std::vector<uint32_t> naive_cluster(const std::vector<std::string> &bcs, const std::vector<uint32_t> &counts, int k)
+{
+    const size_t n(bcs.size());
+    std::vector<uint32_t> parent(n), order(n);
+    std::iota(parent.begin(), parent.end(), 0u);
+    std::iota(order.begin(), order.end(), 0u);
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {return counts[a] > counts[b];});
+    std::vector<uint8_t> assigned(n, 0);
+    for(const uint32_t root: order) {
+        if(assigned[root]) continue;
+        assigned[root] = 1;
+        std::vector<uint32_t> queue(1, root);
+        for(size_t qi(0); qi < queue.size(); ++qi) {
+            const uint32_t u(queue[qi]);
+            for(uint32_t v(0); v < n; ++v) {
+                if(assigned[v] || counts[u] + 1 < 2 * counts[v] || hamming(bcs[u], bcs[v]) > k) continue;
+                assigned[v] = 1, parent[v] = root;
+                queue.push_back(v);
+            }
+        }
+    }
+    return parent;
+}
+
+static size_t count_str(const std::string &s, const char *needle)
+{
+    size_t ret(0);
+    for(size_t pos(0); (pos = s.find(needle, pos)) != std::string::npos; ++pos) ++ret;
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t a[2], b[2];
+    pack_barcode("ACGTACGTACGTACGTACGTACGTACGTACGTACGTA", 37, a);
+    pack_barcode("ACGTACGTACGTACGTACGTACGTACGTACCTACGTT", 37, b);
+    assert(packed_hamming(a, a) == 0);
+    assert(packed_hamming(a, b) == 2);
+
+    // Errors absorbed by a family with at least about twice as many reads, through chains of errors.
+    std::vector<uint32_t> parent(cluster({"AAAAAAAA", "AAAAAAAT", "AAAAAATT", "TTTTTTTT", "AAAAAAAC", "AAAAAAGC"},
+                                         {10, 4, 2, 10, 6, 3}, 1));
+    assert((parent == std::vector<uint32_t>{0, 0, 0, 3, 4, 4}));
+    // Further neighbours only at a larger distance.
+    parent = cluster({"AAAAAAAA", "AAAAAATT", "AAAAATTT"}, {10, 2, 1}, 1);
+    assert((parent == std::vector<uint32_t>{0, 1, 1}));
+    parent = cluster({"AAAAAAAA", "AAAAAATT", "AAAAATTT"}, {10, 2, 1}, 2);
+    assert((parent == std::vector<uint32_t>{0, 0, 0}));
+    parent = cluster({"AAAAAAAA", "AAAAAATT", "AAAAATTT"}, {10, 2, 1}, 3);
+    assert((parent == std::vector<uint32_t>{0, 0, 0}));
+    // Null (QC-failed) barcodes, barcodes with Ns and barcodes of other lengths are left alone.
+    parent = cluster({"AAAAAAAA", "", "AAAAAAAN", "AAAAAAA"}, {10, 1, 1, 1}, 1);
+    assert((parent == std::vector<uint32_t>{0, 1, 2, 3}));
+    // No clustering at distance 0.
+    parent = cluster({"AAAAAAAA", "AAAAAAAT"}, {10, 1}, 0);
+    assert((parent == std::vector<uint32_t>{0, 1}));
+
+    // The pigeonhole index finds the same clusters as comparing all pairs.
+    std::mt19937 rng(137);
+    for(int k: {1, 2, 3}) {
+        std::vector<std::string> bcs;
+        std::vector<uint32_t> counts;
+        for(int i(0); i < 300; ++i) {
+            std::string bc;
+            for(int j(0); j < 12; ++j) bc.push_back("ACGT"[rng() % 4]);
+            bcs.push_back(bc), counts.push_back(1 + rng() % 100);
+            // Errors in the barcode: smaller families a few mismatches away.
+            for(int e(rng() % 4); e--;) {
+                std::string err(bc);
+                for(int m(1 + rng() % (k + 1)); m--;) err[rng() % err.size()] = "ACGT"[rng() % 4];
+                bcs.push_back(err), counts.push_back(1 + rng() % 10);
+            }
+        }
+        assert(cluster(bcs, counts, k) == naive_cluster(bcs, counts, k));
+    }
+
+    // End to end: a family and errors in its barcode collapse to one record, noting the exact-match size.
+    const char *in("bcluster_test.fq");
+    FILE *fp(fopen(in, "w"));
+    const char *bcs[] {"ACGTACGTACGTACGT", "ACGTACGTACGTACGA", "TTTTGGGGCCCCAAAA"};
+    const int sizes[] {8, 2, 3};
+    int n(0);
+    for(int f(0); f < 3; ++f)
+        for(int i(0); i < sizes[f]; ++i)
+            fprintf(fp, "@read%i ~#!#~|FP=1|BS=%c%s\nACGTTGCAAC\n+\nIIIIIIIIII\n", n++, i & 1 ? 'R': 'F', bcs[f]);
+    fclose(fp);
+    for(int stranded: {0, 1}) {
+        stranded ? stranded_hash_dmp_core((char *)in, (char *)"bcluster_test.out", 0, 0, 0)
+                 : hash_dmp_core((char *)in, (char *)"bcluster_test.out", 0, 0, 0);
+        std::string exact(slurp("bcluster_test.out"));
+        assert(count_str(exact, "\n+\n") == 3);
+        assert(count_str(exact, "OF:i:") == 0);
+        stranded ? stranded_hash_dmp_core((char *)in, (char *)"bcluster_test.out", 0, 0, 1)
+                 : hash_dmp_core((char *)in, (char *)"bcluster_test.out", 0, 0, 1);
+        std::string clustered(slurp("bcluster_test.out"));
+        assert(count_str(clustered, "\n+\n") == 2);
+        assert(count_str(clustered, "FM:i:10") == 1);
+        assert(count_str(clustered, "OF:i:8") == 1);
+        assert(count_str(clustered, "OF:i:") == 1);
+    }
+    unlink(in);
+    unlink("bcluster_test.out");
+    fprintf(stderr, "[%s] Barcode clustering tests passed.\n", argv[0]);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,203 @@
+#include "lib/bcscan.h"
+#include "lib/famtable.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace bmf;
+
+/*
+ * Checks that every barcode scanning kernel matches the per-offset memcmp search, test_hp and pack_barcode
+ * it replaces, then times them on the prefixes of 150bp reads.
+ */
+
+static const unsigned READLEN = 150;
+
+// The homopolymer and N check this replaces.
+static int test_hp(const char *barcode, int threshold)
+{
+    int run(0);
+    char last('\0');
+    while(*barcode) {
+        if(*barcode == 'N') return 0;
+        if(*barcode == last) {
+            if(++run == threshold) return 0;
+        } else last = *barcode, run = 0;
+        ++barcode;
+    }
+    return 1;
+}
+
+static int memcmp_search(const char *seq, int l, const char *homing, int hlen, int start, int end)
+{
+    for(int i(start); i <= end && i + hlen <= l; ++i)
+        if(memcmp(seq + i, homing, hlen) == 0) return i;
+    return -1;
+}
+
+static std::string random_read(std::mt19937 &rng, const std::string &homing, int homing_at, unsigned l)
+{
+    std::string ret;
+    const int style(rng() % 4);
+    for(unsigned i(0); i < l; ++i) {
+        switch(style) {
+            case 0: ret.push_back("ACGT"[rng() % 4]); break;
+            case 1: ret.push_back("ACGTN"[rng() % 5]); break;
+            case 2: ret.push_back("AAAACGT"[rng() % 7]); break; // Long homopolymers
+            default: ret.push_back(rng() % 50 ? "ACGT"[rng() % 4]: "acgtNX"[rng() % 6]);
+        }
+    }
+    if(homing_at >= 0 && homing_at + homing.size() <= l) ret.replace(homing_at, homing.size(), homing);
+    // Decoys: the homing sequence's first and last bases without the middle.
+    if(rng() % 2 && homing.size() > 2 && homing.size() <= l) {
+        const unsigned at(rng() % (l - homing.size() + 1));
+        if(at + homing.size() <= (unsigned)homing_at || (int)at > homing_at + (int)homing.size())
+            ret[at] = homing[0], ret[at + homing.size() - 1] = homing.back();
+    }
+    return ret;
+}
+
+/*
+ * Reports which output disagreed and exits. Not assert, since the bench is built with $(OPT).
+ */
+static void expect(bool ok, const bc_kernel_t &kernel, const char *what, unsigned trial)
+{
+    if(ok) return;
+    fprintf(stderr, "[%s] %s: %s differs from the reference in trial %u.\n", __func__, kernel.name, what, trial);
+    exit(EXIT_FAILURE);
+}
+
+static void check_kernel(const bc_kernel_t &kernel)
+{
+    std::mt19937 rng(1337);
+    for(unsigned trial(0); trial < 200000; ++trial) {
+        const std::string homing(std::string("CAGTACGTAGC").substr(0, 1 + trial % 11));
+        const int hlen(homing.size());
+        // Reads shorter than a vector or two exercise the scalar tails.
+        const unsigned l(trial % 5 ? READLEN: 4 + rng() % 40);
+        const int bc_start(rng() % 4), blen(1 + rng() % 70);
+        const int search_start(std::max(bc_start + blen - (int)(rng() % 8), 0)), search_end(search_start + rng() % 24);
+        const std::string read(random_read(rng, homing, search_start + (int)(rng() % 30) - 4, l));
+        const int threshold(rng() % 12);
+
+        bc_scan_t bc, ref_bc;
+        bc_scan_init(&bc), bc_scan_init(&ref_bc);
+        const int found(kernel.scan_read(&bc, read.c_str(), l, bc_start, bc_start + blen,
+                                         homing.c_str(), hlen, search_start, search_end));
+        expect(found == bc_kernel_scalar().scan_read(&ref_bc, read.c_str(), l, bc_start, bc_start + blen,
+                                                     homing.c_str(), hlen, search_start, search_end),
+               kernel, "homing position", trial);
+        expect(found == memcmp_search(read.c_str(), l, homing.c_str(), hlen, search_start, search_end),
+               kernel, "homing position", trial);
+        int bc_end(std::min(bc_start + blen, (int)l));
+        if(found >= 0) bc_end = std::min(bc_end, found);
+        const std::string barcode(bc_end > bc_start ? read.substr(bc_start, bc_end - bc_start): "");
+        expect(bc.len == (int)barcode.size(), kernel, "barcode length", trial);
+        expect(bc_scan_pass(&bc, threshold) == test_hp(barcode.c_str(), threshold), kernel, "homopolymer test", trial);
+        uint64_t key[2];
+        const int packable(pack_barcode(barcode.c_str(), barcode.size(), key) == 0);
+        expect(bc_scan_packed(&bc) == packable, kernel, "packability", trial);
+        expect(!packable || (bc.key[0] == key[0] && bc.key[1] == key[1]), kernel, "packed key", trial);
+
+        // A second piece from another read, as for paired-end barcodes.
+        const std::string read2(random_read(rng, homing, -1, l));
+        const int blen2(1 + rng() % 40);
+        kernel.scan_read(&bc, read2.c_str(), l, bc_start, bc_start + blen2, nullptr, 0, 0, -1);
+        const std::string joined(barcode + read2.substr(bc_start, std::max(std::min(blen2, (int)l - bc_start), 0)));
+        expect(bc.len == (int)joined.size(), kernel, "joined barcode length", trial);
+        expect(bc_scan_pass(&bc, threshold) == test_hp(joined.c_str(), threshold), kernel, "joined homopolymer test", trial);
+        const int packable2(pack_barcode(joined.c_str(), joined.size(), key) == 0);
+        expect(bc_scan_packed(&bc) == packable2, kernel, "joined packability", trial);
+        expect(!packable2 || (bc.key[0] == key[0] && bc.key[1] == key[1]), kernel, "joined packed key", trial);
+    }
+}
+
+static bool supported(const bc_kernel_t *k)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(k == &bc_kernel_scalar()) return true;
+    return __builtin_cpu_supports("sse4.2");
+#else
+    return true;
+#endif
+}
+
+template<typename F>
+static double time_ns_per_read(F fn, unsigned n_reads)
+{
+    const auto start(std::chrono::steady_clock::now());
+    fn();
+    const auto stop(std::chrono::steady_clock::now());
+    return std::chrono::duration<double, std::nano>(stop - start).count() / n_reads;
+}
+
+/*
+ * Barcodes of min_blen to max_blen bases after 1 skipped base, whose end the homing sequence marks.
+ * The old path searches for the homing sequence, then copies, checks and packs the barcode.
+ */
+static void bench(unsigned n_reads, const char *homing, unsigned min_blen, unsigned max_blen, unsigned search_end,
+                  const bc_kernel_t *const *kernels)
+{
+    const unsigned offset(1);
+    const int hlen(strlen(homing));
+    std::mt19937 rng(42);
+    std::vector<std::string> reads;
+    for(unsigned i(0); i < 1024; ++i) {
+        std::string read(random_read(rng, homing, offset + min_blen + rng() % (max_blen - min_blen + 5), READLEN));
+        for(char &c: read) if(c != 'N' && !strchr("ACGT", c)) c = 'A';
+        reads.push_back(read);
+    }
+    volatile unsigned sink(0);
+    const double old_ns(time_ns_per_read([&]() {
+        char bc[64];
+        uint64_t key[2];
+        for(unsigned i(0); i < n_reads; ++i) {
+            const char *seq(reads[i & 1023].c_str());
+            const int found(memcmp_search(seq, READLEN, homing, hlen, offset + min_blen, search_end));
+            const int blen(found >= 0 ? std::min(found - offset, max_blen): max_blen);
+            std::memcpy(bc, seq + offset, blen);
+            bc[blen] = '\0';
+            sink += found + test_hp(bc, 10) + pack_barcode(bc, blen, key) + key[0];
+        }
+    }, n_reads));
+    fprintf(stderr, "[%s] %u-%u base barcodes: %-8s %6.1f ns/read\n", __func__, min_blen, max_blen, "memcmp", old_ns);
+    for(unsigned ki(0); ki < 2; ++ki) {
+        const bc_kernel_t *k(kernels[ki]);
+        if(!supported(k)) continue;
+        const double ns(time_ns_per_read([&]() {
+            bc_scan_t bc;
+            for(unsigned i(0); i < n_reads; ++i) {
+                bc_scan_init(&bc);
+                const int found(k->scan_read(&bc, reads[i & 1023].c_str(), READLEN, offset, offset + max_blen,
+                                             homing, hlen, offset + min_blen, search_end));
+                sink += found + bc_scan_pass(&bc, 10) + bc_scan_packed(&bc) + bc.key[0];
+            }
+        }, n_reads));
+        fprintf(stderr, "[%s] %u-%u base barcodes: %-8s %6.1f ns/read (%.2fx)\n",
+                __func__, min_blen, max_blen, k->name, ns, old_ns / ns);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const bc_kernel_t *kernels[] {&bc_kernel_scalar(), &bc_kernel_sse42()};
+    for(const bc_kernel_t *k: kernels) {
+        if(!supported(k)) continue;
+        check_kernel(*k);
+    }
+    fprintf(stderr, "[%s] All kernels match memcmp, test_hp and pack_barcode. Dispatching to %s.\n",
+            __func__, bc_kernel().name);
+
+    const unsigned n_reads(argc > 1 ? strtoul(argv[1], nullptr, 10): 1000000);
+    const char *homing(argc > 2 ? argv[2]: "CAGTA");
+    // Fixed-length barcodes followed by the homing sequence within a few bases, then variable-length barcodes.
+    bench(n_reads, homing, 12, 12, 16, kernels);
+    bench(n_reads, homing, 8, 24, 32, kernels);
+    return EXIT_SUCCESS;
+}
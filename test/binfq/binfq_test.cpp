@@ -0,0 +1,148 @@
+#include "lib/binfq.h"
+#include "lib/hashdmp.h"
+#include "test/test_util.h"
+#include <algorithm>
+#include <assert.h>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <random>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace bmf;
+
+struct rec_t {
+    mseq_t m;
+    std::string barcode;
+    char strand;
+    int pass;
+};
+
+static std::vector<std::string> sorted_records(const char *path)
+{
+    std::ifstream fp(path);
+    std::vector<std::string> ret;
+    std::string line, rec;
+    for(int i(1); std::getline(fp, line); ++i) {
+        rec += line + '\n';
+        if(i % 4 == 0) ret.push_back(rec), rec.clear();
+    }
+    std::sort(ret.begin(), ret.end());
+    return ret;
+}
+
+static off_t file_size(const char *path)
+{
+    struct stat st;
+    assert(stat(path, &st) == 0);
+    return st.st_size;
+}
+
+/*
+ * Writes recs to path as marked fastq text or binary records, as the splitter would.
+ */
+static void write_recs(const char *path, const char *mode, const std::vector<rec_t> &recs, int binary)
+{
+    TmpFqWriter w(path, mode);
+    if(binary) binfq_write_header(&w);
+    for(auto &r: recs) {
+        mseq_t m(r.m);
+        char *bc(const_cast<char *>(r.barcode.c_str()));
+        if(binary) mseq2bin_stranded(&w.buf, &m, r.pass, bc, r.strand);
+        else mseq2ks_stranded(&w.buf, &m, r.pass, bc, r.strand);
+        w.check();
+    }
+}
+
+static void check_recs(const char *path, const std::vector<rec_t> &recs, int binary)
+{
+    TmpFqReader rec(path);
+    assert(rec.binary() == binary);
+    for(auto &r: recs) {
+        assert(rec.next());
+        assert(std::string(rec.name, rec.name_l) == r.m.name);
+        assert(rec.bs[0] == r.strand);
+        assert(std::string(rec.bs + 1) == r.barcode);
+        assert(rec.blen == (int)r.barcode.size() + 1);
+        assert(rec.pass_fail == '0' + r.pass);
+        assert(rec.l == std::strlen(r.m.seq));
+        assert(std::string(rec.seq, rec.l) == r.m.seq);
+        assert(std::string(rec.qual, rec.l) == r.m.qual);
+    }
+    assert(!rec.next());
+    // Rewinding starts over at the first record.
+    assert(rec.rewind() == 0);
+    assert(rec.next() && std::string(rec.seq, rec.l) == recs[0].m.seq);
+}
+
+static std::vector<rec_t> make_recs(std::mt19937 &rng, size_t n, int n_fams, int blen, int readlen)
+{
+    std::vector<rec_t> ret(n);
+    for(size_t i(0); i < n; ++i) {
+        rec_t &r(ret[i]);
+        std::mt19937 fam(rng() % n_fams);
+        sprintf(r.m.name, "HWI-ST1234:8:C0FFEEACXX:1:%u:%u:%u", (unsigned)rng() % 2000,
+                (unsigned)rng() % 20000, (unsigned)i);
+        for(int j(0); j < blen; ++j) r.barcode.push_back("ACGT"[fam() % 4]);
+        // Some barcodes (which cannot be packed) and reads contain Ns.
+        if(fam() % 50 == 0) r.barcode[fam() % blen] = 'N';
+        const int has_n(rng() % 20 == 0);
+        for(int j(0); j < readlen; ++j) {
+            r.m.seq[j] = has_n && j % 37 == 0 ? 'N': "ACGT"[(fam() + (rng() % 50 == 0)) % 4];
+            r.m.qual[j] = '#' + rng() % 40;
+        }
+        r.m.seq[readlen] = r.m.qual[readlen] = '\0';
+        r.strand = rng() & 1 ? 'F': 'R';
+        r.pass = rng() % 10 != 0;
+    }
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    std::mt19937 rng(137);
+    // Barcodes spanning both words of a packed key, and one too long to pack.
+    for(int blen: {7, 40, 70}) {
+        std::vector<rec_t> recs(make_recs(rng, 200, 50, blen, 51));
+        write_recs("binfq_test.long.bin", "wT", recs, 1);
+        check_recs("binfq_test.long.bin", recs, 1);
+    }
+    unlink("binfq_test.long.bin");
+
+    const std::vector<rec_t> recs(make_recs(rng, 60000, 8000, 16, 150));
+    write_recs("binfq_test.fq", "wT", recs, 0);
+    write_recs("binfq_test.bin", "wT", recs, 1);
+    write_recs("binfq_test.bin.gz", "wb1", recs, 1);
+    check_recs("binfq_test.fq", recs, 0);
+    check_recs("binfq_test.bin", recs, 1);
+    check_recs("binfq_test.bin.gz", recs, 1);
+    fprintf(stderr, "[%s] Temporary file sizes: fastq %lu, binary %lu bytes (%0.1f%%).\n", argv[0],
+            (unsigned long)file_size("binfq_test.fq"), (unsigned long)file_size("binfq_test.bin"),
+            100. * file_size("binfq_test.bin") / file_size("binfq_test.fq"));
+    assert(file_size("binfq_test.bin") * 3 < file_size("binfq_test.fq") * 2);
+
+    // Both formats collapse to the same output.
+    stranded_hash_dmp_core((char *)"binfq_test.fq", (char *)"binfq_test.fq.stranded", 0);
+    stranded_hash_dmp_core((char *)"binfq_test.bin", (char *)"binfq_test.bin.stranded", 0);
+    stranded_hash_dmp_core((char *)"binfq_test.bin.gz", (char *)"binfq_test.bin.gz.stranded", 0);
+    hash_dmp_core((char *)"binfq_test.fq", (char *)"binfq_test.fq.out", 0);
+    hash_dmp_core((char *)"binfq_test.bin", (char *)"binfq_test.bin.out", 0);
+    assert(slurp("binfq_test.fq.stranded").size());
+    assert(slurp("binfq_test.fq.stranded") == slurp("binfq_test.bin.stranded"));
+    assert(slurp("binfq_test.fq.stranded") == slurp("binfq_test.bin.gz.stranded"));
+    assert(slurp("binfq_test.fq.out") == slurp("binfq_test.bin.out"));
+
+    // Binary bins are re-split into binary pieces.
+    stranded_hash_dmp_core((char *)"binfq_test.bin", (char *)"binfq_test.bin.budget", 0, 3 << 20);
+    assert(sorted_records("binfq_test.bin.stranded") == sorted_records("binfq_test.bin.budget"));
+
+    for(const char *path: {"binfq_test.fq", "binfq_test.bin", "binfq_test.bin.gz", "binfq_test.fq.stranded",
+                           "binfq_test.bin.stranded", "binfq_test.bin.gz.stranded", "binfq_test.fq.out",
+                           "binfq_test.bin.out", "binfq_test.bin.budget"})
+        unlink(path);
+    fprintf(stderr, "[%s] Binary temporary file tests passed.\n", argv[0]);
+    return EXIT_SUCCESS;
+}
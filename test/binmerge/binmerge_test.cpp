@@ -0,0 +1,170 @@
+#include "lib/binmerge.h"
+#include "lib/ubam.h"
+#include "test/test_util.h"
+#include <assert.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include <zlib.h>
+
+using namespace bmf;
+
+static const int N_BINS = 17;
+
+static std::string raw(const char *path)
+{
+    std::string ret;
+    FILE *fp(fopen(path, "rb"));
+    assert(fp);
+    int c;
+    while((c = fgetc(fp)) != EOF) ret.push_back(c);
+    fclose(fp);
+    return ret;
+}
+
+static std::string record(int bin, int i, int is_read2)
+{
+    char buf[256];
+    sprintf(buf, "@read%i.%i FM:i:%i\n%s\n+\n%s\n", bin, i, i + 1,
+            is_read2 ? "TTGCAGTCAN": "ACGTACGTAA", is_read2 ? "##FFFFFFF#": "FFFFFFFFFF");
+    return buf;
+}
+
+/*
+ * The same record as an unaligned BAM record.
+ */
+static std::string bam_record(int bin, int i, int is_read2)
+{
+    char name[64];
+    sprintf(name, "read%i.%i", bin, i);
+    kstring_t ks{0, 0, nullptr};
+    const size_t start(ubam_start(&ks, name, is_read2 ? "TTGCAGTCAN": "ACGTACGTAA", 10));
+    for(const char *q(is_read2 ? "##FFFFFFF#": "FFFFFFFFFF"); *q; ++q) kputc(*q - 33, &ks);
+    ubam_aux_int(&ks, "FM", i + 1);
+    ubam_finish(&ks, start);
+    std::string ret(ks.s, ks.l);
+    free(ks.s);
+    return ret;
+}
+
+/*
+ * Collapsed bins are reported out of order from several threads, as the hash dmp cores do.
+ */
+static void run(marksplit_settings_t *settings, splitterhash_params_t *params, const char *ffq_r1, const char *ffq_r2)
+{
+    BinMerger merger(settings, params, ffq_r1, ffq_r2);
+    std::vector<std::thread> threads;
+    for(int t(0); t < 4; ++t)
+        threads.emplace_back([&, t]() {
+            for(int i(N_BINS - 1 - t); i >= 0; i -= 4) {
+                merger.done(i, 0);
+                if(!settings->is_se) merger.done(i, 1);
+            }
+        });
+    for(auto &t: threads) t.join();
+    merger.finish();
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<std::string> names[2];
+    std::vector<char *> fnames[2];
+    std::string expected[2], interleaved;
+    for(int i(0); i < N_BINS; ++i) {
+        for(int r(0); r < 2; ++r)
+            names[r].push_back("binmerge_test.bin" + std::to_string(i) + ".R" + std::to_string(r + 1) + ".fq");
+        // Leave some bins empty.
+        const int n(i % 5 == 3 ? 0: 100 * i + 1);
+        for(int j(0); j < n; ++j) {
+            expected[0] += record(i, j, 0), expected[1] += record(i, j, 1);
+            interleaved += record(i, j, 0) + record(i, j, 1);
+        }
+    }
+    for(int r(0); r < 2; ++r) for(auto &n: names[r]) fnames[r].push_back(&n[0]);
+    splitterhash_params_t params{nullptr, nullptr, fnames[0].data(), fnames[1].data(), N_BINS, 1};
+    marksplit_settings_t settings;
+    std::memset(&settings, 0, sizeof(settings));
+    settings.n_handles = N_BINS;
+
+    for(int level(0); level < 2; ++level) {
+        // Write the bins as hash_dmp_core would.
+        for(int i(0); i < N_BINS; ++i) {
+            for(int r(0); r < 2; ++r) {
+                gzFile fp(gzopen(fnames[r][i], level ? "wb1": "wT"));
+                const int n(i % 5 == 3 ? 0: 100 * i + 1);
+                for(int j(0); j < n; ++j) {
+                    const std::string rec(record(i, j, r));
+                    gzwrite(fp, rec.data(), rec.size());
+                }
+                gzclose(fp);
+            }
+        }
+        settings.gzip_output = level;
+
+        // Paired-end files
+        settings.is_se = 0, settings.to_stdout = 0;
+        run(&settings, &params, "binmerge_test.R1.fq", "binmerge_test.R2.fq");
+        const char *out1(level ? "binmerge_test.R1.fq.gz": "binmerge_test.R1.fq");
+        const char *out2(level ? "binmerge_test.R2.fq.gz": "binmerge_test.R2.fq");
+        assert(slurp(out1) == expected[0]);
+        assert(slurp(out2) == expected[1]);
+        if(!level) assert(raw(out1) == expected[0]);
+
+        // Single-end file
+        settings.is_se = 1;
+        unlink(out2);
+        run(&settings, &params, "binmerge_test.R1.fq", nullptr);
+        assert(slurp(out1) == expected[0]);
+        assert(access(out2, F_OK) != 0);
+        unlink(out1);
+
+        // Interleaved and single-end stdout
+        const int stdout_fd(dup(STDOUT_FILENO));
+        settings.is_se = 0, settings.to_stdout = 1;
+        if(!freopen("binmerge_test.stdout.fq", "w", stdout)) return EXIT_FAILURE;
+        run(&settings, &params, nullptr, nullptr);
+        fflush(stdout);
+        assert(raw("binmerge_test.stdout.fq") == interleaved);
+        settings.is_se = 1;
+        if(!freopen("binmerge_test.stdout.fq", "w", stdout)) return EXIT_FAILURE;
+        run(&settings, &params, nullptr, nullptr);
+        fflush(stdout);
+        assert(raw("binmerge_test.stdout.fq") == expected[0]);
+        dup2(stdout_fd, STDOUT_FILENO), close(stdout_fd);
+        unlink("binmerge_test.stdout.fq");
+    }
+
+    // Unaligned BAM: records of both reads in one file, pairs adjacent.
+    std::string expected_bam;
+    for(int i(0); i < N_BINS; ++i) {
+        for(int r(0); r < 2; ++r) {
+            gzFile fp(gzopen(fnames[r][i], "wT"));
+            for(int j(0), n(i % 5 == 3 ? 0: 100 * i + 1); j < n; ++j) {
+                std::string rec(bam_record(i, j, r));
+                gzwrite(fp, rec.data(), rec.size());
+                if(r == 0) {
+                    std::string rec2(bam_record(i, j, 1));
+                    ubam_set_flag(&rec[0], UBAM_FLAG_R1), ubam_set_flag(&rec2[0], UBAM_FLAG_R2);
+                    expected_bam += rec + rec2;
+                }
+            }
+            gzclose(fp);
+        }
+    }
+    settings.ubam = 1, settings.is_se = 0, settings.to_stdout = 0, settings.gzip_compression = 1;
+    run(&settings, &params, "binmerge_test.bam", nullptr);
+    const std::string bam(slurp("binmerge_test.bam"));
+    assert(bam.compare(0, 4, "BAM\1") == 0);
+    int32_t l_text;
+    std::memcpy(&l_text, bam.data() + 4, sizeof(l_text));
+    assert(bam.substr(12 + l_text) == expected_bam);
+    unlink("binmerge_test.bam");
+
+    for(int r(0); r < 2; ++r) for(auto f: fnames[r]) unlink(f);
+    fprintf(stderr, "[%s] Bin merging tests passed.\n", argv[0]);
+    return EXIT_SUCCESS;
+}
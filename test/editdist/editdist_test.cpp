@@ -0,0 +1,87 @@
+#include "lib/editdist.h"
+#include <algorithm>
+#include <assert.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace bmf;
+
+/*
+ * Full-matrix Levenshtein distance, to check the bounded kernels against.
+ */
+static int full_edit_distance(const std::string &a, const std::string &b)
+{
+    std::vector<int> mat((a.size() + 1) * (b.size() + 1));
+    const size_t w(b.size() + 1);
+    for(size_t i(0); i <= a.size(); ++i) mat[i * w] = i;
+    for(size_t j(0); j <= b.size(); ++j) mat[j] = j;
+    for(size_t i(1); i <= a.size(); ++i)
+        for(size_t j(1); j <= b.size(); ++j)
+            mat[i * w + j] = std::min(std::min(mat[(i - 1) * w + j] + 1, mat[i * w + j - 1] + 1),
+                                      mat[(i - 1) * w + j - 1] + (a[i - 1] != b[j - 1]));
+    return mat.back();
+}
+
+static void check(int expected, int got, int lim)
+{
+    if(expected <= lim) assert(got == expected);
+    else assert(got > lim);
+}
+
+/*
+ * :returns: [std::string] s with n random substitutions, insertions or deletions.
+ */
+static std::string mutate(std::mt19937 &rng, std::string s, int n, const char *alphabet, int n_chars)
+{
+    while(n--) {
+        const size_t pos(s.size() ? rng() % s.size(): 0);
+        switch(rng() % 3) {
+        case 0: if(s.size()) s[pos] = alphabet[rng() % n_chars]; break;
+        case 1: s.insert(s.begin() + pos, alphabet[rng() % n_chars]); break;
+        default: if(s.size()) s.erase(s.begin() + pos);
+        }
+    }
+    return s;
+}
+
+int main(int argc, char **argv)
+{
+    std::mt19937 rng(1337);
+    for(int trial(0); trial < 100000; ++trial) {
+        // Barcode-like names over ACGT, and a small alphabet for many coincidental matches.
+        const char *alphabet(trial & 1 ? "ACGT": "AB");
+        const int n_chars(trial & 1 ? 4: 2), l(trial % 5 ? rng() % 65: rng() % 160);
+        std::string a;
+        for(int i(0); i < l; ++i) a += alphabet[rng() % n_chars];
+        const std::string b(trial % 3 ? mutate(rng, a, rng() % 8, alphabet, n_chars): mutate(rng, "", rng() % 160, alphabet, n_chars));
+        const int expected(full_edit_distance(a, b)), lim(trial % 4 ? rng() % 10: rng() % (ED_MAX_LIM + 1));
+        check(expected, banded_edit_distance(a.data(), a.size(), b.data(), b.size(), lim), lim);
+        check(expected, bounded_edit_distance(a.data(), a.size(), b.data(), b.size(), lim), lim);
+        if(a.size() <= 64) {
+            check(expected, myers_edit_distance(a.data(), a.size(), b.data(), b.size(), lim), lim);
+            assert(myers_edit_distance(a.data(), a.size(), b.data(), b.size(), 1 << 20) == expected);
+        }
+    }
+    // Timing on 16-base barcodes at rsq's default limit.
+    std::vector<std::string> names(2000);
+    for(auto &n: names) for(int i(0); i < 16; ++i) n += "ACGT"[rng() % 4];
+    auto time_ns = [&](int (*fn)(const std::string &, const std::string &)) {
+        const auto start(std::chrono::steady_clock::now());
+        volatile int sink(0);
+        for(size_t i(0); i < names.size(); ++i)
+            for(size_t j(i + 1); j < names.size(); ++j) sink += fn(names[i], names[j]) <= 2;
+        const auto stop(std::chrono::steady_clock::now());
+        return std::chrono::duration<double, std::nano>(stop - start).count() / (names.size() * (names.size() - 1) / 2);
+    };
+    const double full_ns(time_ns([](const std::string &a, const std::string &b) {return full_edit_distance(a, b);}));
+    const double myers_ns(time_ns([](const std::string &a, const std::string &b) {
+        return bounded_edit_distance(a.data(), a.size(), b.data(), b.size(), 2);
+    }));
+    fprintf(stderr, "[%s] Bounded edit distances match. Full matrix: %.1f ns/pair. Bounded: %.1f ns/pair.\n",
+            argv[0], full_ns, myers_ns);
+    return EXIT_SUCCESS;
+}
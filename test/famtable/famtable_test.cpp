@@ -0,0 +1,65 @@
+#include "lib/famtable.h"
+#include <algorithm>
+#include <assert.h>
+#include <cstdlib>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+int main(int argc, char **argv)
+{
+    const char nucs[] {"ACGTN"};
+    std::srand(13);
+    bmf::FamTable<int> table;
+    std::unordered_map<std::string, uint32_t> expected;
+    std::vector<std::string> order;
+    int is_new;
+    // Short and long packed barcodes, barcodes with Ns and barcodes too long to pack.
+    for(int i(0); i < 200000; ++i) {
+        const int len(i % 4 == 0 ? 16: i % 4 == 1 ? 40: i % 4 == 2 ? 64: 70);
+        std::string bs;
+        for(int j(0); j < len; ++j) bs.push_back(nucs[std::rand() % (i % 7 ? 4: 5)]);
+        // Revisit earlier barcodes as often as new ones.
+        if(i & 1 && order.size()) bs = order[std::rand() % order.size()];
+        uint64_t key[2];
+        if(bmf::pack_barcode(bs.data(), bs.size(), key) == 0) {
+            std::string unpacked(bs.size(), '\0');
+            bmf::unpack_barcode(key, bs.size(), &unpacked[0]);
+            assert(unpacked == bs);
+        }
+        const uint32_t idx(table.get(bs.data(), bs.size(), &is_new));
+        auto it(expected.find(bs));
+        if(it == expected.end()) {
+            assert(is_new);
+            assert(idx == order.size());
+            expected.emplace(bs, idx);
+            order.push_back(bs);
+        } else {
+            assert(!is_new);
+            assert(idx == it->second);
+        }
+        ++table[idx];
+    }
+    assert(table.size() == order.size());
+    // Barcode order: packed barcodes, then the rest, each lexicographically.
+    std::vector<std::string> packed, rest;
+    for(const std::string &bs: order) {
+        uint64_t key[2];
+        (bmf::pack_barcode(bs.data(), bs.size(), key) == 0 ? packed: rest).push_back(bs);
+    }
+    std::sort(packed.begin(), packed.end()), std::sort(rest.begin(), rest.end());
+    packed.insert(packed.end(), rest.begin(), rest.end());
+    const std::vector<uint32_t> sorted(table.barcode_order());
+    assert(sorted.size() == packed.size());
+    for(size_t i(0); i < sorted.size(); ++i) assert(order[sorted[i]] == packed[i]);
+    // Barcodes differing only in length must not collide.
+    const uint32_t a(table.get("AAAA", 4, &is_new));
+    assert(is_new);
+    const uint32_t b(table.get("AAAAA", 5, &is_new));
+    assert(is_new && a != b);
+    table.clear();
+    assert(table.size() == 0);
+    table.get("ACGT", 4, &is_new);
+    assert(is_new);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,165 @@
+#include "lib/fqreader.h"
+#include "htslib/bgzf.h"
+#include "htslib/kseq.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <unistd.h>
+
+KSEQ_INIT(gzFile, gzread)
+
+using namespace bmf;
+
+/*
+ * Reads the same fastq with kseq (the previous reader) and with FqReader, checks that both return the same
+ * records, and reports records/sec for uncompressed (memory-mapped), gzipped and BGZF input,
+ * reading compressed input with one thread and with -p threads.
+ * Usage: fqreader_bench [-n <records>] [-T <level>] [-p <threads>]
+ * -T sets the compression level of the compressed copies.
+ */
+
+static const int READLEN = 150;
+
+template<typename F>
+static double records_per_sec(F fn, size_t n)
+{
+    const auto start(std::chrono::steady_clock::now());
+    fn();
+    const auto stop(std::chrono::steady_clock::now());
+    return n / std::chrono::duration<double>(stop - start).count();
+}
+
+/*
+ * Exits with a message unless ok. The bench is built with $(OPT), whose -DNDEBUG would drop asserts,
+ * along with any calls inside them.
+ */
+static void require(bool ok, const char *path, const char *what)
+{
+    if(ok) return;
+    fprintf(stderr, "[%s] %s: %s\n", __func__, path, what);
+    exit(EXIT_FAILURE);
+}
+
+static void write_fastq(const char *path, const char *mode, size_t n)
+{
+    std::mt19937 rng(137);
+    char seq[READLEN + 1], qual[READLEN + 1];
+    gzFile fp(gzopen(path, mode));
+    require(fp != nullptr, path, "could not open for writing");
+    gzbuffer(fp, 1 << 20);
+    for(size_t i(0); i < n; ++i) {
+        for(int j(0); j < READLEN; ++j) seq[j] = "ACGT"[rng() % 4], qual[j] = '#' + rng() % 40;
+        seq[READLEN] = qual[READLEN] = '\0';
+        // Some records have comments, and some lines end with carriage returns.
+        if(i % 3) gzprintf(fp, "@HWI-ST1234:8:C0FFEEACXX:1:%u:%u:%lu\n", (unsigned)rng() % 2000, (unsigned)rng() % 20000, i);
+        else gzprintf(fp, "@HWI-ST1234:8:C0FFEEACXX:1:%u:%u:%lu 1:N:0:ACGTAC\n", (unsigned)rng() % 2000, (unsigned)rng() % 20000, i);
+        gzprintf(fp, i % 101 ? "%s\n+\n%s\n": "%s\r\n+\r\n%s\r\n", seq, qual);
+    }
+    gzclose(fp);
+}
+
+static void write_bgzf(const char *in_path, const char *path, const char *mode)
+{
+    char bmode[3] {'w', mode[2], '\0'}, buf[1 << 16];
+    gzFile in(gzopen(in_path, "r"));
+    BGZF *out(bgzf_open(path, bmode));
+    require(in != nullptr, in_path, "could not open for reading");
+    require(out != nullptr, path, "could not open for writing");
+    int l;
+    while((l = gzread(in, buf, sizeof(buf))) > 0) require(bgzf_write(out, buf, l) == l, path, "write failed");
+    gzclose(in);
+    require(bgzf_close(out) == 0, path, "close failed");
+}
+
+static void check(const char *path, size_t n, int threads)
+{
+    gzFile fp(gzopen(path, "r"));
+    kseq_t *ks(kseq_init(fp));
+    FqReader in(path, threads);
+    fq_view_t rec;
+    size_t count(0);
+    while(kseq_read(ks) >= 0) {
+        const int got(in.next(&rec));
+        require(got, path, "FqReader ended early");
+        require(std::string(rec.name, rec.name_l) == ks->name.s, path, "names differ");
+        require(std::string(rec.comment, rec.comment_l) == (ks->comment.l ? ks->comment.s: ""), path, "comments differ");
+        require(std::string(rec.seq, rec.l) == ks->seq.s, path, "sequences differ");
+        require(std::string(rec.qual, rec.l) == ks->qual.s, path, "qualities differ");
+        ++count;
+    }
+    const int extra(in.next(&rec));
+    require(!extra, path, "FqReader returned records past the end");
+    require(count == n, path, "wrong number of records");
+    // Rewinding starts over at the first record.
+    require(in.rewind() == 0, path, "rewind failed");
+    gzrewind(fp);
+    kseq_rewind(ks);
+    const int got(in.next(&rec));
+    require(got && kseq_read(ks) >= 0 && std::string(rec.seq, rec.l) == ks->seq.s, path, "rewind did not return to the first record");
+    kseq_destroy(ks);
+    gzclose(fp);
+}
+
+static double kseq_rate(const char *path, size_t n)
+{
+    return records_per_sec([&]() {
+        gzFile fp(gzopen(path, "r"));
+        kseq_t *ks(kseq_init(fp));
+        size_t bases(0);
+        while(kseq_read(ks) >= 0) bases += ks->seq.l;
+        require(bases == n * READLEN, path, "kseq read the wrong number of bases");
+        kseq_destroy(ks);
+        gzclose(fp);
+    }, n);
+}
+
+static double fqreader_rate(const char *path, size_t n, int threads)
+{
+    return records_per_sec([&]() {
+        FqReader in(path, threads);
+        fq_view_t rec;
+        size_t bases(0);
+        while(in.next(&rec)) bases += rec.l;
+        require(bases == n * READLEN, path, "FqReader read the wrong number of bases");
+    }, n);
+}
+
+int main(int argc, char **argv)
+{
+    char mode[4] {"wb6"};
+    size_t n(1000000);
+    int c, threads(4);
+    while((c = getopt(argc, argv, "T:n:p:h?")) > -1) {
+        switch(c) {
+            case 'T': sprintf(mode, "wb%c", atoi(optarg) % 10 + '0'); break;
+            case 'n': n = strtoull(optarg, nullptr, 10); break;
+            case 'p': threads = atoi(optarg); break;
+            case 'h': case '?': fprintf(stderr, "Usage: %s [-n <records>] [-T <level>] [-p <threads>]\n", argv[0]); return EXIT_SUCCESS;
+        }
+    }
+    write_fastq("fqreader_bench.fq", "wT", n);
+    write_fastq("fqreader_bench.fq.gz", mode, n);
+    write_bgzf("fqreader_bench.fq", "fqreader_bench.bgzf.fq.gz", mode);
+    for(const char *path: {"fqreader_bench.fq", "fqreader_bench.fq.gz", "fqreader_bench.bgzf.fq.gz"})
+        check(path, n, 1), check(path, n, threads);
+    {
+        FqReader in("fqreader_bench.fq");
+        require(in.mapped(), "fqreader_bench.fq", "uncompressed input was not memory-mapped");
+    }
+
+    fprintf(stderr, "[%s] %lu records of length %i.\n", __func__, n, READLEN);
+    const double plain_kseq(kseq_rate("fqreader_bench.fq", n)), plain(fqreader_rate("fqreader_bench.fq", n, 1));
+    fprintf(stderr, "[%s] fqreader_bench.fq: kseq %12.0f records/sec, FqReader %12.0f records/sec (%.2fx)\n",
+            __func__, plain_kseq, plain, plain / plain_kseq);
+    for(const char *path: {"fqreader_bench.fq.gz", "fqreader_bench.bgzf.fq.gz"}) {
+        const double old_rate(kseq_rate(path, n)), new_rate(fqreader_rate(path, n, 1)),
+                     mt_rate(fqreader_rate(path, n, threads));
+        fprintf(stderr, "[%s] %s: kseq %12.0f records/sec, FqReader %12.0f records/sec (%.2fx), "
+                        "%i threads %12.0f records/sec (%.2fx)\n",
+                __func__, path, old_rate, new_rate, new_rate / old_rate, threads, mt_rate, mt_rate / old_rate);
+    }
+    for(const char *path: {"fqreader_bench.fq", "fqreader_bench.fq.gz", "fqreader_bench.bgzf.fq.gz"}) unlink(path);
+    return EXIT_SUCCESS;
+}
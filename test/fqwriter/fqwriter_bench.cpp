@@ -0,0 +1,100 @@
+#include "lib/mseq.h"
+#include "test/test_util.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+using namespace bmf;
+
+/*
+ * Writes the same marked records to per-bin temporary fastqs with gzprintf (the previous writer)
+ * and with TmpFqWriter, checks that both decompress to the same text, and reports records/sec.
+ * Usage: fqwriter_bench [-T <level>] [-n <records>] [-b <bins>]
+ * Without -T, temporary files are uncompressed, as in collapse.
+ */
+
+static const int READLEN = 150;
+
+template<typename F>
+static double records_per_sec(F fn, size_t n)
+{
+    const auto start(std::chrono::steady_clock::now());
+    fn();
+    const auto stop(std::chrono::steady_clock::now());
+    return n / std::chrono::duration<double>(stop - start).count();
+}
+
+int main(int argc, char **argv)
+{
+    char mode[4] {"wT"};
+    size_t n(2000000);
+    int n_bins(256), c;
+    while((c = getopt(argc, argv, "T:n:b:h?")) > -1) {
+        switch(c) {
+            case 'T': sprintf(mode, "wb%c", atoi(optarg) % 10 + '0'); break;
+            case 'n': n = strtoull(optarg, nullptr, 10); break;
+            case 'b': n_bins = atoi(optarg); break;
+            case 'h': case '?': fprintf(stderr, "Usage: %s [-T <level>] [-n <records>] [-b <bins>]\n", argv[0]); return EXIT_SUCCESS;
+        }
+    }
+    // A pool of records to cycle through.
+    std::mt19937 rng(137);
+    std::vector<mseq_t> recs(1024);
+    std::vector<int> bins(recs.size());
+    char barcode[MAX_BARCODE_LENGTH + 1];
+    for(size_t i(0); i < recs.size(); ++i) {
+        mseq_t &m(recs[i]);
+        sprintf(m.name, "HWI-ST1234:%u:C0FFEEACXX:1:%u:%u:%u", (unsigned)i % 8, (unsigned)rng() % 2000,
+                (unsigned)rng() % 20000, (unsigned)rng() % 200000);
+        for(int j(0); j < READLEN; ++j) m.seq[j] = "ACGT"[rng() % 4], m.qual[j] = '#' + rng() % 40;
+        m.seq[READLEN] = m.qual[READLEN] = '\0';
+        bins[i] = rng() % n_bins;
+    }
+    for(int j(0); j < 16; ++j) barcode[j] = "ACGT"[j % 4];
+    barcode[16] = '\0';
+
+    std::vector<std::string> old_paths, new_paths;
+    for(int i(0); i < n_bins; ++i) {
+        old_paths.emplace_back("fqwriter_bench.old." + std::to_string(i) + ".fastq");
+        new_paths.emplace_back("fqwriter_bench.new." + std::to_string(i) + ".fastq");
+    }
+
+    const double old_rate(records_per_sec([&]() {
+        std::vector<gzFile> handles;
+        for(auto &p: old_paths) handles.push_back(gzopen(p.c_str(), mode));
+        for(size_t i(0); i < n; ++i) {
+            mseq_t &m(recs[i % recs.size()]);
+            gzprintf(handles[bins[i % recs.size()]], "@%s ~#!#~|FP=%c|BS=%c%s\n%s\n+\n%s\n",
+                     m.name, '1', 'F', barcode, m.seq, m.qual);
+        }
+        for(auto h: handles) gzclose(h);
+    }, n));
+
+    const double new_rate(records_per_sec([&]() {
+        std::vector<TmpFqWriter *> handles;
+        for(auto &p: new_paths) handles.push_back(new TmpFqWriter(p.c_str(), mode, fq_writer_buf_size(n_bins)));
+        for(size_t i(0); i < n; ++i)
+            mseq2fq_stranded(handles[bins[i % recs.size()]], &recs[i % recs.size()], 1, barcode, 'F');
+        for(auto h: handles) delete h;
+    }, n));
+
+    // Checked explicitly rather than with assert, which -DNDEBUG in $(OPT) removes.
+    int n_diff(0);
+    for(int i(0); i < n_bins; ++i) {
+        if(slurp(old_paths[i].c_str()) != slurp(new_paths[i].c_str())) {
+            fprintf(stderr, "[%s] %s differs from %s.\n", __func__, new_paths[i].c_str(), old_paths[i].c_str());
+            ++n_diff;
+            continue; // Keep both for inspection.
+        }
+        unlink(old_paths[i].c_str()), unlink(new_paths[i].c_str());
+    }
+    if(n_diff) return EXIT_FAILURE;
+    fprintf(stderr, "[%s] mode %s, %i bins, %lu records.\n", __func__, mode, n_bins, n);
+    fprintf(stderr, "[%s] gzprintf:    %12.0f records/sec\n", __func__, old_rate);
+    fprintf(stderr, "[%s] TmpFqWriter: %12.0f records/sec (%.2fx)\n", __func__, new_rate, new_rate / old_rate);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,204 @@
+#include "lib/hashdmp.h"
+#include "lib/mseq.h"
+#include "lib/splitter.h"
+#include "lib/binner.h"
+#include <algorithm>
+#include <assert.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <unistd.h>
+#include <vector>
+
+using namespace bmf;
+
+/*
+ * Collapsed records from a fastq, sorted, since re-split bins write families in a different order.
+ */
+static std::vector<std::string> sorted_records(const char *path)
+{
+    std::ifstream fp(path);
+    std::vector<std::string> ret;
+    std::string line, rec;
+    for(int i(1); std::getline(fp, line); ++i) {
+        rec += line + '\n';
+        if(i % 4 == 0) ret.push_back(rec), rec.clear();
+    }
+    std::sort(ret.begin(), ret.end());
+    return ret;
+}
+
+/*
+ * Splits marked records into bins by barcode prefix as collapse does (get_bin in src/bmf_collapse.cpp),
+ * collapses each bin in barcode order and checks that the bins, appended in order, are sorted by barcode.
+ * Barcodes with Ns come after the others in their bin, so they are left out of the comparison.
+ * :param: fixed_start [const char *] Start shared by every barcode, to skew the plan from plan_bins.
+ */
+static void check_bins_sorted(std::mt19937 &rng, const char *fixed_start, int planned)
+{
+    marksplit_settings_t settings;
+    std::memset(&settings, 0, sizeof(settings));
+    settings.n_nucs = 2;
+    settings.n_handles = 16;
+    std::vector<std::string> barcodes, recs;
+    char bc[17], seq[51], qual[51];
+    bc[16] = seq[50] = qual[50] = '\0';
+    bin_sample_t sample;
+    const int n_fixed(std::strlen(fixed_start));
+    for(int i(0); i < 20000; ++i) {
+        std::mt19937 fam(rng() % 3000);
+        for(int j(0); j < 16; ++j) bc[j] = j < n_fixed ? fixed_start[j]: "ACGT"[fam() % 4];
+        if(fam() % 50 == 0) bc[fam() % 16] = 'N';
+        for(int j(0); j < 50; ++j) seq[j] = "ACGT"[fam() % 4], qual[j] = '#' + rng() % 40;
+        barcodes.emplace_back(bc);
+        recs.emplace_back(std::string("@read") + std::to_string(i) + " ~#!#~|FP=1|BS=F" + bc + "\n" + seq + "\n+\n" + qual + "\n");
+        sample.add(0, nullptr, nullptr, 1, bc, 'F');
+    }
+    if(planned) {
+        plan_bins(&settings, sample);
+        assert(settings.bin_map);
+    }
+    std::vector<std::string> bins(settings.n_handles);
+    for(size_t i(0); i < recs.size(); ++i) {
+        char *b(&barcodes[i][0]);
+        bins[settings.bin_map ? settings.bin_map[get_binner(b, settings.bin_prefix_len)]: get_binner(b, settings.n_nucs)] += recs[i];
+    }
+    std::string prev;
+    size_t n_checked(0);
+    for(int i(0); i < settings.n_handles; ++i) {
+        const std::string in("max_mem_test.bin" + std::to_string(i) + ".fq"), out(in + ".out");
+        std::ofstream(in) << bins[i];
+        hash_dmp_core((char *)in.c_str(), (char *)out.c_str(), 0, 0, 0, 0, 1);
+        std::ifstream fp(out);
+        std::string line;
+        for(int l(0); std::getline(fp, line); ++l) {
+            if(l % 4) continue;
+            const std::string name(line.substr(1, line.find(' ') - 1));
+            if(name.find('N') != std::string::npos) continue;
+            assert(prev <= name);
+            prev = name, ++n_checked;
+        }
+        unlink(in.c_str()), unlink(out.c_str());
+    }
+    assert(n_checked > 2000);
+    free(settings.bin_map);
+}
+
+/*
+ * :returns: [std::vector<std::string>] Names of the records in a fastq, in order.
+ */
+static std::vector<std::string> record_names(const char *path)
+{
+    std::ifstream fp(path);
+    std::vector<std::string> ret;
+    std::string line;
+    for(int i(0); std::getline(fp, line); ++i) if(i % 4 == 0) ret.push_back(line.substr(0, line.find(' ')));
+    return ret;
+}
+
+/*
+ * Collapses read 1 and read 2 of a bin, of different lengths, as collapse does (parallel_hash_dmp_core)
+ * and checks that their families are written in the same order, with and without a budget.
+ */
+static void check_pair_order(std::mt19937 &rng)
+{
+    const char *paths[] {"max_mem_test.R1.fq", "max_mem_test.R2.fq"};
+    const int readlens[] {100, 150};
+    FILE *fps[] {fopen(paths[0], "w"), fopen(paths[1], "w")};
+    char bc[17], seq[151], qual[151];
+    bc[16] = '\0';
+    for(int i(0); i < 40000; ++i) {
+        std::mt19937 fam(rng() % 6000);
+        for(int j(0); j < 16; ++j) bc[j] = "ACGT"[fam() % 4];
+        const int pass(rng() % 10 != 0);
+        const char strand(rng() & 1 ? 'F': 'R');
+        for(int r(0); r < 2; ++r) {
+            for(int j(0); j < readlens[r]; ++j) seq[j] = "ACGT"[fam() % 4], qual[j] = '#' + rng() % 40;
+            seq[readlens[r]] = qual[readlens[r]] = '\0';
+            fprintf(fps[r], "@read%i ~#!#~|FP=%i|BS=%c%s\n%s\n+\n%s\n", i, pass, strand, bc, seq, qual);
+        }
+    }
+    fclose(fps[0]), fclose(fps[1]);
+    for(int stranded(0); stranded < 2; ++stranded) {
+        for(int sorted(0); sorted < 2; ++sorted) {
+            for(size_t max_mem: {(size_t)0, (size_t)2 << 20}) {
+                std::vector<std::string> names[2];
+                SpillPlan plan(readlens[1]);
+                auto collapse([&](int r) {
+                    const std::string out(std::string(paths[r]) + ".out");
+                    (stranded ? stranded_hash_dmp_core: hash_dmp_core)((char *)paths[r], (char *)out.c_str(), 0, max_mem,
+                                                                       0, 0, sorted, max_mem ? &plan: nullptr, r);
+                    names[r] = record_names(out.c_str());
+                    unlink(out.c_str());
+                });
+                // Read 2 waits on read 1's plan, as it does when the pair is collapsed on two threads.
+                std::thread read2(collapse, 1);
+                collapse(0);
+                read2.join();
+                assert(names[0].size() > 5000);
+                assert(names[0] == names[1]);
+            }
+        }
+    }
+    unlink(paths[0]), unlink(paths[1]);
+}
+
+int main(int argc, char **argv)
+{
+    const char *in("max_mem_test.fq");
+    FILE *fp(fopen(in, "w"));
+    std::mt19937 rng(137);
+    char bc[17], seq[101], qual[101];
+    bc[16] = seq[100] = qual[100] = '\0';
+    // 8000 families over 60000 marked records, on both strands.
+    for(int i(0); i < 60000; ++i) {
+        std::mt19937 fam(rng() % 8000);
+        for(int j(0); j < 16; ++j) bc[j] = "ACGT"[fam() % 4];
+        for(int j(0); j < 100; ++j) seq[j] = "ACGT"[(fam() + (rng() % 50 == 0)) % 4], qual[j] = '#' + rng() % 40;
+        fprintf(fp, "@read%i ~#!#~|FP=%i|BS=%c%s\n%s\n+\n%s\n", i, rng() % 10 != 0, rng() & 1 ? 'F': 'R', bc, seq, qual);
+    }
+    fclose(fp);
+    // Unbounded, then with a budget of about a tenth of the families.
+    stranded_hash_dmp_core((char *)in, (char *)"max_mem_test.stranded.fq", 0);
+    stranded_hash_dmp_core((char *)in, (char *)"max_mem_test.stranded.budget.fq", 0, 3 << 20);
+    hash_dmp_core((char *)in, (char *)"max_mem_test.fq.out", 0);
+    hash_dmp_core((char *)in, (char *)"max_mem_test.budget.fq.out", 0, 3 << 20);
+    const std::vector<std::string> stranded(sorted_records("max_mem_test.stranded.fq"));
+    assert(stranded.size() > 0);
+    assert(stranded == sorted_records("max_mem_test.stranded.budget.fq"));
+    const std::vector<std::string> unstranded(sorted_records("max_mem_test.fq.out"));
+    assert(unstranded.size() > 7900 && unstranded.size() <= 8000);
+    assert(unstranded == sorted_records("max_mem_test.budget.fq.out"));
+    // In barcode order, output is the same byte for byte with or without a budget.
+    stranded_hash_dmp_core((char *)in, (char *)"max_mem_test.stranded.fq", 0, 0, 0, 0, 1);
+    stranded_hash_dmp_core((char *)in, (char *)"max_mem_test.stranded.budget.fq", 0, 3 << 20, 0, 0, 1);
+    hash_dmp_core((char *)in, (char *)"max_mem_test.fq.out", 0, 0, 0, 0, 1);
+    hash_dmp_core((char *)in, (char *)"max_mem_test.budget.fq.out", 0, 3 << 20, 0, 0, 1);
+    for(auto paths: {std::make_pair("max_mem_test.stranded.fq", "max_mem_test.stranded.budget.fq"),
+                     std::make_pair("max_mem_test.fq.out", "max_mem_test.budget.fq.out")}) {
+        std::ifstream a(paths.first), b(paths.second);
+        const std::string sa((std::istreambuf_iterator<char>(a)), std::istreambuf_iterator<char>());
+        const std::string sb((std::istreambuf_iterator<char>(b)), std::istreambuf_iterator<char>());
+        assert(sa.size() > 0 && sa == sb);
+    }
+    assert(sorted_records("max_mem_test.stranded.fq") == stranded);
+    assert(sorted_records("max_mem_test.fq.out") == unstranded);
+    // Across bins, with and without a plan, including one skewed toward a fixed start.
+    check_bins_sorted(rng, "", 0);
+    check_bins_sorted(rng, "", 1);
+    check_bins_sorted(rng, "GTC", 1);
+    // Read 1 and read 2 of a bin are re-split alike.
+    check_pair_order(rng);
+    // Pieces are removed once collapsed.
+    assert(access("max_mem_test.fq.spill0.0.fastq", F_OK) != 0);
+    for(const char *path: {in, "max_mem_test.stranded.fq", "max_mem_test.stranded.budget.fq", "max_mem_test.fq.out", "max_mem_test.budget.fq.out"})
+        unlink(path);
+    fprintf(stderr, "[%s] Memory budget tests passed.\n", argv[0]);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,122 @@
+#include "lib/inmem.h"
+#include "test/test_util.h"
+#include <assert.h>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include <zlib.h>
+
+using namespace bmf;
+
+/*
+ * :returns: [unsigned] Number of records in collapsed output, adding their FM tags to *fm_sum.
+ */
+static unsigned count_records(const std::string &data, unsigned *fm_sum)
+{
+    std::istringstream is(data);
+    std::string line;
+    unsigned ret(0);
+    for(int i(0); std::getline(is, line); ++i) {
+        if(i % 4) continue;
+        ++ret;
+        const size_t fm(line.find("FM:i:"));
+        assert(fm != std::string::npos);
+        *fm_sum += strtoul(line.c_str() + fm + 5, nullptr, 10);
+    }
+    return ret;
+}
+
+static void collapse(const inmem_settings_t &base, int threads, int level, const char *out1, const char *out2)
+{
+    inmem_settings_t settings(base);
+    settings.threads = threads, settings.level = level;
+    inmem_collapse(&settings, "inmem_test.R1.fq", settings.is_se ? nullptr: "inmem_test.R2.fq", out1, out2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *homing("CAGTA");
+    const int blen(8), n_fams(6000), n_pairs(50000), insert(90);
+    std::mt19937 rng(1337);
+    std::vector<std::string> bc_a(n_fams), bc_b(n_fams);
+    for(int i(0); i < n_fams; ++i) {
+        do {
+            bc_a[i].clear(), bc_b[i].clear();
+            for(int j(0); j < blen; ++j) bc_a[i] += "ACGT"[rng() % 4], bc_b[i] += "ACGT"[rng() % 4];
+        } while(bc_a[i] == bc_b[i]);
+        if(i % 50 == 0) bc_a[i][3] = 'N'; // QC fail families, looked up by sequence.
+    }
+    FILE *fp1(fopen("inmem_test.R1.fq", "w")), *fp2(fopen("inmem_test.R2.fq", "w"));
+    std::set<std::string> pe_fams, se_fams;
+    for(int i(0); i < n_pairs; ++i) {
+        const int f(rng() % n_fams), rev(rng() % 3 == 0), lost(rng() % 500 == 0);
+        std::string s1(bc_a[f] + homing), s2(bc_b[f] + homing), q1, q2;
+        if(lost) s1[blen] = 'T'; // No homing sequence.
+        for(int j(0); j < insert; ++j) s1 += "ACGT"[(f + j) % 4], s2 += "ACGT"[(f * 7 + j) % 4];
+        for(size_t j(0); j < s1.size(); ++j) q1 += '#' + rng() % 40, q2 += '#' + rng() % 40;
+        if(rev) std::swap(s1, s2), std::swap(q1, q2);
+        fprintf(fp1, "@read%i 1:N:0\n%s\n+\n%s\n", i, s1.c_str(), q1.c_str());
+        fprintf(fp2, "@read%i 2:N:0\n%s\n+\n%s\n", i, s2.c_str(), q2.c_str());
+        // The read which sorts last contributes the first half of the barcode, so both strands of a pair
+        // share a family. Reads without a homing sequence contribute Ns.
+        std::string first(s1.substr(0, blen)), second(s2.substr(0, blen));
+        if(s1.compare(blen, 5, homing)) first = "NNNNNNNN";
+        if(s2.compare(blen, 5, homing)) second = "NNNNNNNN";
+        pe_fams.insert(s1 < s2 ? second + first: first + second);
+        se_fams.insert(first);
+    }
+    fclose(fp1), fclose(fp2);
+
+    inmem_settings_t settings{const_cast<char *>(homing), 5, blen, blen, 0, 10, 0, 1, 0};
+    collapse(settings, 1, 0, "inmem_test.1.R1.fq", "inmem_test.1.R2.fq");
+    collapse(settings, 4, 0, "inmem_test.4.R1.fq", "inmem_test.4.R2.fq");
+    collapse(settings, 4, 1, "inmem_test.4.R1.fq.gz", "inmem_test.4.R2.fq.gz");
+    const std::string r1(slurp("inmem_test.1.R1.fq")), r2(slurp("inmem_test.1.R2.fq"));
+    // Output does not depend on the number of threads, and concatenated gzip members hold the same records.
+    assert(r1 == slurp("inmem_test.4.R1.fq") && r2 == slurp("inmem_test.4.R2.fq"));
+    assert(r1 == slurp("inmem_test.4.R1.fq.gz") && r2 == slurp("inmem_test.4.R2.fq.gz"));
+    unsigned fm1(0), fm2(0);
+    const unsigned n1(count_records(r1, &fm1)), n2(count_records(r2, &fm2));
+    assert(n1 == pe_fams.size() && n2 == pe_fams.size());
+    assert(fm1 == (unsigned)n_pairs && fm2 == (unsigned)n_pairs);
+
+    // Barcode order: the same records, sorted by barcode, with barcodes containing Ns last.
+    settings.sorted = 1;
+    collapse(settings, 1, 0, "inmem_test.1.R1.fq", "inmem_test.1.R2.fq");
+    collapse(settings, 4, 0, "inmem_test.4.R1.fq", "inmem_test.4.R2.fq");
+    const std::string s1(slurp("inmem_test.1.R1.fq"));
+    assert(s1 == slurp("inmem_test.4.R1.fq") && slurp("inmem_test.1.R2.fq") == slurp("inmem_test.4.R2.fq"));
+    assert(s1.size() == r1.size());
+    std::istringstream is(s1);
+    std::string line, last;
+    for(int i(0); std::getline(is, line); ++i) {
+        if(i % 4) continue;
+        const std::string bs(line.substr(1, line.find(' ') - 1));
+        const int has_n(bs.find('N') != std::string::npos), last_has_n(last.find('N') != std::string::npos);
+        assert(last.empty() || (last_has_n == has_n ? last < bs: has_n));
+        last = bs;
+    }
+    settings.sorted = 0;
+
+    settings.is_se = 1;
+    collapse(settings, 1, 0, "inmem_test.1.se.fq", nullptr);
+    collapse(settings, 3, 0, "inmem_test.3.se.fq", nullptr);
+    const std::string se(slurp("inmem_test.1.se.fq"));
+    assert(se == slurp("inmem_test.3.se.fq"));
+    unsigned fm_se(0);
+    assert(count_records(se, &fm_se) == se_fams.size());
+    assert(fm_se == (unsigned)n_pairs);
+
+    for(const char *path: {"inmem_test.R1.fq", "inmem_test.R2.fq", "inmem_test.1.R1.fq", "inmem_test.1.R2.fq",
+                           "inmem_test.4.R1.fq", "inmem_test.4.R2.fq", "inmem_test.4.R1.fq.gz", "inmem_test.4.R2.fq.gz",
+                           "inmem_test.1.se.fq", "inmem_test.3.se.fq"})
+        unlink(path);
+    fprintf(stderr, "[%s] %u families from %i pairs, %lu single-end families. Output matches across thread counts.\n",
+            __func__, n1, n_pairs, se_fams.size());
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,179 @@
+#include "lib/kingfisher.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace bmf;
+
+/*
+ * Checks that the digit-pair formatters write exactly what ksprintf did,
+ * then times the FA/PV comment tags for 2x150bp reads at family sizes 1 to 50.
+ */
+
+static const unsigned READLEN = 150;
+static const unsigned MAX_FM = 50;
+
+// The formatter this replaces.
+static void printf_fill_both(int readlen, uint16_t *agrees, uint32_t *quals, kstring_t *ks)
+{
+    int i;
+    kputsnl("FA:B:I", ks);
+    for(i = 0; i < readlen; ++i) ksprintf(ks, ",%u", agrees[i]);
+    kputsnl("\tPV:B:I", ks);
+    for(i = 0; i < readlen; ++i) ksprintf(ks, ",%u", quals[i]);
+}
+
+// dmp_process_write as it was, given the consensus it calls into bufs.
+static void printf_dmp_write(kingfisher_t *kfp, kstring_t *ks, tmpbuffers_t *bufs, int is_rev)
+{
+    int i, diffs(kfp->length * kfp->readlen);
+    for(i = 0; i < kfp->readlen; ++i) {
+        diffs -= bufs->agrees[i];
+        if(bufs->argmax[i] != 4) diffs -= kfp->nuc_counts[4 * kfp->readlen + i];
+    }
+    kputc('@', ks); kputs(kfp->barcode + 1, ks); kputc(' ', ks);
+    printf_fill_both(kfp->readlen, bufs->agrees, bufs->cons_quals, ks);
+    kputsnl("\tFP:i:", ks);
+    kputc(kfp->pass_fail, ks);
+    ksprintf(ks, "\tFM:i:%i", kfp->length);
+    if(is_rev != -1) {
+        ksprintf(ks, "\tRV:i:%i", is_rev ? kfp->length: 0);
+        kputsnl("\tDR:i:0", ks);
+    }
+    ksprintf(ks, "\tNF:f:%0.4f", (double) diffs / kfp->length);
+    if(kfp->merged) ksprintf(ks, "\tOF:i:%i", kfp->length - kfp->merged);
+    kputc('\n', ks);
+    kputsn(bufs->cons_seq_buffer, kfp->readlen, ks);
+    kputsnl("\n+\n", ks);
+    for(i = 0; i < kfp->readlen; ++i) kputc(kfp->max_phreds[nuc2num(bufs->cons_seq_buffer[i]) * kfp->readlen + i], ks);
+    kputc('\n', ks);
+}
+
+struct fam_t {
+    std::vector<uint16_t> nuc_counts;
+    std::vector<uint32_t> phred_sums;
+    std::vector<char> max_phreds;
+    kingfisher_t kf;
+    fam_t(): nuc_counts(READLEN * 5), phred_sums(READLEN * 5), max_phreds(READLEN * 5, '#') {
+        kf.nuc_counts = nuc_counts.data();
+        kf.phred_sums = phred_sums.data();
+        kf.max_phreds = max_phreds.data();
+        kf.length = kf.merged = 0;
+        kf.readlen = READLEN;
+        std::strcpy(kf.barcode, "FACGTACGTACGTACGTACGT");
+        kf.pass_fail = '1';
+    }
+};
+
+static void random_read(std::mt19937 &rng, char *seq, char *qual, unsigned tmpl)
+{
+    static const char nucs[] {"ACGTN"};
+    for(unsigned i(0); i < READLEN; ++i) {
+        seq[i] = rng() % 100 < 3 ? nucs[rng() % 5]: nucs[(i * 7 + tmpl) % 4];
+        qual[i] = '#' + rng() % 40;
+    }
+}
+
+/*
+ * Exits if a formatter's output differs from ksprintf's, whether or not NDEBUG is defined.
+ */
+static void expect_same(const kstring_t &got, const kstring_t &expected, const char *what)
+{
+    if(got.l == expected.l && std::strcmp(got.s, expected.s) == 0) return;
+    fprintf(stderr, "[%s] %s wrote \"%.*s\", not \"%.*s\".\n", __func__, what,
+            (int)std::min(got.l, (size_t)200), got.s, (int)std::min(expected.l, (size_t)200), expected.s);
+    exit(EXIT_FAILURE);
+}
+
+static void check_ints()
+{
+    kstring_t a{0, 0, nullptr}, b{0, 0, nullptr};
+    std::mt19937 rng(7);
+    std::vector<uint32_t> vals {0, 9, 10, 99, 100, 999, 1000, 65535, 999999999, 1000000000, UINT32_MAX};
+    for(uint32_t p(1); p && p < UINT32_MAX / 10; p *= 10) vals.push_back(p - 1), vals.push_back(p), vals.push_back(p + 1);
+    for(int i(0); i < 100000; ++i) vals.push_back(rng() >> (rng() % 32));
+    for(const uint32_t v: vals) {
+        a.l = b.l = 0;
+        kput_u32(v, &a), ksprintf(&b, "%u", v);
+        expect_same(a, b, "kput_u32");
+    }
+    a.l = b.l = 0;
+    kput_u32_array(vals.data(), vals.size(), &a);
+    for(const uint32_t v: vals) ksprintf(&b, ",%u", v);
+    expect_same(a, b, "kput_u32_array");
+    // NF, including exact ties and the fallbacks.
+    for(int decimals: {0, 4, 6})
+        for(int64_t den(1); den <= 300; ++den)
+            for(int64_t num(-3); num <= 3000; ++num) {
+                a.l = b.l = 0;
+                kput_ratio(num, den, decimals, &a), ksprintf(&b, "%.*f", decimals, (double)num / den);
+                expect_same(a, b, "kput_ratio");
+            }
+    free(a.s), free(b.s);
+}
+
+template<typename F>
+static double time_ns_per_fam(F fn, unsigned n_fams)
+{
+    const auto start(std::chrono::steady_clock::now());
+    fn();
+    const auto stop(std::chrono::steady_clock::now());
+    return std::chrono::duration<double, std::nano>(stop - start).count() / n_fams;
+}
+
+int main(int argc, char **argv)
+{
+    check_ints();
+    // Read 1 and read 2 families of each size, from different templates.
+    std::mt19937 rng(42);
+    std::vector<fam_t> fams(2 * MAX_FM);
+    std::vector<tmpbuffers_t> bufs(fams.size());
+    char seq[READLEN], qual[READLEN];
+    kstring_t ks{0, 0, nullptr}, ref{0, 0, nullptr};
+    for(unsigned f(0); f < fams.size(); ++f) {
+        for(unsigned k(0); k < f / 2 + 1; ++k) {
+            random_read(rng, seq, qual, f & 1);
+            kf_kernel().pushback(&fams[f].kf, seq, qual, READLEN);
+        }
+        for(int is_rev: {-1, 0, 1}) {
+            ks.l = ref.l = 0;
+            dmp_process_write(&fams[f].kf, &ks, &bufs[f], is_rev);
+            printf_dmp_write(&fams[f].kf, &ref, &bufs[f], is_rev);
+            expect_same(ks, ref, "dmp_process_write");
+        }
+    }
+    fprintf(stderr, "[%s] Formatters match ksprintf.\n", __func__);
+
+    const unsigned reps(argc > 1 ? strtoul(argv[1], nullptr, 10): 1000);
+    volatile size_t sink(0);
+    for(auto fill: {printf_fill_both, kfill_both}) {
+        const double ns(time_ns_per_fam([&]() {
+            for(unsigned r(0); r < reps; ++r)
+                for(unsigned f(0); f < fams.size(); ++f) {
+                    ks.l = 0;
+                    fill(READLEN, bufs[f].agrees, bufs[f].cons_quals, &ks);
+                    sink += ks.l;
+                }
+        }, reps * fams.size()));
+        fprintf(stderr, "[%s] %-12s FA/PV %7.1f ns/family\n", __func__, fill == kfill_both ? "digit pairs": "ksprintf", ns);
+    }
+    for(auto write: {printf_dmp_write, dmp_process_write}) {
+        const double ns(time_ns_per_fam([&]() {
+            for(unsigned r(0); r < reps; ++r)
+                for(unsigned f(0); f < fams.size(); ++f) {
+                    ks.l = 0;
+                    // printf_dmp_write reuses the consensus the other call left in bufs.
+                    write(&fams[f].kf, &ks, &bufs[f], 0);
+                    sink += ks.l;
+                }
+        }, reps * fams.size()));
+        fprintf(stderr, "[%s] %-12s record %6.1f ns/family\n", __func__, write == dmp_process_write ? "digit pairs": "ksprintf", ns);
+    }
+    free(ks.s), free(ref.s);
+    return EXIT_SUCCESS;
+}
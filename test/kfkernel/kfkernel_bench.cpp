@@ -0,0 +1,199 @@
+#include "lib/kingfisher.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+using namespace bmf;
+
+/*
+ * Checks that every consensus kernel matches the original cycle-major (AoS) accumulators
+ * on random families, then times pushback and argmax on 150bp reads.
+ */
+
+static const unsigned READLEN = 150;
+
+struct aos_fam_t {
+    std::vector<uint16_t> nuc_counts;
+    std::vector<uint32_t> phred_sums;
+    std::vector<char> max_phreds;
+    aos_fam_t(): nuc_counts(READLEN * 5), phred_sums(READLEN * 5), max_phreds(READLEN * 5, '#') {}
+};
+
+// The kernel this replaces: nucleotide n at cycle i is [i * 5 + n].
+static void aos_pushback(aos_fam_t &f, const char *seq, const char *qual, unsigned l)
+{
+    for(unsigned i(0), posdata; i < l; ++i) {
+        posdata = nuc2num(seq[i]) + i * 5;
+        ++f.nuc_counts[posdata];
+        f.phred_sums[posdata] += qual[i] - 33;
+        if(qual[i] > f.max_phreds[posdata]) f.max_phreds[posdata] = qual[i];
+    }
+}
+
+static int aos_argmax(const uint32_t *arr, int index)
+{
+    arr += index * 5;
+    return (arr[0] > arr[1]) ? ((arr[0] > arr[2]) ? ((arr[0] > arr[3]) ? (arr[0] > arr[4] ? 0: 4)
+                                                                       : (arr[3] > arr[4] ? 3: 4))
+                                                  : (arr[2] > arr[3])  ? (arr[2] > arr[4] ? 2: 4)
+                                                                       : (arr[3] > arr[4] ? 3: 4))
+                             : ((arr[1] > arr[2]) ? ((arr[1] > arr[3]) ? (arr[1] > arr[4] ? 1: 4)
+                                                                       : (arr[3] > arr[4] ? 3: 4))
+                                                  : ((arr[2] > arr[3]) ? (arr[2] > arr[4] ? 2: 4)
+                                                                       : (arr[3] > arr[4] ? 3: 4)));
+}
+
+struct soa_fam_t {
+    std::vector<uint16_t> nuc_counts;
+    std::vector<uint32_t> phred_sums;
+    std::vector<char> max_phreds;
+    kingfisher_t kf;
+    soa_fam_t(): nuc_counts(READLEN * 5), phred_sums(READLEN * 5), max_phreds(READLEN * 5, '#') {
+        kf.nuc_counts = nuc_counts.data();
+        kf.phred_sums = phred_sums.data();
+        kf.max_phreds = max_phreds.data();
+        kf.length = 0;
+        kf.readlen = READLEN;
+    }
+};
+
+static void random_read(std::mt19937 &rng, char *seq, char *qual, unsigned ambig)
+{
+    static const char nucs[] {"ACGTN"};
+    for(unsigned i(0); i < READLEN; ++i) {
+        // Families mostly agree, so bias toward a fixed template.
+        seq[i] = rng() % 100 < ambig ? nucs[rng() % 5]: nucs[(i * 7) % 4];
+        qual[i] = '#' + rng() % 40;
+    }
+}
+
+/*
+ * Exits on a mismatch. This is built with -DNDEBUG, so assert would check nothing.
+ */
+static void expect(bool ok, const kf_kernel_t &kernel, const char *what, unsigned i)
+{
+    if(ok) return;
+    fprintf(stderr, "[%s] %s: %s differs from the AoS reference at cycle %u.\n", __func__, kernel.name, what, i);
+    exit(EXIT_FAILURE);
+}
+
+static void check_accumulators(const kf_kernel_t &kernel, const aos_fam_t &aos, const soa_fam_t &soa)
+{
+    for(unsigned i(0); i < READLEN; ++i)
+        for(unsigned n(0); n < 5; ++n) {
+            expect(aos.nuc_counts[i * 5 + n] == soa.nuc_counts[n * READLEN + i], kernel, "nuc_counts", i);
+            expect(aos.phred_sums[i * 5 + n] == soa.phred_sums[n * READLEN + i], kernel, "phred_sums", i);
+            expect(aos.max_phreds[i * 5 + n] == soa.max_phreds[n * READLEN + i], kernel, "max_phreds", i);
+        }
+}
+
+static void check_family(const kf_kernel_t &kernel, const aos_fam_t &aos, const soa_fam_t &soa)
+{
+    check_accumulators(kernel, aos, soa);
+    uint8_t argmax[SEQBUF_SIZE];
+    kernel.argmax(&soa.kf, argmax);
+    for(unsigned i(0); i < READLEN; ++i) expect(argmax[i] == aos_argmax(aos.phred_sums.data(), i), kernel, "argmax", i);
+}
+
+static void check_kernel(const kf_kernel_t &kernel)
+{
+    std::mt19937 rng(1337);
+    char seq[READLEN], qual[READLEN];
+    for(unsigned trial(0); trial < 200; ++trial) {
+        aos_fam_t af, ar;
+        soa_fam_t sf, sr;
+        const unsigned fm(1 + trial % 8), ambig(trial % 60);
+        for(unsigned k(0); k < fm; ++k) {
+            const unsigned l(k == fm - 1 && trial & 1 ? READLEN - trial % 37: READLEN); // Exercise scalar tails.
+            random_read(rng, seq, qual, ambig);
+            aos_pushback(af, seq, qual, l), kernel.pushback(&sf.kf, seq, qual, l);
+            random_read(rng, seq, qual, ambig);
+            aos_pushback(ar, seq, qual, l), kernel.pushback(&sr.kf, seq, qual, l);
+        }
+        check_family(kernel, af, sf);
+        check_family(kernel, ar, sr);
+        // Merge as zstranded_process_write did per cycle.
+        uint8_t argf[SEQBUF_SIZE], argr[SEQBUF_SIZE], out[SEQBUF_SIZE];
+        kernel.argmax(&sf.kf, argf);
+        kernel.argmax(&sr.kf, argr);
+        kernel.merge(&sf.kf, &sr.kf, argf, argr, out);
+        for(unsigned i(0); i < READLEN; ++i) {
+            const int f(aos_argmax(af.phred_sums.data(), i)), r(aos_argmax(ar.phred_sums.data(), i));
+            int call(KF_NO_CALL);
+            if(f == r || r == 4) call = f;
+            else if(f == 4) call = r;
+            expect(out[i] == call, kernel, "merge", i);
+            if(call == KF_NO_CALL) continue;
+            const unsigned index(i * 5 + call);
+            af.phred_sums[index] += ar.phred_sums[index];
+            af.nuc_counts[index] += ar.nuc_counts[index];
+            if(f == r) af.max_phreds[index] = std::max(af.max_phreds[index], ar.max_phreds[index]);
+            else if(f == 4) af.max_phreds[index] = ar.max_phreds[index];
+        }
+        check_accumulators(kernel, af, sf);
+    }
+}
+
+static bool supported(const kf_kernel_t *k)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(k == &kf_kernel_scalar()) return true;
+    if(k == &kf_kernel_avx2()) return __builtin_cpu_supports("avx2");
+    return __builtin_cpu_supports("sse4.2");
+#else
+    return true;
+#endif
+}
+
+template<typename F>
+static double time_ns_per_read(F fn, unsigned n_reads)
+{
+    const auto start(std::chrono::steady_clock::now());
+    fn();
+    const auto stop(std::chrono::steady_clock::now());
+    return std::chrono::duration<double, std::nano>(stop - start).count() / n_reads;
+}
+
+int main(int argc, char **argv)
+{
+    const kf_kernel_t *kernels[] {&kf_kernel_scalar(), &kf_kernel_sse42(), &kf_kernel_avx2()};
+    const kf_kernel_t &best(kf_kernel());
+    for(const kf_kernel_t *k: kernels) {
+        if(!supported(k)) continue;
+        check_kernel(*k);
+    }
+    fprintf(stderr, "[%s] All kernels match the AoS reference. Dispatching to %s.\n", __func__, best.name);
+
+    // Benchmark: families of 8 reads, each pushed back then called.
+    const unsigned n_fams(argc > 1 ? strtoul(argv[1], nullptr, 10): 20000), fm(8);
+    std::mt19937 rng(42);
+    std::vector<char> seqs(fm * READLEN), quals(fm * READLEN);
+    for(unsigned k(0); k < fm; ++k) random_read(rng, &seqs[k * READLEN], &quals[k * READLEN], 5);
+    uint8_t argmax[SEQBUF_SIZE];
+    volatile unsigned sink(0);
+    const double aos_ns(time_ns_per_read([&]() {
+        for(unsigned f(0); f < n_fams; ++f) {
+            aos_fam_t fam;
+            for(unsigned k(0); k < fm; ++k) aos_pushback(fam, &seqs[k * READLEN], &quals[k * READLEN], READLEN);
+            for(unsigned i(0); i < READLEN; ++i) argmax[i] = aos_argmax(fam.phred_sums.data(), i);
+            sink += argmax[f % READLEN];
+        }
+    }, n_fams * fm));
+    fprintf(stderr, "[%s] %-8s %7.1f ns/read\n", __func__, "aos", aos_ns);
+    for(const kf_kernel_t *k: kernels) {
+        if(!supported(k)) continue;
+        const double ns(time_ns_per_read([&]() {
+            for(unsigned f(0); f < n_fams; ++f) {
+                soa_fam_t fam;
+                for(unsigned j(0); j < fm; ++j) k->pushback(&fam.kf, &seqs[j * READLEN], &quals[j * READLEN], READLEN);
+                k->argmax(&fam.kf, argmax);
+                sink += argmax[f % READLEN];
+            }
+        }, n_fams * fm));
+        fprintf(stderr, "[%s] %-8s %7.1f ns/read (%.2fx)\n", __func__, k->name, ns, aos_ns / ns);
+    }
+    return EXIT_SUCCESS;
+}
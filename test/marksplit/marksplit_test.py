@@ -43,6 +43,25 @@ def check_bc(read):
     if max(freqs.values()) >= mm_threshold:
         assert fp == 0
 
+def check_stream(ex):
+    """
+    Stream mode must produce the same final fastqs as mark/split/collapse.
+    """
+    base = ("../../%s collapse inline -n1 -sTGACT -t%i -l 10 -v 11 "
+            "-o marksplit_stream_tmp" % (ex, mm_threshold))
+    for extra, prefix in (("", "marksplit_split"),
+                          ("-e", "marksplit_stream"),
+                          ("-e -E0", "marksplit_spill")):
+        subprocess.check_call(shlex.split("%s %s -f %s marksplit_test.R1.fq "
+                                          "marksplit_test.R2.fq" % (base, extra, prefix)))
+    for suffix in (".R1.fq", ".R2.fq"):
+        expected = open("marksplit_split" + suffix).read()
+        for prefix in ("marksplit_stream", "marksplit_spill"):
+            assert open(prefix + suffix).read() == expected
+    subprocess.check_call("rm marksplit_split.R[12].fq marksplit_stream.R[12].fq "
+                          "marksplit_spill.R[12].fq", shell=True)
+
+
 def main():
     for ex in ["bmftools_db", "bmftools", "bmftools_p"]:
         cstr = ("../../%s collapse inline -wn0 -sTGACT -t%i -o marksplit_test_tmp -l 10 "
@@ -50,6 +69,7 @@ def main():
         subprocess.check_call(shlex.split(cstr))
         for read in pysam.FastqFile("marksplit_test_tmp.tmp.0.R1.fastq"):
             check_bc(read)
+        check_stream(ex)
     return 0
 
 if __name__ == "__main__":
@@ -0,0 +1,28 @@
+#include "lib/phredtable.h"
+#include <assert.h>
+#include <cstdio>
+#include <cstdlib>
+
+/*
+ * Checks that table lookups are bit-exact with the igamc path
+ * over the whole table and past its edges, and that the table round-trips through a blob.
+ */
+int main(int argc, char **argv)
+{
+    bmf::PhredTable table;
+    table.build();
+    for(int n(1); n <= PHRED_TABLE_MAX_FM + 8; ++n)
+        for(uint32_t sum(0); sum <= (uint32_t)(2 * n * PHRED_TABLE_MAX_Q + 10); ++sum)
+            assert(table.get(n, sum) == pvalue_to_phred(igamc_pvalues(n, LOG10_TO_CHI2(sum))));
+    const char path[] {"phred_table_test.bin"};
+    assert(table.write(path) == 0);
+    bmf::PhredTable loaded;
+    assert(loaded.read(path) == 0);
+    for(int n(1); n <= PHRED_TABLE_MAX_FM; ++n)
+        for(uint32_t sum(0); sum <= (uint32_t)(n * PHRED_TABLE_MAX_Q); ++sum)
+            assert(loaded.get(n, sum) == table.get(n, sum));
+    bmf::PhredTable smaller(PHRED_TABLE_MAX_FM / 2);
+    assert(smaller.read(path) == -1); // Dimensions must match.
+    remove(path);
+    return EXIT_SUCCESS;
+}
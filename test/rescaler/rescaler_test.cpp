@@ -0,0 +1,122 @@
+#include "lib/rescaler.h"
+#include <assert.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace bmf;
+
+static const unsigned READLEN = 151; // Odd, to exercise the kernels' scalar tails.
+
+/*
+ * Writes a rescaler as bmftools err fm does, with a few values outside of fastq's range.
+ * :returns: [std::vector<int>] The values written, as [cycle][readnum][qscore][base].
+ */
+static std::vector<int> write_text(const char *path, std::mt19937 &rng)
+{
+    std::vector<int> ret;
+    FILE *fp(fopen(path, "w"));
+    for(unsigned cycle(0); cycle < READLEN; ++cycle) {
+        for(int readnum(0); readnum < 2; ++readnum) {
+            for(unsigned qn(0); qn < NQSCORES; ++qn) {
+                for(int bn(0); bn < 4; ++bn) {
+                    const int v(rng() % 50 ? 2 + rng() % 60: rng() % 2 ? 0: 150);
+                    ret.push_back(v);
+                    fprintf(fp, bn ? ":%i": "%i", v);
+                }
+                if(qn != NQSCORES - 1) fputc(',', fp);
+            }
+            if(!readnum) fputc('|', fp);
+        }
+        fputc('\n', fp);
+    }
+    fclose(fp);
+    return ret;
+}
+
+static char expected(const std::vector<int> &vals, int readnum, unsigned cycle, char base, char qual)
+{
+    if(base == 'N') return '#';
+    const int bn(base == 'C' ? 1: base == 'G' ? 2: base == 'T' ? 3: 0);
+    const int qn(std::min(std::max(qual - 35, 0), (int)NQSCORES - 1));
+    return std::min(std::max(vals[((cycle * 2 + readnum) * NQSCORES + qn) * 4 + bn], 2), 93) + 33;
+}
+
+int main(int argc, char **argv)
+{
+    std::mt19937 rng(1337);
+    const char path[] {"rescaler_test.txt"};
+    const std::string cache(std::string(path) + RESCALER_CACHE_SUFFIX);
+    remove(cache.c_str());
+    const std::vector<int> vals(write_text(path, rng));
+    const Rescaler parsed(path);
+    assert(parsed.readlen() == READLEN);
+    struct stat st;
+    assert(stat(cache.c_str(), &st) == 0); // Parsing wrote the cache, which is read the next time.
+    const Rescaler cached(path);
+    assert(cached == parsed);
+
+    char seq[READLEN + 1], qual[READLEN + 1], out[READLEN + 1];
+    for(int trial(0); trial < 2000; ++trial) {
+        const int readnum(trial & 1);
+        for(unsigned i(0); i < READLEN; ++i) {
+            seq[i] = "ACGTNacgt"[rng() % (trial % 3 ? 5: 9)];
+            qual[i] = '!' + rng() % 94;
+        }
+        // Whole reads, and reads whose first cycles were trimmed.
+        const unsigned start(trial % 4 ? 0: rng() % 40);
+        cached.rescale(out, seq + start, qual + start, start, READLEN - start, readnum);
+        for(unsigned i(start); i < READLEN; ++i) {
+            assert(out[i - start] == expected(vals, readnum, i, seq[i], qual[i]));
+            assert(cached.get(readnum, i, seq[i], qual[i]) == out[i - start]);
+        }
+        // In place, as mseq_init rescales.
+        std::copy(qual, qual + READLEN, out);
+        cached.rescale(out, seq, out, 0, READLEN, readnum);
+        for(unsigned i(0); i < READLEN; ++i) assert(out[i] == expected(vals, readnum, i, seq[i], qual[i]));
+    }
+
+    // Caches are only used for the exact version of the text file they came from.
+    rescaler_stamp_t stamp, other;
+    assert(rescaler_stamp(path, &stamp) == 0);
+    Rescaler copy(parsed);
+    assert(copy.read(cache.c_str(), stamp) == 0 && copy == parsed);
+    other = stamp, ++other.mtime_nsec;
+    assert(copy.read(cache.c_str(), other) == -1);
+    other = stamp, ++other.size;
+    assert(copy.read(cache.c_str(), other) == -1);
+    // A different rescaler put in place within the same second, then one older than the cache:
+    // both are parsed rather than served from the stale cache.
+    for(int older(0); older < 2; ++older) {
+        const std::vector<int> new_vals(write_text(path, rng));
+        struct timespec times[2];
+        times[0].tv_sec = times[1].tv_sec = older ? stamp.mtime_sec - 3600: stamp.mtime_sec;
+        times[0].tv_nsec = times[1].tv_nsec = older ? 0: (stamp.mtime_nsec + 1) % 1000000000;
+        assert(utimensat(AT_FDCWD, path, times, 0) == 0);
+        const Rescaler reloaded(path);
+        for(unsigned i(0); i < READLEN; ++i)
+            for(const char base: {'A', 'C', 'G', 'T'})
+                for(int q('#'); q < '#' + (int)NQSCORES; ++q)
+                    assert(reloaded.get(i & 1, i, base, q) == expected(new_vals, i & 1, i, base, q));
+        // Its cache was replaced, not left behind.
+        assert(rescaler_stamp(path, &stamp) == 0);
+        assert(copy.read(cache.c_str(), stamp) == 0 && copy == reloaded);
+    }
+
+    // Truncated caches are rejected.
+    FILE *fp(fopen(cache.c_str(), "r+b"));
+    assert(fp && ftruncate(fileno(fp), 100) == 0);
+    fclose(fp);
+    const Rescaler before(copy);
+    assert(copy.read(cache.c_str(), stamp) == -1);
+    assert(copy == before);
+    remove(path), remove(cache.c_str());
+    fprintf(stderr, "[%s] Rescaler tests passed with the %s kernel.\n", argv[0], rescale_kernel_name());
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,105 @@
+#include "lib/rescue.h"
+#include "src/bmf_rsq.h"
+#include <assert.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace bmf;
+
+static const char SEQ_NT16[] {"=ACMGRSVTWYHKDBN"};
+
+static bam1_t make_read(const char *name, const std::string &seq)
+{
+    bam1_t ret;
+    std::memset(&ret, 0, sizeof(ret));
+    ret.core.l_qname = std::strlen(name) + 1;
+    ret.core.l_qseq = seq.size();
+    ret.l_data = ret.m_data = ret.core.l_qname + (seq.size() + 1) / 2 + seq.size();
+    ret.data = (uint8_t *)calloc(ret.l_data, 1);
+    std::memcpy(ret.data, name, ret.core.l_qname);
+    uint8_t *s(bam_get_seq(&ret));
+    for(size_t i(0); i < seq.size(); ++i)
+        s[i >> 1] |= (std::strchr(SEQ_NT16, seq[i]) - SEQ_NT16) << ((~i & 1) << 2);
+    return ret;
+}
+
+/*
+ * Masks every position at which p and b disagree, as merging reads does.
+ */
+static void mask_merge(bam1_t *p, const bam1_t *b)
+{
+    uint8_t *ps(bam_get_seq(p));
+    const uint8_t *bs(bam_get_seq(b));
+    for(int i(0); i < p->core.l_qseq; ++i)
+        if(bam_seqi(ps, i) != bam_seqi(bs, i)) ps[i >> 1] |= 0xf << ((~i & 1) << 2);
+}
+
+static int mergeable(const bam1_t *a, const bam1_t *b, int mmlim)
+{
+    return a->core.l_qseq == b->core.l_qseq && a->core.l_qname == b->core.l_qname && read_hd(b, a) <= mmlim;
+}
+
+/*
+ * Flattens a stack the way Stack::flatten does, with or without the index.
+ * :returns: [std::vector<int>] For each read, the read it was merged into, or -1.
+ */
+static std::vector<int> flatten(std::vector<bam1_t> &reads, int mmlim, int use_index, size_t *n_checked)
+{
+    const unsigned n(reads.size());
+    std::vector<int> ret(n, -1);
+    RescueIndex index(mmlim);
+    if(use_index) for(unsigned i(0); i < n; ++i) index.add(&reads[i], i);
+    for(unsigned i(0); i < n; ++i) {
+        std::vector<uint32_t> cands;
+        if(use_index) cands = index.candidates(&reads[i], i);
+        else for(unsigned j(i + 1); j < n; ++j) cands.push_back(j);
+        for(const uint32_t j: cands) {
+            ++*n_checked;
+            if(!mergeable(&reads[i], &reads[j], mmlim)) continue;
+            mask_merge(&reads[j], &reads[i]);
+            if(use_index) index.add(&reads[j], j);
+            ret[i] = j;
+            break;
+        }
+    }
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    std::mt19937 rng(42);
+    for(int mmlim(0); mmlim <= 3; ++mmlim) {
+        // A hotspot: 3000 reads from 60 templates, with errors, Ns (sometimes several in one block),
+        // a few other ambiguity codes, and a few reads with different read or name lengths.
+        std::vector<std::string> templates(60);
+        for(auto &t: templates) for(int i(0); i < 100; ++i) t += "ACGT"[rng() % 4];
+        std::vector<bam1_t> plain, indexed;
+        for(int r(0); r < 3000; ++r) {
+            std::string seq(templates[rng() % templates.size()]);
+            for(int e(rng() % (mmlim + 3)); e--;) seq[rng() % seq.size()] = "ACGT"[rng() % 4];
+            if(rng() % 4 == 0) for(int e(rng() % 4), p(rng() % 90); e--;) seq[p + rng() % 10] = 'N';
+            if(rng() % 200 == 0) seq[rng() % seq.size()] = 'R';
+            if(rng() % 100 == 0) seq.pop_back();
+            const char *name(rng() % 100 ? "ACGTACGTACGT": "ACGTACGTACGTA");
+            plain.push_back(make_read(name, seq));
+            indexed.push_back(make_read(name, seq));
+        }
+        size_t n_plain(0), n_indexed(0);
+        const std::vector<int> expected(flatten(plain, mmlim, 0, &n_plain));
+        assert(flatten(indexed, mmlim, 1, &n_indexed) == expected);
+        int n_merged(0);
+        for(size_t i(0); i < plain.size(); ++i) {
+            assert(std::memcmp(plain[i].data, indexed[i].data, plain[i].l_data) == 0);
+            n_merged += expected[i] >= 0;
+            free(plain[i].data), free(indexed[i].data);
+        }
+        assert(n_merged > 0);
+        fprintf(stderr, "[%s] mmlim %i: %i merges. %lu distance checks with the index, %lu without.\n",
+                argv[0], mmlim, n_merged, n_indexed, n_plain);
+    }
+    return EXIT_SUCCESS;
+}
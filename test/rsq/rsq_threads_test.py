@@ -0,0 +1,110 @@
+import sys
+import subprocess
+import random
+import array
+try:
+    import pysam
+except ImportError:
+    sys.stderr.write("Could not import pysam. Not running tests.\n")
+    sys.exit(0)
+
+# Stacks at least this deep are flattened through RescueIndex (RESCUE_INDEX_MIN in lib/rescue.h).
+RESCUE_INDEX_MIN = 32
+READLEN = 60
+BCLEN = 16
+
+
+def mutate(seq, n, rng):
+    seq = list(seq)
+    for i in rng.sample(range(len(seq)), n):
+        seq[i] = rng.choice([c for c in "ACGT" if c != seq[i]])
+    return "".join(seq)
+
+
+def make_record(name, seq, pos, flag, rng):
+    a = pysam.AlignedSegment()
+    a.query_name = name
+    a.query_sequence = seq
+    a.flag = flag
+    a.reference_id = 0
+    a.reference_start = pos
+    a.mapping_quality = 60 if not flag & 4 else 0
+    a.cigarstring = "%iM" % len(seq) if not flag & 4 else None
+    a.query_qualities = array.array('B', [rng.randint(20, 40) for _ in seq])
+    fm = rng.randint(1, 8)
+    a.set_tag("FM", fm)
+    a.set_tag("FP", 1)
+    a.set_tag("RV", rng.randint(0, fm))
+    a.set_tag("NP", 1)
+    a.set_tag("PV", array.array('I', [rng.randint(30, 3000) for _ in seq]))
+    a.set_tag("FA", array.array('I', [fm] * len(seq)))
+    return a
+
+
+def write_input(path, rng):
+    """
+    Writes stacks of single-end reads in positional rescue order.
+    Unmapped records, which rsq writes as they are, sit between the stacks.
+    Deep stacks hold a few barcodes, each copied with errors, so that reads are merged.
+    """
+    header = {"HD": {"VN": "1.4", "SO": "positional_rescue"},
+              "SQ": [{"SN": "chr1", "LN": 10000000}]}
+    fp = pysam.AlignmentFile(path, "wb", header=header)
+    n = 0
+    pos = 1000
+    while n < 60000:
+        depth = rng.choice([1, 2, 5, RESCUE_INDEX_MIN - 1, RESCUE_INDEX_MIN, 80, 300])
+        flag = rng.choice([0, 16])
+        seq = "".join(rng.choice("ACGT") for _ in range(READLEN))
+        parents = ["".join(rng.choice("ACGT") for _ in range(BCLEN)) for _ in range(max(1, depth // 20))]
+        for _ in range(depth):
+            name = mutate(rng.choice(parents), rng.choice([0, 0, 1, 2, 3]), rng)
+            fp.write(make_record(name, mutate(seq, rng.choice([0, 0, 1]), rng), pos, flag, rng))
+            n += 1
+        for _ in range(rng.choice([0, 0, 1, 3])):
+            name = "".join(rng.choice("ACGT") for _ in range(BCLEN))
+            fp.write(make_record(name, seq, pos, 4, rng))
+            n += 1
+        pos += rng.randint(1, 50)
+    fp.close()
+    return n
+
+
+def run(options, inpath, prefix, threads):
+    subprocess.check_call("../../bmftools rsq %s -p%i -f%s.fq %s %s.bam 2> %s.log" %
+                          (options, threads, prefix, inpath, prefix), shell=True)
+    # Headers differ in the command line of the @PG line, so only records are compared.
+    records = subprocess.check_output("samtools view %s.bam" % prefix, shell=True)
+    with open("%s.fq" % prefix, "rb") as f:
+        fastq = f.read()
+    return records, fastq
+
+
+def check_threads(options, inpath, name):
+    records, fastq = run(options, inpath, "%s.p1" % name, 1)
+    for threads in [2, 4]:
+        if run(options, inpath, "%s.p%i" % (name, threads), threads) != (records, fastq):
+            sys.stderr.write("rsq %s output with -p%i differs from -p1 for %s. TEST FAILED\n" %
+                             (options, threads, inpath))
+            return None
+    return records, fastq
+
+
+def main():
+    rng = random.Random(1337)
+    n = write_input("rsq_threads_test.bam", rng)
+    out = check_threads("-S", "rsq_threads_test.bam", "rsq_threads_test.se")
+    if out is None:
+        return 1
+    records, fastq = out
+    n_written = len(records.splitlines()) + fastq.count(b"\n") // 4
+    # Reads were merged, and merged reads were sent for realignment, so the test covers flattening.
+    assert n_written < n
+    assert len(fastq)
+    if check_threads("", "rsq_test.bam", "rsq_threads_test.pe") is None:
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,90 @@
+#include "lib/seqhd.h"
+#include "src/bmf_rsq.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+using namespace bmf;
+
+/*
+ * Times HammingDistance (read_hd, one base at a time) against PackedHammingDistance with each kernel,
+ * over pairs of 150bp reads from one stack, as rsq compares them: mostly pairs well past the limit,
+ * which the packed kernels give up on early.
+ */
+
+static const int READLEN = 150;
+
+static bool supported(const seq_hd_kernel_t *k)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(k == &seq_hd_kernel_avx2()) return __builtin_cpu_supports("avx2");
+#endif
+    return true;
+}
+
+template<typename F>
+static double time_ns_per_pair(F fn, size_t n_pairs)
+{
+    const auto start(std::chrono::steady_clock::now());
+    fn();
+    const auto stop(std::chrono::steady_clock::now());
+    return std::chrono::duration<double, std::nano>(stop - start).count() / n_pairs;
+}
+
+int main(int argc, char **argv)
+{
+    const unsigned n_reads(argc > 1 ? strtoul(argv[1], nullptr, 10): 2000);
+    const int lim(argc > 2 ? atoi(argv[2]): 2);
+    std::mt19937 rng(42);
+    // 20 templates with a few errors and Ns per read.
+    std::vector<std::vector<uint8_t>> templates(20, std::vector<uint8_t>(READLEN));
+    for(auto &t: templates) for(auto &c: t) c = 1 << (rng() % 4);
+    std::vector<bam1_t> reads(n_reads);
+    for(bam1_t &b: reads) {
+        std::memset(&b, 0, sizeof(b));
+        b.core.l_qseq = READLEN;
+        b.l_data = b.m_data = (READLEN + 1) / 2;
+        b.data = (uint8_t *)calloc(b.m_data, 1);
+        std::vector<uint8_t> seq(templates[rng() % templates.size()]);
+        for(int e(rng() % 4); e--;) seq[rng() % READLEN] = 1 << (rng() % 4);
+        for(int e(rng() % 3); e--;) seq[rng() % READLEN] = 15;
+        for(int i(0); i < READLEN; ++i) b.data[i >> 1] |= seq[i] << ((~i & 1) << 2);
+    }
+    const size_t n_pairs((size_t)n_reads * (n_reads - 1) / 2);
+    volatile unsigned sink(0);
+    HammingDistance ref;
+    const double ref_ns(time_ns_per_pair([&]() {
+        unsigned n_within(0);
+        for(unsigned i(0); i < n_reads; ++i)
+            for(unsigned j(i + 1); j < n_reads; ++j)
+                n_within += ref(&reads[j], &reads[i], lim) <= lim;
+        sink += n_within;
+    }, n_pairs));
+    const unsigned ref_within(sink);
+    fprintf(stderr, "[%s] %-8s %6.2f ns/pair (%u of %lu pairs within %i)\n", __func__, "read_hd", ref_ns,
+            ref_within, n_pairs, lim);
+    for(const seq_hd_kernel_t *k: {&seq_hd_kernel_swar(), &seq_hd_kernel_avx2()}) {
+        if(!supported(k)) continue;
+        PackedHammingDistance dm;
+        dm.hd = k->hd;
+        sink = 0;
+        const double ns(time_ns_per_pair([&]() {
+            unsigned n_within(0);
+            for(unsigned i(0); i < n_reads; ++i)
+                for(unsigned j(i + 1); j < n_reads; ++j)
+                    n_within += dm(&reads[j], &reads[i], lim) <= lim;
+            sink += n_within;
+        }, n_pairs));
+        if(sink != ref_within) {
+            fprintf(stderr, "[%s] %s found %u pairs within %i, not %u.\n", __func__, k->name, (unsigned)sink, lim, ref_within);
+            return EXIT_FAILURE;
+        }
+        fprintf(stderr, "[%s] %-8s %6.2f ns/pair (%.2fx)\n", __func__, k->name, ns, ref_ns / ns);
+    }
+    for(bam1_t &b: reads) free(b.data);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,71 @@
+#include "lib/seqhd.h"
+#include "src/bmf_rsq.h"
+#include <assert.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+using namespace bmf;
+
+/*
+ * Checks that every packed Hamming distance kernel agrees with HammingDistance (read_hd) on random pairs:
+ * the same distance when it is within the limit, and a value past the limit otherwise.
+ */
+
+static const uint8_t CODES[] {1, 2, 4, 8, 15, 5}; // A, C, G, T, N and R.
+
+static bool supported(const seq_hd_kernel_t *k)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(k == &seq_hd_kernel_avx2()) return __builtin_cpu_supports("avx2");
+#endif
+    return true;
+}
+
+static void set_seq(bam1_t *b, const std::vector<uint8_t> &codes, uint8_t pad)
+{
+    std::memset(b->data, 0, b->m_data);
+    b->core.l_qseq = codes.size();
+    uint8_t *s(bam_get_seq(b));
+    for(size_t i(0); i < codes.size(); ++i) s[i >> 1] |= codes[i] << ((~i & 1) << 2);
+    if(codes.size() & 1) s[codes.size() >> 1] |= pad; // Whatever follows the last base must not count.
+}
+
+int main(int argc, char **argv)
+{
+    const seq_hd_kernel_t *kernels[] {&seq_hd_kernel_swar(), &seq_hd_kernel_avx2(), &seq_hd_kernel()};
+    std::mt19937 rng(1337);
+    bam1_t b, p;
+    std::memset(&b, 0, sizeof(b)), std::memset(&p, 0, sizeof(p));
+    b.m_data = p.m_data = 512;
+    b.data = (uint8_t *)malloc(b.m_data), p.data = (uint8_t *)malloc(p.m_data);
+    HammingDistance ref;
+    std::vector<uint8_t> bc, pc;
+    for(int trial(0); trial < 200000; ++trial) {
+        const int l(1 + rng() % 400), n_pct(trial % 7 * 3), mm_pct(trial % 11 ? trial % 5: 60);
+        bc.resize(l), pc.resize(l);
+        for(int i(0); i < l; ++i) {
+            bc[i] = rng() % 100 < (unsigned)n_pct ? 15: CODES[rng() % 4];
+            pc[i] = rng() % 100 < (unsigned)mm_pct ? CODES[rng() % 6]: bc[i];
+            if(rng() % 100 < (unsigned)n_pct) pc[i] = 15;
+        }
+        set_seq(&b, bc, rng() & 0xf), set_seq(&p, pc, rng() & 0xf);
+        b.core.l_qseq = p.core.l_qseq = l;
+        const int expected(ref(&b, &p, 0)), lim(trial & 1 ? rng() % 8: l);
+        for(const seq_hd_kernel_t *k: kernels) {
+            if(!supported(k)) continue;
+            const int hd(k->hd(bam_get_seq(&b), bam_get_seq(&p), l, lim));
+            if(expected <= lim) assert(hd == expected);
+            else assert(hd > lim);
+        }
+        PackedHammingDistance dm;
+        assert(dm(&b, &p, l) == expected);
+    }
+    free(b.data), free(p.data);
+    fprintf(stderr, "[%s] Packed Hamming distance kernels match read_hd. Dispatching to %s.\n",
+            argv[0], seq_hd_kernel().name);
+    return EXIT_SUCCESS;
+}
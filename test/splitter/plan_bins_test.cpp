@@ -0,0 +1,93 @@
+#include "lib/splitter.h"
+#include "lib/mseq.h"
+#include "lib/binner.h"
+#include <assert.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+using namespace bmf;
+
+/*
+ * A third of barcodes are a single homopolymer and an eighth are drawn from only A and C.
+ */
+static void skewed_barcode(std::mt19937 &rng, int i, char *bc)
+{
+    for(int j(0); j < 16; ++j)
+        bc[j] = i % 3 == 0 ? 'A': i % 8 == 0 ? "AC"[rng() % 2]: "ACGT"[rng() % 4];
+    bc[16] = '\0';
+}
+
+int main(int argc, char **argv)
+{
+    marksplit_settings_t settings;
+    std::memset(&settings, 0, sizeof(settings));
+    settings.n_nucs = 2;
+    settings.n_handles = 16;
+    char bc[17];
+    std::mt19937 rng(13);
+
+    // Small samples keep the default binning.
+    bin_sample_t small;
+    for(int i(0); i < 100; ++i) skewed_barcode(rng, i, bc), small.add(0, nullptr, nullptr, 1, bc, 'F');
+    plan_bins(&settings, small);
+    assert(settings.bin_map == nullptr);
+    assert(settings.n_handles == 16);
+
+    bin_sample_t sample;
+    for(int i(0); i < BIN_SAMPLE_SIZE; ++i) skewed_barcode(rng, i, bc), sample.add(0, nullptr, nullptr, 1, bc, 'F');
+    plan_bins(&settings, sample);
+    assert(settings.bin_map);
+    assert(settings.bin_prefix_len >= 2 && settings.bin_prefix_len <= BIN_MAX_PREFIX);
+    assert(settings.n_handles <= 16);
+    // Bins hold contiguous ranges of prefixes, so output stays grouped by barcode prefix.
+    const size_t n_prefixes(dlib::ipow(4, settings.bin_prefix_len));
+    for(size_t i(1); i < n_prefixes; ++i)
+        assert(settings.bin_map[i] == settings.bin_map[i - 1] || settings.bin_map[i] == settings.bin_map[i - 1] + 1);
+    assert(settings.bin_map[n_prefixes - 1] == (uint32_t)settings.n_handles - 1);
+
+    // Apart from the homopolymer, which cannot be split, bins are about even.
+    std::vector<uint64_t> counts(settings.n_handles);
+    const int n(BIN_SAMPLE_SIZE);
+    for(int i(0); i < n; ++i) skewed_barcode(rng, i, bc), ++counts[settings.bin_map[get_binner(bc, settings.bin_prefix_len)]];
+    const uint64_t homopolymer(counts[0]);
+    assert(homopolymer >= n / 3);
+    for(int i(1); i < settings.n_handles; ++i)
+        assert(counts[i] * (settings.n_handles - 1) < 2 * (n - homopolymer) && counts[i] * 2 * (settings.n_handles - 1) > (n - homopolymer));
+    free(settings.bin_map);
+
+    // Skew that depends on position: every barcode starts with the same 3 bases. Planning has to split on the
+    // bases after them, and bins have to follow the order of the barcodes themselves.
+    std::memset(&settings, 0, sizeof(settings));
+    settings.n_nucs = 2;
+    settings.n_handles = 16;
+    bin_sample_t fixed_start;
+    auto fixed_barcode = [&](char *bc) {
+        std::memcpy(bc, "GTC", 3);
+        for(int j(3); j < 16; ++j) bc[j] = "ACGT"[rng() % 4];
+        bc[16] = '\0';
+    };
+    for(int i(0); i < BIN_SAMPLE_SIZE; ++i) fixed_barcode(bc), fixed_start.add(0, nullptr, nullptr, 1, bc, 'F');
+    plan_bins(&settings, fixed_start);
+    assert(settings.bin_map);
+    assert(settings.bin_prefix_len > 3);
+    assert(settings.n_handles == 16);
+    std::fill(counts.begin(), counts.end(), 0);
+    counts.resize(settings.n_handles);
+    for(int i(0); i < n; ++i) fixed_barcode(bc), ++counts[settings.bin_map[get_binner(bc, settings.bin_prefix_len)]];
+    for(int i(0); i < settings.n_handles; ++i)
+        assert(counts[i] * settings.n_handles < 2uL * n && counts[i] * 2 * settings.n_handles > (uint64_t)n);
+    // Lexicographically smaller barcodes never land in later bins.
+    char lo[17], hi[17];
+    for(int i(0); i < 10000; ++i) {
+        fixed_barcode(lo), fixed_barcode(hi);
+        if(std::strcmp(lo, hi) > 0) std::swap(lo, hi);
+        assert(settings.bin_map[get_binner(lo, settings.bin_prefix_len)] <= settings.bin_map[get_binner(hi, settings.bin_prefix_len)]);
+    }
+    free(settings.bin_map);
+    fprintf(stderr, "[%s] Bin planning tests passed.\n", argv[0]);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,30 @@
+#ifndef BMF_TEST_UTIL_H
+#define BMF_TEST_UTIL_H
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <zlib.h>
+
+/*
+ * @func slurp
+ * Reads a whole file, which gzread decompresses if it is gzipped.
+ * Exits on failure to open it, since tests built with -DNDEBUG have no asserts.
+ * :param: path [const char *] Path to the file.
+ * :returns: [std::string] Its contents.
+ */
+static inline std::string slurp(const char *path)
+{
+    gzFile fp(gzopen(path, "rb"));
+    if(!fp) {
+        fprintf(stderr, "[%s] Could not open %s.\n", __func__, path);
+        exit(EXIT_FAILURE);
+    }
+    std::string ret;
+    char buf[1 << 16];
+    int l;
+    while((l = gzread(fp, buf, sizeof(buf))) > 0) ret.append(buf, l);
+    gzclose(fp);
+    return ret;
+}
+
+#endif /* BMF_TEST_UTIL_H */
@@ -0,0 +1,195 @@
+#include "lib/hashdmp.h"
+#include "lib/ubam.h"
+#include "test/test_util.h"
+#include <assert.h>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include <zlib.h>
+
+using namespace bmf;
+
+/*
+ * A collapsed record, with its tags as SAM text (e.g., "FM" -> "i:3"), except NF, which is kept as a number.
+ */
+struct rec_t {
+    std::string name, seq, qual;
+    std::map<std::string, std::string> tags;
+    double nf;
+    int flag;
+};
+
+static std::vector<rec_t> parse_fastq(const char *path)
+{
+    std::ifstream fp(path);
+    std::vector<rec_t> ret;
+    std::string header, plus;
+    rec_t r;
+    while(std::getline(fp, header) && std::getline(fp, r.seq) && std::getline(fp, plus) && std::getline(fp, r.qual)) {
+        const size_t space(header.find(' '));
+        r.name = header.substr(1, space - 1);
+        r.tags.clear();
+        for(size_t start(space + 1), end; start < header.size(); start = end + 1) {
+            if((end = header.find('\t', start)) == std::string::npos) end = header.size();
+            const std::string tag(header.substr(start, 2)), val(header.substr(start + 3, end - start - 3));
+            if(tag == "NF") r.nf = atof(val.c_str() + 2);
+            else r.tags[tag] = val;
+        }
+        r.flag = -1;
+        ret.push_back(r);
+    }
+    return ret;
+}
+
+template<typename T>
+static T get(const char *&p)
+{
+    T ret;
+    std::memcpy(&ret, p, sizeof(ret));
+    p += sizeof(ret);
+    return ret;
+}
+
+static std::vector<rec_t> parse_bam(const std::string &data)
+{
+    std::vector<rec_t> ret;
+    for(const char *p(data.data()), *const end(data.data() + data.size()); p < end;) {
+        const char *const rec_end(p + ubam_rec_len(p));
+        rec_t r;
+        p += 4;
+        assert(get<int32_t>(p) == -1 && get<int32_t>(p) == -1);
+        const int l_name(get<uint8_t>(p));
+        assert(get<uint8_t>(p) == 0 && get<uint16_t>(p) == 4680 && get<uint16_t>(p) == 0);
+        r.flag = get<uint16_t>(p);
+        const int l_seq(get<int32_t>(p));
+        assert(get<int32_t>(p) == -1 && get<int32_t>(p) == -1 && get<int32_t>(p) == 0);
+        r.name = std::string(p, l_name - 1), p += l_name;
+        for(int i(0); i < l_seq; ++i) r.seq.push_back("=ACMGRSVTWYHKDBN"[(uint8_t)p[i >> 1] >> ((~i & 1) << 2) & 0xf]);
+        p += (l_seq + 1) >> 1;
+        for(int i(0); i < l_seq; ++i) r.qual.push_back(*p++ + 33);
+        while(p < rec_end) {
+            const std::string tag(p, 2);
+            p += 2;
+            const char type(*p++);
+            std::string val;
+            switch(type) {
+                case 'C': val = "i:" + std::to_string(get<uint8_t>(p)); break;
+                case 'S': val = "i:" + std::to_string(get<uint16_t>(p)); break;
+                case 'I': val = "i:" + std::to_string(get<uint32_t>(p)); break;
+                case 'f': r.nf = get<float>(p); continue;
+                case 'B': {
+                    assert(*p++ == 'I');
+                    val = "B:I";
+                    for(int i(0), n(get<int32_t>(p)); i < n; ++i) val += "," + std::to_string(get<uint32_t>(p));
+                    break;
+                }
+                default: assert(0);
+            }
+            r.tags[tag] = val;
+        }
+        assert(p == rec_end);
+        ret.push_back(r);
+    }
+    return ret;
+}
+
+static void check_same(const rec_t &a, const rec_t &b)
+{
+    assert(a.name == b.name && a.seq == b.seq && a.qual == b.qual);
+    assert(a.tags == b.tags);
+    assert(std::fabs(a.nf - b.nf) < 1e-4);
+}
+
+/*
+ * Writes 3000 marked records over 400 families, with the same barcodes in both reads.
+ */
+static void write_marked(const char *r1, const char *r2)
+{
+    FILE *fp1(fopen(r1, "w")), *fp2(fopen(r2, "w"));
+    std::mt19937 rng(137);
+    char bc[13], seq1[77], seq2[77], qual[77];
+    bc[12] = seq1[76] = seq2[76] = qual[76] = '\0';
+    for(int i(0); i < 3000; ++i) {
+        std::mt19937 fam(rng() % 400);
+        for(int j(0); j < 12; ++j) bc[j] = "ACGT"[fam() % 4];
+        // An odd read length, with some Ns, to check sequence packing.
+        for(int j(0); j < 75; ++j) {
+            seq1[j] = rng() % 200 ? "ACGT"[(fam() + (rng() % 30 == 0)) % 4]: 'N';
+            seq2[j] = "ACGT"[(fam() + (rng() % 30 == 0)) % 4];
+            qual[j] = '#' + rng() % 40;
+        }
+        seq1[75] = seq2[75] = qual[75] = '\0';
+        const int pass(rng() % 10 != 0);
+        const char strand(rng() & 1 ? 'F': 'R');
+        fprintf(fp1, "@read%i ~#!#~|FP=%i|BS=%c%s\n%s\n+\n%s\n", i, pass, strand, bc, seq1, qual);
+        fprintf(fp2, "@read%i ~#!#~|FP=%i|BS=%c%s\n%s\n+\n%s\n", i, pass, strand, bc, seq2, qual);
+    }
+    fclose(fp1), fclose(fp2);
+}
+
+/*
+ * Decompresses a BAM and checks and strips its header.
+ */
+static std::string read_bam(const char *path)
+{
+    gzFile fp(gzopen(path, "r"));
+    assert(fp);
+    std::string ret;
+    char buf[1 << 16];
+    int l;
+    while((l = gzread(fp, buf, sizeof(buf))) > 0) ret.append(buf, l);
+    gzclose(fp);
+    assert(ret.compare(0, 4, "BAM\1") == 0);
+    const char *p(ret.data() + 4);
+    const int32_t l_text(get<int32_t>(p));
+    assert(std::string(p, l_text).find("@HD\tVN:") == 0);
+    p += l_text;
+    assert(get<int32_t>(p) == 0);
+    return ret.substr(p - ret.data());
+}
+
+int main(int argc, char **argv)
+{
+    write_marked("ubam_test.R1.fq", "ubam_test.R2.fq");
+    for(int stranded: {0, 1}) {
+        for(const char *in: {"ubam_test.R1.fq", "ubam_test.R2.fq"}) {
+            const std::string text(std::string(in) + ".out"), bam(std::string(in) + ".bin");
+            // Clustering adds OF tags to some records.
+            for(const std::string &out: {text, bam}) {
+                (stranded ? stranded_hash_dmp_core: hash_dmp_core)((char *)in, (char *)out.c_str(), 0, 0, 1, out == bam, 0, nullptr, 0);
+            }
+            const std::vector<rec_t> expected(parse_fastq(text.c_str())), got(parse_bam(slurp(bam.c_str())));
+            assert(expected.size() > 300 && got.size() == expected.size());
+            for(size_t i(0); i < got.size(); ++i) {
+                assert(got[i].flag == UBAM_FLAG_SE);
+                check_same(got[i], expected[i]);
+            }
+        }
+        // Read pairs are written adjacent, flagged as reads 1 and 2.
+        std::string r1(slurp("ubam_test.R1.fq.bin")), r2(slurp("ubam_test.R2.fq.bin"));
+        kstring_t ks1{r1.size(), r1.size(), &r1[0]}, ks2{r2.size(), r2.size(), &r2[0]};
+        {
+            UBamWriter out("ubam_test.bam", 1, 1);
+            out.write_pairs(&ks1, &ks2);
+        }
+        const std::vector<rec_t> pairs(parse_bam(read_bam("ubam_test.bam"))),
+                                 e1(parse_fastq("ubam_test.R1.fq.out")), e2(parse_fastq("ubam_test.R2.fq.out"));
+        assert(pairs.size() == 2 * e1.size() && e1.size() == e2.size());
+        for(size_t i(0); i < e1.size(); ++i) {
+            assert(pairs[2 * i].flag == UBAM_FLAG_R1 && pairs[2 * i + 1].flag == UBAM_FLAG_R2);
+            check_same(pairs[2 * i], e1[i]);
+            check_same(pairs[2 * i + 1], e2[i]);
+        }
+    }
+    for(const char *path: {"ubam_test.R1.fq", "ubam_test.R2.fq", "ubam_test.R1.fq.out", "ubam_test.R2.fq.out",
+                           "ubam_test.R1.fq.bin", "ubam_test.R2.fq.bin", "ubam_test.bam"})
+        unlink(path);
+    fprintf(stderr, "[%s] Unaligned BAM tests passed.\n", argv[0]);
+    return EXIT_SUCCESS;
+}